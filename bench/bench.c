@@ -0,0 +1,536 @@
+/* bench.c - Benchmark generate and apply over a corpus
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs ddelta_generate_opts() and ddelta_apply() on each <case>.old and
+ * <case>.new pair of a corpus directory, and prints the results as JSON.
+ * Each run is done in a child process, so its peak RSS is its own. With
+ * --repeat, the times and RSS are the medians of the runs.
+ *
+ * With --baseline, the results are compared with an earlier output, and
+ * patch sizes worse than the tolerance fail the benchmark. Throughput only
+ * compares with a run on the same machine, so it is left out with
+ * --sizes-only, and its regressions are warnings unless --time-fails is
+ * given.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct run {
+    double seconds;
+    long max_rss_kb;
+    int result;
+};
+
+/* Results of a case */
+struct result {
+    const char *name;
+    size_t oldsize, newsize;
+    long patch_size, patch_compressed_size;
+    struct run generate, apply;
+    int ok;
+};
+
+/* Allowed regressions, in percent */
+struct tolerance {
+    double time;
+    double size;
+    /* Non-zero if throughput regressions fail rather than warn */
+    int time_fails;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int generate(const char *old, const char *new, const char *patch)
+{
+    int oldfd = open(old, O_RDONLY);
+    int newfd = open(new, O_RDONLY);
+    int patchfd = open(patch, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (oldfd < 0 || newfd < 0 || patchfd < 0)
+        return -DDELTA_EOLDIO;
+
+    return ddelta_generate_opts(oldfd, newfd, patchfd, NULL, NULL);
+}
+
+static int apply(const char *old, const char *patch, const char *out)
+{
+    struct ddelta_header header;
+    FILE *oldf = fopen(old, "rb");
+    FILE *patchf = fopen(patch, "rb");
+    int result;
+
+    if (oldf == NULL || patchf == NULL)
+        return -DDELTA_EOLDIO;
+    if ((result = ddelta_header_read(&header, patchf)) < 0)
+        return result;
+
+    return ddelta_apply(&header, patchf, oldf, out);
+}
+
+/* Runs shorter than this are repeated, so that forking does not count */
+#define BENCH_MIN_SECONDS 0.2
+
+/* Run generate() or apply() in a child process, which reports the average
+ * time of a run through a pipe */
+static struct run measure(int (*fn)(const char *, const char *, const char *),
+                          const char *a, const char *b, const char *c)
+{
+    struct run r = {0, 0, -1};
+    struct rusage ru;
+    int status, fds[2];
+    pid_t pid;
+
+    fflush(stdout);
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return r;
+    }
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return r;
+    }
+    if (pid == 0) {
+        const double start = now();
+        double seconds;
+        int result, runs = 0;
+
+        do {
+            result = fn(a, b, c);
+            runs++;
+            seconds = now() - start;
+        } while (result == 0 && seconds < BENCH_MIN_SECONDS);
+
+        seconds /= runs;
+        if (write(fds[1], &seconds, sizeof(seconds)) != sizeof(seconds))
+            result = -DDELTA_EALGO;
+        _exit(-result);
+    }
+
+    close(fds[1]);
+    if (read(fds[0], &r.seconds, sizeof(r.seconds)) != sizeof(r.seconds))
+        r.seconds = 0;
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return r;
+    }
+
+    r.max_rss_kb = ru.ru_maxrss;
+    r.result = WIFEXITED(status) ? -WEXITSTATUS(status) : -DDELTA_EALGO;
+    return r;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    const double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* The median of the |n| runs in |runs|, or the first failed one */
+static struct run median(struct run *runs, int n)
+{
+    double seconds[n], rss[n];
+    struct run r = runs[0];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (runs[i].result != 0)
+            return runs[i];
+        seconds[i] = runs[i].seconds;
+        rss[i] = runs[i].max_rss_kb;
+    }
+
+    qsort(seconds, n, sizeof(*seconds), compare_doubles);
+    qsort(rss, n, sizeof(*rss), compare_doubles);
+    r.seconds = n % 2 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+    r.max_rss_kb = (long) (n % 2 ? rss[n / 2] : (rss[n / 2 - 1] + rss[n / 2]) / 2);
+    return r;
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    unsigned char *data = NULL;
+    struct stat st;
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return NULL;
+    if (fstat(fileno(f), &st) == 0 && (data = malloc(st.st_size + 1)) != NULL &&
+        fread(data, 1, st.st_size, f) < (size_t) st.st_size) {
+        free(data);
+        data = NULL;
+    }
+
+    *size = st.st_size;
+    fclose(f);
+    return data;
+}
+
+/* Size of the patch compressed with zlib at the highest level */
+static long compressed_size(const unsigned char *data, size_t size)
+{
+    uLongf out_size = compressBound(size);
+    unsigned char *out = malloc(out_size);
+    long result = -1;
+
+    if (out != NULL && compress2(out, &out_size, data, size, Z_BEST_COMPRESSION) == Z_OK)
+        result = (long) out_size;
+
+    free(out);
+    return result;
+}
+
+static int same_file(const char *a, const char *b)
+{
+    size_t asize, bsize;
+    unsigned char *adata = read_file(a, &asize);
+    unsigned char *bdata = read_file(b, &bsize);
+    int same = adata != NULL && bdata != NULL && asize == bsize &&
+               memcmp(adata, bdata, asize) == 0;
+
+    free(adata);
+    free(bdata);
+    return same;
+}
+
+static double throughput(const struct run *r, size_t size)
+{
+    return r->seconds > 0 ? size / r->seconds / (1024 * 1024) : 0.0;
+}
+
+static void print_run(const char *name, const struct run *r, size_t size)
+{
+    printf("      \"%s\": {\"result\": %d, \"seconds\": %.6f, "
+           "\"mib_per_s\": %.3f, \"max_rss_kib\": %ld}",
+           name, r->result, r->seconds, throughput(r, size), r->max_rss_kb);
+}
+
+static void print_result(const struct result *r, int first, int sizes_only)
+{
+    printf("%s    {\n      \"name\": \"%s\",\n", first ? "" : ",\n", r->name);
+    printf("      \"old_size\": %zu,\n      \"new_size\": %zu,\n",
+           r->oldsize, r->newsize);
+    printf("      \"patch_size\": %ld,\n      \"patch_compressed_size\": %ld,\n",
+           r->patch_size, r->patch_compressed_size);
+    if (!sizes_only) {
+        print_run("generate", &r->generate, r->newsize);
+        printf(",\n");
+        print_run("apply", &r->apply, r->newsize);
+        printf(",\n");
+    }
+    printf("      \"ok\": %s\n    }", r->ok ? "true" : "false");
+}
+
+static int bench_case(const char *dir, struct result *r, int repeat)
+{
+    char old[4096], new[4096], patch[4096], out[4096];
+    struct run gen[repeat], app[repeat];
+    unsigned char *data;
+    size_t patchsize;
+    struct stat st;
+    int i;
+
+    snprintf(old, sizeof(old), "%s/%s.old", dir, r->name);
+    snprintf(new, sizeof(new), "%s/%s.new", dir, r->name);
+    snprintf(patch, sizeof(patch), "%s/%s.patch", dir, r->name);
+    snprintf(out, sizeof(out), "%s/%s.out", dir, r->name);
+
+    if (stat(old, &st) == 0)
+        r->oldsize = st.st_size;
+    if (stat(new, &st) == 0)
+        r->newsize = st.st_size;
+
+    for (i = 0; i < repeat; i++)
+        gen[i] = measure(generate, old, new, patch);
+    for (i = 0; i < repeat; i++)
+        app[i] = measure(apply, old, patch, out);
+
+    r->generate = median(gen, repeat);
+    r->apply = median(app, repeat);
+    r->ok = r->generate.result == 0 && r->apply.result == 0 && same_file(out, new);
+
+    r->patch_size = r->patch_compressed_size = -1;
+    if ((data = read_file(patch, &patchsize)) != NULL) {
+        r->patch_size = (long) patchsize;
+        r->patch_compressed_size = compressed_size(data, patchsize);
+        free(data);
+    }
+
+    unlink(out);
+    return r->ok ? 0 : -1;
+}
+
+/*
+ * Find the number |key| in the output of an earlier run, in the object of
+ * case |name|, inside its object |sub| if not NULL. This only needs to read
+ * what print_result() writes.
+ */
+static int baseline_number(const char *json, const char *name, const char *sub,
+                           const char *key, double *value)
+{
+    char pattern[256];
+    const char *p, *end;
+    char *num_end;
+
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+    if ((p = strstr(json, pattern)) == NULL)
+        return -1;
+    if ((end = strstr(p + 1, "\"name\":")) == NULL)
+        end = p + strlen(p);
+
+    if (sub != NULL) {
+        snprintf(pattern, sizeof(pattern), "\"%s\":", sub);
+        if ((p = strstr(p, pattern)) == NULL || p > end)
+            return -1;
+    }
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    if ((p = strstr(p, pattern)) == NULL || p > end)
+        return -1;
+
+    *value = strtod(p + strlen(pattern), &num_end);
+    return num_end == p + strlen(pattern) ? -1 : 0;
+}
+
+/*
+ * Compare |current| with |base| where larger is |better|, printing the
+ * change. Returns -1 if it regressed by more than |tolerance| percent, and
+ * 1 if it did but that only |warns|.
+ */
+static int check(const char *name, const char *what, double current,
+                 double base, int better, double tolerance, int warns)
+{
+    const double change = base != 0 ? (current - base) * 100 / base : 0;
+    const int regressed = better * change < -tolerance;
+
+    fprintf(stderr, "%-16s %-24s %14.3f %14.3f %+8.2f%%%s\n", name, what,
+            current, base, change,
+            !regressed ? "" : warns ? "  SLOWER" : "  REGRESSED");
+    return !regressed ? 0 : warns ? 1 : -1;
+}
+
+/*
+ * Compare |r| with its case in |json|, and its throughput if the baseline
+ * has it. Returns -1 on a regression, and sets |*slower| on a throughput
+ * regression that only warns.
+ */
+static int compare(const struct result *r, const char *json,
+                   const struct tolerance *tol, int *slower)
+{
+    double oldsize, newsize, patch, compressed, gen, app;
+    int result = 0, gen_change, app_change;
+
+    if (baseline_number(json, r->name, NULL, "old_size", &oldsize) < 0 ||
+        baseline_number(json, r->name, NULL, "new_size", &newsize) < 0 ||
+        baseline_number(json, r->name, NULL, "patch_size", &patch) < 0 ||
+        baseline_number(json, r->name, NULL, "patch_compressed_size", &compressed) < 0) {
+        fprintf(stderr, "%-16s not in the baseline\n", r->name);
+        return 0;
+    }
+
+    if (oldsize != r->oldsize || newsize != r->newsize) {
+        fprintf(stderr, "%-16s baseline is for files of other sizes\n", r->name);
+        return -1;
+    }
+
+    if (check(r->name, "patch size", r->patch_size, patch, -1, tol->size, 0) < 0)
+        result = -1;
+    if (check(r->name, "compressed patch size", r->patch_compressed_size,
+              compressed, -1, tol->size, 0) < 0)
+        result = -1;
+
+    if (baseline_number(json, r->name, "generate", "mib_per_s", &gen) < 0 ||
+        baseline_number(json, r->name, "apply", "mib_per_s", &app) < 0)
+        return result;
+
+    gen_change = check(r->name, "generate MiB/s", throughput(&r->generate, r->newsize),
+                       gen, 1, tol->time, !tol->time_fails);
+    app_change = check(r->name, "apply MiB/s", throughput(&r->apply, r->newsize),
+                       app, 1, tol->time, !tol->time_fails);
+    if (gen_change < 0 || app_change < 0)
+        result = -1;
+    else if (gen_change > 0 || app_change > 0)
+        *slower = 1;
+
+    return result;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] corpus-directory\n\n"
+            "Options:\n"
+            "  --repeat=N              run each case N times, reporting medians\n"
+            "  --baseline=FILE         compare with the output of an earlier run\n"
+            "  --time-tolerance=PCT    allowed throughput regression (default 10)\n"
+            "  --size-tolerance=PCT    allowed patch size regression (default 1)\n"
+            "  --time-fails            fail on throughput regressions, for a\n"
+            "                          baseline run on the same machine\n"
+            "  --sizes-only            leave the timings out of the output\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"repeat", required_argument, NULL, 'r'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"time-tolerance", required_argument, NULL, 't'},
+        {"size-tolerance", required_argument, NULL, 's'},
+        {"time-fails", no_argument, NULL, 'f'},
+        {"sizes-only", no_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct tolerance tol = {10, 1, 0};
+    const char *baseline_path = NULL;
+    char *baseline = NULL;
+    char **names = NULL;
+    size_t nnames = 0, size, i;
+    struct dirent *d;
+    DIR *dir;
+    int repeat = 1, failed = 0, regressed = 0, slower = 0, sizes_only = 0, opt;
+
+    while ((opt = getopt_long(argc, argv, "r:b:t:s:foh", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 't':
+            tol.time = atof(optarg);
+            break;
+        case 's':
+            tol.size = atof(optarg);
+            break;
+        case 'f':
+            tol.time_fails = 1;
+            break;
+        case 'o':
+            sizes_only = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind != argc - 1 || repeat < 1 || tol.time < 0 || tol.size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (baseline_path != NULL &&
+        (baseline = (char *) read_file(baseline_path, &size)) == NULL) {
+        perror(baseline_path);
+        return 1;
+    }
+    if (baseline != NULL)
+        baseline[size] = '\0';
+
+    if ((dir = opendir(argv[optind])) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    /* Every <case>.old is a case */
+    while ((d = readdir(dir)) != NULL) {
+        const size_t len = strlen(d->d_name);
+
+        if (len <= 4 || strcmp(d->d_name + len - 4, ".old") != 0)
+            continue;
+        if ((names = realloc(names, (nnames + 1) * sizeof(*names))) == NULL ||
+            (names[nnames] = strndup(d->d_name, len - 4)) == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        nnames++;
+    }
+    closedir(dir);
+
+    qsort(names, nnames, sizeof(*names), compare_names);
+
+    if (baseline != NULL)
+        fprintf(stderr, "%-16s %-24s %14s %14s %9s\n", "case", "", "current",
+                "baseline", "change");
+
+    printf("{\n  \"repeat\": %d,\n  \"cases\": [\n", repeat);
+    for (i = 0; i < nnames; i++) {
+        struct result r = {names[i], 0, 0, -1, -1, {0, 0, -1}, {0, 0, -1}, 0};
+
+        if (bench_case(argv[optind], &r, repeat) < 0)
+            failed = 1;
+        print_result(&r, i == 0, sizes_only);
+        if (baseline != NULL && r.ok && compare(&r, baseline, &tol, &slower) < 0)
+            regressed = 1;
+        free(names[i]);
+    }
+    printf("\n  ]\n}\n");
+
+    if (regressed)
+        fprintf(stderr, "Performance regressed beyond the tolerances "
+                "(throughput %g%%, size %g%%)\n", tol.time, tol.size);
+    else if (slower)
+        fprintf(stderr, "Warning: throughput dropped by more than %g%%\n",
+                tol.time);
+
+    free(baseline);
+    free(names);
+    return failed || regressed;
+}
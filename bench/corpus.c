@@ -0,0 +1,369 @@
+/* corpus.c - Synthetic old and new file pairs for benchmarks
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Writes the pairs <case>.old and <case>.new into a directory. The data is
+ * generated from fixed seeds, so the corpus is the same on every run and
+ * machine. The sizes scale with the first argument, from 4 MiB at scale 1.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define MIB (1024 * 1024)
+
+/* Erase block size of the padded flash images */
+#define ERASE_SIZE (64 * 1024)
+
+struct buf {
+    unsigned char *data;
+    size_t size;
+    size_t alloc;
+};
+
+/* xorshift64* */
+static uint64_t rng_state;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void seed(uint64_t s)
+{
+    rng_state = s * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+/* A random number in [lo, hi] */
+static size_t range(size_t lo, size_t hi)
+{
+    return lo + rng() % (hi - lo + 1);
+}
+
+static void reserve(struct buf *b, size_t size)
+{
+    if (b->size + size <= b->alloc)
+        return;
+
+    b->alloc = MIN(b->alloc * 2, b->alloc + 64 * MIB);
+    if (b->alloc < b->size + size)
+        b->alloc = b->size + size;
+    if ((b->data = realloc(b->data, b->alloc)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+}
+
+static void append(struct buf *b, const void *data, size_t size)
+{
+    reserve(b, size);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void append_random(struct buf *b, size_t size)
+{
+    size_t i;
+
+    reserve(b, size);
+    for (i = 0; i < size; i++)
+        b->data[b->size + i] = (unsigned char) rng();
+    b->size += size;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+    p[2] = (unsigned char) (v >> 16);
+    p[3] = (unsigned char) (v >> 24);
+}
+
+/* Something like x86 code: short instructions, and calls with 32-bit
+ * displacements to targets within 64 KiB. The call offsets are recorded
+ * in |calls|, so they can be relocated. */
+static void append_code(struct buf *b, size_t size, struct buf *calls)
+{
+    const size_t end = b->size + size;
+
+    while (b->size + 5 <= end) {
+        if (rng() % 8 == 0) {
+            unsigned char insn[5] = {0xE8};
+            const uint64_t pos = b->size;
+            int32_t target = (int32_t) range(0, 128 * 1024) - 64 * 1024;
+
+            if ((int64_t) pos + target < 0)
+                target = (int32_t) -pos;
+            put_le32(insn + 1, (uint32_t) (target - 5));
+            append(b, insn, sizeof(insn));
+            append(calls, &pos, sizeof(pos));
+        } else {
+            /* A small set of opcodes, as in real code */
+            static const unsigned char ops[] = {0x48, 0x89, 0x8B, 0x83, 0xC3,
+                                                0x55, 0x5D, 0x31, 0x85, 0x74,
+                                                0x75, 0x0F, 0xFF, 0x00};
+            const size_t n = range(1, 4);
+            size_t i;
+
+            for (i = 0; i < n; i++) {
+                const unsigned char op = ops[rng() % sizeof(ops)];
+                append(b, &op, 1);
+            }
+        }
+    }
+
+    append_random(b, end - b->size);
+}
+
+/* Text from a small vocabulary */
+static void append_text(struct buf *b, size_t size)
+{
+    static const char *const words[] = {
+        "the ", "patch ", "block ", "flash ", "old ", "new ", "file ",
+        "entry ", "diff ", "extra ", "seek ", "update ", "device ", "image ",
+        "return ", "if ", "for ", "int ", "static ", "struct ", "\n", "{\n",
+        "}\n", "    ", "0x", "error ", "size ", "offset ",
+    };
+    const size_t end = b->size + size;
+
+    while (b->size < end) {
+        const char *w = words[rng() % (sizeof(words) / sizeof(words[0]))];
+
+        append(b, w, MIN(strlen(w), end - b->size));
+    }
+}
+
+/* Code that grows by |shift| bytes at |at|, with the calls relocated as a
+ * linker would */
+static void gen_code_shift(size_t size, struct buf *old, struct buf *new)
+{
+    struct buf calls = {NULL, 0, 0}, inserted = {NULL, 0, 0};
+    const size_t at = size / 3, shift = 4096 + 17;
+    const uint64_t *pos;
+    size_t i, n;
+
+    seed(1);
+    append_code(old, size, &calls);
+
+    append(new, old->data, at);
+    append_code(new, shift, &inserted);
+    append(new, old->data + at, old->size - at);
+
+    pos = (const uint64_t *) calls.data;
+    n = calls.size / sizeof(*pos);
+    for (i = 0; i < n; i++) {
+        const unsigned char *p = old->data + pos[i] + 1;
+        const int64_t target = (int64_t) pos[i] + 5 +
+                               (int32_t) (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+        const int64_t newpos = pos[i] + (pos[i] >= at ? shift : 0);
+        const int64_t newtarget = target + (target >= (int64_t) at ? shift : 0);
+
+        put_le32(new->data + newpos + 1, (uint32_t) (newtarget - newpos - 5));
+    }
+
+    free(calls.data);
+    free(inserted.data);
+}
+
+/* Text with blocks inserted, deleted and changed */
+static void gen_insert_delete(size_t size, struct buf *old, struct buf *new)
+{
+    size_t pos = 0;
+
+    seed(2);
+    append_text(old, size);
+
+    while (pos < old->size) {
+        const size_t keep = MIN(range(16 * 1024, 256 * 1024), old->size - pos);
+
+        append(new, old->data + pos, keep);
+        pos += keep;
+
+        switch (rng() % 3) {
+        case 0:
+            append_text(new, range(16, 4096));
+            break;
+        case 1:
+            pos += MIN(range(16, 4096), old->size - pos);
+            break;
+        case 2: {
+            const size_t n = MIN(range(1, 64), old->size - pos);
+
+            append_random(new, n);
+            pos += n;
+            break;
+        }
+        }
+    }
+}
+
+/* A flash image of code sections, each padded with 0xFF to an erase
+ * block. One section grows, which moves the ones after it. */
+static void gen_flash_image(size_t size, struct buf *old, struct buf *new)
+{
+    const size_t sections = 16, slot = size / sections;
+    struct buf calls = {NULL, 0, 0};
+    size_t i;
+
+    for (i = 0; i < sections; i++) {
+        const size_t used = slot / 2 + (slot / 3) * (i % 3) / 2;
+        const size_t grow = i == 3 ? 3 * ERASE_SIZE / 2 : 0;
+        struct buf section = {NULL, 0, 0};
+        size_t padded;
+
+        seed(100 + i);
+        append_code(&section, used, &calls);
+
+        padded = (section.size + ERASE_SIZE - 1) / ERASE_SIZE * ERASE_SIZE;
+        append(old, section.data, section.size);
+        reserve(old, padded - section.size);
+        memset(old->data + old->size, 0xFF, padded - section.size);
+        old->size += padded - section.size;
+
+        /* The new section has some changes, and may grow */
+        if (i % 4 == 1)
+            section.data[range(0, section.size - 1)] ^= 0x5A;
+        if (grow > 0)
+            append_code(&section, grow, &calls);
+
+        padded = (section.size + ERASE_SIZE - 1) / ERASE_SIZE * ERASE_SIZE;
+        append(new, section.data, section.size);
+        reserve(new, padded - section.size);
+        memset(new->data + new->size, 0xFF, padded - section.size);
+        new->size += padded - section.size;
+
+        free(section.data);
+    }
+
+    free(calls.data);
+}
+
+/* A large binary with a few scattered single byte changes */
+static void gen_near_identical(size_t size, struct buf *old, struct buf *new)
+{
+    size_t i;
+
+    seed(4);
+    append_random(old, 4 * size);
+    append(new, old->data, old->size);
+
+    for (i = 0; i < 100; i++)
+        new->data[range(0, new->size - 1)] ^= 0xFF;
+}
+
+/* Unrelated random data, the worst case */
+static void gen_random(size_t size, struct buf *old, struct buf *new)
+{
+    seed(5);
+    append_random(old, size);
+    append_random(new, size);
+}
+
+/* A short pattern repeated, with variations, which is hard on suffix
+ * sorting and matching */
+static void gen_repetitive(size_t size, struct buf *old, struct buf *new)
+{
+    unsigned char pattern[64];
+    size_t i;
+
+    seed(6);
+    for (i = 0; i < sizeof(pattern); i++)
+        pattern[i] = (unsigned char) rng();
+
+    while (old->size < size)
+        append(old, pattern, MIN(sizeof(pattern), size - old->size));
+    append(new, old->data, old->size);
+
+    for (i = 0; i < size / 4096; i++) {
+        old->data[range(0, old->size - 1)] = (unsigned char) rng();
+        new->data[range(0, new->size - 1)] = (unsigned char) rng();
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(size_t size, struct buf *old, struct buf *new);
+} cases[] = {
+    {"code_shift", gen_code_shift},
+    {"insert_delete", gen_insert_delete},
+    {"flash_image", gen_flash_image},
+    {"near_identical", gen_near_identical},
+    {"random", gen_random},
+    {"repetitive", gen_repetitive},
+};
+
+static int write_file(const char *dir, const char *name, const char *ext,
+                      const struct buf *b)
+{
+    char path[4096];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    if ((f = fopen(path, "wb")) == NULL ||
+        fwrite(b->data, 1, b->size, f) < b->size || fclose(f) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    double scale;
+    size_t i;
+
+    if (argc != 3 || (scale = strtod(argv[1], NULL)) <= 0) {
+        fprintf(stderr, "usage: %s scale directory\n", argv[0]);
+        return 1;
+    }
+
+    if (mkdir(argv[2], 0755) < 0 && errno != EEXIST) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        struct buf old = {NULL, 0, 0}, new = {NULL, 0, 0};
+
+        cases[i].gen((size_t) (scale * 4 * MIB), &old, &new);
+        if (write_file(argv[2], cases[i].name, "old", &old) < 0 ||
+            write_file(argv[2], cases[i].name, "new", &new) < 0)
+            return 1;
+
+        free(old.data);
+        free(new.data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,404 @@
+/* kernels.c - Microbenchmark of the generate and apply kernels
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Times the hot kernels of generating and applying patches on controlled
+ * inputs, and prints ns/op, throughput and bytes/cycle as JSON. Cycles,
+ * instructions, cache misses and branch misses come from perf events where
+ * the kernel allows them; without them, cycles are TSC ticks on x86.
+ */
+
+#define _GNU_SOURCE
+#include "kernels.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const struct kernel kernel_crc32;
+
+static const struct kernel *const kernels[] = {
+    &kernel_matchlen,
+    &kernel_search,
+    &kernel_scan,
+    &kernel_diff_block,
+    &kernel_apply_diff,
+    &kernel_crc32,
+};
+
+/* Match lengths for matchlen, suffix array sizes around the cache sizes for
+ * search, block sizes for the others */
+static const struct kernel_case cases[] = {
+    {"matchlen", 16, 1},
+    {"matchlen", 256, 1},
+    {"matchlen", 4096, 1},
+    {"search", 64 * 1024, 1},
+    {"search", 1024 * 1024, 1},
+    {"search", 16 * 1024 * 1024, 1},
+    {"scan", 256 * 1024, 1},
+    {"scan", 1024 * 1024, 1},
+    {"scan", 1024 * 1024, 4},
+    {"diff_block", 4 * 1024, 1},
+    {"diff_block", 32 * 1024, 1},
+    {"diff_block", 32 * 1024, 4},
+    {"diff_block", 32 * 1024, 8},
+    {"apply_diff", 4 * 1024, 1},
+    {"apply_diff", 64 * 1024, 1},
+    {"apply_diff", 64 * 1024, 4},
+    {"apply_diff", 64 * 1024, 8},
+    {"apply_diff", 1024 * 1024, 1},
+    {"crc32", 4 * 1024, 1},
+    {"crc32", 64 * 1024, 1},
+    {"crc32", 1024 * 1024, 1},
+};
+
+void kernel_fill(unsigned char *buf, size_t size, uint64_t seed)
+{
+    uint64_t x = seed * 0x2545F4914F6CDD1DULL + 1;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        buf[i] = (unsigned char) ((x * 0x2545F4914F6CDD1DULL) >> 56);
+    }
+}
+
+void kernel_mutate(unsigned char *new, const unsigned char *old, size_t size,
+                   size_t stride)
+{
+    size_t i;
+
+    memmove(new, old, size);
+    for (i = stride - 1; i < size; i += stride)
+        new[i] += 1 + (unsigned char) (i / stride % 7);
+}
+
+int kernel_discard(void *data, const void *buf, size_t size)
+{
+    (void) data;
+    (void) buf;
+    (void) size;
+    return 0;
+}
+
+struct crc32_state {
+    unsigned char *buf;
+    size_t size;
+};
+
+static void *crc32_setup(const struct kernel_case *c)
+{
+    struct crc32_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL || (s->buf = malloc(c->size)) == NULL) {
+        free(s);
+        return NULL;
+    }
+
+    s->size = c->size;
+    kernel_fill(s->buf, s->size, 6);
+    return s;
+}
+
+static uint64_t crc32_run(void *state)
+{
+    struct crc32_state *s = state;
+
+    return crc32(0, s->buf, s->size) == 0 ? 0 : s->size;
+}
+
+static void crc32_teardown(void *state)
+{
+    struct crc32_state *s = state;
+
+    free(s->buf);
+    free(s);
+}
+
+static const struct kernel kernel_crc32 = {
+    "crc32", crc32_setup, crc32_run, crc32_teardown,
+};
+
+enum { COUNT_CYCLES, COUNT_INSTRUCTIONS, COUNT_CACHE_MISSES,
+       COUNT_BRANCH_MISSES, COUNT_MAX };
+
+static const char *const counter_names[COUNT_MAX] = {
+    "cycles", "instructions", "cache_misses", "branch_misses",
+};
+
+/* Hardware counters of the calling thread, or -1 where not available */
+struct counters {
+    int fd[COUNT_MAX];
+    uint64_t value[COUNT_MAX];
+};
+
+static void counters_open(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < COUNT_MAX; i++)
+        c->fd[i] = -1;
+
+#ifdef __linux__
+    {
+        static const uint64_t config[COUNT_MAX] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+
+        for (i = 0; i < COUNT_MAX; i++) {
+            struct perf_event_attr attr;
+
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config[i];
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            c->fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+#endif
+}
+
+static void counters_start(struct counters *c)
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; i < COUNT_MAX; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void) c;
+#endif
+}
+
+static void counters_stop(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < COUNT_MAX; i++) {
+        c->value[i] = 0;
+#ifdef __linux__
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(c->fd[i], &c->value[i], sizeof(c->value[i])) != sizeof(c->value[i])) {
+                close(c->fd[i]);
+                c->fd[i] = -1;
+            }
+        }
+#endif
+    }
+}
+
+static void counters_close(struct counters *c)
+{
+    int i;
+
+    for (i = 0; i < COUNT_MAX; i++)
+        if (c->fd[i] >= 0)
+            close(c->fd[i]);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static const struct kernel *find_kernel(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if (strcmp(kernels[i]->name, name) == 0)
+            return kernels[i];
+
+    return NULL;
+}
+
+/* Run |c| for about |min_time| seconds and print its results */
+static int run_case(const struct kernel_case *c, double min_time,
+                    struct counters *counters, int first)
+{
+    const struct kernel *k = find_kernel(c->kernel);
+    uint64_t iterations = 1, i, bytes = 0, tsc;
+    double seconds;
+    void *state;
+    int j;
+
+    if (k == NULL || (state = k->setup(c)) == NULL) {
+        fprintf(stderr, "Cannot set up %s of %zu bytes\n", c->kernel, c->size);
+        return -1;
+    }
+
+    /* Warm up and find the number of iterations */
+    for (;;) {
+        seconds = now();
+        for (i = 0; i < iterations; i++)
+            k->run(state);
+        seconds = now() - seconds;
+        if (seconds >= min_time / 10)
+            break;
+        iterations *= 2;
+    }
+    if (seconds < min_time)
+        iterations = (uint64_t) (iterations * min_time / (seconds > 0 ? seconds : min_time / 10));
+
+    counters_start(counters);
+    tsc = ticks();
+    seconds = now();
+    for (i = 0; i < iterations; i++)
+        bytes += k->run(state);
+    seconds = now() - seconds;
+    tsc = ticks() - tsc;
+    counters_stop(counters);
+
+    k->teardown(state);
+
+    printf("%s    {\"kernel\": \"%s\", \"size\": %zu, \"word_size\": %d, "
+           "\"iterations\": %llu,\n",
+           first ? "" : ",\n", c->kernel, c->size, c->word_size,
+           (unsigned long long) iterations);
+    printf("     \"ns_per_op\": %.3f, \"bytes_per_op\": %.1f, \"mib_per_s\": %.3f",
+           seconds * 1e9 / iterations, (double) bytes / iterations,
+           bytes / seconds / (1024 * 1024));
+
+    if (counters->fd[COUNT_CYCLES] >= 0 && counters->value[COUNT_CYCLES] > 0)
+        printf(",\n     \"bytes_per_cycle\": %.4f, \"cycle_source\": \"perf\"",
+               (double) bytes / counters->value[COUNT_CYCLES]);
+    else if (tsc > 0)
+        printf(",\n     \"bytes_per_cycle\": %.4f, \"cycle_source\": \"tsc\"",
+               (double) bytes / tsc);
+
+    for (j = 0; j < COUNT_MAX; j++)
+        if (counters->fd[j] >= 0)
+            printf(",\n     \"%s_per_op\": %.2f", counter_names[j],
+                   (double) counters->value[j] / iterations);
+
+    printf("}");
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    size_t i;
+
+    fprintf(stderr, "usage: %s [--min-time=SECONDS] [kernel...]\n\nKernels:", prog);
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        fprintf(stderr, " %s", kernels[i]->name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"min-time", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    struct counters counters;
+    double min_time = 0.5;
+    int opt, first = 1, failed = 0, i;
+    size_t n;
+
+    while ((opt = getopt_long(argc, argv, "t:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            min_time = atof(optarg);
+            if (min_time <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (find_kernel(argv[i]) == NULL) {
+            fprintf(stderr, "Unknown kernel %s\n", argv[i]);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    counters_open(&counters);
+    if (counters.fd[COUNT_CYCLES] < 0)
+        fprintf(stderr, "perf events not available, counting TSC ticks\n");
+
+    printf("{\n  \"kernels\": [\n");
+    for (n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+        int selected = optind == argc;
+
+        for (i = optind; i < argc && !selected; i++)
+            selected = strcmp(argv[i], cases[n].kernel) == 0;
+
+        if (selected && run_case(&cases[n], min_time, &counters, first) < 0)
+            failed = 1;
+        else if (selected)
+            first = 0;
+    }
+    printf("\n  ]\n}\n");
+
+    counters_close(&counters);
+    return failed;
+}
@@ -0,0 +1,69 @@
+/* kernels.h - Kernels of the microbenchmark
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef DDELTA_BENCH_KERNELS_H
+#define DDELTA_BENCH_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An input configuration of a kernel */
+struct kernel_case {
+    const char *kernel;
+    /* Size of the input, or match length for matchlen */
+    size_t size;
+    int word_size;
+};
+
+/**
+ * A kernel is set up for a case, then run repeatedly. Only run() is timed;
+ * it does one operation and returns the number of bytes it processed.
+ */
+struct kernel {
+    const char *name;
+    void *(*setup)(const struct kernel_case *c);
+    uint64_t (*run)(void *state);
+    void (*teardown)(void *state);
+};
+
+/* In kernels_generate.c */
+extern const struct kernel kernel_matchlen;
+extern const struct kernel kernel_search;
+extern const struct kernel kernel_scan;
+extern const struct kernel kernel_diff_block;
+
+/* In kernels_apply.c */
+extern const struct kernel kernel_apply_diff;
+
+/* Fill |buf| with pseudo-random bytes from |seed| */
+void kernel_fill(unsigned char *buf, size_t size, uint64_t seed);
+
+/* Make |new| a copy of |old| with a changed byte every |stride| bytes */
+void kernel_mutate(unsigned char *new, const unsigned char *old, size_t size,
+                   size_t stride);
+
+/* Output callback discarding the data */
+int kernel_discard(void *data, const void *buf, size_t size);
+
+#endif
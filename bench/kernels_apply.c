@@ -0,0 +1,89 @@
+/* kernels_apply.c - Apply kernels of the microbenchmark
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The kernels are static functions, so this includes the applier source
+ * rather than linking against it.
+ */
+
+#include "../ddelta_apply.c"
+#include "kernels.h"
+
+struct apply_diff_state {
+    struct apply_state st;
+    unsigned char *old, *patch;
+    uint32_t size;
+};
+
+static void apply_diff_teardown(void *state)
+{
+    struct apply_diff_state *s = state;
+
+    free(s->old);
+    free(s->patch);
+    free(s);
+}
+
+static void *apply_diff_setup(const struct kernel_case *c)
+{
+    struct apply_diff_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return NULL;
+
+    s->size = (uint32_t) c->size;
+    s->old = malloc(s->size);
+    s->patch = calloc(1, s->size);
+    if (s->old == NULL || s->patch == NULL) {
+        apply_diff_teardown(s);
+        return NULL;
+    }
+
+    /* Mostly zero diff data, as for similar files */
+    kernel_fill(s->old, s->size, 5);
+    kernel_mutate(s->patch, s->patch, s->size, 16);
+
+    s->st.word_size = c->word_size;
+    s->st.old_data = s->old;
+    s->st.old_size = s->size;
+    s->st.write = kernel_discard;
+    return s;
+}
+
+/* Apply the diff data of one entry from memory, writing the result nowhere */
+static uint64_t apply_diff_run(void *state)
+{
+    struct apply_diff_state *s = state;
+    uint32_t crc = 0;
+
+    s->st.old_pos = 0;
+    if (apply_diff(&s->st, NULL, s->patch, NULL, NULL, s->size, &crc, 0) < 0)
+        return 0;
+
+    return s->size;
+}
+
+const struct kernel kernel_apply_diff = {
+    "apply_diff", apply_diff_setup, apply_diff_run, apply_diff_teardown,
+};
@@ -0,0 +1,265 @@
+/* kernels_generate.c - Generate kernels of the microbenchmark
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The kernels are static functions, so this includes the generator source
+ * rather than linking against it.
+ */
+
+#include "../ddelta_generate.c"
+#include "kernels.h"
+
+struct match_state {
+    unsigned char *old, *new;
+    off_t size;
+};
+
+static void *matchlen_setup(const struct kernel_case *c)
+{
+    struct match_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return NULL;
+
+    s->size = c->size + 1;
+    s->old = malloc(s->size);
+    s->new = malloc(s->size);
+    if (s->old == NULL || s->new == NULL) {
+        free(s->old);
+        free(s->new);
+        free(s);
+        return NULL;
+    }
+
+    /* Match c->size bytes, then differ */
+    kernel_fill(s->old, s->size, 1);
+    memcpy(s->new, s->old, s->size);
+    s->new[c->size] ^= 0xFF;
+    return s;
+}
+
+static uint64_t matchlen_run(void *state)
+{
+    struct match_state *s = state;
+
+    return matchlen(s->old, s->size, s->new, s->size);
+}
+
+static void match_teardown(void *state)
+{
+    struct match_state *s = state;
+
+    free(s->old);
+    free(s->new);
+    free(s);
+}
+
+const struct kernel kernel_matchlen = {
+    "matchlen", matchlen_setup, matchlen_run, match_teardown,
+};
+
+/* Number of positions searched, in turn */
+#define SEARCH_QUERIES 4096
+
+struct search_state {
+    unsigned char *old, *new;
+    off_t size;
+    saidx_t *I;
+    off_t queries[SEARCH_QUERIES];
+    size_t next;
+};
+
+static void search_teardown(void *state)
+{
+    struct search_state *s = state;
+
+    free(s->old);
+    free(s->new);
+    free(s->I);
+    free(s);
+}
+
+static void *search_setup(const struct kernel_case *c)
+{
+    struct search_state *s = calloc(1, sizeof(*s));
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    size_t i;
+
+    if (s == NULL)
+        return NULL;
+
+    s->size = c->size;
+    s->old = malloc(s->size);
+    s->new = malloc(s->size);
+    s->I = malloc((s->size + 1) * sizeof(*s->I));
+    if (s->old == NULL || s->new == NULL || s->I == NULL) {
+        search_teardown(s);
+        return NULL;
+    }
+
+    kernel_fill(s->old, s->size, 2);
+    kernel_mutate(s->new, s->old, s->size, 97);
+    if (divsufsort(s->old, s->I, (int32_t) s->size)) {
+        search_teardown(s);
+        return NULL;
+    }
+
+    /* Random positions, so large suffix arrays miss the cache */
+    for (i = 0; i < SEARCH_QUERIES; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        s->queries[i] = x % s->size;
+    }
+
+    return s;
+}
+
+static uint64_t search_run(void *state)
+{
+    struct search_state *s = state;
+    off_t q = s->queries[s->next++ % SEARCH_QUERIES], idx;
+
+    return search(s->I, s->old, s->size, s->new + q, s->size - q,
+                  0, s->size - 1, &idx);
+}
+
+const struct kernel kernel_search = {
+    "search", search_setup, search_run, search_teardown,
+};
+
+struct scan_state {
+    struct generate_state g;
+    struct patch_file pf;
+    struct ddelta_generate_stats stats;
+    struct old_index ix;
+};
+
+static void scan_teardown(void *state)
+{
+    struct scan_state *s = state;
+
+    free(s->g.old);
+    free(s->g.new);
+    free(s->ix.I);
+    free(s);
+}
+
+static void *scan_setup(const struct kernel_case *c)
+{
+    struct scan_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return NULL;
+
+    s->pf.write = kernel_discard;
+    s->g.pf = &s->pf;
+    s->g.stats = &s->stats;
+    s->g.word_size = c->word_size;
+    s->g.oldsize = s->g.newsize = c->size;
+    s->g.old = malloc(c->size);
+    s->g.new = malloc(c->size);
+    s->ix.I = malloc((c->size + 1) * sizeof(*s->ix.I));
+    s->ix.size = c->size;
+    if (s->g.old == NULL || s->g.new == NULL || s->ix.I == NULL) {
+        scan_teardown(s);
+        return NULL;
+    }
+
+    kernel_fill(s->g.old, c->size, 3);
+    kernel_mutate(s->g.new, s->g.old, c->size, 61);
+    if (divsufsort(s->g.old, s->ix.I, (int32_t) c->size)) {
+        scan_teardown(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+/* Match and score the whole new file, writing the entries nowhere */
+static uint64_t scan_run(void *state)
+{
+    struct scan_state *s = state;
+
+    s->g.scan = s->g.pos = 0;
+    s->g.lastscan = s->g.lastpos = s->g.lastoffset = 0;
+    if (scan_range(&s->g, &s->ix, s->g.newsize, -1) < 0)
+        return 0;
+
+    return s->g.newsize;
+}
+
+const struct kernel kernel_scan = {
+    "scan", scan_setup, scan_run, scan_teardown,
+};
+
+struct diff_state {
+    unsigned char *old, *new, *out;
+    size_t size;
+    int word_size;
+};
+
+static void diff_teardown(void *state)
+{
+    struct diff_state *s = state;
+
+    free(s->old);
+    free(s->new);
+    free(s->out);
+    free(s);
+}
+
+static void *diff_setup(const struct kernel_case *c)
+{
+    struct diff_state *s = calloc(1, sizeof(*s));
+
+    if (s == NULL)
+        return NULL;
+
+    s->size = c->size;
+    s->word_size = c->word_size;
+    s->old = malloc(s->size);
+    s->new = malloc(s->size);
+    s->out = malloc(s->size);
+    if (s->old == NULL || s->new == NULL || s->out == NULL) {
+        diff_teardown(s);
+        return NULL;
+    }
+
+    kernel_fill(s->old, s->size, 4);
+    kernel_mutate(s->new, s->old, s->size, 16);
+    return s;
+}
+
+static uint64_t diff_run(void *state)
+{
+    struct diff_state *s = state;
+
+    diff_block(s->out, s->old, s->new, s->size, s->word_size, 0);
+    return s->size;
+}
+
+const struct kernel kernel_diff_block = {
+    "diff_block", diff_setup, diff_run, diff_teardown,
+};
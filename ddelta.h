@@ -1,23 +1,222 @@
 #ifndef DDELTA_H
 #define DDELTA_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* Fork of BSDIFF that does not compress ctrl, diff, extra blocks */
 #define DDELTA_MAGIC "DDELTA50"
+/* Same, with the 'flags' and 'reserved' header fields present */
+#define DDELTA_MAGIC_EXT "DDELTA51"
 
 /**
  * A ddelta file has the following format:
  *
  * * the header
  * * a list of entries
+ *
+ * The 'flags' and 'reserved' fields are only stored in the file if the
+ * magic is DDELTA_MAGIC_EXT; they are 0 otherwise.
  */
 struct ddelta_header {
     char magic[8];
     uint64_t new_file_size;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+/* Size of the header in the file, without and with the flags */
+#define DDELTA_HEADER_SIZE 16
+#define DDELTA_HEADER_EXT_SIZE 24
+
+/**
+ * Header flags.
+ *
+ * By default diff data is the byte-wise difference between new and old.
+ * With DDELTA_FLAG_WORD32 or DDELTA_FLAG_WORD64, it is the difference of
+ * little-endian words instead, aligned to their offset in the new file.
+ * Words cut off at the start or end of an entry's diff data are treated as
+ * if the missing bytes were zero.
+ */
+#define DDELTA_FLAG_WORD32 (1u << 0)
+#define DDELTA_FLAG_WORD64 (1u << 1)
+
+/**
+ * Branch filter the patch was generated with, see enum ddelta_filter.
+ */
+#define DDELTA_FLAG_FILTER_SHIFT 8
+#define DDELTA_FLAG_FILTER_MASK (0xFu << DDELTA_FLAG_FILTER_SHIFT)
+
+/**
+ * The old file is a gzip file, and the patch applies to its content.
+ */
+#define DDELTA_FLAG_INFLATE_OLD (1u << 2)
+
+/**
+ * The new file is a gzip file, and the patch produces its content. The
+ * header is followed by a struct ddelta_deflate_params and the gzip header
+ * of the new file, which apply uses to compress the content bit-exactly.
+ */
+#define DDELTA_FLAG_DEFLATE_NEW (1u << 3)
+
+/**
+ * The new file is a zip archive, and the patch produces its content with
+ * the deflated members that zlib reproduces inflated. The header is
+ * followed by a struct ddelta_zip_header and the members of both files:
+ * those of the old file are inflated before applying the patch to it, and
+ * those of the new file compressed again as they are written. Cannot be
+ * combined with DDELTA_FLAG_INFLATE_OLD or DDELTA_FLAG_DEFLATE_NEW.
+ */
+#define DDELTA_FLAG_ZIP (1u << 4)
+
+/**
+ * The new file is an ELF file whose absolute pointers the patch produces
+ * as addresses in the old file: those at the places of its relocations,
+ * the relocations themselves and the values of its symbols. The header is
+ * followed by a struct ddelta_reloc_header, the sections that map the
+ * addresses and the regions of the new file holding the pointers. Cannot
+ * be combined with in-place updates.
+ */
+#define DDELTA_FLAG_RELOC (1u << 5)
+
+#define DDELTA_FLAGS_KNOWN (DDELTA_FLAG_WORD32 | DDELTA_FLAG_WORD64 | \
+                            DDELTA_FLAG_FILTER_MASK |                \
+                            DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW | \
+                            DDELTA_FLAG_ZIP | DDELTA_FLAG_RELOC)
+
+/**
+ * zlib parameters reproducing the compressed data of the new file.
+ */
+struct ddelta_deflate_params {
+    /** Size of the uncompressed content, which the patch entries produce */
+    uint64_t content_size;
+    /** crc32 of the whole new file, to check the result is bit-exact */
+    uint32_t file_crc;
+    /** Size of the gzip header following this structure */
+    uint32_t header_size;
+    /** deflateInit2() parameters */
+    uint8_t level;
+    uint8_t mem_level;
+    uint8_t strategy;
+    /** Window size of the raw deflate stream in bits, 9 to 15, or 0 for 15 */
+    uint8_t window_bits;
+    uint8_t reserved[4];
+};
+
+/**
+ * The deflated members of DDELTA_FLAG_ZIP, which follow this structure in
+ * the patch: first |old_members| of the old file, then |new_members| of
+ * the new one, each a struct ddelta_zip_member.
+ */
+struct ddelta_zip_header {
+    /** Size of the content of the new file, which the patch entries produce */
+    uint64_t content_size;
+    /** crc32 of the whole new file, to check the result is bit-exact */
+    uint32_t file_crc;
+    uint32_t old_members;
+    uint32_t new_members;
+    uint32_t reserved;
+};
+
+/* Members of each file in a patch at most, as in a zip archive without
+ * the zip64 extensions */
+#define DDELTA_ZIP_MAX_MEMBERS 65535
+
+/**
+ * A deflated member of a zip archive. The members of each file are sorted
+ * by offset and do not overlap.
+ */
+struct ddelta_zip_member {
+    /**
+     * Offset of the deflated data in the old file, or of the inflated data
+     * in the content of the new file
+     */
+    uint64_t offset;
+    /** Size of the deflated and of the inflated data */
+    uint64_t size;
+    uint64_t content_size;
+    /**
+     * deflateInit2() parameters of a member of the new file, as in struct
+     * ddelta_deflate_params, and 0 for the old file
+     */
+    uint8_t level;
+    uint8_t mem_level;
+    uint8_t strategy;
+    uint8_t window_bits;
+    uint8_t reserved[4];
+};
+
+/**
+ * The layout of DDELTA_FLAG_RELOC, which is followed by |sections| struct
+ * ddelta_reloc_section and |regions| struct ddelta_reloc_region.
+ *
+ * The sections map the address space of the new file onto that of the old
+ * one, one to one: an address in a section moves to the same offset in the
+ * section in the old file, and the other addresses keep their order. Both
+ * the sections and the regions are sorted and do not overlap.
+ */
+struct ddelta_reloc_header {
+    uint32_t sections;
+    uint32_t regions;
+    /** Size of the pointers, 4 or 8 bytes, which are little-endian */
+    uint8_t word_size;
+    uint8_t reserved[7];
+};
+
+/* Sections and regions of a patch at most */
+#define DDELTA_RELOC_MAX_SECTIONS 1024
+#define DDELTA_RELOC_MAX_REGIONS 16384
+
+/** A section of both files, sorted by its address in either */
+struct ddelta_reloc_section {
+    uint64_t old_addr;
+    uint64_t new_addr;
+    /** The smaller of its sizes in both files */
+    uint64_t size;
 };
 
+/**
+ * Pointers in the new file: |count| elements of |stride| bytes, starting
+ * at |offset|, each with a pointer in the words whose bit is set in |mask|.
+ * A run of pointers has a |stride| of one word and a |mask| of 1, a table
+ * of Elf64_Rela a |stride| of 24 and a |mask| of 5, for its offset and
+ * addend.
+ */
+struct ddelta_reloc_region {
+    uint64_t offset;
+    uint32_t count;
+    uint16_t stride;
+    uint16_t mask;
+};
+
+/**
+ * Branch filters.
+ *
+ * Before diffing, relative branch targets in old and new are converted to
+ * absolute ones, like the BCJ filters of xz do, so that moving code around
+ * does not change the encoding of every call after it. Applying the patch
+ * reverts the conversion on the fly.
+ *
+ * Filters work on independent windows of DDELTA_FILTER_WINDOW bytes; for
+ * in-place updates, the blocksize is rounded up to a multiple of it.
+ */
+enum ddelta_filter {
+    DDELTA_FILTER_NONE = 0,
+    /** x86 CALL and JMP instructions */
+    DDELTA_FILTER_X86,
+    /** 32-bit ARM BL instructions */
+    DDELTA_FILTER_ARM,
+    /** ARM Thumb BL instructions */
+    DDELTA_FILTER_ARMTHUMB,
+};
+
+#define DDELTA_FILTER_WINDOW 4096
+
 /**
  * An entry consists of this header, followed by
  *
@@ -46,7 +245,13 @@ struct ddelta_entry_header {
 };
 
 /* Static assertions that the headers have the correct size. */
-typedef int ddelta_assert_header_size[sizeof(struct ddelta_header) == 16 ? 1 : -1];
+typedef int ddelta_assert_header_size[sizeof(struct ddelta_header) == DDELTA_HEADER_EXT_SIZE ? 1 : -1];
+typedef int ddelta_assert_deflate_params_size[sizeof(struct ddelta_deflate_params) == 24 ? 1 : -1];
+typedef int ddelta_assert_zip_header_size[sizeof(struct ddelta_zip_header) == 24 ? 1 : -1];
+typedef int ddelta_assert_zip_member_size[sizeof(struct ddelta_zip_member) == 32 ? 1 : -1];
+typedef int ddelta_assert_reloc_header_size[sizeof(struct ddelta_reloc_header) == 16 ? 1 : -1];
+typedef int ddelta_assert_reloc_section_size[sizeof(struct ddelta_reloc_section) == 24 ? 1 : -1];
+typedef int ddelta_assert_reloc_region_size[sizeof(struct ddelta_reloc_region) == 16 ? 1 : -1];
 typedef int ddelta_assert_entry_header_size[sizeof(struct ddelta_entry_header) == 12 ? 1 : -1];
 
 /**
@@ -67,7 +272,313 @@ enum ddelta_error {
     /** An I/O error occured while reading from (generate) or writing to (apply) the new file */
     DDELTA_ENEWIO,
     /** Patch ended before target file was fully written */
-    DDELTA_EPATCHSHORT
+    DDELTA_EPATCHSHORT,
+    /** An invalid option was passed */
+    DDELTA_EINVAL,
+    /** The generated patch does not give the new file */
+    DDELTA_EVERIFY,
+    /** The progress callback asked to cancel */
+    DDELTA_ECANCELED,
+    /** The memory limit or the device profile cannot be met */
+    DDELTA_EBUDGET,
+    /** An allocation failed, or would have exceeded the memory cap */
+    DDELTA_ENOMEM
+};
+
+/**
+ * Phases of generating and applying a patch.
+ */
+enum ddelta_phase {
+    /** Reading and preparing the old and new file */
+    DDELTA_PHASE_READ,
+    /** Sorting the suffixes of the old file */
+    DDELTA_PHASE_SORT,
+    /** Matching the new file against the old one and writing the entries */
+    DDELTA_PHASE_SCAN,
+    /** Applying entries to the new file */
+    DDELTA_PHASE_APPLY,
+    /** Copying a flushed block to the old file, for in-place updates */
+    DDELTA_PHASE_FLUSH,
+};
+
+/**
+ * Progress of generating or applying a patch.
+ */
+struct ddelta_progress {
+    /** Current phase, see enum ddelta_phase */
+    int phase;
+    /** Bytes of the new file done, out of total */
+    uint64_t done;
+    uint64_t total;
+    /** Time since the call started, in microseconds */
+    uint64_t elapsed_us;
+    /** Average bytes of the new file done per second since then */
+    uint64_t rate;
+};
+
+/**
+ * Progress callback.
+ *
+ * It is called when a phase starts, and at least every 'progress_interval'
+ * bytes of the new file otherwise.
+ *
+ * @return 0 to continue, non-zero to make the call return -DDELTA_ECANCELED
+ *         as soon as possible, after releasing its resources
+ */
+typedef int (*ddelta_progress_fn)(const struct ddelta_progress *progress,
+                                  void *data);
+
+/**
+ * Storage characteristics of the device a patch is going to be applied on.
+ *
+ * Applying a patch reads the old file sequentially, except for the 'seek'
+ * of each entry. On slow storage (eMMC, SPI flash) such seeks, and backward
+ * ones in particular, dominate the apply time.
+ */
+struct ddelta_cost_profile {
+    /** Cost of a non-sequential read of the old file, in microseconds */
+    uint32_t seek_cost;
+    /** Sequential read bandwidth of the old file, in bytes per second */
+    uint32_t read_bandwidth;
+    /** RAM available for caching old file data, in bytes */
+    uint32_t cache_size;
+};
+
+/**
+ * Resources of the device a patch is applied on. Its erase block size is
+ * the erase_size option.
+ */
+struct ddelta_device_profile {
+    /** Memory available to ddelta_apply(), in bytes, or 0 if unknown */
+    uint64_t ram;
+    /** Free space next to the file for in-place updates, in bytes, or 0 */
+    uint64_t scratch;
+};
+
+/**
+ * Allocator for the memory of a call.
+ *
+ * 'free' receives the size passed to 'alloc' for the block. Blocks must be
+ * aligned for any type, as by malloc().
+ */
+struct ddelta_allocator {
+    void *(*alloc)(void *data, size_t size);
+    void (*free)(void *data, void *ptr, size_t size);
+    void *data;
+};
+
+/** Blocksize option choosing the largest flush blocks the device fits */
+#define DDELTA_BLOCKSIZE_AUTO (-1)
+
+/**
+ * Options for ddelta_generate_opts().
+ *
+ * A zero-initialized structure gives the behavior of ddelta_generate().
+ * Fields are only added at the end, along with a new soname of the shared
+ * library, as are those of the other structures passed by pointer.
+ */
+struct ddelta_generate_options {
+    /**
+     * Flush block size for in-place updates, 0 to disable, or
+     * DDELTA_BLOCKSIZE_AUTO to choose it from the scratch space of the
+     * device. An in-place update needs scratch space for one block.
+     */
+    int blocksize;
+    /**
+     * Storage profile of the applying device, or NULL. If set, matches of
+     * near-equal length are chosen so that the old file is read forward
+     * and local where possible.
+     */
+    const struct ddelta_cost_profile *cost;
+    /**
+     * Size of the words diff data is computed on: 0 or 1 for bytes, 4 or 8
+     * for little-endian 32-bit or 64-bit words. Word-wise diffs of code
+     * with relocated pointers compress better.
+     */
+    int word_size;
+    /** Branch filter to apply to old and new, see enum ddelta_filter */
+    int filter;
+    /**
+     * If non-zero and the new file is an ELF executable, shared object or
+     * relocatable object, pick the branch filter from its machine type and
+     * the word size from its class, unless filter or word_size are set.
+     * If both files are executables or shared objects and many of the
+     * pointers of the new file moved, also diff them as addresses of the
+     * old one, with DDELTA_FLAG_RELOC, unless there is a blocksize.
+     */
+    int elf;
+    /**
+     * If non-zero and both files are tar archives, diff each member of the
+     * new archive against the matching member of the old one, found by name
+     * or by content. This is faster on large archives, and aligns members
+     * that moved. Cannot be combined with a blocksize.
+     */
+    int tar;
+    /**
+     * If non-zero, diff the content of gzip files, or of the deflated
+     * members of zip archives. The new file is only diffed this way if
+     * zlib can reproduce its compressed data exactly, or that of some of
+     * its members. Cannot be combined with a blocksize.
+     */
+    int gzip;
+    /**
+     * Erase block size of the flash the patch is applied to in-place, or 0.
+     * The blocksize is rounded up to a multiple of it, and matches within
+     * the current or already updated erase blocks are preferred.
+     */
+    int erase_size;
+    /**
+     * If non-zero, apply the patch to the old data in memory in a second
+     * thread while it is being written, and fail with -DDELTA_EVERIFY at the
+     * first difference to the new file. This checks the entries against
+     * the data as diffed, i.e. after decompression and branch filtering.
+     */
+    int verify;
+    /**
+     * Path of a cache file, or NULL. The entries of the patch are saved in
+     * it, together with hashes of the new file and the suffix array of the
+     * old one. A later run with the same old file and patch format reuses
+     * the entries for the parts of the new file that did not change, and
+     * only scans the rest. Cannot be combined with a blocksize or tar.
+     */
+    const char *cache;
+    /** Progress callback and its data, or NULL */
+    ddelta_progress_fn progress;
+    void *progress_data;
+    /** Bytes of the new file between calls to progress, 0 for 1 MiB */
+    uint64_t progress_interval;
+    /**
+     * Percentage of CPU time the scan may use, 0 or 100 for no limit. The
+     * scan sleeps in between to stay below it. Suffix sorting is done in a
+     * single call and is not limited.
+     */
+    int cpu_percent;
+    /**
+     * Memory generating may use, in bytes, or 0 for no limit. If the peak
+     * projected by ddelta_generate_memory() exceeds it, generating fails
+     * with -DDELTA_EBUDGET before reading the files, or for gzip before
+     * sorting the decompressed content.
+     */
+    uint64_t memory_limit;
+    /**
+     * Device the patch is applied on, or NULL. Gzip content is only diffed
+     * if the device has the memory for compressing it again, and patches
+     * the device has no memory or scratch space for fail with
+     * -DDELTA_EBUDGET before reading the files.
+     */
+    const struct ddelta_device_profile *device;
+    /**
+     * Stream to write a CSV trace of the entries to, or NULL. Each line
+     * has the offsets of an entry in the new and old data as diffed, its
+     * diff and extra sizes and seek, the number of non-zero diff bytes, and
+     * the nanoseconds since generating started. Write errors are left to
+     * the caller to check with ferror().
+     */
+    FILE *trace;
+    /**
+     * Allocator for the buffers of the files, the suffix array, the entries
+     * and zlib, or NULL for malloc(). Without it, the buffers are mapped
+     * where possible, backed by huge pages. Allocations within
+     * libdivsufsort and stdio do not go through it.
+     */
+    const struct ddelta_allocator *allocator;
+    /**
+     * Most bytes allocated at once, or 0 for no limit. Unlike memory_limit,
+     * it is checked on each allocation, and generating fails with
+     * -DDELTA_ENOMEM at the first one that would exceed it.
+     */
+    uint64_t memory_cap;
+};
+
+/**
+ * Time spent in a phase, in nanoseconds. The CPU time is that of the
+ * thread doing the work.
+ */
+struct ddelta_phase_time {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+/** Buckets of the entry size histograms, see struct ddelta_scan_counters */
+#define DDELTA_SIZE_BUCKETS 33
+
+/**
+ * Counters of the hot paths of generating a patch. They are only counted
+ * in builds with DDELTA_COUNTERS defined, and zero otherwise.
+ */
+struct ddelta_scan_counters {
+    /** Non-zero if counted */
+    uint64_t enabled;
+    /** Suffix array searches, and their total and largest number of steps */
+    uint64_t searches;
+    uint64_t search_steps;
+    uint64_t search_steps_max;
+    /** Bytes compared by matchlen(), and memcmp() calls of the searches */
+    uint64_t compared_bytes;
+    uint64_t memcmp_calls;
+    /** Times the scan broke out of a block of nearly equal matches */
+    uint64_t stuck_escapes;
+    /** Wall time extending matches and resolving overlaps, in nanoseconds */
+    uint64_t extend_ns;
+    /**
+     * Entries by the size of their diff and extra data: bucket 0 counts
+     * empty ones, bucket i sizes from 2^(i-1) to 2^i - 1.
+     */
+    uint64_t diff_sizes[DDELTA_SIZE_BUCKETS];
+    uint64_t extra_sizes[DDELTA_SIZE_BUCKETS];
+};
+
+/**
+ * Statistics about a generated patch.
+ */
+struct ddelta_generate_stats {
+    /** Number of entries written, excluding flush and terminating entries */
+    uint64_t entries;
+    /** Total size of the diff data, which is also the bytes read from old */
+    uint64_t diff_bytes;
+    /** Total size of the extra data */
+    uint64_t extra_bytes;
+    /** Number of entries with a non-zero seek */
+    uint64_t seeks;
+    /** Number of entries with a negative seek */
+    uint64_t backward_seeks;
+    /** Number of flush entries */
+    uint64_t flushes;
+    /** Estimated apply I/O cost in microseconds, if a cost profile was given */
+    uint64_t apply_cost;
+    /** Time generating took, and spent sleeping for cpu_percent, in microseconds */
+    uint64_t elapsed_us;
+    uint64_t throttled_us;
+    /** Peak memory held by the file buffers and the suffix array, in bytes */
+    uint64_t memory_peak;
+    /** The same, as projected before reading the files */
+    uint64_t memory_projected;
+    /**
+     * Peak of the bytes allocated at once, including zlib and the cache,
+     * but not libdivsufsort's buffers or the verifier thread's stack
+     */
+    uint64_t allocated_peak;
+    /** Projected memory use of applying the patch, see ddelta_apply_memory() */
+    uint64_t apply_memory;
+    /** Flush block size used, e.g. for DDELTA_BLOCKSIZE_AUTO */
+    uint64_t blocksize;
+    /** Reading, unpacking and filtering the files */
+    struct ddelta_phase_time read_time;
+    /** Sorting the suffix arrays */
+    struct ddelta_phase_time sort_time;
+    /** Scanning the new file for matches, excluding writing the entries */
+    struct ddelta_phase_time scan_time;
+    /** Computing and writing the entries */
+    struct ddelta_phase_time write_time;
+    /** CPU time of the process while generating, in microseconds */
+    uint64_t cpu_us;
+    /** Peak resident set size of the process, in bytes */
+    uint64_t max_rss;
+    /** Bytes read from the old and new file, and written to the patch */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    /** Counters of the scan, if built with DDELTA_COUNTERS */
+    struct ddelta_scan_counters counters;
 };
 
 /**
@@ -77,6 +588,24 @@ enum ddelta_error {
  */
 int ddelta_generate(int oldfd, int newfd, int patchfd, int blocksize);
 
+/**
+ * Like ddelta_generate(), with additional options.
+ *
+ * @param options may be NULL for the defaults
+ * @param stats if not NULL, receives statistics about the patch
+ */
+int ddelta_generate_opts(int oldfd, int newfd, int patchfd,
+                         const struct ddelta_generate_options *options,
+                         struct ddelta_generate_stats *stats);
+
+/**
+ * Projected peak memory of ddelta_generate_opts() for files of the given
+ * sizes, in bytes. With the gzip option, the sizes are those of the
+ * compressed files, so the decompressed content may need more.
+ */
+uint64_t ddelta_generate_memory(uint64_t oldsize, uint64_t newsize,
+                                const struct ddelta_generate_options *options);
+
 /**
  * Read a header from the given file.
  *
@@ -85,15 +614,250 @@ int ddelta_generate(int oldfd, int newfd, int patchfd, int blocksize);
  *
  * @return 0 on success,
  *         -DDELTA_EPATCHIO on I/O errors,
- *         -DDELTA_EMAGIC if it is not a ddelta file
+ *         -DDELTA_EMAGIC if it is not a ddelta file, or uses unknown flags
  */
 int ddelta_header_read(struct ddelta_header *header, FILE *patchfd);
 
 /**
  * Generates a new file from a given patch and an old file.
  *
- * The old file must be seekable.
+ * The old file must be seekable. If |newfile| is a directory, the old file
+ * is updated in place, through temporary files in it. Patches generated
+ * with a blocksize need that, and fail with -DDELTA_EINVAL otherwise.
+ */
+int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, const char *newfile);
+
+/**
+ * Options for ddelta_apply_opts().
+ *
+ * A zero-initialized structure gives the behavior of ddelta_apply().
+ */
+struct ddelta_apply_options {
+    /** Progress callback and its data, or NULL */
+    ddelta_progress_fn progress;
+    void *progress_data;
+    /** Bytes of the new file between calls to progress, 0 for 1 MiB */
+    uint64_t progress_interval;
+    /**
+     * Limits of the bytes read from the old file and the patch, and written
+     * to the new file and, for in-place updates, the old file, in bytes per
+     * second. 0 for no limit.
+     */
+    uint64_t read_rate;
+    uint64_t write_rate;
+    /**
+     * Memory applying may use, in bytes, or 0 for no limit. If
+     * ddelta_apply_memory() exceeds it for the patch, applying fails with
+     * -DDELTA_EBUDGET before writing anything.
+     */
+    uint64_t memory_limit;
+    /**
+     * Stream to write a CSV trace of the entries to, or NULL, in the format
+     * of ddelta_generate_options.trace. Flush entries are left out.
+     */
+    FILE *trace;
+    /**
+     * If non-zero, time each I/O operation and count them by class in
+     * ddelta_apply_stats.io. Otherwise this costs a branch per operation.
+     */
+    int io_stats;
+    /**
+     * Allocator for the buffers, zlib and struct ddelta_apply_ctx, or NULL
+     * for malloc(), and the most bytes allocated at once, or 0 for no
+     * limit. Allocations beyond the cap fail with -DDELTA_ENOMEM, and
+     * ddelta_apply_ctx_new() with NULL.
+     */
+    const struct ddelta_allocator *allocator;
+    uint64_t memory_cap;
+};
+
+/**
+ * Projected peak memory of applying a patch with the given header flags,
+ * in bytes, excluding the temporary file of DDELTA_FLAG_INFLATE_OLD and
+ * DDELTA_FLAG_ZIP, and the tables of the members of the latter.
+ *
+ * @param mem_level zlib memory level of DDELTA_FLAG_DEFLATE_NEW, or 0 for
+ *                  the largest one
+ */
+uint64_t ddelta_apply_memory(uint32_t flags, int mem_level);
+
+/**
+ * Classes of I/O operations of applying a patch. Reads and writes are the
+ * calls to stdio or the write callback, which may buffer them; the others
+ * are system calls.
+ */
+enum ddelta_io_op {
+    /** Reading the patch */
+    DDELTA_IO_PATCH_READ,
+    /** Reading the old file, and the saved blocks of in-place updates */
+    DDELTA_IO_OLD_READ,
+    /** Seeking in the old file */
+    DDELTA_IO_SEEK,
+    /** Writing the new file, the old file in place, or temporary files */
+    DDELTA_IO_WRITE,
+    /** fflush() and fsync() at flush entries and the end */
+    DDELTA_IO_SYNC,
+    /** Creating, opening and checking for temporary files */
+    DDELTA_IO_OPEN,
+    DDELTA_IO_RENAME,
+    DDELTA_IO_UNLINK,
+    DDELTA_IO_OPS
+};
+
+/** Buckets of the I/O latency histograms */
+#define DDELTA_LATENCY_BUCKETS 40
+
+/**
+ * I/O operations of one class.
+ */
+struct ddelta_io_class {
+    uint64_t calls;
+    uint64_t bytes;
+    /** Total and longest time of the operations, in nanoseconds */
+    uint64_t ns;
+    uint64_t max_ns;
+    /**
+     * Operations by latency: bucket 0 counts those that took no measurable
+     * time, bucket i those that took at least 2^(i-1) and less than 2^i
+     * nanoseconds. The last bucket also counts all longer ones.
+     */
+    uint64_t latency[DDELTA_LATENCY_BUCKETS];
+};
+
+/**
+ * Statistics about applying a patch.
+ */
+struct ddelta_apply_stats {
+    /** Bytes read from the old file and the patch */
+    uint64_t bytes_read;
+    /** Bytes written to the new file and, for in-place updates, the old file */
+    uint64_t bytes_written;
+    /** Time applying took, and spent waiting for the rate limits, in microseconds */
+    uint64_t elapsed_us;
+    uint64_t throttled_us;
+    /**
+     * Wall time reading the patch, reading the old file, adding the diff
+     * data, writing the new file, and flushing and syncing it at the end
+     * and at flush entries, in nanoseconds
+     */
+    uint64_t patch_read_ns;
+    uint64_t old_read_ns;
+    uint64_t add_ns;
+    uint64_t write_ns;
+    uint64_t flush_ns;
+    /** CPU time of the process while applying, in microseconds */
+    uint64_t cpu_us;
+    /** Peak resident set size of the process, in bytes */
+    uint64_t max_rss;
+    /** Entries applied, excluding flush and terminating entries, their
+     * diff and extra data, and flush entries */
+    uint64_t entries;
+    uint64_t diff_bytes;
+    uint64_t extra_bytes;
+    uint64_t flushes;
+    /** Peak of the bytes allocated at once */
+    uint64_t allocated_peak;
+    /** I/O operations by enum ddelta_io_op, if the io_stats option is set */
+    struct ddelta_io_class io[DDELTA_IO_OPS];
+};
+
+/**
+ * Like ddelta_apply(), with additional options.
+ *
+ * @param options may be NULL for the defaults
+ * @param stats if not NULL, receives statistics about applying the patch
+ */
+int ddelta_apply_opts(struct ddelta_header *header, FILE *patchfd,
+                      FILE *oldfd, const char *newfile,
+                      const struct ddelta_apply_options *options,
+                      struct ddelta_apply_stats *stats);
+
+/**
+ * Receives |size| bytes of output in order.
+ *
+ * @return 0 on success, negative to fail with -DDELTA_EPATCHIO when
+ *         generating or -DDELTA_ENEWIO when applying
+ */
+typedef int (*ddelta_write_fn)(void *data, const void *buf, size_t size);
+
+/**
+ * Like ddelta_generate_opts(), for files in memory, passing the patch to
+ * |write| as it is generated.
+ *
+ * The files are copied, as generating filters them and pads the old file.
+ */
+int ddelta_generate_mem(const void *olddata, size_t oldsize,
+                        const void *newdata, size_t newsize,
+                        ddelta_write_fn write, void *write_data,
+                        const struct ddelta_generate_options *options,
+                        struct ddelta_generate_stats *stats);
+
+/**
+ * A patch being applied incrementally, as its data arrives.
+ *
+ * The new file is passed to a write callback, so there are no in-place
+ * updates. A patch generated with a blocksize, whose entries read back
+ * the flushed blocks, fails with -DDELTA_EINVAL at its first entry after a
+ * flush; the flush before the terminating entry of other patches is
+ * skipped.
  */
-int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, const char *new);
+struct ddelta_apply_ctx;
+
+/**
+ * Start applying a patch to the seekable old file |oldfd|, which must
+ * remain open until ddelta_apply_ctx_free().
+ *
+ * @param options may be NULL for the defaults
+ * @return the context, or NULL if out of memory
+ */
+struct ddelta_apply_ctx *ddelta_apply_ctx_new(FILE *oldfd, ddelta_write_fn write,
+                                              void *write_data,
+                                              const struct ddelta_apply_options *options);
+
+/**
+ * Like ddelta_apply_ctx_new(), for an old file in memory, which must remain
+ * valid until ddelta_apply_ctx_free(). It is read in place, unless the
+ * patch has DDELTA_FLAG_INFLATE_OLD.
+ */
+struct ddelta_apply_ctx *ddelta_apply_ctx_new_mem(const void *old, size_t oldsize,
+                                                  ddelta_write_fn write,
+                                                  void *write_data,
+                                                  const struct ddelta_apply_options *options);
+
+/**
+ * Apply the next |size| bytes of the patch, starting with its header.
+ * Data after the terminating entry is ignored.
+ *
+ * @return 1 once the new file is complete, 0 if more data is needed, or a
+ *         negative error, which all later calls return as well
+ */
+int ddelta_apply_ctx_feed(struct ddelta_apply_ctx *ctx, const void *patch,
+                          size_t size);
+
+/**
+ * Free |ctx|, whether the patch was applied completely or not.
+ *
+ * @param stats if not NULL, receives statistics about applying the patch
+ */
+void ddelta_apply_ctx_free(struct ddelta_apply_ctx *ctx,
+                           struct ddelta_apply_stats *stats);
+
+/**
+ * Apply the complete patch in memory to the old file in memory, passing
+ * the new file to |write|.
+ *
+ * @return 0 on success, -DDELTA_EPATCHIO if the patch is truncated,
+ *         -DDELTA_EINVAL if it is for in-place updates, or another negative
+ *         error
+ */
+int ddelta_apply_mem(const void *patch, size_t patchsize,
+                     const void *old, size_t oldsize,
+                     ddelta_write_fn write, void *write_data,
+                     const struct ddelta_apply_options *options,
+                     struct ddelta_apply_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,306 @@
+#ifndef DDELTA_HPP
+#define DDELTA_HPP
+
+/*
+ * C++17 interface to ddelta.
+ *
+ * Data is passed as views of the caller's memory and output goes to a
+ * writer, a callable taking a ddelta::bytes chunk and returning void or
+ * bool (false fails with an I/O error). Nothing is copied or allocated
+ * between the caller and the C functions; exceptions thrown by a writer are
+ * caught before they reach C code and rethrown afterwards.
+ */
+
+#include "ddelta.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define DDELTA_HPP_SPAN 1
+#endif
+#endif
+
+namespace ddelta {
+
+/** A view of read-only bytes, like std::span<const std::byte>. */
+class bytes {
+public:
+    constexpr bytes() noexcept : data_(nullptr), size_(0) {}
+    constexpr bytes(const std::byte *data, std::size_t size) noexcept
+        : data_(data), size_(size) {}
+    bytes(const void *data, std::size_t size) noexcept
+        : data_(static_cast<const std::byte *>(data)), size_(size) {}
+
+    /** Any contiguous container of byte-sized elements */
+    template <class C,
+              class T = std::remove_pointer_t<decltype(std::declval<const C &>().data())>,
+              class = std::enable_if_t<sizeof(T) == 1 && std::is_trivial_v<T>>>
+    bytes(const C &c) noexcept : bytes(c.data(), c.size()) {}
+
+#ifdef DDELTA_HPP_SPAN
+    constexpr bytes(std::span<const std::byte> s) noexcept
+        : data_(s.data()), size_(s.size()) {}
+    constexpr operator std::span<const std::byte>() const noexcept
+    {
+        return {data_, size_};
+    }
+#endif
+
+    constexpr const std::byte *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+
+private:
+    const std::byte *data_;
+    std::size_t size_;
+};
+
+/** The errors of ddelta.h, as std::error_code values. */
+enum class errc {
+    magic = DDELTA_EMAGIC,
+    algo = DDELTA_EALGO,
+    patch_io = DDELTA_EPATCHIO,
+    old_io = DDELTA_EOLDIO,
+    new_io = DDELTA_ENEWIO,
+    patch_short = DDELTA_EPATCHSHORT,
+    invalid = DDELTA_EINVAL,
+    verify = DDELTA_EVERIFY,
+    canceled = DDELTA_ECANCELED,
+    budget = DDELTA_EBUDGET,
+    no_memory = DDELTA_ENOMEM,
+};
+
+class error_category_impl : public std::error_category {
+public:
+    const char *name() const noexcept override { return "ddelta"; }
+
+    std::string message(int ev) const override
+    {
+        switch (static_cast<errc>(ev)) {
+        case errc::magic:
+            return "not a ddelta patch, or unknown flags";
+        case errc::algo:
+            return "out of memory or internal error";
+        case errc::patch_io:
+            return "patch I/O error or truncated patch";
+        case errc::old_io:
+            return "old file I/O error";
+        case errc::new_io:
+            return "new file I/O error";
+        case errc::patch_short:
+            return "patch ended before the new file was complete";
+        case errc::invalid:
+            return "invalid option";
+        case errc::verify:
+            return "patch does not give the new file";
+        case errc::canceled:
+            return "canceled";
+        case errc::budget:
+            return "memory limit or device profile cannot be met";
+        case errc::no_memory:
+            return "out of memory, or over the memory cap";
+        }
+        return "unknown ddelta error";
+    }
+};
+
+inline const std::error_category &error_category() noexcept
+{
+    static const error_category_impl category;
+    return category;
+}
+
+inline std::error_code make_error_code(errc e) noexcept
+{
+    return {static_cast<int>(e), error_category()};
+}
+
+/** The std::error_code for a result of the C functions, empty if >= 0. */
+inline std::error_code to_error_code(int result) noexcept
+{
+    if (result >= 0)
+        return {};
+    return make_error_code(static_cast<errc>(-result));
+}
+
+/** A writer appending to a caller-provided buffer, failing once it is full. */
+class buffer_writer {
+public:
+    buffer_writer(std::byte *data, std::size_t capacity) noexcept
+        : data_(data), capacity_(capacity), size_(0) {}
+    buffer_writer(void *data, std::size_t capacity) noexcept
+        : buffer_writer(static_cast<std::byte *>(data), capacity) {}
+#ifdef DDELTA_HPP_SPAN
+    buffer_writer(std::span<std::byte> s) noexcept
+        : buffer_writer(s.data(), s.size()) {}
+#endif
+
+    bool operator()(bytes chunk) noexcept
+    {
+        if (chunk.size() > capacity_ - size_)
+            return false;
+        if (!chunk.empty())
+            std::memcpy(data_ + size_, chunk.data(), chunk.size());
+        size_ += chunk.size();
+        return true;
+    }
+
+    /** Bytes written so far */
+    std::size_t size() const noexcept { return size_; }
+    const std::byte *data() const noexcept { return data_; }
+
+private:
+    std::byte *data_;
+    std::size_t capacity_;
+    std::size_t size_;
+};
+
+namespace detail {
+
+/* Adapts a writer to ddelta_write_fn, keeping its exception */
+template <class Writer>
+struct write_call {
+    Writer &writer;
+    std::exception_ptr error;
+
+    static int call(void *data, const void *buf, std::size_t size) noexcept
+    {
+        auto *self = static_cast<write_call *>(data);
+        const bytes chunk(buf, size);
+
+        try {
+            if constexpr (std::is_void_v<std::invoke_result_t<Writer &, bytes>>) {
+                self->writer(chunk);
+                return 0;
+            } else {
+                return self->writer(chunk) ? 0 : -1;
+            }
+        } catch (...) {
+            self->error = std::current_exception();
+            return -1;
+        }
+    }
+
+    std::error_code result(int result)
+    {
+        if (error)
+            std::rethrow_exception(std::exchange(error, nullptr));
+        return to_error_code(result);
+    }
+};
+
+} // namespace detail
+
+/**
+ * Generate a patch from |old| to |new_file|, passed to |writer| as it is
+ * written. See ddelta_generate_mem().
+ */
+template <class Writer>
+std::error_code generate(bytes old, bytes new_file, Writer &&writer,
+                         const ddelta_generate_options *options = nullptr,
+                         ddelta_generate_stats *stats = nullptr)
+{
+    detail::write_call<std::remove_reference_t<Writer>> w{writer, nullptr};
+
+    return w.result(ddelta_generate_mem(old.data(), old.size(),
+                                        new_file.data(), new_file.size(),
+                                        w.call, &w, options, stats));
+}
+
+/**
+ * Apply the complete |patch| to |old|, passing the new file to |writer|.
+ * See ddelta_apply_mem().
+ */
+template <class Writer>
+std::error_code apply(bytes patch, bytes old, Writer &&writer,
+                      const ddelta_apply_options *options = nullptr,
+                      ddelta_apply_stats *stats = nullptr)
+{
+    detail::write_call<std::remove_reference_t<Writer>> w{writer, nullptr};
+
+    return w.result(ddelta_apply_mem(patch.data(), patch.size(),
+                                     old.data(), old.size(),
+                                     w.call, &w, options, stats));
+}
+
+/**
+ * Applies a patch as its data arrives, wrapping struct ddelta_apply_ctx.
+ *
+ * The old file and the writer must outlive the context. The context itself
+ * cannot be moved, as the C context points to it; hold it in a
+ * std::optional or std::unique_ptr to pass it around.
+ */
+template <class Writer>
+class apply_context {
+public:
+    apply_context(bytes old, Writer &writer,
+                  const ddelta_apply_options *options = nullptr)
+        : write_{writer, nullptr},
+          ctx_(ddelta_apply_ctx_new_mem(old.data(), old.size(),
+                                        write_.call, &write_, options)),
+          result_(ctx_ == nullptr ? -DDELTA_ENOMEM : 0)
+    {
+    }
+
+    /** For a seekable old file, see ddelta_apply_ctx_new() */
+    apply_context(std::FILE *old, Writer &writer,
+                  const ddelta_apply_options *options = nullptr)
+        : write_{writer, nullptr},
+          ctx_(ddelta_apply_ctx_new(old, write_.call, &write_, options)),
+          result_(ctx_ == nullptr ? -DDELTA_ENOMEM : 0)
+    {
+    }
+
+    apply_context(const apply_context &) = delete;
+    apply_context &operator=(const apply_context &) = delete;
+
+    ~apply_context() { ddelta_apply_ctx_free(ctx_, nullptr); }
+
+    /** Apply the next chunk of the patch. Errors are sticky, and data after
+     * the end of the patch is ignored. */
+    std::error_code feed(bytes patch)
+    {
+        if (result_ == 0)
+            result_ = ddelta_apply_ctx_feed(ctx_, patch.data(), patch.size());
+        return write_.result(result_);
+    }
+
+    /** Whether the new file is complete */
+    bool done() const noexcept { return result_ == 1; }
+
+    /**
+     * The final result: an error if the patch failed or was incomplete.
+     * Frees the C context, after which only done() may be called.
+     */
+    std::error_code finish(ddelta_apply_stats *stats = nullptr)
+    {
+        ddelta_apply_ctx_free(ctx_, stats);
+        ctx_ = nullptr;
+        if (result_ == 0)
+            result_ = -DDELTA_EPATCHIO;
+        return to_error_code(result_);
+    }
+
+private:
+    detail::write_call<Writer> write_;
+    ddelta_apply_ctx *ctx_;
+    int result_;
+};
+
+} // namespace ddelta
+
+namespace std {
+template <>
+struct is_error_code_enum<ddelta::errc> : true_type {};
+} // namespace std
+
+#endif
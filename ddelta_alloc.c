@@ -0,0 +1,173 @@
+/* ddelta_alloc.c - allocations with accounting and a cap
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ddelta_alloc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Size of a block, in front of it, keeping the alignment of malloc() */
+union alloc_header {
+    size_t size;
+    long double align_ld;
+    void *align_p;
+    uint64_t align_u;
+};
+
+void ddelta_alloc_init(struct ddelta_alloc *a,
+                       const struct ddelta_allocator *allocator, uint64_t cap)
+{
+    memset(a, 0, sizeof(*a));
+    if (allocator != NULL && allocator->alloc != NULL && allocator->free != NULL)
+        a->allocator = allocator;
+    a->cap = cap;
+}
+
+int ddelta_alloc_charge(struct ddelta_alloc *a, uint64_t size)
+{
+    if (a->cap > 0 && (size > a->cap || a->current > a->cap - size)) {
+        a->failed = 1;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    a->current += size;
+    if (a->current > a->peak)
+        a->peak = a->current;
+    return 0;
+}
+
+void ddelta_alloc_uncharge(struct ddelta_alloc *a, uint64_t size)
+{
+    a->current -= size;
+}
+
+static union alloc_header *block_alloc(struct ddelta_alloc *a, size_t total)
+{
+    if (a->allocator != NULL)
+        return a->allocator->alloc(a->allocator->data, total);
+    return malloc(total);
+}
+
+static void block_free(struct ddelta_alloc *a, union alloc_header *h)
+{
+    if (a->allocator != NULL)
+        a->allocator->free(a->allocator->data, h, h->size + sizeof(*h));
+    else
+        free(h);
+}
+
+void *ddelta_malloc(struct ddelta_alloc *a, size_t size)
+{
+    union alloc_header *h;
+
+    if (size > SIZE_MAX - sizeof(*h)) {
+        a->failed = 1;
+        return NULL;
+    }
+    if (ddelta_alloc_charge(a, size) != 0)
+        return NULL;
+
+    if ((h = block_alloc(a, size + sizeof(*h))) == NULL) {
+        ddelta_alloc_uncharge(a, size);
+        a->failed = 1;
+        return NULL;
+    }
+
+    h->size = size;
+    return h + 1;
+}
+
+void *ddelta_calloc(struct ddelta_alloc *a, size_t size)
+{
+    void *p = ddelta_malloc(a, size);
+
+    if (p != NULL)
+        memset(p, 0, size);
+    return p;
+}
+
+void *ddelta_realloc(struct ddelta_alloc *a, void *p, size_t size)
+{
+    union alloc_header *h;
+    size_t old;
+    void *q;
+
+    if (p == NULL)
+        return ddelta_malloc(a, size);
+
+    h = (union alloc_header *) p - 1;
+    old = h->size;
+
+    /* Custom allocators have no realloc, so copy */
+    if (a->allocator != NULL) {
+        if ((q = ddelta_malloc(a, size)) == NULL)
+            return NULL;
+        memcpy(q, p, old < size ? old : size);
+        ddelta_free(a, p);
+        return q;
+    }
+
+    if (size > SIZE_MAX - sizeof(*h)) {
+        a->failed = 1;
+        return NULL;
+    }
+    if (size > old && ddelta_alloc_charge(a, size - old) != 0)
+        return NULL;
+
+    if ((h = realloc(h, size + sizeof(*h))) == NULL) {
+        if (size > old)
+            ddelta_alloc_uncharge(a, size - old);
+        a->failed = 1;
+        return NULL;
+    }
+
+    if (size < old)
+        ddelta_alloc_uncharge(a, old - size);
+    h->size = size;
+    return h + 1;
+}
+
+void ddelta_free(struct ddelta_alloc *a, void *p)
+{
+    union alloc_header *h;
+
+    if (p == NULL)
+        return;
+
+    h = (union alloc_header *) p - 1;
+    ddelta_alloc_uncharge(a, h->size);
+    block_free(a, h);
+}
+
+void *ddelta_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+    return ddelta_malloc(opaque, (size_t) items * size);
+}
+
+void ddelta_zfree(void *opaque, void *p)
+{
+    ddelta_free(opaque, p);
+}
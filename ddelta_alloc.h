@@ -0,0 +1,67 @@
+#ifndef DDELTA_ALLOC_H
+#define DDELTA_ALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ddelta.h"
+
+/**
+ * Allocations of one call, through the allocator of its options or
+ * malloc(). It counts the bytes allocated at once and their peak, and
+ * refuses allocations that would exceed 'cap'.
+ *
+ * Only the calling thread may use it; the verifier thread does not
+ * allocate.
+ */
+struct ddelta_alloc {
+    const struct ddelta_allocator *allocator;
+    uint64_t cap;
+    uint64_t current;
+    uint64_t peak;
+    /* Non-zero once an allocation failed or was refused */
+    int failed;
+};
+
+/**
+ * Set up |a| for |allocator|, or malloc() if NULL, and a cap of |cap|
+ * bytes, or 0 for none.
+ */
+void ddelta_alloc_init(struct ddelta_alloc *a,
+                       const struct ddelta_allocator *allocator, uint64_t cap);
+
+/**
+ * Allocate |size| bytes, or return NULL.
+ */
+void *ddelta_malloc(struct ddelta_alloc *a, size_t size);
+
+/**
+ * Allocate |size| zeroed bytes, or return NULL.
+ */
+void *ddelta_calloc(struct ddelta_alloc *a, size_t size);
+
+/**
+ * Resize |p|, which may be NULL, to |size| bytes. On failure, |p| is left
+ * as it is and NULL returned.
+ */
+void *ddelta_realloc(struct ddelta_alloc *a, void *p, size_t size);
+
+void ddelta_free(struct ddelta_alloc *a, void *p);
+
+/**
+ * Account |size| bytes allocated elsewhere, such as mapped memory.
+ *
+ * @return 0 on success, -1 if that exceeds the cap
+ */
+int ddelta_alloc_charge(struct ddelta_alloc *a, uint64_t size);
+
+void ddelta_alloc_uncharge(struct ddelta_alloc *a, uint64_t size);
+
+/**
+ * zalloc and zfree functions of a z_stream, with |opaque| the struct
+ * ddelta_alloc to allocate from.
+ */
+void *ddelta_zalloc(void *opaque, unsigned int items, unsigned int size);
+void ddelta_zfree(void *opaque, void *p);
+
+#endif
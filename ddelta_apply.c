@@ -25,10 +25,21 @@
  */
 
 #include "ddelta.h"
+#include "ddelta_alloc.h"
+#include "ddelta_budget.h"
+#include "ddelta_filter.h"
+#include "ddelta_limit.h"
+#include "ddelta_probe.h"
+#include "ddelta_progress.h"
+#include "ddelta_reloc.h"
+#include "ddelta_stats.h"
 
 #include <errno.h>
+#include <getopt.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <sys/stat.h>
@@ -38,11 +49,6 @@
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #endif
 
-/* Size of blocks to work on at once */
-#ifndef DDELTA_BLOCK_SIZE
-#define DDELTA_BLOCK_SIZE (32 * 1024)
-#endif
-
 #ifdef CONFIG_UTILS_DDELTA_DEBUG
 #  define ddelta_debug(fmt, ...) \
       fprintf(stderr, __FILE__ ":%d:" fmt, __LINE__, ##__VA_ARGS__)
@@ -50,6 +56,19 @@
 #  define ddelta_debug(...)
 #endif
 
+static uint16_t ddelta_be16toh(uint16_t be16)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(be16);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return be16;
+#else
+    unsigned char *buf = (unsigned char *) &be16;
+
+    return (uint16_t) (buf[0] << 8 | buf[1] << 0);
+#endif
+}
+
 static uint32_t ddelta_be32toh(uint32_t be32)
 {
 #if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -59,151 +78,1310 @@ static uint32_t ddelta_be32toh(uint32_t be32)
 #else
     unsigned char *buf = (unsigned char *) &be32;
 
-    return (uint32_t) buf[0] << 24 |
-           (uint32_t) buf[1] << 16 |
-           (uint32_t) buf[2] << 8 |
-           (uint32_t) buf[3] << 0;
-#endif
+    return (uint32_t) buf[0] << 24 |
+           (uint32_t) buf[1] << 16 |
+           (uint32_t) buf[2] << 8 |
+           (uint32_t) buf[3] << 0;
+#endif
+}
+
+static uint64_t ddelta_be64toh(uint64_t be64)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(be64);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return be64;
+#else
+    unsigned char *buf = (unsigned char *) &be64;
+
+    return (uint64_t) buf[0] << 56 |
+           (uint64_t) buf[1] << 48 |
+           (uint64_t) buf[2] << 40 |
+           (uint64_t) buf[3] << 32 |
+           (uint64_t) buf[4] << 24 |
+           (uint64_t) buf[5] << 16 |
+           (uint64_t) buf[6] << 8 |
+           (uint64_t) buf[7] << 0;
+#endif
+}
+
+/* State of applying a patch */
+struct apply_state {
+    /** Word size of the diff data */
+    int word_size;
+    /** Branch filter of the patch */
+    int filter;
+    /** Old file and diff data of a block, each DDELTA_BLOCK_SIZE bytes */
+    unsigned char *block;
+    /** Filtered old file data, starting at offset cache_start */
+    unsigned char *cache;
+    off_t cache_start;
+    size_t cache_len;
+    /** Filtered new file data not written yet, starting at window_start,
+     * also for rewriting its pointers */
+    unsigned char *window;
+    uint64_t window_start;
+    size_t window_len;
+    /** Compressor of the new file content, if DDELTA_FLAG_DEFLATE_NEW */
+    int deflating;
+    z_stream zs;
+    struct ddelta_deflate_params params;
+    unsigned char *out;
+    uint32_t content_crc;
+    /** Members of DDELTA_FLAG_ZIP, those of the old file first, the next
+     * member of the new file, and the position in its content */
+    int zip;
+    struct ddelta_zip_header zip_header;
+    struct ddelta_zip_member *members;
+    uint32_t member;
+    uint64_t zip_pos;
+    /** Layout of DDELTA_FLAG_RELOC */
+    struct ddelta_reloc_header reloc_header;
+    struct ddelta_reloc reloc;
+    /** crc32 and size of the data written to the new file */
+    uint32_t file_crc;
+    uint64_t file_size;
+    /** Progress reporting, and the size of the new file content */
+    struct ddelta_progress_state progress;
+    uint64_t content_pos;
+    uint64_t content_size;
+    /** I/O rate limits, which also count the bytes read and written */
+    struct ddelta_rate_limit read_limit;
+    struct ddelta_rate_limit write_limit;
+    /** Old file data and position, if it is in memory rather than a FILE */
+    const unsigned char *old_data;
+    off_t old_size;
+    off_t old_pos;
+    /** Writer of the new file, if it is not written to a FILE */
+    ddelta_write_fn write;
+    void *write_data;
+    /** Wall time of the parts of applying, see struct ddelta_apply_stats */
+    uint64_t patch_read_ns;
+    uint64_t old_read_ns;
+    uint64_t add_ns;
+    uint64_t write_ns;
+    uint64_t flush_ns;
+    /** Entries applied, their data, and flush entries */
+    uint64_t entries;
+    uint64_t diff_bytes;
+    uint64_t extra_bytes;
+    uint64_t flushes;
+    /** Trace of the entries, when applying started, and the non-zero diff
+     * bytes of the current entry */
+    FILE *trace;
+    uint64_t start_ns;
+    uint64_t nonzero;
+    /** I/O operations by class, if they are accounted */
+    int io_stats;
+    struct ddelta_io_class io[DDELTA_IO_OPS];
+    /** Allocations of the buffers and zlib */
+    struct ddelta_alloc *alloc;
+};
+
+static int32_t ddelta_from_unsigned(uint32_t u)
+{
+    return u & 0x80000000 ? -(int32_t) ~(u - 1) : (int32_t) u;
+}
+
+/* Convert a header as read from the patch and check it. The flags must be
+ * zero unless the magic is DDELTA_MAGIC_EXT. */
+static int header_decode(struct ddelta_header *header)
+{
+    if (memcmp(DDELTA_MAGIC_EXT, header->magic, sizeof(header->magic)) == 0) {
+        header->flags = ddelta_be32toh(header->flags);
+        header->reserved = ddelta_be32toh(header->reserved);
+
+        if ((header->flags & ~DDELTA_FLAGS_KNOWN) != 0 || header->reserved != 0)
+            return -DDELTA_EMAGIC;
+        if ((header->flags & DDELTA_FLAG_WORD32) && (header->flags & DDELTA_FLAG_WORD64))
+            return -DDELTA_EMAGIC;
+        if ((header->flags & DDELTA_FLAG_FILTER_MASK) >> DDELTA_FLAG_FILTER_SHIFT > DDELTA_FILTER_ARMTHUMB)
+            return -DDELTA_EMAGIC;
+        if ((header->flags & DDELTA_FLAG_ZIP) &&
+            (header->flags & (DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW)))
+            return -DDELTA_EMAGIC;
+    } else if (memcmp(DDELTA_MAGIC, header->magic, sizeof(header->magic)) != 0) {
+        return -DDELTA_EMAGIC;
+    }
+
+    header->new_file_size = ddelta_be64toh(header->new_file_size);
+    return 0;
+}
+
+int ddelta_header_read(struct ddelta_header *header, FILE *file)
+{
+    if (fread(header, DDELTA_HEADER_SIZE, 1, file) < 1)
+        return -DDELTA_EPATCHIO;
+
+    header->flags = 0;
+    header->reserved = 0;
+
+    if (memcmp(DDELTA_MAGIC_EXT, header->magic, sizeof(header->magic)) == 0 &&
+        fread(&header->flags, DDELTA_HEADER_EXT_SIZE - DDELTA_HEADER_SIZE, 1, file) < 1)
+        return -DDELTA_EPATCHIO;
+
+    return header_decode(header);
+}
+
+static void entry_header_decode(struct ddelta_entry_header *entry)
+{
+    entry->diff = ddelta_be32toh(entry->diff);
+    entry->extra = ddelta_be32toh(entry->extra);
+    entry->seek.value = ddelta_from_unsigned(ddelta_be32toh(entry->seek.raw));
+}
+
+static int ddelta_entry_header_read(struct ddelta_entry_header *entry,
+                                    FILE *file)
+{
+    if (fread(entry, sizeof(*entry), 1, file) < 1)
+        return -DDELTA_EPATCHIO;
+
+    entry_header_decode(entry);
+    return 0;
+}
+
+/* Start of an I/O operation, if they are accounted. */
+static uint64_t io_start(const struct apply_state *st)
+{
+    return st->io_stats ? ddelta_time_ns() : 0;
+}
+
+/* Account an I/O operation of class |op| on |bytes| bytes that started at
+ * |start|. */
+static void io_done(struct apply_state *st, enum ddelta_io_op op,
+                    uint64_t start, uint64_t bytes)
+{
+    if (st->io_stats)
+        ddelta_io_account(&st->io[op], ddelta_time_ns() - start, bytes);
+}
+
+static FILE *open_file(struct apply_state *st, const char *path,
+                       const char *mode)
+{
+    const uint64_t io = io_start(st);
+    FILE *f = fopen(path, mode);
+
+    io_done(st, DDELTA_IO_OPEN, io, 0);
+    return f;
+}
+
+static int remove_file(struct apply_state *st, const char *path)
+{
+    const uint64_t io = io_start(st);
+    int err = unlink(path);
+
+    io_done(st, DDELTA_IO_UNLINK, io, 0);
+    return err;
+}
+
+/* Write the buffered data of |f| to the disk. */
+static int sync_file(struct apply_state *st, FILE *f)
+{
+    const uint64_t io = io_start(st);
+    int err;
+
+    DDELTA_PROBE1(fsync__start, fileno(f));
+    err = fflush(f) < 0 || fsync(fileno(f)) < 0 ? -1 : 0;
+    DDELTA_PROBE2(fsync__done, fileno(f), err);
+    io_done(st, DDELTA_IO_SYNC, io, 0);
+    return err;
+}
+
+/* ddelta_entry_header_read(), counting the time as reading the patch. */
+static int entry_read(struct apply_state *st, struct ddelta_entry_header *entry,
+                      FILE *file)
+{
+    const uint64_t start = ddelta_time_ns();
+    int err = ddelta_entry_header_read(entry, file);
+
+    io_done(st, DDELTA_IO_PATCH_READ, start, sizeof(*entry));
+    ddelta_lap_ns(start, &st->patch_read_ns);
+    return err;
+}
+
+static int apply_state_init(struct apply_state *st,
+                            const struct ddelta_header *header,
+                            struct ddelta_alloc *alloc)
+{
+    memset(st, 0, sizeof(*st));
+    st->alloc = alloc;
+
+    if ((st->block = ddelta_malloc(alloc, 2 * DDELTA_BLOCK_SIZE)) == NULL)
+        return -DDELTA_EALGO;
+
+    st->word_size = 1;
+    if (header->flags & DDELTA_FLAG_WORD32)
+        st->word_size = 4;
+    if (header->flags & DDELTA_FLAG_WORD64)
+        st->word_size = 8;
+
+    st->filter = (header->flags & DDELTA_FLAG_FILTER_MASK) >> DDELTA_FLAG_FILTER_SHIFT;
+    if (st->filter != DDELTA_FILTER_NONE) {
+        st->cache = ddelta_malloc(alloc, DDELTA_BLOCK_SIZE + DDELTA_FILTER_WINDOW);
+        if (st->cache == NULL)
+            return -DDELTA_EALGO;
+        st->window = st->cache + DDELTA_BLOCK_SIZE;
+    } else if (header->flags & DDELTA_FLAG_RELOC) {
+        if ((st->window = ddelta_malloc(alloc, DDELTA_FILTER_WINDOW)) == NULL)
+            return -DDELTA_EALGO;
+    }
+
+    return 0;
+}
+
+/* Write the trace of the entries to |trace|, if it is not NULL. */
+static void trace_start(struct apply_state *st, FILE *trace)
+{
+    st->trace = trace;
+    st->start_ns = ddelta_time_ns();
+    if (trace != NULL)
+        ddelta_trace_header(trace);
+}
+
+/* Add |entry|, applied at offset |newoff| of the new file and |oldoff| of
+ * the old one, to the trace. */
+static void trace_entry(struct apply_state *st,
+                        const struct ddelta_entry_header *entry,
+                        uint64_t newoff, off_t oldoff)
+{
+    struct ddelta_trace_row row;
+
+    if (st->trace == NULL)
+        return;
+
+    row.new_offset = newoff;
+    row.old_offset = (uint64_t) oldoff;
+    row.diff = entry->diff;
+    row.extra = entry->extra;
+    row.seek = entry->seek.value;
+    row.diff_nonzero = st->nonzero;
+    row.time_ns = ddelta_time_ns() - st->start_ns;
+    ddelta_trace_row(st->trace, &row);
+    st->nonzero = 0;
+}
+
+/* Fill |stats| from |st|, for applying that started at |start_us| with
+ * |start_cpu| nanoseconds of process CPU time. */
+static void apply_stats_fill(const struct apply_state *st, uint64_t start_us,
+                             uint64_t start_cpu, struct ddelta_apply_stats *stats)
+{
+    stats->bytes_read = st->read_limit.bytes;
+    stats->bytes_written = st->write_limit.bytes;
+    stats->elapsed_us = ddelta_time_us() - start_us;
+    stats->throttled_us = st->read_limit.throttled_us +
+                          st->write_limit.throttled_us;
+    stats->patch_read_ns = st->patch_read_ns;
+    stats->old_read_ns = st->old_read_ns;
+    stats->add_ns = st->add_ns;
+    stats->write_ns = st->write_ns;
+    stats->flush_ns = st->flush_ns;
+    stats->cpu_us = (ddelta_cpu_ns(1) - start_cpu) / 1000;
+    stats->max_rss = ddelta_max_rss();
+    stats->entries = st->entries;
+    stats->diff_bytes = st->diff_bytes;
+    stats->extra_bytes = st->extra_bytes;
+    stats->flushes = st->flushes;
+    stats->allocated_peak = st->alloc->peak;
+    memcpy(stats->io, st->io, sizeof(stats->io));
+}
+
+static void apply_state_free(struct apply_state *st)
+{
+    if (st->deflating)
+        deflateEnd(&st->zs);
+
+    ddelta_free(st->alloc, st->members);
+    ddelta_free(st->alloc, st->reloc.sections);
+    ddelta_free(st->alloc, st->reloc.regions);
+    ddelta_free(st->alloc, st->out);
+    if (st->cache == NULL)
+        ddelta_free(st->alloc, st->window);
+    ddelta_free(st->alloc, st->cache);
+    ddelta_free(st->alloc, st->block);
+}
+
+/* Write |size| bytes to the new file as they are. */
+static int write_file(struct apply_state *st, FILE *newfd,
+                      const unsigned char *buf, size_t size)
+{
+    const uint64_t io = io_start(st);
+
+    if (st->write != NULL) {
+        if (size > 0 && st->write(st->write_data, buf, size) < 0) {
+            ddelta_debug("write_file failed.\n");
+            return -DDELTA_ENEWIO;
+        }
+    } else if (size > 0 && fwrite(buf, 1, size, newfd) < size) {
+        ddelta_debug("write_file failed.\n");
+        return -DDELTA_ENEWIO;
+    }
+    io_done(st, DDELTA_IO_WRITE, io, size);
+
+    ddelta_rate_consume(&st->write_limit, size);
+
+    if (st->deflating || st->zip)
+        st->file_crc = crc32(st->file_crc, buf, size);
+    st->file_size += size;
+    return 0;
+}
+
+/* Compress the pending input of the compressor into the new file. */
+static int deflate_run(struct apply_state *st, FILE *newfd, int flush)
+{
+    int ret, err;
+
+    do {
+        st->zs.next_out = st->out;
+        st->zs.avail_out = DDELTA_BLOCK_SIZE;
+
+        if ((ret = deflate(&st->zs, flush)) == Z_STREAM_ERROR)
+            return -DDELTA_EALGO;
+        if ((err = write_file(st, newfd, st->out,
+                              DDELTA_BLOCK_SIZE - st->zs.avail_out)) < 0)
+            return err;
+    } while (st->zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    return 0;
+}
+
+static int reserved_zero(const uint8_t *reserved, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        if (reserved[i] != 0)
+            return 0;
+    return 1;
+}
+
+/* Whether deflateInit2() takes the parameters of a patch, with a window
+ * of 0 standing for 15 bits. */
+static int deflate_params_valid(unsigned int level, unsigned int mem_level,
+                                unsigned int strategy, unsigned int window_bits)
+{
+    return level <= 9 && mem_level >= 1 && mem_level <= 9 && strategy <= Z_FIXED &&
+           (window_bits == 0 || (window_bits >= 9 && window_bits <= 15));
+}
+
+/* Set up the compressor of raw deflate data, into st->out. */
+static int deflate_begin(struct apply_state *st, int level, int mem_level,
+                         int strategy, int window_bits)
+{
+    memset(&st->zs, 0, sizeof(st->zs));
+    st->zs.zalloc = ddelta_zalloc;
+    st->zs.zfree = ddelta_zfree;
+    st->zs.opaque = st->alloc;
+    if (deflateInit2(&st->zs, level, Z_DEFLATED,
+                     window_bits != 0 ? -window_bits : -15,
+                     mem_level, strategy) != Z_OK)
+        return -DDELTA_EALGO;
+    st->deflating = 1;
+    return 0;
+}
+
+/* Check the parameters of DDELTA_FLAG_DEFLATE_NEW as read from the patch
+ * into st->params, and set up the compressor. */
+static int deflate_init(struct apply_state *st)
+{
+    struct ddelta_deflate_params *params = &st->params;
+
+    params->content_size = ddelta_be64toh(params->content_size);
+    params->file_crc = ddelta_be32toh(params->file_crc);
+    params->header_size = ddelta_be32toh(params->header_size);
+
+    if (!reserved_zero(params->reserved, sizeof(params->reserved)) ||
+        !deflate_params_valid(params->level, params->mem_level, params->strategy,
+                              params->window_bits))
+        return -DDELTA_EMAGIC;
+
+    if ((st->out = ddelta_malloc(st->alloc, DDELTA_BLOCK_SIZE)) == NULL)
+        return -DDELTA_EALGO;
+    return deflate_begin(st, params->level, params->mem_level, params->strategy,
+                         params->window_bits);
+}
+
+/* Read the parameters of DDELTA_FLAG_DEFLATE_NEW from the patch, set up the
+ * compressor, and copy the gzip header to the new file. */
+static int deflate_start(struct apply_state *st, FILE *patchfd, FILE *newfd)
+{
+    uint32_t left;
+    size_t i;
+    uint64_t io = io_start(st);
+    int err;
+
+    if (fread(&st->params, sizeof(st->params), 1, patchfd) < 1)
+        return -DDELTA_EPATCHIO;
+    io_done(st, DDELTA_IO_PATCH_READ, io, sizeof(st->params));
+    ddelta_rate_consume(&st->read_limit, sizeof(st->params));
+
+    if ((err = deflate_init(st)) < 0)
+        return err;
+
+    for (left = st->params.header_size; left > 0; left -= i) {
+        i = MIN(left, DDELTA_BLOCK_SIZE);
+        io = io_start(st);
+        if (fread(st->out, 1, i, patchfd) < i)
+            return -DDELTA_EPATCHIO;
+        io_done(st, DDELTA_IO_PATCH_READ, io, i);
+        ddelta_rate_consume(&st->read_limit, i);
+        if ((err = write_file(st, newfd, st->out, i)) < 0)
+            return err;
+    }
+
+    return 0;
+}
+
+/* Finish the compressed data and write the gzip trailer. The new file must
+ * then be the one the patch was generated for. */
+static int deflate_finish(struct apply_state *st, FILE *newfd,
+                          uint64_t content_size)
+{
+    unsigned char trailer[8];
+    int i, err;
+
+    if ((err = deflate_run(st, newfd, Z_FINISH)) < 0)
+        return err;
+
+    for (i = 0; i < 4; i++) {
+        trailer[i] = (unsigned char) (st->content_crc >> (8 * i));
+        trailer[4 + i] = (unsigned char) (content_size >> (8 * i));
+    }
+
+    if ((err = write_file(st, newfd, trailer, sizeof(trailer))) < 0)
+        return err;
+
+    if (st->file_crc != st->params.file_crc) {
+        ddelta_debug("deflate_finish: compressed data differs.\n");
+        return -DDELTA_ENEWIO;
+    }
+
+    return 0;
+}
+
+/* Check the header of DDELTA_FLAG_ZIP as read from the patch into
+ * st->zip_header, and allocate the members. With them, a patch with
+ * |flags| must fit into |memory_limit| bytes, unless that is 0. */
+static int zip_init(struct apply_state *st, uint32_t flags, uint64_t memory_limit)
+{
+    struct ddelta_zip_header *zip = &st->zip_header;
+    uint64_t size;
+
+    zip->content_size = ddelta_be64toh(zip->content_size);
+    zip->file_crc = ddelta_be32toh(zip->file_crc);
+    zip->old_members = ddelta_be32toh(zip->old_members);
+    zip->new_members = ddelta_be32toh(zip->new_members);
+    zip->reserved = ddelta_be32toh(zip->reserved);
+
+    if (zip->reserved != 0 || zip->old_members > DDELTA_ZIP_MAX_MEMBERS ||
+        zip->new_members > DDELTA_ZIP_MAX_MEMBERS)
+        return -DDELTA_EMAGIC;
+
+    size = (uint64_t) (zip->old_members + zip->new_members) * sizeof(*st->members);
+    if (memory_limit > 0 && ddelta_apply_memory(flags, 0) + size > memory_limit)
+        return -DDELTA_EBUDGET;
+
+    if ((st->out = ddelta_malloc(st->alloc, DDELTA_BLOCK_SIZE)) == NULL ||
+        (size > 0 && (st->members = ddelta_malloc(st->alloc, size)) == NULL))
+        return -DDELTA_EALGO;
+    st->zip = 1;
+    return 0;
+}
+
+/* Check member |i| as read from the patch into st->members. */
+static int zip_member_decode(struct apply_state *st, uint32_t i)
+{
+    struct ddelta_zip_member *m = &st->members[i];
+    const struct ddelta_zip_member *prev = m - 1;
+    const uint64_t content_size = st->zip_header.content_size;
+
+    m->offset = ddelta_be64toh(m->offset);
+    m->size = ddelta_be64toh(m->size);
+    m->content_size = ddelta_be64toh(m->content_size);
+
+    if (!reserved_zero(m->reserved, sizeof(m->reserved)))
+        return -DDELTA_EMAGIC;
+
+    /* Members of the old file are found by their offset in it */
+    if (i < st->zip_header.old_members) {
+        if (m->level != 0 || m->mem_level != 0 || m->strategy != 0 ||
+            m->window_bits != 0 || m->offset > INT64_MAX ||
+            m->size > INT64_MAX - m->offset ||
+            (i > 0 && m->offset < prev->offset + prev->size))
+            return -DDELTA_EMAGIC;
+        return 0;
+    }
+
+    if (!deflate_params_valid(m->level, m->mem_level, m->strategy, m->window_bits) ||
+        m->offset > content_size || m->content_size > content_size - m->offset ||
+        (i > st->zip_header.old_members && m->offset < prev->offset + prev->content_size))
+        return -DDELTA_EMAGIC;
+    return 0;
+}
+
+/* Read the header and members of DDELTA_FLAG_ZIP from the patch. */
+static int zip_start(struct apply_state *st, FILE *patchfd, uint32_t flags,
+                     uint64_t memory_limit)
+{
+    uint64_t io = io_start(st);
+    uint32_t i, count;
+    int err;
+
+    if (fread(&st->zip_header, sizeof(st->zip_header), 1, patchfd) < 1)
+        return -DDELTA_EPATCHIO;
+    io_done(st, DDELTA_IO_PATCH_READ, io, sizeof(st->zip_header));
+    ddelta_rate_consume(&st->read_limit, sizeof(st->zip_header));
+
+    if ((err = zip_init(st, flags, memory_limit)) < 0)
+        return err;
+
+    count = st->zip_header.old_members + st->zip_header.new_members;
+    io = io_start(st);
+    if (count > 0 && fread(st->members, sizeof(*st->members), count, patchfd) < count)
+        return -DDELTA_EPATCHIO;
+    io_done(st, DDELTA_IO_PATCH_READ, io, count * sizeof(*st->members));
+    ddelta_rate_consume(&st->read_limit, count * sizeof(*st->members));
+
+    for (i = 0; i < count; i++)
+        if ((err = zip_member_decode(st, i)) < 0)
+            return err;
+
+    return 0;
+}
+
+/* Check the header of DDELTA_FLAG_RELOC as read from the patch into
+ * st->reloc_header, and allocate the sections and regions. With them, a
+ * patch with |flags| must fit into |memory_limit| bytes, unless that is 0. */
+static int reloc_init(struct apply_state *st, uint32_t flags, uint64_t memory_limit)
+{
+    struct ddelta_reloc_header *header = &st->reloc_header;
+    uint64_t sections, regions;
+
+    header->sections = ddelta_be32toh(header->sections);
+    header->regions = ddelta_be32toh(header->regions);
+
+    if ((header->word_size != 4 && header->word_size != 8) ||
+        !reserved_zero(header->reserved, sizeof(header->reserved)) ||
+        header->sections > DDELTA_RELOC_MAX_SECTIONS ||
+        header->regions > DDELTA_RELOC_MAX_REGIONS)
+        return -DDELTA_EMAGIC;
+
+    sections = (uint64_t) header->sections * sizeof(*st->reloc.sections);
+    regions = (uint64_t) header->regions * sizeof(*st->reloc.regions);
+    if (memory_limit > 0 &&
+        ddelta_apply_memory(flags, 0) + sections + regions > memory_limit)
+        return -DDELTA_EBUDGET;
+
+    if ((sections > 0 && (st->reloc.sections = ddelta_malloc(st->alloc, sections)) == NULL) ||
+        (regions > 0 && (st->reloc.regions = ddelta_malloc(st->alloc, regions)) == NULL))
+        return -DDELTA_EALGO;
+    st->reloc.word_size = header->word_size;
+    return 0;
+}
+
+/* Check section |i| as read from the patch into st->reloc. */
+static int reloc_section_decode(struct apply_state *st, uint32_t i)
+{
+    struct ddelta_reloc_section *s = &st->reloc.sections[i];
+
+    s->old_addr = ddelta_be64toh(s->old_addr);
+    s->new_addr = ddelta_be64toh(s->new_addr);
+    s->size = ddelta_be64toh(s->size);
+    if (!ddelta_reloc_section_valid(&st->reloc, i))
+        return -DDELTA_EMAGIC;
+
+    st->reloc.nsections = i + 1;
+    return 0;
+}
+
+/* Check region |i| as read from the patch into st->reloc. */
+static int reloc_region_decode(struct apply_state *st, uint32_t i)
+{
+    struct ddelta_reloc_region *g = &st->reloc.regions[i];
+
+    g->offset = ddelta_be64toh(g->offset);
+    g->count = ddelta_be32toh(g->count);
+    g->stride = ddelta_be16toh(g->stride);
+    g->mask = ddelta_be16toh(g->mask);
+    if (!ddelta_reloc_region_valid(&st->reloc, i))
+        return -DDELTA_EMAGIC;
+
+    st->reloc.nregions = i + 1;
+    return 0;
+}
+
+/* Read the layout of DDELTA_FLAG_RELOC from the patch. */
+static int reloc_start(struct apply_state *st, FILE *patchfd, uint32_t flags,
+                       uint64_t memory_limit)
+{
+    struct ddelta_reloc_header *header = &st->reloc_header;
+    uint64_t io = io_start(st);
+    size_t size;
+    uint32_t i;
+    int err;
+
+    if (fread(header, sizeof(*header), 1, patchfd) < 1)
+        return -DDELTA_EPATCHIO;
+    io_done(st, DDELTA_IO_PATCH_READ, io, sizeof(*header));
+    ddelta_rate_consume(&st->read_limit, sizeof(*header));
+
+    if ((err = reloc_init(st, flags, memory_limit)) < 0)
+        return err;
+
+    io = io_start(st);
+    if ((header->sections > 0 &&
+         fread(st->reloc.sections, sizeof(*st->reloc.sections), header->sections, patchfd) < header->sections) ||
+        (header->regions > 0 &&
+         fread(st->reloc.regions, sizeof(*st->reloc.regions), header->regions, patchfd) < header->regions))
+        return -DDELTA_EPATCHIO;
+    size = header->sections * sizeof(*st->reloc.sections) +
+           header->regions * sizeof(*st->reloc.regions);
+    io_done(st, DDELTA_IO_PATCH_READ, io, size);
+    ddelta_rate_consume(&st->read_limit, size);
+
+    for (i = 0; i < header->sections; i++)
+        if ((err = reloc_section_decode(st, i)) < 0)
+            return err;
+    for (i = 0; i < header->regions; i++)
+        if ((err = reloc_region_decode(st, i)) < 0)
+            return err;
+
+    return 0;
+}
+
+/* Start compressing the next member of the new file once the content
+ * reaches it, and finish it at its end, which empty ones are at at once.
+ * Each must compress into as many bytes as it had. */
+static int zip_advance(struct apply_state *st, FILE *newfd)
+{
+    const struct ddelta_zip_member *members = st->members + st->zip_header.old_members;
+    int err;
+
+    while (st->member < st->zip_header.new_members) {
+        const struct ddelta_zip_member *m = &members[st->member];
+
+        if (!st->deflating) {
+            if (st->zip_pos < m->offset)
+                return 0;
+            if ((err = deflate_begin(st, m->level, m->mem_level, m->strategy,
+                                     m->window_bits)) < 0)
+                return err;
+        }
+        if (st->zip_pos < m->offset + m->content_size)
+            return 0;
+
+        if ((err = deflate_run(st, newfd, Z_FINISH)) < 0)
+            return err;
+        if (st->zs.total_out != m->size) {
+            ddelta_debug("zip_advance: compressed member differs.\n");
+            return -DDELTA_ENEWIO;
+        }
+        deflateEnd(&st->zs);
+        st->deflating = 0;
+        st->member++;
+    }
+
+    return 0;
+}
+
+/* Write |size| bytes of the content of a zip archive, compressing those
+ * of its members. */
+static int zip_output(struct apply_state *st, FILE *newfd,
+                      const unsigned char *buf, size_t size)
+{
+    const struct ddelta_zip_member *members = st->members + st->zip_header.old_members;
+    int err;
+
+    while (size > 0) {
+        const struct ddelta_zip_member *m;
+        size_t n = size;
+
+        if ((err = zip_advance(st, newfd)) < 0)
+            return err;
+
+        m = &members[st->member];
+        if (st->deflating) {
+            n = MIN(n, m->offset + m->content_size - st->zip_pos);
+            st->zs.next_in = (unsigned char *) buf;
+            st->zs.avail_in = n;
+            err = deflate_run(st, newfd, Z_NO_FLUSH);
+        } else {
+            if (st->member < st->zip_header.new_members)
+                n = MIN(n, m->offset - st->zip_pos);
+            err = write_file(st, newfd, buf, n);
+        }
+        if (err < 0)
+            return err;
+
+        buf += n;
+        size -= n;
+        st->zip_pos += n;
+    }
+
+    return zip_advance(st, newfd);
+}
+
+/* The patch ended, so the new zip archive must be complete, and the one
+ * the patch was generated for. */
+static int zip_finish(struct apply_state *st, FILE *newfd)
+{
+    int err;
+
+    if ((err = zip_advance(st, newfd)) < 0)
+        return err;
+    if (st->zip_pos != st->zip_header.content_size ||
+        st->member != st->zip_header.new_members)
+        return -DDELTA_EPATCHSHORT;
+
+    if (st->file_crc != st->zip_header.file_crc) {
+        ddelta_debug("zip_finish: new archive differs.\n");
+        return -DDELTA_ENEWIO;
+    }
+
+    return 0;
+}
+
+/* Write |size| bytes of new file content, compressing them if needed. */
+static int output_new(struct apply_state *st, FILE *newfd,
+                      const unsigned char *buf, size_t size)
+{
+    if (st->zip)
+        return zip_output(st, newfd, buf, size);
+    if (!st->deflating)
+        return write_file(st, newfd, buf, size);
+
+    st->content_crc = crc32(st->content_crc, buf, size);
+    st->zs.next_in = (unsigned char *) buf;
+    st->zs.avail_in = size;
+    return deflate_run(st, newfd, Z_NO_FLUSH);
+}
+
+/* Read up to |size| bytes at the current position of the old file. */
+static size_t old_read(struct apply_state *st, FILE *oldfd, unsigned char *buf,
+                       size_t size)
+{
+    if (st->old_data == NULL) {
+        const uint64_t io = io_start(st);
+
+        size = fread(buf, 1, size, oldfd);
+        io_done(st, DDELTA_IO_OLD_READ, io, size);
+        return size;
+    }
+
+    if (st->old_pos >= st->old_size)
+        return 0;
+
+    size = MIN(size, (size_t) (st->old_size - st->old_pos));
+    memcpy(buf, st->old_data + st->old_pos, size);
+    st->old_pos += size;
+    return size;
+}
+
+static off_t old_tell(struct apply_state *st, FILE *oldfd)
+{
+    return st->old_data == NULL ? ftell(oldfd) : st->old_pos;
+}
+
+/* Seek in the old file like fseek(), which allows seeking past the end. */
+static int old_seek(struct apply_state *st, FILE *oldfd, off_t offset,
+                    int whence)
+{
+    if (st->old_data == NULL) {
+        const uint64_t io = io_start(st);
+        int err = fseek(oldfd, offset, whence);
+
+        io_done(st, DDELTA_IO_SEEK, io, 0);
+        return err;
+    }
+
+    if (whence == SEEK_CUR)
+        offset += st->old_pos;
+    if (offset < 0)
+        return -1;
+
+    st->old_pos = offset;
+    return 0;
+}
+
+/* Decompress the gzip file |oldfd| into a temporary file in |*inflated|. */
+static int inflate_old(struct apply_state *st, FILE *oldfd, FILE **inflated)
+{
+    unsigned char *in, *out;
+    z_stream zs;
+    uint64_t io;
+    int ret = Z_OK, err = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = st->alloc;
+    /* Accept a gzip header only */
+    if (inflateInit2(&zs, 16 + 15) != Z_OK)
+        return -DDELTA_EALGO;
+
+    in = ddelta_malloc(st->alloc, 2 * DDELTA_BLOCK_SIZE);
+    out = in + DDELTA_BLOCK_SIZE;
+    if (in == NULL) {
+        err = -DDELTA_EALGO;
+        goto out;
+    }
+
+    io = io_start(st);
+    if ((*inflated = tmpfile()) == NULL) {
+        err = -DDELTA_EOLDIO;
+        goto out;
+    }
+    io_done(st, DDELTA_IO_OPEN, io, 0);
+
+    while (ret != Z_STREAM_END) {
+        if (zs.avail_in == 0) {
+            zs.next_in = in;
+            zs.avail_in = old_read(st, oldfd, in, DDELTA_BLOCK_SIZE);
+            if (zs.avail_in == 0) {
+                err = -DDELTA_EOLDIO;
+                goto out;
+            }
+            ddelta_rate_consume(&st->read_limit, zs.avail_in);
+        }
+
+        zs.next_out = out;
+        zs.avail_out = DDELTA_BLOCK_SIZE;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            ddelta_debug("inflate_old failed.\n");
+            err = -DDELTA_EOLDIO;
+            goto out;
+        }
+
+        io = io_start(st);
+        if (fwrite(out, 1, DDELTA_BLOCK_SIZE - zs.avail_out, *inflated) <
+            DDELTA_BLOCK_SIZE - zs.avail_out) {
+            err = -DDELTA_EOLDIO;
+            goto out;
+        }
+        io_done(st, DDELTA_IO_WRITE, io, DDELTA_BLOCK_SIZE - zs.avail_out);
+        ddelta_rate_consume(&st->write_limit, DDELTA_BLOCK_SIZE - zs.avail_out);
+    }
+
+    io = io_start(st);
+    if (fseek(*inflated, 0, SEEK_SET) < 0)
+        err = -DDELTA_EOLDIO;
+    io_done(st, DDELTA_IO_SEEK, io, 0);
+
+out:
+    if (err < 0 && *inflated != NULL) {
+        fclose(*inflated);
+        *inflated = NULL;
+    }
+
+    inflateEnd(&zs);
+    ddelta_free(st->alloc, in);
+    return err;
+}
+
+/* Append |size| bytes to the temporary file of the old file content. */
+static int inflated_write(struct apply_state *st, FILE *inflated,
+                          const unsigned char *buf, size_t size)
+{
+    const uint64_t io = io_start(st);
+
+    if (fwrite(buf, 1, size, inflated) < size)
+        return -DDELTA_EOLDIO;
+    io_done(st, DDELTA_IO_WRITE, io, size);
+    ddelta_rate_consume(&st->write_limit, size);
+    return 0;
+}
+
+/* Copy the old zip archive |oldfd| to a temporary file in |*inflated|,
+ * with its deflated members inflated. Each must end where the patch says
+ * and inflate to as many bytes as it did. */
+static int zip_inflate_old(struct apply_state *st, FILE *oldfd, FILE **inflated)
+{
+    unsigned char *in, *out;
+    z_stream zs;
+    uint64_t pos = 0, io;
+    uint32_t i;
+    int err = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = st->alloc;
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return -DDELTA_EALGO;
+
+    if ((in = ddelta_malloc(st->alloc, 2 * DDELTA_BLOCK_SIZE)) == NULL) {
+        err = -DDELTA_EALGO;
+        goto out;
+    }
+    out = in + DDELTA_BLOCK_SIZE;
+
+    io = io_start(st);
+    if ((*inflated = tmpfile()) == NULL) {
+        err = -DDELTA_EOLDIO;
+        goto out;
+    }
+    io_done(st, DDELTA_IO_OPEN, io, 0);
+
+    for (i = 0; i <= st->zip_header.old_members; i++) {
+        const struct ddelta_zip_member *m = i < st->zip_header.old_members ? &st->members[i] : NULL;
+        uint64_t left;
+        int ret = Z_OK;
+
+        /* The data up to the member, or the rest of the file, as it is */
+        for (;;) {
+            size_t n = m != NULL ? MIN(DDELTA_BLOCK_SIZE, m->offset - pos) : DDELTA_BLOCK_SIZE;
+
+            if (n == 0)
+                break;
+            n = old_read(st, oldfd, in, n);
+            ddelta_rate_consume(&st->read_limit, n);
+            if (n == 0 && m != NULL)
+                err = -DDELTA_EOLDIO;
+            if (n == 0 || (err = inflated_write(st, *inflated, in, n)) < 0)
+                break;
+            pos += n;
+        }
+        if (m == NULL || err < 0)
+            break;
+
+        if (inflateReset(&zs) != Z_OK) {
+            err = -DDELTA_EALGO;
+            break;
+        }
+
+        for (left = m->size; ret != Z_STREAM_END;) {
+            if (zs.avail_in == 0) {
+                const size_t n = MIN(DDELTA_BLOCK_SIZE, left);
+
+                zs.next_in = in;
+                zs.avail_in = n > 0 ? old_read(st, oldfd, in, n) : 0;
+                ddelta_rate_consume(&st->read_limit, zs.avail_in);
+                if (n == 0 || zs.avail_in < n) {
+                    err = -DDELTA_EOLDIO;
+                    break;
+                }
+                left -= n;
+            }
+
+            zs.next_out = out;
+            zs.avail_out = DDELTA_BLOCK_SIZE;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if ((ret != Z_OK && ret != Z_STREAM_END) ||
+                (err = inflated_write(st, *inflated, out, DDELTA_BLOCK_SIZE - zs.avail_out)) < 0)
+                break;
+        }
+        if (err < 0 || ret != Z_STREAM_END || zs.avail_in != 0 || left != 0 ||
+            zs.total_out != m->content_size) {
+            ddelta_debug("zip_inflate_old failed.\n");
+            err = err < 0 ? err : -DDELTA_EOLDIO;
+            break;
+        }
+        pos += m->size;
+    }
+    if (err < 0)
+        goto out;
+
+    io = io_start(st);
+    if (fseek(*inflated, 0, SEEK_SET) < 0)
+        err = -DDELTA_EOLDIO;
+    io_done(st, DDELTA_IO_SEEK, io, 0);
+
+out:
+    if (err < 0 && *inflated != NULL) {
+        fclose(*inflated);
+        *inflated = NULL;
+    }
+
+    inflateEnd(&zs);
+    ddelta_free(st->alloc, in);
+    return err;
+}
+
+/* Read |size| bytes from the current position of the old file, filtered.
+ *
+ * Filter windows are read as a whole into the cache, which serves the
+ * sequential reads in between seeks. */
+static int read_old(struct apply_state *st, FILE *oldfd, unsigned char *buf,
+                    uint32_t size)
+{
+    off_t pos;
+
+    if (st->filter == DDELTA_FILTER_NONE) {
+        ddelta_rate_consume(&st->read_limit, size);
+        return old_read(st, oldfd, buf, size) < size ? -DDELTA_EOLDIO : 0;
+    }
+
+    if ((pos = old_tell(st, oldfd)) < 0)
+        return -DDELTA_EOLDIO;
+
+    while (size > 0) {
+        size_t n;
+
+        if (pos < st->cache_start || pos >= st->cache_start + (off_t) st->cache_len) {
+            st->cache_start = pos - pos % DDELTA_FILTER_WINDOW;
+            if (old_seek(st, oldfd, st->cache_start, SEEK_SET) < 0)
+                return -DDELTA_EOLDIO;
+
+            st->cache_len = old_read(st, oldfd, st->cache, DDELTA_BLOCK_SIZE);
+            ddelta_rate_consume(&st->read_limit, st->cache_len);
+            if (pos >= st->cache_start + (off_t) st->cache_len) {
+                st->cache_len = 0;
+                return -DDELTA_EOLDIO;
+            }
+
+            ddelta_filter_encode(st->filter, st->cache, st->cache_len,
+                                 st->cache_start);
+        }
+
+        n = MIN(size, st->cache_start + st->cache_len - pos);
+        memcpy(buf, st->cache + (pos - st->cache_start), n);
+        buf += n;
+        pos += n;
+        size -= n;
+    }
+
+    return old_seek(st, oldfd, pos, SEEK_SET) < 0 ? -DDELTA_EOLDIO : 0;
 }
 
-static uint64_t ddelta_be64toh(uint64_t be64)
+/* Write out the pending filter window. This must only be called at the
+ * end of a window, or of the new file. */
+static int flush_new(struct apply_state *st, FILE *newfd)
 {
-#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    return __builtin_bswap64(be64);
-#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-    return be64;
-#else
-    unsigned char *buf = (unsigned char *) &be64;
+    int err;
 
-    return (uint64_t) buf[0] << 56 |
-           (uint64_t) buf[1] << 48 |
-           (uint64_t) buf[2] << 40 |
-           (uint64_t) buf[3] << 32 |
-           (uint64_t) buf[4] << 24 |
-           (uint64_t) buf[5] << 16 |
-           (uint64_t) buf[6] << 8 |
-           (uint64_t) buf[7] << 0;
-#endif
-}
+    if (st->window_len == 0)
+        return 0;
 
-static int32_t ddelta_from_unsigned(uint32_t u)
-{
-    return u & 0x80000000 ? -(int32_t) ~(u - 1) : (int32_t) u;
+    ddelta_filter_decode(st->filter, st->window, st->window_len,
+                         st->window_start);
+    ddelta_reloc_decode(&st->reloc, st->window, st->window_len,
+                        st->window_start);
+
+    if ((err = output_new(st, newfd, st->window, st->window_len)) < 0)
+        return err;
+
+    st->window_start += st->window_len;
+    st->window_len = 0;
+    return 0;
 }
 
-int ddelta_header_read(struct ddelta_header *header, FILE *file)
+/* Write |size| bytes to the new file, reverting the filter. */
+static int write_new(struct apply_state *st, FILE *newfd,
+                     const unsigned char *buf, uint32_t size)
 {
-    if (fread(header, sizeof(*header), 1, file) < 1)
-        return -DDELTA_EPATCHIO;
-    if (memcmp(DDELTA_MAGIC, header->magic, sizeof(header->magic)) != 0)
-        return -DDELTA_EMAGIC;
+    int err;
+
+    if (ddelta_progress_due(&st->progress, st->content_pos) &&
+        (err = ddelta_progress_report(&st->progress, DDELTA_PHASE_APPLY,
+                                      st->content_pos, st->content_size)) < 0)
+        return err;
+    st->content_pos += size;
+
+    if (st->window == NULL)
+        return output_new(st, newfd, buf, size);
+
+    while (size > 0) {
+        size_t n = MIN(size, DDELTA_FILTER_WINDOW - st->window_len);
+
+        memcpy(st->window + st->window_len, buf, n);
+        st->window_len += n;
+        buf += n;
+        size -= n;
+
+        if (st->window_len == DDELTA_FILTER_WINDOW && (err = flush_new(st, newfd)) < 0)
+            return err;
+    }
 
-    header->new_file_size = ddelta_be64toh(header->new_file_size);
     return 0;
 }
 
-static int ddelta_entry_header_read(struct ddelta_entry_header *entry,
-                                    FILE *file)
+#if !(defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/* Add the little-endian words of size |w| in |patch| to those in |old|.
+ * A word cut off at the end of |len| is added as if it was zero-padded. */
+static void add_words(unsigned char *old, const unsigned char *patch,
+                      size_t len, int w)
 {
-    if (fread(entry, sizeof(*entry), 1, file) < 1)
-        return -DDELTA_EPATCHIO;
+    size_t i, j;
 
-    entry->diff = ddelta_be32toh(entry->diff);
-    entry->extra = ddelta_be32toh(entry->extra);
-    entry->seek.value = ddelta_from_unsigned(ddelta_be32toh(entry->seek.raw));
-    return 0;
+    for (i = 0; i < len; i += w) {
+        const size_t n = MIN((size_t) w, len - i);
+        uint64_t o = 0, p = 0;
+
+        for (j = 0; j < n; j++) {
+            o |= (uint64_t) old[i + j] << (8 * j);
+            p |= (uint64_t) patch[i + j] << (8 * j);
+        }
+
+        o += p;
+
+        for (j = 0; j < n; j++)
+            old[i + j] = (unsigned char) (o >> (8 * j));
+    }
 }
+#endif
 
-static int apply_diff(FILE *patchfd, FILE *oldfd, FILE *newfd, uint32_t size, uint32_t *oldcrc)
+/* Apply |size| bytes of diff data for the new file at offset |newoff|,
+ * computed on words of size |w|. The diff data is read from |patchfd|, or
+ * taken from |patchmem| if it is not NULL. */
+static int apply_diff(struct apply_state *st, FILE *patchfd,
+                      const unsigned char *patchmem, FILE *oldfd,
+                      FILE *newfd, uint32_t size, uint32_t *oldcrc,
+                      uint64_t newoff)
 {
+    const int w = st->word_size;
 #ifdef __GNUC__
-    typedef unsigned char uchar_vector __attribute__((vector_size(16)));
+    typedef unsigned char uchar_vector __attribute__((vector_size(16), may_alias));
 #else
     typedef unsigned char uchar_vector;
 #endif
-    uchar_vector old[DDELTA_BLOCK_SIZE / sizeof(uchar_vector)];
-    uchar_vector patch[DDELTA_BLOCK_SIZE / sizeof(uchar_vector)];
+    /* Allocations are aligned for any type, so for the vectors too */
+    uchar_vector *old = (uchar_vector *) st->block;
+    uchar_vector *patch = (uchar_vector *) (st->block + DDELTA_BLOCK_SIZE);
+    /* Offset of the data in the buffers, so that they start at the same
+     * offset of a word as in the new file. */
+    uint32_t shift = w > 1 ? newoff % w : 0;
+    uint64_t t = ddelta_time_ns();
 
     /* Apply the diff */
     while (size > 0) {
         unsigned int i;
-        const uint32_t toread = MIN(sizeof(old), size);
-        const uint32_t items_to_add = MIN(sizeof(uchar_vector) + toread,
-                                          sizeof(old)) /
+        int err;
+        unsigned char *oldbuf = (unsigned char *) old + shift;
+        unsigned char *patchbuf = (unsigned char *) patch + shift;
+        const uint32_t toread = MIN(DDELTA_BLOCK_SIZE - shift, size);
+        const uint32_t items_to_add = MIN(sizeof(uchar_vector) + shift + toread,
+                                          DDELTA_BLOCK_SIZE) /
                                       sizeof(uchar_vector);
 
-        if (fread(&patch, 1, toread, patchfd) < toread) {
-            ddelta_debug("apply_diff failed.\n");
-            return -DDELTA_EPATCHIO;
+        if (patchmem != NULL) {
+            memcpy(patchbuf, patchmem, toread);
+            patchmem += toread;
+        } else {
+            const uint64_t io = io_start(st);
+
+            if (fread(patchbuf, 1, toread, patchfd) < toread) {
+                ddelta_debug("apply_diff failed.\n");
+                return -DDELTA_EPATCHIO;
+            }
+            io_done(st, DDELTA_IO_PATCH_READ, io, toread);
         }
-        if (fread(&old, 1, toread, oldfd) < toread) {
+        if (st->trace != NULL)
+            st->nonzero += ddelta_nonzero_bytes(patchbuf, toread);
+        ddelta_rate_consume(&st->read_limit, toread);
+        t = ddelta_lap_ns(t, &st->patch_read_ns);
+        if ((err = read_old(st, oldfd, oldbuf, toread)) < 0) {
             ddelta_debug("apply_diff failed.\n");
-            return -DDELTA_EOLDIO;
+            return err;
         }
+        t = ddelta_lap_ns(t, &st->old_read_ns);
 
-        *oldcrc = crc32(*oldcrc, (const unsigned char *)old, toread);
-        for (i = 0; i < items_to_add; i++)
-            old[i] += patch[i];
+        *oldcrc = crc32(*oldcrc, oldbuf, toread);
 
-        if (fwrite(&old, 1, toread, newfd) < toread) {
-            ddelta_debug("apply_diff failed.\n");
-            return -DDELTA_ENEWIO;
+        /* The part of a word cut off at the start is zero */
+        memset(old, 0, shift);
+        memset(patch, 0, shift);
+
+        if (w <= 1) {
+            for (i = 0; i < items_to_add; i++)
+                old[i] += patch[i];
+        } else {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            typedef uint32_t u32_vector __attribute__((vector_size(16), may_alias));
+            typedef uint64_t u64_vector __attribute__((vector_size(16), may_alias));
+
+            if (w == 4) {
+                for (i = 0; i < items_to_add; i++)
+                    ((u32_vector *) old)[i] += ((u32_vector *) patch)[i];
+            } else {
+                for (i = 0; i < items_to_add; i++)
+                    ((u64_vector *) old)[i] += ((u64_vector *) patch)[i];
+            }
+#else
+            add_words((unsigned char *) old, (unsigned char *) patch,
+                      shift + toread, w);
+#endif
         }
+        t = ddelta_lap_ns(t, &st->add_ns);
+
+        if ((err = write_new(st, newfd, oldbuf, toread)) < 0)
+            return err;
+        t = ddelta_lap_ns(t, &st->write_ns);
 
         size -= toread;
+        shift = 0;
     }
 
     return 0;
 }
 
-static int copy_bytes(FILE *a, FILE *b, uint32_t bytes)
+static int copy_bytes(struct apply_state *st, FILE *a, FILE *b, uint32_t bytes)
 {
-    char buf[DDELTA_BLOCK_SIZE];
+    unsigned char *buf = st->block;
+    int err;
+
     while (bytes > 0) {
-        uint32_t toread = MIN(sizeof(buf), bytes);
+        uint32_t toread = MIN(DDELTA_BLOCK_SIZE, bytes);
+        uint64_t t = ddelta_time_ns();
 
-        if (fread(&buf, toread, 1, a) < 1)
+        if (fread(buf, toread, 1, a) < 1)
             return -DDELTA_EPATCHIO;
-        if (fwrite(&buf, toread, 1, b) < 1) {
+        io_done(st, DDELTA_IO_PATCH_READ, t, toread);
+        ddelta_rate_consume(&st->read_limit, toread);
+        t = ddelta_lap_ns(t, &st->patch_read_ns);
+        if ((err = write_new(st, b, buf, toread)) < 0) {
             ddelta_debug("copy_bytes failed.\n");
-            return -DDELTA_ENEWIO;
+            return err;
         }
+        ddelta_lap_ns(t, &st->write_ns);
 
         bytes -= toread;
     }
     return 0;
 }
 
-static int copy_file(const char *a, FILE *b, off_t start, off_t end, uint32_t *crc)
+/* Copy [start, end) of the new file from |a| to the old file |b|, and
+ * compute the crc of the filtered data. */
+static int copy_file(struct apply_state *st, const char *a, FILE *b,
+                     off_t start, off_t end, uint32_t *crc)
 {
-    unsigned char buf[DDELTA_BLOCK_SIZE];
+    unsigned char *buf = st->block;
     off_t origin = ftell(b);
     int err = 0;
     FILE *af;
 
-    if (fseek(b, start, SEEK_SET) < 0) {
+    if (old_seek(st, b, start, SEEK_SET) < 0) {
         ddelta_debug("copy_file failed.\n");
         return -DDELTA_EOLDIO;
     }
 
-    af = fopen(a, "rb");
+    af = open_file(st, a, "rb");
     if (af == NULL) {
         ddelta_debug("copy_file failed.\n");
         return -DDELTA_ENEWIO;
     }
 
     while (start < end && err >= 0) {
-        uint32_t toread = MIN(sizeof(buf), end - start);
+        uint32_t toread = MIN(DDELTA_BLOCK_SIZE, end - start);
+        uint64_t io = io_start(st);
 
-        if (fread(&buf, toread, 1, af) < 1) {
+        if (fread(buf, toread, 1, af) < 1) {
             ddelta_debug("copy_file failed.\n");
             err = -DDELTA_ENEWIO;
-        }
-        else if (fwrite(&buf, toread, 1, b) < 1) {
-            ddelta_debug("copy_file failed.\n");
-            err = -DDELTA_EOLDIO;
+        } else {
+            io_done(st, DDELTA_IO_OLD_READ, io, toread);
+            io = io_start(st);
+            if (fwrite(buf, toread, 1, b) < 1) {
+                ddelta_debug("copy_file failed.\n");
+                err = -DDELTA_EOLDIO;
+            }
+            io_done(st, DDELTA_IO_WRITE, io, toread);
         }
 
+        /* Flushes read and write, but the block size bounds the bursts */
+        ddelta_rate_consume(&st->read_limit, toread);
+        ddelta_rate_consume(&st->write_limit, toread);
+
+        ddelta_filter_encode(st->filter, buf, toread, start);
         *crc = crc32(*crc, buf, toread);
         start += toread;
     }
@@ -212,12 +1390,12 @@ static int copy_file(const char *a, FILE *b, off_t start, off_t end, uint32_t *c
     if (err < 0)
         return err;
 
-    if (fflush(b) < 0 || fsync(fileno(b)) < 0) {
+    if (sync_file(st, b) < 0) {
         ddelta_debug("copy_file failed.\n");
         return -DDELTA_EOLDIO;
     }
 
-    if (fseek(b, origin, SEEK_SET) < 0) {
+    if (old_seek(st, b, origin, SEEK_SET) < 0) {
         ddelta_debug("copy_file failed.\n");
         return -DDELTA_EOLDIO;
     }
@@ -225,25 +1403,30 @@ static int copy_file(const char *a, FILE *b, off_t start, off_t end, uint32_t *c
     return 0;
 }
 
-static int compute_crc32(FILE *a, off_t start, off_t end, uint32_t *crc)
+static int compute_crc32(struct apply_state *st, FILE *a, off_t start,
+                         off_t end, uint32_t *crc)
 {
-    unsigned char buf[DDELTA_BLOCK_SIZE];
+    unsigned char *buf = st->block;
     off_t origin = ftell(a);
     int err = 0;
 
-    if (fseek(a, start, SEEK_SET) < 0) {
+    if (old_seek(st, a, start, SEEK_SET) < 0) {
         ddelta_debug("compute_crc32 failed.\n");
         return -DDELTA_EOLDIO;
     }
 
     while (start < end && err >= 0) {
-        uint32_t toread = MIN(sizeof(buf), end - start);
+        uint32_t toread = MIN(DDELTA_BLOCK_SIZE, end - start);
+        const uint64_t io = io_start(st);
 
-        if (fread(&buf, toread, 1, a) < 1) {
+        if (fread(buf, toread, 1, a) < 1) {
             ddelta_debug("compute_crc32 failed.\n");
             err = -DDELTA_EOLDIO;
         }
+        io_done(st, DDELTA_IO_OLD_READ, io, toread);
+        ddelta_rate_consume(&st->read_limit, toread);
 
+        ddelta_filter_encode(st->filter, buf, toread, start);
         *crc = crc32(*crc, buf, toread);
         start += toread;
     }
@@ -251,7 +1434,7 @@ static int compute_crc32(FILE *a, off_t start, off_t end, uint32_t *crc)
     if (err < 0)
         return err;
 
-    if (fseek(a, origin, SEEK_SET) < 0) {
+    if (old_seek(st, a, origin, SEEK_SET) < 0) {
         ddelta_debug("compute_crc32 failed.\n");
         return -DDELTA_EOLDIO;
     }
@@ -259,135 +1442,900 @@ static int compute_crc32(FILE *a, off_t start, off_t end, uint32_t *crc)
     return 0;
 }
 
+int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, const char *new)
+{
+    return ddelta_apply_opts(header, patchfd, oldfd, new, NULL, NULL);
+}
+
 /**
  * Apply a ddelta_apply in patchfd to oldfd, writing to newfd.
  *
  * The oldfd must be seekable, the patchfd and newfd are read/written
  * sequentially.
  */
-int ddelta_apply(struct ddelta_header *header, FILE *patchfd, FILE *oldfd, const char *new)
+int ddelta_apply_opts(struct ddelta_header *header, FILE *patchfd,
+                      FILE *oldfd, const char *new,
+                      const struct ddelta_apply_options *options,
+                      struct ddelta_apply_stats *stats)
 {
     struct ddelta_entry_header entry;
+    struct apply_state state;
+    struct ddelta_alloc alloc;
     struct stat st;
     char tmpname[PATH_MAX];
     uint32_t oldcrc = 0;
+    off_t oldoff = 0;
     FILE *tmpfd;
-    FILE *newfd;
+    FILE *newfd = NULL;
+    FILE *inflated = NULL;
     int err;
     uint64_t bytes_written = 0;
+    uint64_t t;
+    const uint64_t start_us = ddelta_time_us();
+    const uint64_t start_cpu = ddelta_cpu_ns(1);
+
+    if (options != NULL)
+        ddelta_alloc_init(&alloc, options->allocator, options->memory_cap);
+    else
+        ddelta_alloc_init(&alloc, NULL, 0);
+    if ((err = apply_state_init(&state, header, &alloc)) < 0) {
+        apply_state_free(&state);
+        return alloc.failed ? -DDELTA_ENOMEM : err;
+    }
+    DDELTA_PROBE2(apply__start, header->new_file_size, header->flags);
+
+    state.content_size = header->new_file_size;
+    if (options != NULL) {
+        ddelta_progress_init(&state.progress, options->progress,
+                             options->progress_data, options->progress_interval);
+        ddelta_rate_init(&state.read_limit, options->read_rate);
+        ddelta_rate_init(&state.write_limit, options->write_rate);
+
+        if (options->memory_limit > 0 &&
+            ddelta_apply_memory(header->flags, 0) > options->memory_limit) {
+            err = -DDELTA_EBUDGET;
+            goto out;
+        }
+        trace_start(&state, options->trace);
+        state.io_stats = options->io_stats;
+    }
 
     if (stat(new, &st) >= 0 && S_ISDIR(st.st_mode)) {
+        /* In-place updates need the old and new file to be the same */
+        if (header->flags & (DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW |
+                             DDELTA_FLAG_ZIP | DDELTA_FLAG_RELOC)) {
+            err = -DDELTA_EINVAL;
+            goto out;
+        }
+
         snprintf(tmpname, sizeof(tmpname), "%s/%s", new, "ddelta.tmp");
-        unlink(tmpname);
-        newfd = tmpfd = fopen(tmpname, "wb");
+        remove_file(&state, tmpname);
+        newfd = tmpfd = open_file(&state, tmpname, "wb");
     } else {
-        newfd = fopen(new, "wb");
+        newfd = open_file(&state, new, "wb");
         tmpfd = NULL;
     }
 
     if (newfd == NULL) {
         ddelta_debug("ddelta_apply failed.\n");
-        return -DDELTA_ENEWIO;
+        err = -DDELTA_ENEWIO;
+        goto out;
+    }
+
+    if (header->flags & DDELTA_FLAG_DEFLATE_NEW) {
+        if ((err = deflate_start(&state, patchfd, newfd)) < 0)
+            goto out;
+        state.content_size = state.params.content_size;
     }
 
-    while (ddelta_entry_header_read(&entry, patchfd) == 0) {
+    if (header->flags & DDELTA_FLAG_INFLATE_OLD) {
+        t = ddelta_time_ns();
+        if ((err = inflate_old(&state, oldfd, &inflated)) < 0)
+            goto out;
+        ddelta_lap_ns(t, &state.old_read_ns);
+        oldfd = inflated;
+    }
+
+    if (header->flags & DDELTA_FLAG_ZIP) {
+        if ((err = zip_start(&state, patchfd, header->flags,
+                             options != NULL ? options->memory_limit : 0)) < 0)
+            goto out;
+        state.content_size = state.zip_header.content_size;
+
+        if (state.zip_header.old_members > 0) {
+            t = ddelta_time_ns();
+            if ((err = zip_inflate_old(&state, oldfd, &inflated)) < 0)
+                goto out;
+            ddelta_lap_ns(t, &state.old_read_ns);
+            oldfd = inflated;
+        }
+    }
+
+    if ((header->flags & DDELTA_FLAG_RELOC) &&
+        (err = reloc_start(&state, patchfd, header->flags,
+                           options != NULL ? options->memory_limit : 0)) < 0)
+        goto out;
+
+    while (entry_read(&state, &entry, patchfd) == 0) {
+        ddelta_rate_consume(&state.read_limit, sizeof(entry));
+
         if (entry.diff == 0 && entry.extra == 0 && entry.seek.value == 0) {
-            fflush(newfd);
-            fsync(fileno(newfd));
+            t = ddelta_time_ns();
+            if ((err = flush_new(&state, newfd)) < 0)
+                goto out;
+            if (state.zip && (err = zip_finish(&state, newfd)) < 0)
+                goto out;
+            if (state.deflating &&
+                (err = deflate_finish(&state, newfd, bytes_written)) < 0)
+                goto out;
+
+            sync_file(&state, newfd);
             fclose(newfd);
+            newfd = NULL;
+            ddelta_lap_ns(t, &state.flush_ns);
 
             if (tmpfd)
-                unlink(tmpname);
+                remove_file(&state, tmpname);
 
-            return bytes_written == header->new_file_size ? 0 : -DDELTA_EPATCHSHORT;
+            if (state.deflating && bytes_written != state.params.content_size)
+                err = -DDELTA_EPATCHSHORT;
+            else
+                err = state.file_size == header->new_file_size ? 0 : -DDELTA_EPATCHSHORT;
+            goto out;
         }
 
         if (entry.seek.value == DDELTA_FLUSH) {
             char bakname[PATH_MAX];
             uint32_t newcrc = 0;
             off_t start;
+            uint64_t io;
+            int saved;
 
+            state.flushes++;
             if (tmpfd == NULL)
                 continue;
+            DDELTA_PROBE1(flush__start, bytes_written);
+
+            if ((err = ddelta_progress_report(&state.progress, DDELTA_PHASE_FLUSH,
+                                              bytes_written, state.content_size)) < 0)
+                goto out;
+
+            /* Flush blocks end at a window boundary or the end of file */
+            t = ddelta_time_ns();
+            if ((err = flush_new(&state, tmpfd)) < 0)
+                goto out;
 
             start = bytes_written - ftell(tmpfd);
 
-            fflush(tmpfd);
-            fsync(fileno(tmpfd));
+            sync_file(&state, tmpfd);
             fclose(tmpfd);
+            newfd = tmpfd = NULL;
 
             snprintf(bakname, sizeof(bakname), "%s/%" PRIu32 ".tmp", new, entry.newcrc);
 
             if (oldcrc == entry.oldcrc) {
-                unlink(bakname);
+                remove_file(&state, bakname);
+                io = io_start(&state);
                 if (rename(tmpname, bakname) < 0) {
                     ddelta_debug("ddelta_apply failed.\n");
-                    return -DDELTA_ENEWIO;
+                    err = -DDELTA_ENEWIO;
+                    goto out;
                 }
+                io_done(&state, DDELTA_IO_RENAME, io, 0);
             }
 
-            if (access(bakname, F_OK) >= 0) {
-                err = copy_file(bakname, oldfd, start, bytes_written, &newcrc);
+            /* The old file changes, the cached filtered data is stale */
+            state.cache_len = 0;
+
+            io = io_start(&state);
+            saved = access(bakname, F_OK) >= 0;
+            io_done(&state, DDELTA_IO_OPEN, io, 0);
+            if (saved) {
+                err = copy_file(&state, bakname, oldfd, start, bytes_written, &newcrc);
                 if (err < 0)
-                    return err;
+                    goto out;
                 if (newcrc != entry.newcrc) {
                     ddelta_debug("ddelta_apply failed.\n");
-                    return -DDELTA_ENEWIO;
+                    err = -DDELTA_ENEWIO;
+                    goto out;
                 }
-                unlink(bakname);
+                remove_file(&state, bakname);
             } else {
-                err = compute_crc32(oldfd, start, bytes_written, &newcrc);
+                err = compute_crc32(&state, oldfd, start, bytes_written, &newcrc);
                 if (err < 0)
-                  return err;
+                    goto out;
                 if (newcrc != entry.newcrc) {
                     fprintf(stderr, "corrupt block?\n");
-                    return -DDELTA_EOLDIO;
+                    err = -DDELTA_EOLDIO;
+                    goto out;
                 }
             }
 
-            unlink(tmpname);
-            newfd = tmpfd = fopen(tmpname, "wb");
+            remove_file(&state, tmpname);
+            newfd = tmpfd = open_file(&state, tmpname, "wb");
             if (newfd == NULL) {
                 ddelta_debug("ddelta_apply failed.\n");
-                return -DDELTA_ENEWIO;
+                err = -DDELTA_ENEWIO;
+                goto out;
             }
 
             oldcrc = 0;
+            ddelta_lap_ns(t, &state.flush_ns);
+            DDELTA_PROBE2(flush__done, bytes_written, 0);
+
+            if ((err = ddelta_progress_report(&state.progress, DDELTA_PHASE_APPLY,
+                                              bytes_written, state.content_size)) < 0)
+                goto out;
             continue;
         }
 
-        if ((err = apply_diff(patchfd, oldfd, newfd, entry.diff, &oldcrc)) < 0)
-            return err;
+        /* Entries after a flush read the blocks it wrote to the old file */
+        if (tmpfd == NULL && state.flushes > 0) {
+            ddelta_debug("ddelta_apply: patch needs an in-place update.\n");
+            err = -DDELTA_EINVAL;
+            goto out;
+        }
+
+        state.entries++;
+        state.diff_bytes += entry.diff;
+        state.extra_bytes += entry.extra;
+        DDELTA_PROBE4(entry, bytes_written, entry.diff, entry.extra, entry.seek.value);
+        if (state.trace != NULL)
+            oldoff = old_tell(&state, oldfd);
+
+        if ((err = apply_diff(&state, patchfd, NULL, oldfd, newfd, entry.diff,
+                              &oldcrc, bytes_written)) < 0)
+            goto out;
 
         /* Copy the bytes over */
-        if ((err = copy_bytes(patchfd, newfd, entry.extra)) < 0)
-            return err;
+        if ((err = copy_bytes(&state, patchfd, newfd, entry.extra)) < 0)
+            goto out;
 
         /* Skip remaining bytes */
-        if (fseek(oldfd, entry.seek.value, SEEK_CUR) < 0) {
+        t = ddelta_time_ns();
+        if (old_seek(&state, oldfd, entry.seek.value, SEEK_CUR) < 0) {
             ddelta_debug("ddelta_apply failed.\n");
-            return -DDELTA_EOLDIO;
+            err = -DDELTA_EOLDIO;
+            goto out;
         }
+        ddelta_lap_ns(t, &state.old_read_ns);
 
+        trace_entry(&state, &entry, bytes_written, oldoff);
         bytes_written += entry.diff + entry.extra;
     }
 
-    return -DDELTA_EPATCHIO;
+    err = -DDELTA_EPATCHIO;
+
+out:
+    if (newfd != NULL)
+        fclose(newfd);
+    if (inflated != NULL)
+        fclose(inflated);
+
+    /* Callers of the allocator report its failures as their own errors */
+    if (err < 0 && err != -DDELTA_ECANCELED && alloc.failed)
+        err = -DDELTA_ENOMEM;
+    DDELTA_PROBE2(apply__done, err, bytes_written);
+    if (stats != NULL)
+        apply_stats_fill(&state, start_us, start_cpu, stats);
+
+    apply_state_free(&state);
+    return err;
+}
+
+/* Parts of the patch an apply context expects next */
+enum apply_part {
+    PART_HEADER,
+    PART_HEADER_EXT,
+    PART_DEFLATE_PARAMS,
+    PART_GZIP_HEADER,
+    PART_ZIP_HEADER,
+    PART_ZIP_MEMBERS,
+    PART_RELOC_HEADER,
+    PART_RELOC_SECTIONS,
+    PART_RELOC_REGIONS,
+    PART_ENTRY,
+    PART_DIFF,
+    PART_EXTRA,
+    PART_DONE,
+};
+
+struct ddelta_apply_ctx {
+    struct apply_state state;
+    /** Allocations of the state, and of the context itself */
+    struct ddelta_alloc alloc;
+    struct ddelta_header header;
+    struct ddelta_entry_header entry;
+    enum apply_part part;
+    /** Bytes of a fixed size part collected, or left of a variable one */
+    size_t have;
+    uint32_t left;
+    /** Diff data of a word cut off by the end of the data fed so far */
+    unsigned char word[8];
+    uint32_t word_len;
+    /** The old file, as given or inflated, and the data if in memory */
+    FILE *oldfd;
+    FILE *inflated;
+    const unsigned char *old_data;
+    off_t old_size;
+    ddelta_write_fn write;
+    void *write_data;
+    struct ddelta_apply_options options;
+    uint32_t oldcrc;
+    uint64_t bytes_written;
+    /** Offset of the current entry in the old file, for the trace */
+    off_t oldoff;
+    uint64_t start_us;
+    uint64_t start_cpu;
+    /** The first error, which every later call returns */
+    int err;
+};
+
+static struct ddelta_apply_ctx *apply_ctx_new(ddelta_write_fn write,
+                                              void *write_data,
+                                              const struct ddelta_apply_options *options)
+{
+    struct ddelta_apply_ctx *ctx;
+    struct ddelta_alloc alloc;
+
+    if (options != NULL)
+        ddelta_alloc_init(&alloc, options->allocator, options->memory_cap);
+    else
+        ddelta_alloc_init(&alloc, NULL, 0);
+    if ((ctx = ddelta_calloc(&alloc, sizeof(*ctx))) == NULL)
+        return NULL;
+
+    ctx->alloc = alloc;
+    ctx->state.alloc = &ctx->alloc;
+    ctx->write = write;
+    ctx->write_data = write_data;
+    if (options != NULL)
+        ctx->options = *options;
+    ctx->start_us = ddelta_time_us();
+    ctx->start_cpu = ddelta_cpu_ns(1);
+    return ctx;
+}
+
+struct ddelta_apply_ctx *ddelta_apply_ctx_new(FILE *oldfd, ddelta_write_fn write,
+                                              void *write_data,
+                                              const struct ddelta_apply_options *options)
+{
+    struct ddelta_apply_ctx *ctx = apply_ctx_new(write, write_data, options);
+
+    if (ctx != NULL)
+        ctx->oldfd = oldfd;
+    return ctx;
+}
+
+struct ddelta_apply_ctx *ddelta_apply_ctx_new_mem(const void *old, size_t oldsize,
+                                                  ddelta_write_fn write,
+                                                  void *write_data,
+                                                  const struct ddelta_apply_options *options)
+{
+    struct ddelta_apply_ctx *ctx = apply_ctx_new(write, write_data, options);
+
+    if (ctx != NULL) {
+        ctx->old_data = old;
+        ctx->old_size = oldsize;
+    }
+    return ctx;
+}
+
+/* Collect the next bytes of a fixed size part of |size| bytes in |dst|.
+ * Returns 1 once it is complete. */
+static int apply_ctx_collect(struct ddelta_apply_ctx *ctx, void *dst, size_t size,
+                             const unsigned char **data, size_t *len)
+{
+    const size_t n = MIN(size - ctx->have, *len);
+
+    memcpy((unsigned char *) dst + ctx->have, *data, n);
+    ctx->have += n;
+    *data += n;
+    *len -= n;
+
+    if (ctx->have < size)
+        return 0;
+
+    ddelta_rate_consume(&ctx->state.read_limit, size);
+    ctx->have = 0;
+    return 1;
+}
+
+/* Everything up to the layout of DDELTA_FLAG_RELOC, or up to the entries,
+ * has been read. */
+static int apply_ctx_begin_entries(struct ddelta_apply_ctx *ctx)
+{
+    struct apply_state *st = &ctx->state;
+    int err;
+
+    if ((ctx->header.flags & DDELTA_FLAG_RELOC) && ctx->part < PART_RELOC_HEADER) {
+        ctx->part = PART_RELOC_HEADER;
+        return 0;
+    }
+
+    if (ctx->header.flags & DDELTA_FLAG_INFLATE_OLD) {
+        const uint64_t t = ddelta_time_ns();
+
+        if ((err = inflate_old(st, ctx->oldfd, &ctx->inflated)) < 0)
+            return err;
+        ddelta_lap_ns(t, &st->old_read_ns);
+        ctx->oldfd = ctx->inflated;
+        st->old_data = NULL;
+    }
+
+    if (st->zip && st->zip_header.old_members > 0) {
+        const uint64_t t = ddelta_time_ns();
+
+        if ((err = zip_inflate_old(st, ctx->oldfd, &ctx->inflated)) < 0)
+            return err;
+        ddelta_lap_ns(t, &st->old_read_ns);
+        ctx->oldfd = ctx->inflated;
+        st->old_data = NULL;
+    }
+
+    ctx->part = PART_ENTRY;
+    return 0;
+}
+
+/* The header has been read, set up the state for it. */
+static int apply_ctx_start(struct ddelta_apply_ctx *ctx)
+{
+    struct apply_state *st = &ctx->state;
+    int err;
+
+    if ((err = header_decode(&ctx->header)) < 0)
+        return err;
+    if (ctx->options.memory_limit > 0 &&
+        ddelta_apply_memory(ctx->header.flags, 0) > ctx->options.memory_limit)
+        return -DDELTA_EBUDGET;
+    if ((err = apply_state_init(st, &ctx->header, &ctx->alloc)) < 0)
+        return err;
+    DDELTA_PROBE2(apply__start, ctx->header.new_file_size, ctx->header.flags);
+
+    st->content_size = ctx->header.new_file_size;
+    st->old_data = ctx->old_data;
+    st->old_size = ctx->old_size;
+    st->write = ctx->write;
+    st->write_data = ctx->write_data;
+    ddelta_progress_init(&st->progress, ctx->options.progress,
+                         ctx->options.progress_data, ctx->options.progress_interval);
+    ddelta_rate_init(&st->read_limit, ctx->options.read_rate);
+    ddelta_rate_init(&st->write_limit, ctx->options.write_rate);
+    trace_start(st, ctx->options.trace);
+    st->io_stats = ctx->options.io_stats;
+
+    if (ctx->header.flags & DDELTA_FLAG_DEFLATE_NEW) {
+        ctx->part = PART_DEFLATE_PARAMS;
+        return 0;
+    }
+    if (ctx->header.flags & DDELTA_FLAG_ZIP) {
+        ctx->part = PART_ZIP_HEADER;
+        return 0;
+    }
+
+    return apply_ctx_begin_entries(ctx);
+}
+
+/* The diff and extra data of the current entry are done. */
+static int apply_ctx_end_entry(struct ddelta_apply_ctx *ctx)
+{
+    const uint64_t t = ddelta_time_ns();
+
+    if (old_seek(&ctx->state, ctx->oldfd, ctx->entry.seek.value, SEEK_CUR) < 0) {
+        ddelta_debug("ddelta_apply_ctx_feed failed.\n");
+        return -DDELTA_EOLDIO;
+    }
+    ddelta_lap_ns(t, &ctx->state.old_read_ns);
+
+    trace_entry(&ctx->state, &ctx->entry, ctx->bytes_written, ctx->oldoff);
+    ctx->bytes_written += ctx->entry.diff + ctx->entry.extra;
+    ctx->part = PART_ENTRY;
+    return 0;
+}
+
+/* Apply the next diff data. A word must not be split between calls to
+ * apply_diff(), as carries cross its bytes, so the start of a word cut off
+ * by the end of the data is kept until its end arrives. */
+static int apply_ctx_diff(struct ddelta_apply_ctx *ctx,
+                          const unsigned char **data, size_t *len)
+{
+    struct apply_state *st = &ctx->state;
+    const uint32_t w = st->word_size;
+    const uint64_t pos = ctx->bytes_written + ctx->entry.diff - ctx->left;
+    uint32_t n = MIN(ctx->left, *len);
+    uint32_t cut = 0;
+    int err;
+
+    if (ctx->word_len > 0) {
+        const uint64_t start = pos - ctx->word_len;
+
+        n = MIN(n, w - pos % w);
+        memcpy(ctx->word + ctx->word_len, *data, n);
+        ctx->word_len += n;
+        *data += n;
+        *len -= n;
+        ctx->left -= n;
+
+        if ((pos + n) % w != 0 && ctx->left > 0)
+            return 0;
+
+        n = ctx->word_len;
+        ctx->word_len = 0;
+        return apply_diff(st, NULL, ctx->word, ctx->oldfd, NULL, n,
+                          &ctx->oldcrc, start);
+    }
+
+    if (n < ctx->left) {
+        cut = (pos + n) % w;
+        if (cut > n)
+            cut = n;
+    }
+
+    if (n > cut && (err = apply_diff(st, NULL, *data, ctx->oldfd, NULL,
+                                     n - cut, &ctx->oldcrc, pos)) < 0)
+        return err;
+
+    memcpy(ctx->word, *data + n - cut, cut);
+    ctx->word_len = cut;
+    *data += n;
+    *len -= n;
+    ctx->left -= n;
+    return 0;
+}
+
+/* An entry header has been read. */
+static int apply_ctx_entry(struct ddelta_apply_ctx *ctx)
+{
+    struct apply_state *st = &ctx->state;
+    struct ddelta_entry_header *entry = &ctx->entry;
+    int err;
+
+    entry_header_decode(entry);
+
+    if (entry->diff == 0 && entry->extra == 0 && entry->seek.value == 0) {
+        const uint64_t t = ddelta_time_ns();
+
+        if ((err = flush_new(st, NULL)) < 0)
+            return err;
+        if (st->zip && (err = zip_finish(st, NULL)) < 0)
+            return err;
+        if (st->deflating &&
+            (err = deflate_finish(st, NULL, ctx->bytes_written)) < 0)
+            return err;
+        ddelta_lap_ns(t, &st->flush_ns);
+
+        if (st->deflating && ctx->bytes_written != st->params.content_size)
+            return -DDELTA_EPATCHSHORT;
+        if (st->file_size != ctx->header.new_file_size)
+            return -DDELTA_EPATCHSHORT;
+
+        ctx->part = PART_DONE;
+        return 0;
+    }
+
+    /* There is no old file to update in place */
+    if (entry->seek.value == DDELTA_FLUSH) {
+        st->flushes++;
+        return 0;
+    }
+
+    /* Entries after a flush read the blocks it wrote to the old file */
+    if (st->flushes > 0) {
+        ddelta_debug("ddelta_apply_ctx_feed: patch needs an in-place update.\n");
+        return -DDELTA_EINVAL;
+    }
+
+    st->entries++;
+    st->diff_bytes += entry->diff;
+    st->extra_bytes += entry->extra;
+    DDELTA_PROBE4(entry, ctx->bytes_written, entry->diff, entry->extra, entry->seek.value);
+    if (st->trace != NULL)
+        ctx->oldoff = old_tell(st, ctx->oldfd);
+    ctx->left = entry->diff;
+    ctx->part = PART_DIFF;
+    if (ctx->left == 0) {
+        ctx->left = entry->extra;
+        ctx->part = PART_EXTRA;
+        if (ctx->left == 0)
+            return apply_ctx_end_entry(ctx);
+    }
+
+    return 0;
+}
+
+int ddelta_apply_ctx_feed(struct ddelta_apply_ctx *ctx, const void *patch,
+                          size_t size)
+{
+    struct apply_state *st = &ctx->state;
+    const unsigned char *data = patch;
+    int err = 0;
+
+    if (ctx->err < 0)
+        return ctx->err;
+
+    while (err == 0 && size > 0 && ctx->part != PART_DONE) {
+        uint64_t t;
+        uint32_t n;
+
+        switch (ctx->part) {
+        case PART_HEADER:
+            if (!apply_ctx_collect(ctx, &ctx->header, DDELTA_HEADER_SIZE, &data, &size))
+                break;
+            if (memcmp(DDELTA_MAGIC_EXT, ctx->header.magic, sizeof(ctx->header.magic)) == 0)
+                ctx->part = PART_HEADER_EXT;
+            else
+                err = apply_ctx_start(ctx);
+            break;
+        case PART_HEADER_EXT:
+            if (apply_ctx_collect(ctx, &ctx->header.flags,
+                                  DDELTA_HEADER_EXT_SIZE - DDELTA_HEADER_SIZE,
+                                  &data, &size))
+                err = apply_ctx_start(ctx);
+            break;
+        case PART_DEFLATE_PARAMS:
+            if (!apply_ctx_collect(ctx, &st->params, sizeof(st->params), &data, &size) ||
+                (err = deflate_init(st)) < 0)
+                break;
+            st->content_size = st->params.content_size;
+            ctx->left = st->params.header_size;
+            ctx->part = PART_GZIP_HEADER;
+            break;
+        case PART_GZIP_HEADER:
+            n = MIN(ctx->left, size);
+            ddelta_rate_consume(&st->read_limit, n);
+            if ((err = write_file(st, NULL, data, n)) < 0)
+                break;
+            data += n;
+            size -= n;
+            if ((ctx->left -= n) == 0)
+                err = apply_ctx_begin_entries(ctx);
+            break;
+        case PART_ZIP_HEADER:
+            if (!apply_ctx_collect(ctx, &st->zip_header, sizeof(st->zip_header), &data, &size) ||
+                (err = zip_init(st, ctx->header.flags, ctx->options.memory_limit)) < 0)
+                break;
+            st->content_size = st->zip_header.content_size;
+            ctx->left = st->zip_header.old_members + st->zip_header.new_members;
+            ctx->part = PART_ZIP_MEMBERS;
+            if (ctx->left == 0)
+                err = apply_ctx_begin_entries(ctx);
+            break;
+        case PART_ZIP_MEMBERS:
+            n = st->zip_header.old_members + st->zip_header.new_members - ctx->left;
+            if (!apply_ctx_collect(ctx, &st->members[n], sizeof(st->members[n]), &data, &size) ||
+                (err = zip_member_decode(st, n)) < 0)
+                break;
+            if (--ctx->left == 0)
+                err = apply_ctx_begin_entries(ctx);
+            break;
+        case PART_RELOC_HEADER:
+            if (!apply_ctx_collect(ctx, &st->reloc_header, sizeof(st->reloc_header), &data, &size) ||
+                (err = reloc_init(st, ctx->header.flags, ctx->options.memory_limit)) < 0)
+                break;
+            ctx->part = PART_RELOC_SECTIONS;
+            if (st->reloc_header.sections > 0)
+                break;
+            /* fall through */
+        case PART_RELOC_SECTIONS:
+            if (ctx->part == PART_RELOC_SECTIONS && st->reloc.nsections < st->reloc_header.sections) {
+                n = st->reloc.nsections;
+                if (!apply_ctx_collect(ctx, &st->reloc.sections[n], sizeof(st->reloc.sections[n]),
+                                       &data, &size) ||
+                    (err = reloc_section_decode(st, n)) < 0 ||
+                    st->reloc.nsections < st->reloc_header.sections)
+                    break;
+            }
+            ctx->part = PART_RELOC_REGIONS;
+            if (st->reloc_header.regions > 0)
+                break;
+            /* fall through */
+        case PART_RELOC_REGIONS:
+            if (st->reloc.nregions < st->reloc_header.regions) {
+                n = st->reloc.nregions;
+                if (!apply_ctx_collect(ctx, &st->reloc.regions[n], sizeof(st->reloc.regions[n]),
+                                       &data, &size) ||
+                    (err = reloc_region_decode(st, n)) < 0 ||
+                    st->reloc.nregions < st->reloc_header.regions)
+                    break;
+            }
+            err = apply_ctx_begin_entries(ctx);
+            break;
+        case PART_ENTRY:
+            if (apply_ctx_collect(ctx, &ctx->entry, sizeof(ctx->entry), &data, &size))
+                err = apply_ctx_entry(ctx);
+            break;
+        case PART_DIFF:
+            if ((err = apply_ctx_diff(ctx, &data, &size)) < 0)
+                break;
+            if (ctx->left == 0) {
+                ctx->left = ctx->entry.extra;
+                ctx->part = PART_EXTRA;
+                if (ctx->left == 0)
+                    err = apply_ctx_end_entry(ctx);
+            }
+            break;
+        case PART_EXTRA:
+            n = MIN(ctx->left, size);
+            ddelta_rate_consume(&st->read_limit, n);
+            t = ddelta_time_ns();
+            if ((err = write_new(st, NULL, data, n)) < 0)
+                break;
+            ddelta_lap_ns(t, &st->write_ns);
+            data += n;
+            size -= n;
+            if ((ctx->left -= n) == 0)
+                err = apply_ctx_end_entry(ctx);
+            break;
+        case PART_DONE:
+            break;
+        }
+    }
+
+    if (err < 0 && err != -DDELTA_ECANCELED && ctx->alloc.failed)
+        err = -DDELTA_ENOMEM;
+    if (err < 0)
+        return ctx->err = err;
+    return ctx->part == PART_DONE;
+}
+
+void ddelta_apply_ctx_free(struct ddelta_apply_ctx *ctx,
+                           struct ddelta_apply_stats *stats)
+{
+    struct ddelta_alloc alloc;
+
+    if (ctx == NULL)
+        return;
+
+    DDELTA_PROBE2(apply__done, ctx->part == PART_DONE ? 0 : ctx->err < 0 ? ctx->err : -DDELTA_EPATCHIO,
+                  ctx->bytes_written);
+    if (stats != NULL)
+        apply_stats_fill(&ctx->state, ctx->start_us, ctx->start_cpu, stats);
+
+    if (ctx->inflated != NULL)
+        fclose(ctx->inflated);
+    apply_state_free(&ctx->state);
+
+    /* The context holds its own allocations */
+    alloc = ctx->alloc;
+    ddelta_free(&alloc, ctx);
+}
+
+int ddelta_apply_mem(const void *patch, size_t patchsize,
+                     const void *old, size_t oldsize,
+                     ddelta_write_fn write, void *write_data,
+                     const struct ddelta_apply_options *options,
+                     struct ddelta_apply_stats *stats)
+{
+    struct ddelta_apply_ctx *ctx;
+    int err;
+
+    ctx = ddelta_apply_ctx_new_mem(old, oldsize, write, write_data, options);
+    if (ctx == NULL)
+        return -DDELTA_ENOMEM;
+
+    err = ddelta_apply_ctx_feed(ctx, patch, patchsize);
+    if (err == 0)
+        err = -DDELTA_EPATCHIO;
+    else if (err == 1)
+        err = 0;
+
+    ddelta_apply_ctx_free(ctx, stats);
+    return err;
 }
 
 #ifndef DDELTA_NO_MAIN
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] oldfile newfile|tmpdir patchfile\n"
+            "\n"
+            "  --progress            show progress\n"
+            "  --read-rate=BPS       limit reads to this many bytes per second\n"
+            "  --write-rate=BPS      limit writes to this many bytes per second\n"
+            "  --memory-limit=BYTES  refuse patches that need more memory\n"
+            "  --memory-cap=BYTES    fail if more memory is allocated at once\n"
+            "  --stats=json          print timings and statistics to stdout\n"
+            "  --trace=FILE          write the entries to FILE as CSV\n"
+            "  --io-stats            time the I/O operations and print them by class\n",
+            prog);
+}
+
+/* Show progress if |data| points to a non-zero int, and cancel on SIGINT */
+static int show_progress(const struct ddelta_progress *progress, void *data)
+{
+    static const char *const phases[] = {"read", "sort", "scan", "apply", "flush"};
+
+    if (*(const int *) data)
+        fprintf(stderr, "\r%-5s %3u%% %8llu KiB/s",
+                phases[progress->phase],
+                (unsigned) (progress->total ? progress->done * 100 / progress->total : 0),
+                (unsigned long long) progress->rate / 1024);
+
+    return interrupted;
+}
+
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"progress", no_argument, NULL, 'p'},
+        {"read-rate", required_argument, NULL, 'r'},
+        {"write-rate", required_argument, NULL, 'w'},
+        {"memory-limit", required_argument, NULL, 'm'},
+        {"memory-cap", required_argument, NULL, 'M'},
+        {"stats", required_argument, NULL, 'j'},
+        {"trace", required_argument, NULL, 't'},
+        {"io-stats", no_argument, NULL, 'i'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    struct ddelta_apply_options options = {0};
+    struct ddelta_apply_stats stats;
+    int verbose = 0;
+    int json = 0;
     int ret;
+    int opt;
     FILE *old;
     FILE *patch;
     struct ddelta_header header;
 
-    if (argc != 4) {
-        fprintf(stderr, "usage: %s oldfile newfile|tmpdir patchfile\n", argv[0]);
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            verbose = 1;
+            break;
+        case 'r':
+            options.read_rate = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            options.write_rate = strtoull(optarg, NULL, 0);
+            break;
+        case 'm':
+            options.memory_limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'M':
+            options.memory_cap = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            if (strcmp(optarg, "json") != 0) {
+                fprintf(stderr, "unknown stats format: %s\n", optarg);
+                return 1;
+            }
+            json = 1;
+            break;
+        case 't':
+            if ((options.trace = fopen(optarg, "w")) == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            options.io_stats = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 3) {
+        usage(argv[0]);
         return 1;
     }
 
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    options.progress = show_progress;
+    options.progress_data = &verbose;
+    signal(SIGINT, on_interrupt);
+
     old = fopen(argv[1], "r+b");
     patch = fopen(argv[3], "rb");
 
@@ -400,9 +2348,29 @@ int main(int argc, char *argv[])
     if (ret < 0)
         return fprintf(stderr, "Not a ddelta file: %d(%d)", ret, errno), 1;
 
-    ret = ddelta_apply(&header, patch, old, argv[2]);
+    ret = ddelta_apply_opts(&header, patch, old, argv[2], &options, &stats);
     fclose(old);
     fclose(patch);
+    if (options.trace != NULL && fclose(options.trace) != 0 && ret >= 0) {
+        perror("trace");
+        return 1;
+    }
+
+    if (verbose)
+        fprintf(stderr, "\n");
+
+    if (options.read_rate > 0 || options.write_rate > 0)
+        fprintf(stderr, "read %llu bytes at %llu B/s, wrote %llu bytes at %llu B/s, throttled %llu ms\n",
+                (unsigned long long) stats.bytes_read,
+                (unsigned long long) (stats.elapsed_us ? stats.bytes_read * 1000000 / stats.elapsed_us : 0),
+                (unsigned long long) stats.bytes_written,
+                (unsigned long long) (stats.elapsed_us ? stats.bytes_written * 1000000 / stats.elapsed_us : 0),
+                (unsigned long long) stats.throttled_us / 1000);
+
+    if (options.io_stats)
+        ddelta_io_stats_print(stderr, &stats);
+    if (json)
+        ddelta_apply_stats_json(stdout, &stats);
 
     if (ret < 0)
         return fprintf(stderr, "Cannot apply patch: %d(%d)\n", ret, errno), 1;
@@ -0,0 +1,156 @@
+/* ddelta_arena.c - Arena allocator for large buffers
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta_arena.h"
+#include "ddelta_alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Alignment of allocations, a cache line */
+#define ARENA_ALIGN 64
+
+/* Size of the huge pages MAP_HUGETLB gives by default on most systems */
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+#if defined(MAP_ANONYMOUS) && !defined(DDELTA_NO_MMAP)
+static void *arena_map(size_t *size)
+{
+    void *p;
+
+#if defined(MAP_HUGETLB) && !defined(DDELTA_NO_HUGE_PAGES)
+    /* Explicit huge pages only exist if the administrator reserved some */
+    if (*size >= ARENA_HUGE_PAGE) {
+        size_t huge = (*size + ARENA_HUGE_PAGE - 1) / ARENA_HUGE_PAGE * ARENA_HUGE_PAGE;
+
+        p = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *size = huge;
+            return p;
+        }
+    }
+#endif
+
+    p = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+#if defined(MADV_HUGEPAGE) && !defined(DDELTA_NO_HUGE_PAGES)
+    /* Otherwise ask for transparent huge pages; failing is fine */
+    madvise(p, *size, MADV_HUGEPAGE);
+#endif
+
+    return p;
+}
+#endif
+
+size_t ddelta_arena_space(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+int ddelta_arena_init(struct ddelta_arena *a, size_t size,
+                      struct ddelta_alloc *alloc)
+{
+    memset(a, 0, sizeof(*a));
+
+    if (alloc != NULL && alloc->allocator != NULL) {
+        if ((a->base = ddelta_calloc(alloc, size)) == NULL)
+            return -1;
+        a->alloc = alloc;
+        a->size = size;
+        return 0;
+    }
+
+    /* Account the size asked for, not that of the huge pages */
+    if (alloc != NULL && ddelta_alloc_charge(alloc, size) != 0)
+        return -1;
+
+#if defined(MAP_ANONYMOUS) && !defined(DDELTA_NO_MMAP)
+    {
+        size_t mapped = size;
+
+        if ((a->base = arena_map(&mapped)) != NULL) {
+            a->mapped = 1;
+            a->size = mapped;
+            a->alloc = alloc;
+            a->charged = size;
+            return 0;
+        }
+    }
+#endif
+
+    if ((a->base = calloc(1, size)) == NULL) {
+        if (alloc != NULL)
+            ddelta_alloc_uncharge(alloc, size);
+        return -1;
+    }
+
+    a->size = size;
+    a->alloc = alloc;
+    a->charged = size;
+    return 0;
+}
+
+void *ddelta_arena_alloc(struct ddelta_arena *a, size_t size)
+{
+    void *p;
+
+    size = ddelta_arena_space(size);
+    if (size > a->size - a->used)
+        return NULL;
+
+    p = a->base + a->used;
+    a->used += size;
+    if (a->used > a->peak)
+        a->peak = a->used;
+
+    return p;
+}
+
+void ddelta_arena_free(struct ddelta_arena *a)
+{
+    if (a->alloc != NULL && a->alloc->allocator != NULL) {
+        ddelta_free(a->alloc, a->base);
+        a->base = NULL;
+        return;
+    }
+    if (a->alloc != NULL)
+        ddelta_alloc_uncharge(a->alloc, a->charged);
+
+#if defined(MAP_ANONYMOUS) && !defined(DDELTA_NO_MMAP)
+    if (a->mapped) {
+        munmap(a->base, a->size);
+        a->base = NULL;
+        return;
+    }
+#endif
+
+    free(a->base);
+    a->base = NULL;
+}
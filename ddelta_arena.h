@@ -0,0 +1,50 @@
+#ifndef DDELTA_ARENA_H
+#define DDELTA_ARENA_H
+
+#include <stddef.h>
+
+struct ddelta_alloc;
+
+/**
+ * A single memory region the large buffers are carved from.
+ *
+ * Where available, it is backed by huge pages, which cuts the TLB misses of
+ * random accesses to the suffix array. Memory is zeroed, and only released
+ * as a whole.
+ */
+struct ddelta_arena {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    /* Largest 'used' so far */
+    size_t peak;
+    /* Non-zero if 'base' was mapped rather than allocated */
+    int mapped;
+    /* Allocations it is accounted in, or NULL */
+    struct ddelta_alloc *alloc;
+    size_t charged;
+};
+
+/**
+ * Set up |a| for allocations of |size| bytes in total. If |alloc| is not
+ * NULL, the size is accounted in it, and the memory taken from its
+ * allocator if it has one rather than mapped.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int ddelta_arena_init(struct ddelta_arena *a, size_t size,
+                      struct ddelta_alloc *alloc);
+
+/**
+ * Bytes needed in an arena for an allocation of |size| bytes.
+ */
+size_t ddelta_arena_space(size_t size);
+
+/**
+ * Allocate |size| bytes from |a|, or return NULL if it is full.
+ */
+void *ddelta_arena_alloc(struct ddelta_arena *a, size_t size);
+
+void ddelta_arena_free(struct ddelta_arena *a);
+
+#endif
@@ -0,0 +1,52 @@
+/* ddelta_budget.c - Projected memory use of applying a patch
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ddelta.h"
+#include "ddelta_budget.h"
+
+uint64_t ddelta_apply_memory(uint32_t flags, int mem_level)
+{
+    /* Old and diff data of a block, and the stdio buffers of the
+     * patch, old and new file */
+    uint64_t size = 2 * DDELTA_BLOCK_SIZE + 3 * BUFSIZ;
+
+    if (mem_level <= 0)
+        mem_level = 9;
+
+    if (flags & DDELTA_FLAG_FILTER_MASK)
+        size += DDELTA_BLOCK_SIZE + DDELTA_FILTER_WINDOW;
+    else if (flags & DDELTA_FLAG_RELOC)
+        size += DDELTA_FILTER_WINDOW;
+
+    /* Output buffer and the deflate state, which has a window of 32 KiB */
+    if (flags & (DDELTA_FLAG_DEFLATE_NEW | DDELTA_FLAG_ZIP))
+        size += DDELTA_BLOCK_SIZE + (1 << (15 + 2)) + (1 << (mem_level + 9)) +
+                DDELTA_ZLIB_OVERHEAD;
+
+    /* Input and output buffers, the inflate window and the temporary file */
+    if (flags & (DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_ZIP))
+        size += 2 * DDELTA_BLOCK_SIZE + (1 << 15) + DDELTA_ZLIB_OVERHEAD + BUFSIZ;
+
+    return size;
+}
@@ -0,0 +1,12 @@
+#ifndef DDELTA_BUDGET_H
+#define DDELTA_BUDGET_H
+
+/* Size of blocks ddelta_apply() works on at once */
+#ifndef DDELTA_BLOCK_SIZE
+#define DDELTA_BLOCK_SIZE (32 * 1024)
+#endif
+
+/* Memory zlib needs besides the window and hash tables, from zconf.h */
+#define DDELTA_ZLIB_OVERHEAD (8 * 1024)
+
+#endif
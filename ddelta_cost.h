@@ -0,0 +1,38 @@
+#ifndef DDELTA_COST_H
+#define DDELTA_COST_H
+
+#include "ddelta.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Cost in microseconds of reading |bytes| sequentially from the old file. */
+static inline uint64_t ddelta_read_cost(const struct ddelta_cost_profile *profile,
+                                        uint64_t bytes)
+{
+    if (profile->read_bandwidth == 0)
+        return 0;
+
+    return bytes * 1000000 / profile->read_bandwidth;
+}
+
+/* Cost in microseconds of moving by |seek| bytes in the old file before
+ * reading on. A forward seek costs as much as reading through the gap, up
+ * to a real seek. A backward one costs a seek unless its data is still
+ * cached, and then as much as the same seek forward: going back is never
+ * cheaper than skipping ahead. */
+static inline uint64_t ddelta_seek_cost(const struct ddelta_cost_profile *profile,
+                                        off_t seek)
+{
+    uint64_t cost;
+
+    if (seek == 0)
+        return 0;
+    if (seek < 0 && -seek > (off_t) profile->cache_size)
+        return profile->seek_cost;
+
+    cost = ddelta_read_cost(profile, seek < 0 ? (uint64_t) -seek : (uint64_t) seek);
+    return cost < profile->seek_cost ? cost : profile->seek_cost;
+}
+
+#endif
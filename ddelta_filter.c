@@ -0,0 +1,180 @@
+/* ddelta_filter.c - Branch filters for executables
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ddelta.h"
+#include "ddelta_filter.h"
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+/* Whether |b| is the opcode of a CALL or JMP filter_x86() converts */
+static int x86_branch(unsigned char b)
+{
+    return b == 0xE8 || b == 0xE9;
+}
+
+/* x86 CALL and JMP with a 32-bit displacement. Only displacements within
+ * +-16 MiB are converted, modulo 2^25, so that the most significant byte
+ * stays 0x00 or 0xFF and the decoder finds the same instructions. An
+ * opcode that is not converted hides those in its displacement, whose
+ * conversion would change the byte it was decided on. */
+static void filter_x86(unsigned char *buf, size_t size, uint32_t pos,
+                       int encode)
+{
+    size_t i = 0;
+
+    while (i + 5 <= size) {
+        uint32_t src, dst;
+
+        if (!x86_branch(buf[i])) {
+            i++;
+            continue;
+        }
+        if (buf[i + 4] != 0x00 && buf[i + 4] != 0xFF) {
+            i += x86_branch(buf[i + 1]) || x86_branch(buf[i + 2]) ||
+                         x86_branch(buf[i + 3])
+                     ? 5
+                     : 1;
+            continue;
+        }
+
+        src = (uint32_t) buf[i + 1] |
+              (uint32_t) buf[i + 2] << 8 |
+              (uint32_t) buf[i + 3] << 16 |
+              (uint32_t) buf[i + 4] << 24;
+
+        if (encode)
+            dst = src + (pos + (uint32_t) i + 5);
+        else
+            dst = src - (pos + (uint32_t) i + 5);
+
+        dst &= 0x01FFFFFF;
+        if (dst & 0x01000000)
+            dst |= 0xFF000000;
+
+        buf[i + 1] = (unsigned char) dst;
+        buf[i + 2] = (unsigned char) (dst >> 8);
+        buf[i + 3] = (unsigned char) (dst >> 16);
+        buf[i + 4] = (unsigned char) (dst >> 24);
+        i += 5;
+    }
+}
+
+/* ARM BL instructions, 4-byte aligned. */
+static void filter_arm(unsigned char *buf, size_t size, uint32_t pos,
+                       int encode)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 4) {
+        uint32_t src, dst;
+
+        if (buf[i + 3] != 0xEB)
+            continue;
+
+        src = ((uint32_t) buf[i + 2] << 16 |
+               (uint32_t) buf[i + 1] << 8 |
+               (uint32_t) buf[i + 0]) << 2;
+
+        if (encode)
+            dst = src + (pos + (uint32_t) i + 8);
+        else
+            dst = src - (pos + (uint32_t) i + 8);
+
+        dst >>= 2;
+        buf[i + 2] = (unsigned char) (dst >> 16);
+        buf[i + 1] = (unsigned char) (dst >> 8);
+        buf[i + 0] = (unsigned char) dst;
+    }
+}
+
+/* Thumb BL instruction pairs, 2-byte aligned. The marker bits are kept,
+ * and a pair can never start in the second half of another pair, so the
+ * decoder sees the same pairs. */
+static void filter_armthumb(unsigned char *buf, size_t size, uint32_t pos,
+                            int encode)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 2) {
+        uint32_t src, dst;
+
+        if ((buf[i + 1] & 0xF8) != 0xF0 || (buf[i + 3] & 0xF8) != 0xF8)
+            continue;
+
+        src = (((uint32_t) buf[i + 1] & 7) << 19 |
+               (uint32_t) buf[i + 0] << 11 |
+               ((uint32_t) buf[i + 3] & 7) << 8 |
+               (uint32_t) buf[i + 2]) << 1;
+
+        if (encode)
+            dst = src + (pos + (uint32_t) i + 4);
+        else
+            dst = src - (pos + (uint32_t) i + 4);
+
+        dst >>= 1;
+        buf[i + 1] = (unsigned char) (0xF0 | ((dst >> 19) & 7));
+        buf[i + 0] = (unsigned char) (dst >> 11);
+        buf[i + 3] = (unsigned char) (0xF8 | ((dst >> 8) & 7));
+        buf[i + 2] = (unsigned char) dst;
+        i += 2;
+    }
+}
+
+static void filter(int filter, unsigned char *buf, size_t size, uint64_t pos,
+                   int encode)
+{
+    size_t i;
+
+    for (i = 0; i < size; i += DDELTA_FILTER_WINDOW) {
+        size_t n = MIN(size - i, DDELTA_FILTER_WINDOW);
+
+        switch (filter) {
+        case DDELTA_FILTER_X86:
+            filter_x86(buf + i, n, (uint32_t) (pos + i), encode);
+            break;
+        case DDELTA_FILTER_ARM:
+            filter_arm(buf + i, n, (uint32_t) (pos + i), encode);
+            break;
+        case DDELTA_FILTER_ARMTHUMB:
+            filter_armthumb(buf + i, n, (uint32_t) (pos + i), encode);
+            break;
+        default:
+            return;
+        }
+    }
+}
+
+void ddelta_filter_encode(int f, unsigned char *buf, size_t size,
+                          uint64_t pos)
+{
+    filter(f, buf, size, pos, 1);
+}
+
+void ddelta_filter_decode(int f, unsigned char *buf, size_t size,
+                          uint64_t pos)
+{
+    filter(f, buf, size, pos, 0);
+}
@@ -0,0 +1,21 @@
+#ifndef DDELTA_FILTER_H
+#define DDELTA_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Convert relative branch targets in |buf| to absolute ones (encode), or
+ * back (decode). |pos| is the offset of |buf| in its file.
+ *
+ * Filters work on windows of DDELTA_FILTER_WINDOW bytes aligned in the file
+ * and do not convert instructions crossing a window boundary, so |pos| must
+ * be aligned to a window and |buf| must consist of complete windows,
+ * except for the last window of the file.
+ */
+void ddelta_filter_encode(int filter, unsigned char *buf, size_t size,
+                          uint64_t pos);
+void ddelta_filter_decode(int filter, unsigned char *buf, size_t size,
+                          uint64_t pos);
+
+#endif
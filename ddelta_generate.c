@@ -27,11 +27,24 @@
 
 #define _POSIX_SOURCE
 #include "ddelta.h"
-
+#include "ddelta_alloc.h"
+#include "ddelta_arena.h"
+#include "ddelta_cost.h"
+#include "ddelta_filter.h"
+#include "ddelta_limit.h"
+#include "ddelta_probe.h"
+#include "ddelta_progress.h"
+#include "ddelta_reloc.h"
+#include "ddelta_stats.h"
+
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,6 +62,36 @@
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #endif
 
+#ifdef DDELTA_COUNTERS
+/* Counters of the patch generated by this thread, or NULL */
+static __thread struct ddelta_scan_counters *counters;
+
+#define COUNT(field, n)                 \
+    do {                                \
+        if (counters != NULL)           \
+            counters->field += (n);     \
+    } while (0)
+#else
+#define COUNT(field, n) do { } while (0)
+#endif
+
+static uint16_t ddelta_htobe16(uint16_t host)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap16(host);
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return host;
+#else
+    uint16_t be16;
+    unsigned char *buf = &be16;
+
+    buf[0] = (host >> 8) & 0xFF;
+    buf[1] = (host >> 0) & 0xFF;
+
+    return be16;
+#endif
+}
+
 static uint32_t ddelta_htobe32(uint32_t host)
 {
 #if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -96,29 +139,591 @@ static uint32_t ddelta_to_unsigned(int32_t i)
     return i >= 0 ? (uint32_t) i : ~(uint32_t)(-i) + 1;
 }
 
-static int ddelta_header_write(struct ddelta_header *header, FILE *file)
+static int32_t ddelta_from_unsigned(uint32_t u)
 {
-    header->new_file_size = ddelta_htobe64(header->new_file_size);
+    return u & 0x80000000 ? -(int32_t) ~(u - 1) : (int32_t) u;
+}
+
+/* Size of the queue of patch data waiting to be verified */
+#define DDELTA_VERIFY_QUEUE (1024 * 1024)
+
+/* A thread applying the patch in memory while it is being written */
+struct verifier {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* Ring buffer of patch data not verified yet */
+    unsigned char *queue;
+    size_t head, count;
+    /* Set at the end of the patch, when the verifier waits for more data,
+     * and when it finished with |result| */
+    int eof, idle, done;
+    int result;
+    /* What applying the patch must give */
+    const unsigned char *old, *new;
+    const off_t *oldsize;
+    off_t newsize;
+    uint64_t file_size;
+    /* Allocations of the generating thread, which own the queue */
+    struct ddelta_alloc *alloc;
+};
+
+/* The patch file being written, to |file| or |write| */
+struct patch_file {
+    FILE *file;
+    ddelta_write_fn write;
+    void *write_data;
+    struct verifier *verifier;
+    /* Bytes written so far */
+    uint64_t written;
+};
+
+/* Pass |size| bytes of patch data to the verifier, waiting for space in the
+ * queue. Returns -DDELTA_EVERIFY once it found a mismatch. */
+static int verifier_feed(struct verifier *v, const void *buf, size_t size)
+{
+    const unsigned char *in = buf;
+    int result;
+
+    pthread_mutex_lock(&v->lock);
+    while (size > 0 && !v->done) {
+        size_t tail, n;
+
+        if (v->count == DDELTA_VERIFY_QUEUE) {
+            pthread_cond_wait(&v->cond, &v->lock);
+            continue;
+        }
+
+        tail = (v->head + v->count) % DDELTA_VERIFY_QUEUE;
+        n = MIN(size, MIN(DDELTA_VERIFY_QUEUE - v->count, DDELTA_VERIFY_QUEUE - tail));
+        memcpy(v->queue + tail, in, n);
+        v->count += n;
+        in += n;
+        size -= n;
+        pthread_cond_broadcast(&v->cond);
+    }
+    result = v->result;
+    pthread_mutex_unlock(&v->lock);
 
-    if (fwrite(header, sizeof(*header), 1, file) < 1)
+    return result;
+}
+
+static int patch_write(struct patch_file *pf, const void *buf, size_t size)
+{
+    if (pf->write != NULL) {
+        if (size > 0 && pf->write(pf->write_data, buf, size) < 0)
+            return -DDELTA_EPATCHIO;
+    } else if (size > 0 && fwrite(buf, size, 1, pf->file) < 1) {
         return -DDELTA_EPATCHIO;
+    }
+    pf->written += size;
+    if (pf->verifier != NULL)
+        return verifier_feed(pf->verifier, buf, size);
+
+    return 0;
+}
+
+static int ddelta_header_write(struct ddelta_header *header,
+                               struct patch_file *file)
+{
+    size_t size = DDELTA_HEADER_SIZE;
+
+    header->new_file_size = ddelta_htobe64(header->new_file_size);
+
+    /* Keep writing the old format unless we need the flags */
+    if (header->flags != 0) {
+        memcpy(header->magic, DDELTA_MAGIC_EXT, sizeof(header->magic));
+        header->flags = ddelta_htobe32(header->flags);
+        header->reserved = ddelta_htobe32(header->reserved);
+        size = DDELTA_HEADER_EXT_SIZE;
+    }
+
+    return patch_write(file, header, size);
+}
+
+static int ddelta_deflate_params_write(struct ddelta_deflate_params *params,
+                                       const unsigned char *gzip_header,
+                                       struct patch_file *file)
+{
+    const uint32_t header_size = params->header_size;
+    int result;
+
+    params->content_size = ddelta_htobe64(params->content_size);
+    params->file_crc = ddelta_htobe32(params->file_crc);
+    params->header_size = ddelta_htobe32(params->header_size);
+
+    if ((result = patch_write(file, params, sizeof(*params))) < 0)
+        return result;
+
+    return patch_write(file, gzip_header, header_size);
+}
+
+static int ddelta_zip_members_write(const struct ddelta_zip_member *members,
+                                    uint32_t count, struct patch_file *file)
+{
+    uint32_t i;
+    int result;
+
+    for (i = 0; i < count; i++) {
+        struct ddelta_zip_member m = members[i];
+
+        m.offset = ddelta_htobe64(m.offset);
+        m.size = ddelta_htobe64(m.size);
+        m.content_size = ddelta_htobe64(m.content_size);
+        if ((result = patch_write(file, &m, sizeof(m))) < 0)
+            return result;
+    }
+
+    return 0;
+}
+
+static int ddelta_zip_write(struct ddelta_zip_header *zip,
+                            const struct ddelta_zip_member *old_members,
+                            const struct ddelta_zip_member *new_members,
+                            struct patch_file *file)
+{
+    const uint32_t old_count = zip->old_members, new_count = zip->new_members;
+    int result;
+
+    zip->content_size = ddelta_htobe64(zip->content_size);
+    zip->file_crc = ddelta_htobe32(zip->file_crc);
+    zip->old_members = ddelta_htobe32(zip->old_members);
+    zip->new_members = ddelta_htobe32(zip->new_members);
+
+    if ((result = patch_write(file, zip, sizeof(*zip))) < 0 ||
+        (result = ddelta_zip_members_write(old_members, old_count, file)) < 0)
+        return result;
+
+    return ddelta_zip_members_write(new_members, new_count, file);
+}
+
+static int ddelta_reloc_write(const struct ddelta_reloc *reloc,
+                              struct patch_file *file)
+{
+    struct ddelta_reloc_header header;
+    uint32_t i;
+    int result;
+
+    memset(&header, 0, sizeof(header));
+    header.sections = ddelta_htobe32(reloc->nsections);
+    header.regions = ddelta_htobe32(reloc->nregions);
+    header.word_size = reloc->word_size;
+    if ((result = patch_write(file, &header, sizeof(header))) < 0)
+        return result;
+
+    for (i = 0; i < reloc->nsections; i++) {
+        struct ddelta_reloc_section s = reloc->sections[i];
+
+        s.old_addr = ddelta_htobe64(s.old_addr);
+        s.new_addr = ddelta_htobe64(s.new_addr);
+        s.size = ddelta_htobe64(s.size);
+        if ((result = patch_write(file, &s, sizeof(s))) < 0)
+            return result;
+    }
+
+    for (i = 0; i < reloc->nregions; i++) {
+        struct ddelta_reloc_region g = reloc->regions[i];
+
+        g.offset = ddelta_htobe64(g.offset);
+        g.count = ddelta_htobe32(g.count);
+        g.stride = ddelta_htobe16(g.stride);
+        g.mask = ddelta_htobe16(g.mask);
+        if ((result = patch_write(file, &g, sizeof(g))) < 0)
+            return result;
+    }
 
     return 0;
 }
 
 static int ddelta_entry_header_write(struct ddelta_entry_header *entry,
-                                     FILE *file)
+                                     struct patch_file *file)
 {
     entry->diff = ddelta_htobe32(entry->diff);
     entry->extra = ddelta_htobe32(entry->extra);
     entry->seek.raw = ddelta_htobe32(ddelta_to_unsigned(entry->seek.value));
 
-    if (fwrite(entry, sizeof(*entry), 1, file) < 1)
-        return -DDELTA_EPATCHIO;
+    return patch_write(file, entry, sizeof(*entry));
+}
+
+/* Size of the buffer diff data is computed in before being written */
+#define DDELTA_DIFF_BLOCK (32 * 1024)
+
+/* Subtract the |n| bytes at |old| from those at |new|, which start at byte
+ * |start| of a little-endian word with all other bytes zero. */
+static void diff_word(unsigned char *out, const unsigned char *old,
+                      const unsigned char *new, size_t start, size_t n)
+{
+    uint64_t o = 0, v = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        o |= (uint64_t) old[i] << (8 * (start + i));
+        v |= (uint64_t) new[i] << (8 * (start + i));
+    }
+
+    v -= o;
+
+    for (i = 0; i < n; i++)
+        out[i] = (unsigned char) (v >> (8 * (start + i)));
+}
+
+/* Compute |len| bytes of diff data between |new| and |old| into |out|.
+ * For word sizes |w| larger than 1, |new| starts at byte |align| of a
+ * word. */
+static void diff_block(unsigned char *out, const unsigned char *old,
+                       const unsigned char *new, size_t len, int w,
+                       size_t align)
+{
+    size_t i = 0;
+
+    if (w <= 1) {
+#ifdef __GNUC__
+        typedef unsigned char uchar_vector __attribute__((vector_size(16)));
+
+        for (; i + sizeof(uchar_vector) <= len; i += sizeof(uchar_vector)) {
+            uchar_vector a, b;
+
+            memcpy(&a, new + i, sizeof(a));
+            memcpy(&b, old + i, sizeof(b));
+            a -= b;
+            memcpy(out + i, &a, sizeof(a));
+        }
+#endif
+        for (; i < len; i++)
+            out[i] = new[i] - old[i];
+        return;
+    }
+
+    if (align != 0) {
+        i = MIN(w - align, len);
+        diff_word(out, old, new, align, i);
+    }
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (w == 4) {
+        typedef uint32_t u32_vector __attribute__((vector_size(16)));
+
+        for (; i + sizeof(u32_vector) <= len; i += sizeof(u32_vector)) {
+            u32_vector a, b;
+
+            memcpy(&a, new + i, sizeof(a));
+            memcpy(&b, old + i, sizeof(b));
+            a -= b;
+            memcpy(out + i, &a, sizeof(a));
+        }
+    } else {
+        typedef uint64_t u64_vector __attribute__((vector_size(16)));
+
+        for (; i + sizeof(u64_vector) <= len; i += sizeof(u64_vector)) {
+            u64_vector a, b;
+
+            memcpy(&a, new + i, sizeof(a));
+            memcpy(&b, old + i, sizeof(b));
+            a -= b;
+            memcpy(out + i, &a, sizeof(a));
+        }
+    }
+#endif
+
+    for (; i < len; i += w)
+        diff_word(out + i, old + i, new + i, 0, MIN((size_t) w, len - i));
+}
+
+/* Write the diff data of |len| bytes of |new| at offset |newoff| in the new
+ * file against |old|, using words of size |w|. The non-zero bytes of it are
+ * added to |*nonzero| unless it is NULL. */
+static int write_diff(struct patch_file *file, const unsigned char *old,
+                      const unsigned char *new, off_t newoff, off_t len, int w,
+                      uint64_t *nonzero)
+{
+    unsigned char buf[DDELTA_DIFF_BLOCK];
+    size_t align = w > 1 ? newoff % w : 0;
+    int result;
+
+    while (len > 0) {
+        /* Only the first block may start in the middle of a word */
+        size_t n = MIN((off_t) (sizeof(buf) - align), len);
+
+        diff_block(buf, old, new, n, w, align);
+        if (nonzero != NULL)
+            *nonzero += ddelta_nonzero_bytes(buf, n);
+        if ((result = patch_write(file, buf, n)) < 0)
+            return result;
+
+        old += n;
+        new += n;
+        len -= n;
+        align = 0;
+    }
+
+    return 0;
+}
+
+/* Check that adding the |len| bytes of diff data in |diff| to |old| gives
+ * |new|, at offset |newoff| of the new file and with words of size |w|.
+ * This is deliberately not sharing code with diff_block(). */
+static int verify_diff(const unsigned char *old, const unsigned char *new,
+                       const unsigned char *diff, off_t newoff, size_t len,
+                       int w)
+{
+    size_t i = 0, j;
+
+    while (i < len) {
+        const size_t start = (newoff + i) % w;
+        const size_t n = MIN(w - start, len - i);
+        uint64_t o = 0, d = 0;
+
+        for (j = 0; j < n; j++) {
+            o |= (uint64_t) old[i + j] << (8 * (start + j));
+            d |= (uint64_t) diff[i + j] << (8 * (start + j));
+        }
+
+        o += d;
+
+        for (j = 0; j < n; j++)
+            if ((unsigned char) (o >> (8 * (start + j))) != new[i + j])
+                return -1;
+
+        i += n;
+    }
+
+    return 0;
+}
+
+/* Read |size| bytes of patch data, waiting for the generator to write
+ * them. Fails at the end of the patch. */
+static int verifier_read(struct verifier *v, void *buf, size_t size)
+{
+    unsigned char *out = buf;
+
+    pthread_mutex_lock(&v->lock);
+    while (size > 0) {
+        size_t n;
+
+        if (v->count == 0) {
+            if (v->eof)
+                break;
+            v->idle = 1;
+            pthread_cond_broadcast(&v->cond);
+            pthread_cond_wait(&v->cond, &v->lock);
+            continue;
+        }
+
+        v->idle = 0;
+        n = MIN(size, MIN(v->count, DDELTA_VERIFY_QUEUE - v->head));
+        memcpy(out, v->queue + v->head, n);
+        v->head = (v->head + n) % DDELTA_VERIFY_QUEUE;
+        v->count -= n;
+        out += n;
+        size -= n;
+        pthread_cond_broadcast(&v->cond);
+    }
+    pthread_mutex_unlock(&v->lock);
+
+    return size == 0 ? 0 : -1;
+}
+
+/* Apply the patch in the queue to the old data in memory, like
+ * ddelta_apply() does, and compare the result to the new data. */
+static int verify_patch(struct verifier *v)
+{
+    struct ddelta_header header;
+    struct ddelta_entry_header entry;
+    struct ddelta_deflate_params params;
+    struct ddelta_zip_header zip;
+    struct ddelta_reloc_header reloc;
+    unsigned char buf[DDELTA_DIFF_BLOCK];
+    off_t oldpos = 0, newpos = 0;
+    uint32_t oldcrc = 0, newcrc = 0;
+    int w = 1;
+
+    if (verifier_read(v, &header, DDELTA_HEADER_SIZE) < 0)
+        return -1;
+
+    header.flags = 0;
+    if (memcmp(header.magic, DDELTA_MAGIC_EXT, sizeof(header.magic)) == 0) {
+        if (verifier_read(v, &header.flags, DDELTA_HEADER_EXT_SIZE - DDELTA_HEADER_SIZE) < 0)
+            return -1;
+        header.flags = ddelta_htobe32(header.flags);
+    } else if (memcmp(header.magic, DDELTA_MAGIC, sizeof(header.magic)) != 0) {
+        return -1;
+    }
+
+    if (ddelta_htobe64(header.new_file_size) != v->file_size)
+        return -1;
+    if (header.flags & DDELTA_FLAG_WORD32)
+        w = 4;
+    if (header.flags & DDELTA_FLAG_WORD64)
+        w = 8;
+
+    if (header.flags & DDELTA_FLAG_DEFLATE_NEW) {
+        uint32_t left;
+
+        if (verifier_read(v, &params, sizeof(params)) < 0 ||
+            ddelta_htobe64(params.content_size) != (uint64_t) v->newsize)
+            return -1;
+
+        for (left = ddelta_htobe32(params.header_size); left > 0; left -= MIN(left, sizeof(buf)))
+            if (verifier_read(v, buf, MIN(left, sizeof(buf))) < 0)
+                return -1;
+    }
+
+    /* The members only matter for the old and new archive themselves */
+    if (header.flags & DDELTA_FLAG_ZIP) {
+        uint64_t left;
+
+        if (verifier_read(v, &zip, sizeof(zip)) < 0 ||
+            ddelta_htobe64(zip.content_size) != (uint64_t) v->newsize)
+            return -1;
+
+        left = ((uint64_t) ddelta_htobe32(zip.old_members) + ddelta_htobe32(zip.new_members)) *
+               sizeof(struct ddelta_zip_member);
+        for (; left > 0; left -= MIN(left, sizeof(buf)))
+            if (verifier_read(v, buf, MIN(left, sizeof(buf))) < 0)
+                return -1;
+    }
+
+    /* The entries produce the new file with its pointers rewritten */
+    if (header.flags & DDELTA_FLAG_RELOC) {
+        uint64_t left;
+
+        if (verifier_read(v, &reloc, sizeof(reloc)) < 0)
+            return -1;
+
+        left = (uint64_t) ddelta_htobe32(reloc.sections) * sizeof(struct ddelta_reloc_section) +
+               (uint64_t) ddelta_htobe32(reloc.regions) * sizeof(struct ddelta_reloc_region);
+        for (; left > 0; left -= MIN(left, sizeof(buf)))
+            if (verifier_read(v, buf, MIN(left, sizeof(buf))) < 0)
+                return -1;
+    }
+
+    for (;;) {
+        uint32_t n;
+
+        if (verifier_read(v, &entry, sizeof(entry)) < 0)
+            return -1;
+
+        entry.diff = ddelta_htobe32(entry.diff);
+        entry.extra = ddelta_htobe32(entry.extra);
+        entry.seek.value = ddelta_from_unsigned(ddelta_htobe32(entry.seek.raw));
+
+        /* The end of the patch must come with the end of the new data */
+        if (entry.diff == 0 && entry.extra == 0 && entry.seek.value == 0)
+            return newpos == v->newsize && verifier_read(v, buf, 1) < 0 ? 0 : -1;
+
+        if (entry.seek.value == DDELTA_FLUSH) {
+            if (entry.oldcrc != oldcrc || entry.newcrc != newcrc)
+                return -1;
+            oldcrc = 0;
+            newcrc = 0;
+            continue;
+        }
+
+        if (oldpos < 0 || entry.diff > *v->oldsize - oldpos ||
+            (off_t) entry.diff + entry.extra > v->newsize - newpos)
+            return -1;
+
+        for (; entry.diff > 0; entry.diff -= n) {
+            n = MIN(entry.diff, sizeof(buf));
+            if (verifier_read(v, buf, n) < 0 ||
+                verify_diff(v->old + oldpos, v->new + newpos, buf, newpos, n, w) < 0)
+                return -1;
+
+            oldcrc = crc32(oldcrc, v->old + oldpos, n);
+            newcrc = crc32(newcrc, v->new + newpos, n);
+            oldpos += n;
+            newpos += n;
+        }
+
+        for (; entry.extra > 0; entry.extra -= n) {
+            n = MIN(entry.extra, sizeof(buf));
+            if (verifier_read(v, buf, n) < 0 ||
+                memcmp(buf, v->new + newpos, n) != 0)
+                return -1;
+
+            newcrc = crc32(newcrc, buf, n);
+            newpos += n;
+        }
+
+        oldpos += entry.seek.value;
+    }
+}
+
+static void *verifier_main(void *arg)
+{
+    struct verifier *v = arg;
+    int result = verify_patch(v);
+
+    pthread_mutex_lock(&v->lock);
+    v->result = result < 0 ? -DDELTA_EVERIFY : 0;
+    v->done = 1;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+
+    return NULL;
+}
+
+/* Start verifying that the patch applied to |old| gives |new|. The old
+ * data may only change while the verifier is synchronized. */
+static int verifier_start(struct verifier *v, struct ddelta_alloc *alloc,
+                          const unsigned char *old, const off_t *oldsize,
+                          const unsigned char *new, off_t newsize,
+                          uint64_t file_size)
+{
+    memset(v, 0, sizeof(*v));
+    v->old = old;
+    v->oldsize = oldsize;
+    v->new = new;
+    v->newsize = newsize;
+    v->file_size = file_size;
+    v->alloc = alloc;
+
+    if ((v->queue = ddelta_malloc(alloc, DDELTA_VERIFY_QUEUE)) == NULL)
+        return -DDELTA_EALGO;
+
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+
+    if (pthread_create(&v->thread, NULL, verifier_main, v) != 0) {
+        pthread_cond_destroy(&v->cond);
+        pthread_mutex_destroy(&v->lock);
+        ddelta_free(alloc, v->queue);
+        return -DDELTA_EALGO;
+    }
 
     return 0;
 }
 
+/* Wait until the verifier checked all data written so far. */
+static int verifier_sync(struct verifier *v)
+{
+    int result;
+
+    pthread_mutex_lock(&v->lock);
+    while (!v->done && !(v->idle && v->count == 0))
+        pthread_cond_wait(&v->cond, &v->lock);
+    result = v->result;
+    pthread_mutex_unlock(&v->lock);
+
+    return result;
+}
+
+/* Signal the end of the patch and wait for the verifier's result. */
+static int verifier_finish(struct verifier *v)
+{
+    pthread_mutex_lock(&v->lock);
+    v->eof = 1;
+    pthread_cond_broadcast(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+
+    pthread_join(v->thread, NULL);
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->lock);
+    ddelta_free(v->alloc, v->queue);
+
+    return v->result;
+}
+
 static off_t matchlen(unsigned char *old, off_t oldsize, unsigned char *new,
                       off_t newsize)
 {
@@ -128,49 +733,145 @@ static off_t matchlen(unsigned char *old, off_t oldsize, unsigned char *new,
         if (old[i] != new[i])
             break;
 
+    COUNT(compared_bytes, i);
     return i;
 }
 
 /* This is a binary search of the string |new| of size |newsize| (or a
  * prefix of it) in the |old| string with size |oldsize| using the suffix array
  * |I|. |st| and |en| is the start and end of the search range (inclusive).
- * Returns the length of the longest prefix found and stores the position of the
- * string found in |*pos|. */
+ * Returns the length of the longest prefix found and stores the index in |I|
+ * of the string found in |*idx|. */
 static off_t search(saidx_t *I, unsigned char *old, off_t oldsize,
                     unsigned char *new, off_t newsize, off_t st, off_t en,
-                    off_t *pos)
+                    off_t *idx)
 {
     off_t x, y;
 
+    COUNT(search_steps, 1);
     if (en - st < 2) {
         x = matchlen(old + I[st], oldsize - I[st], new, newsize);
         y = matchlen(old + I[en], oldsize - I[en], new, newsize);
 
         if (x > y) {
-            *pos = I[st];
+            *idx = st;
             return x;
         } else {
-            *pos = I[en];
+            *idx = en;
             return y;
         }
     };
 
     x = st + (en - st) / 2;
+    COUNT(memcmp_calls, 1);
     if (memcmp(old + I[x], new, MIN(oldsize - I[x], newsize)) <= 0) {
-        return search(I, old, oldsize, new, newsize, x, en, pos);
+        return search(I, old, oldsize, new, newsize, x, en, idx);
     } else {
-        return search(I, old, oldsize, new, newsize, st, x, pos);
+        return search(I, old, oldsize, new, newsize, st, x, idx);
     };
 }
 
-static off_t read_file(int fd, unsigned char **buf)
+/* Number of suffix array neighbours looked at by select_match() */
+#define DDELTA_COST_WINDOW 32
+
+/* Cost of taking a match of |len| bytes at |pos| in the old file, coming
+ * from position |cur|. Matches ending past |erase_limit|, if non-zero, read
+ * erase blocks the in-place applier has not reached yet: they cost as much
+ * as a seek, so a cheaper match elsewhere still wins, and without a profile
+ * they only lose against matches of the same length. */
+static uint64_t match_cost(const struct ddelta_cost_profile *profile,
+                           off_t erase_limit, off_t pos, off_t len, off_t cur)
+{
+    uint64_t cost = 0;
+
+    if (profile != NULL)
+        cost += ddelta_seek_cost(profile, pos - cur);
+    if (erase_limit > 0 && pos + len > erase_limit)
+        cost += profile != NULL ? profile->seek_cost : 1;
+
+    return cost;
+}
+
+/* The suffixes sorted next to |I[*idx]| share the longest prefixes with
+ * |new|. Among those matching at least |min_len| bytes, pick the one
+ * cheapest to reach from position |cur| in the old file, preferring longer
+ * matches on equal cost. Updates |*idx| and returns the match length. */
+static off_t select_match(const struct ddelta_cost_profile *profile,
+                          off_t erase_limit, saidx_t *I, off_t nI,
+                          unsigned char *old, off_t oldsize,
+                          unsigned char *new, off_t newsize,
+                          off_t len, off_t min_len, off_t cur, off_t *idx)
+{
+    off_t bestidx = *idx, bestlen = len;
+    uint64_t bestcost = match_cost(profile, erase_limit, I[bestidx], len, cur);
+    int dir, k;
+
+    for (dir = -1; dir <= 1; dir += 2) {
+        for (k = 1; k <= DDELTA_COST_WINDOW && bestcost > 0; k++) {
+            off_t j = *idx + dir * k, l;
+            uint64_t cost;
+
+            if (j < 0 || j >= nI)
+                break;
+
+            l = matchlen(old + I[j], oldsize - I[j], new, newsize);
+            if (l < min_len)
+                break;
+
+            cost = match_cost(profile, erase_limit, I[j], l, cur);
+            if (cost < bestcost || (cost == bestcost && l > bestlen)) {
+                bestidx = j;
+                bestlen = l;
+                bestcost = cost;
+            }
+        }
+    }
+
+    *idx = bestidx;
+    return bestlen;
+}
+
+/* An input file, in a file descriptor or in memory if |data| is not NULL */
+struct input_file {
+    int fd;
+    const unsigned char *data;
+    off_t size;
+};
+
+static off_t input_size(const struct input_file *f)
+{
+    if (f->data != NULL)
+        return f->size;
+    return f->fd < 0 ? -1 : lseek(f->fd, 0, SEEK_END);
+}
+
+/**
+ * Read the file |f| into |*buf|, closing its file descriptor. If |*buf| is
+ * NULL, it is allocated, otherwise it must have room for more than the file
+ * size in |capacity|.
+ */
+static off_t read_file(const struct input_file *f, struct ddelta_alloc *alloc,
+                       unsigned char **buf, off_t capacity)
 {
+    const int fd = f->fd;
     off_t size;
+
+    if (f->data != NULL) {
+        size = f->size;
+        if ((*buf != NULL && size >= capacity) ||
+            (*buf == NULL && (*buf = ddelta_malloc(alloc, size + 1)) == NULL))
+            return -1;
+
+        memcpy(*buf, f->data, size);
+        return size;
+    }
+
     if (fd < 0)
         return -1;
 
     if (((size = lseek(fd, 0, SEEK_END)) == -1) ||
-        ((*buf = malloc(size + 1)) == NULL) ||
+        (*buf != NULL && size >= capacity) ||
+        (*buf == NULL && (*buf = ddelta_malloc(alloc, size + 1)) == NULL) ||
         (lseek(fd, 0, SEEK_SET) != 0) ||
         (read(fd, *buf, size) != size) || (close(fd) == -1))
         return -1;
@@ -178,274 +879,2709 @@ static off_t read_file(int fd, unsigned char **buf)
     return size;
 }
 
-int ddelta_generate(int oldfd, int newfd, int patchfd, int blocksize)
+/* Offsets and values of the ELF header fields we look at */
+#define ELF_EI_CLASS 4
+#define ELF_EI_DATA 5
+#define ELF_E_MACHINE 18
+#define ELF_E_ENTRY 24
+#define ELF_CLASS32 1
+#define ELF_CLASS64 2
+#define ELF_DATA2LSB 1
+#define ELF_EM_386 3
+#define ELF_EM_ARM 40
+#define ELF_EM_X86_64 62
+
+/* If |buf| is a little-endian ELF file, choose the branch filter for its
+ * machine and the word size of its pointers. Code of ARM executables is
+ * considered Thumb if the entry point is, as on Cortex-M. */
+static void elf_options(const unsigned char *buf, off_t size, int *filter,
+                        int *word_size)
 {
-    struct ddelta_header file_header = {
-        DDELTA_MAGIC,
-        0};
-    struct ddelta_entry_header header;
-    unsigned char *old = NULL, *new = NULL;
-    off_t scansize, oldsize, newsize;
-    uint32_t oldcrc, newcrc;
-    saidx_t *I = NULL;
-    off_t scan, pos = 0, len;
-    off_t lastscan, lastpos, lastoffset;
-    off_t oldscore, scsc;
-    off_t s, Sf, lenf, Sb, lenb;
-    off_t overlap, Ss, lens;
-    off_t i;
-    FILE *pf = NULL;
-    int result = 0;
+    int machine;
 
-    newsize = read_file(newfd, &new);
-    if (newsize > INT32_MAX) {
-        result = -DDELTA_ENEWIO;
-        goto out;
-    } else if (newsize < 0) {
-        result = -DDELTA_ENEWIO;
-        goto out;
-    }
+    if (size < 52 || memcmp(buf, "\177ELF", 4) != 0 ||
+        buf[ELF_EI_DATA] != ELF_DATA2LSB)
+        return;
 
-    oldsize = read_file(oldfd, &old);
-    if (oldsize > INT32_MAX) {
-        result = -DDELTA_EOLDIO;
-        goto out;
-    } else if (oldsize < 0) {
-        result = -DDELTA_EOLDIO;
-        goto out;
+    if (*word_size == 1) {
+        if (buf[ELF_EI_CLASS] == ELF_CLASS32)
+            *word_size = 4;
+        else if (buf[ELF_EI_CLASS] == ELF_CLASS64)
+            *word_size = 8;
     }
 
-    if (newsize > oldsize) {
-        unsigned char *tmp = realloc(old, newsize);
-        if (tmp == NULL) {
-            result = -DDELTA_EOLDIO;
-            goto out;
-        }
-        memset(tmp + oldsize, 0, newsize - oldsize);
-        old = tmp;
+    if (*filter != DDELTA_FILTER_NONE)
+        return;
+
+    machine = buf[ELF_E_MACHINE] | buf[ELF_E_MACHINE + 1] << 8;
+    switch (machine) {
+    case ELF_EM_386:
+    case ELF_EM_X86_64:
+        *filter = DDELTA_FILTER_X86;
+        break;
+    case ELF_EM_ARM:
+        *filter = (buf[ELF_E_ENTRY] & 1) ? DDELTA_FILTER_ARMTHUMB : DDELTA_FILTER_ARM;
+        break;
     }
+}
 
-    I = malloc((MAX(oldsize, newsize) + 1) * sizeof(saidx_t));
-    if (I == NULL) {
-        result = -DDELTA_EALGO;
-        goto out;
-    }
+/* Section header fields and values DDELTA_FLAG_RELOC looks at */
+#define ELF_E_TYPE 16
+#define ELF_ET_EXEC 2
+#define ELF_ET_DYN 3
+#define ELF_EM_AARCH64 183
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_RELA 4
+#define ELF_SHT_NOBITS 8
+#define ELF_SHT_REL 9
+#define ELF_SHT_DYNSYM 11
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHF_TLS 0x400
+
+/* A section header of an ELF file, and its name */
+struct elf_section {
+    const char *name;
+    uint32_t name_offset;
+    uint32_t type;
+    uint64_t flags, addr, offset, size, entsize;
+};
+
+/* An ELF executable or shared object, with |w| byte pointers */
+struct elf_file {
+    const unsigned char *buf;
+    off_t size;
+    int w;
+    int machine;
+    struct elf_section *sections;
+    long count;
+};
 
-    /* Create the patch file */
-    if ((pf = fdopen(patchfd, "wb")) == NULL) {
-        result = -DDELTA_EPATCHIO;
-        goto out;
-    }
+static uint64_t elf_get(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    int i;
 
-    file_header.new_file_size = (uint64_t) newsize;
-    if ((result = ddelta_header_write(&file_header, pf)) < 0)
-        goto out;
+    for (i = 0; i < bytes; i++)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+/* Read the section headers of the little-endian ELF executable or shared
+ * object in |buf|. Returns 1 if it is none. */
+static int elf_open(struct ddelta_alloc *alloc, const unsigned char *buf,
+                    off_t size, struct elf_file *f)
+{
+    const struct elf_section *names;
+    uint64_t shoff, entsize, count, strndx;
+    long i;
+    int w;
+
+    memset(f, 0, sizeof(*f));
+    if (size < 64 || memcmp(buf, "\177ELF", 4) != 0 ||
+        buf[ELF_EI_DATA] != ELF_DATA2LSB ||
+        (buf[ELF_EI_CLASS] != ELF_CLASS32 && buf[ELF_EI_CLASS] != ELF_CLASS64) ||
+        (elf_get(buf + ELF_E_TYPE, 2) != ELF_ET_EXEC &&
+         elf_get(buf + ELF_E_TYPE, 2) != ELF_ET_DYN))
+        return 1;
+
+    w = buf[ELF_EI_CLASS] == ELF_CLASS64 ? 8 : 4;
+    shoff = elf_get(buf + (w == 8 ? 40 : 32), w);
+    entsize = elf_get(buf + (w == 8 ? 58 : 46), 2);
+    count = elf_get(buf + (w == 8 ? 60 : 48), 2);
+    strndx = elf_get(buf + (w == 8 ? 62 : 50), 2);
+    if (entsize != (w == 8 ? 64u : 40u) || count == 0 || strndx >= count ||
+        count > DDELTA_RELOC_MAX_SECTIONS || shoff > (uint64_t) size ||
+        count * entsize > (uint64_t) size - shoff)
+        return 1;
+
+    if ((f->sections = ddelta_calloc(alloc, count * sizeof(*f->sections))) == NULL)
+        return -DDELTA_EALGO;
+
+    for (i = 0; i < (long) count; i++) {
+        const unsigned char *h = buf + shoff + i * entsize;
+        struct elf_section *s = &f->sections[i];
+
+        s->type = elf_get(h + 4, 4);
+        s->flags = elf_get(h + 8, w);
+        s->addr = elf_get(h + (w == 8 ? 16 : 12), w);
+        s->offset = elf_get(h + (w == 8 ? 24 : 16), w);
+        s->size = elf_get(h + (w == 8 ? 32 : 20), w);
+        s->entsize = elf_get(h + (w == 8 ? 56 : 36), w);
+        s->name_offset = elf_get(h, 4);
+
+        /* Only sections without data may lie outside the file */
+        if (s->type != ELF_SHT_NOBITS &&
+            (s->offset > (uint64_t) size || s->size > (uint64_t) size - s->offset)) {
+            s->type = ELF_SHT_NOBITS;
+            s->flags = 0;
+        }
+    }
+
+    /* Names that do not end within the file are empty */
+    names = &f->sections[strndx];
+    for (i = 0; i < (long) count; i++) {
+        const uint32_t name = f->sections[i].name_offset;
+
+        f->sections[i].name = "";
+        if (names->type != ELF_SHT_NOBITS && name < names->size &&
+            memchr(buf + names->offset + name, '\0', names->size - name) != NULL)
+            f->sections[i].name = (const char *) buf + names->offset + name;
+    }
+
+    f->buf = buf;
+    f->size = size;
+    f->w = w;
+    f->machine = elf_get(buf + ELF_E_MACHINE, 2);
+    f->count = count;
+    return 0;
+}
+
+/* Whether section |s| takes part in the address space mapping */
+static int elf_mapped(const struct elf_section *s)
+{
+    return (s->flags & ELF_SHF_ALLOC) && !(s->flags & ELF_SHF_TLS) && s->size > 0;
+}
+
+static int elf_section_by_addr(const void *a, const void *b)
+{
+    const struct elf_section *x = *(const struct elf_section *const *) a;
+    const struct elf_section *y = *(const struct elf_section *const *) b;
+
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Map the sections of |new| to those of |old| with the same name, keeping
+ * those that are in the same order in both. */
+static long elf_map_sections(struct ddelta_alloc *alloc, const struct elf_file *old,
+                             const struct elf_file *new,
+                             struct ddelta_reloc_section **sections)
+{
+    const struct elf_section **sorted;
+    struct ddelta_reloc_section *map;
+    struct ddelta_reloc check;
+    long i, j, n = 0, count = 0;
+
+    sorted = ddelta_malloc(alloc, new->count * sizeof(*sorted));
+    map = ddelta_malloc(alloc, new->count * sizeof(*map));
+    if (sorted == NULL || map == NULL) {
+        ddelta_free(alloc, sorted);
+        ddelta_free(alloc, map);
+        return -DDELTA_EALGO;
+    }
+
+    for (i = 0; i < new->count; i++)
+        if (elf_mapped(&new->sections[i]))
+            sorted[count++] = &new->sections[i];
+    qsort(sorted, count, sizeof(*sorted), elf_section_by_addr);
+
+    memset(&check, 0, sizeof(check));
+    check.word_size = new->w;
+    check.sections = map;
+    for (i = 0; i < count; i++) {
+        const struct elf_section *s = sorted[i];
+
+        if (*s->name == '\0')
+            continue;
+        for (j = 0; j < old->count; j++) {
+            const struct elf_section *o = &old->sections[j];
+
+            if (elf_mapped(o) && strcmp(o->name, s->name) == 0)
+                break;
+        }
+        if (j == old->count)
+            continue;
+
+        map[n].old_addr = old->sections[j].addr;
+        map[n].new_addr = s->addr;
+        map[n].size = MIN(old->sections[j].size, s->size);
+        if (!ddelta_reloc_section_valid(&check, n))
+            continue;
+
+        /* Sections that moved by the same distance share one entry, along
+         * with the gap between them */
+        if (n > 0 && map[n - 1].old_addr - map[n - 1].new_addr == map[n].old_addr - map[n].new_addr) {
+            map[n - 1].size = map[n].new_addr + map[n].size - map[n - 1].new_addr;
+            continue;
+        }
+        n++;
+    }
+
+    ddelta_free(alloc, sorted);
+    *sections = map;
+    return n;
+}
+
+/* Relocation types whose place holds an address */
+static int elf_pointer_reloc(int machine, uint64_t type)
+{
+    switch (machine) {
+    case ELF_EM_386:
+    case ELF_EM_X86_64:
+        /* R_*_JUMP_SLOT and R_*_RELATIVE */
+        return type == 7 || type == 8;
+    case ELF_EM_ARM:
+        return type == 22 || type == 23;
+    case ELF_EM_AARCH64:
+        return type == 1026 || type == 1027;
+    }
+    return 0;
+}
+
+static int region_by_offset(const void *a, const void *b)
+{
+    const struct ddelta_reloc_region *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/* Add the region of |count| elements of |stride| bytes at |offset|. */
+static void elf_add_region(struct ddelta_reloc_region *regions, long *n,
+                           uint64_t offset, uint64_t count, unsigned int stride,
+                           unsigned int mask)
+{
+    if (count == 0 || count > UINT32_MAX)
+        return;
+
+    regions[*n].offset = offset;
+    regions[*n].count = count;
+    regions[*n].stride = stride;
+    regions[*n].mask = mask;
+    ++*n;
+}
+
+/* Find the pointers of |f|: the places of its relocations that hold an
+ * address, the offsets and addends of the relocations, and the values of
+ * its symbols. */
+static long elf_regions(struct ddelta_alloc *alloc, const struct elf_file *f,
+                        struct ddelta_reloc_region **regions)
+{
+    struct ddelta_reloc_region *r;
+    uint64_t capacity = 0;
+    long i, j, n = 0, count;
+
+    for (i = 0; i < f->count; i++) {
+        const struct elf_section *s = &f->sections[i];
+
+        if ((s->type == ELF_SHT_REL || s->type == ELF_SHT_RELA) && s->entsize > 0)
+            capacity += 1 + s->size / s->entsize;
+        else if (s->type == ELF_SHT_SYMTAB || s->type == ELF_SHT_DYNSYM)
+            capacity++;
+    }
+    if (capacity == 0)
+        return 0;
+    if ((r = ddelta_malloc(alloc, capacity * sizeof(*r))) == NULL)
+        return -DDELTA_EALGO;
+
+    for (i = 0; i < f->count; i++) {
+        const struct elf_section *s = &f->sections[i];
+        const int rela = s->type == ELF_SHT_RELA;
+        const uint64_t entsize = f->w * (rela ? 3 : 2);
+
+        if (s->type == ELF_SHT_SYMTAB || s->type == ELF_SHT_DYNSYM) {
+            /* st_value is the second word of Elf32_Sym, and the middle
+             * one of Elf64_Sym */
+            const uint64_t symsize = f->w == 8 ? 24 : 16;
+
+            if (s->entsize == symsize && s->offset % f->w == 0)
+                elf_add_region(r, &n, s->offset, s->size / symsize, symsize, 2);
+            continue;
+        }
+        if ((s->type != ELF_SHT_REL && s->type != ELF_SHT_RELA) ||
+            s->entsize != entsize || s->offset % f->w != 0)
+            continue;
+
+        elf_add_region(r, &n, s->offset, s->size / entsize, entsize, rela ? 5 : 1);
+        for (j = 0; j < (long) (s->size / entsize); j++) {
+            const unsigned char *e = f->buf + s->offset + j * entsize;
+            const uint64_t addr = elf_get(e, f->w);
+            const uint64_t info = elf_get(e + f->w, f->w);
+            long k;
+
+            if (!elf_pointer_reloc(f->machine, f->w == 8 ? info & 0xFFFFFFFF : info & 0xFF))
+                continue;
+
+            for (k = 0; k < f->count; k++) {
+                const struct elf_section *t = &f->sections[k];
+                uint64_t offset;
+
+                if (!(t->flags & ELF_SHF_ALLOC) || t->type == ELF_SHT_NOBITS ||
+                    addr < t->addr || addr - t->addr >= t->size ||
+                    t->size - (addr - t->addr) < (uint64_t) f->w)
+                    continue;
+
+                offset = t->offset + (addr - t->addr);
+                if (offset % f->w == 0)
+                    elf_add_region(r, &n, offset, 1, f->w, 1);
+                break;
+            }
+        }
+    }
+
+    /* Join the places into runs of pointers, and drop those in a table */
+    qsort(r, n, sizeof(*r), region_by_offset);
+    for (count = n, n = 0, i = 0; i < count; i++) {
+        if (n > 0) {
+            struct ddelta_reloc_region *prev = &r[n - 1];
+            const uint64_t end = prev->offset + (uint64_t) prev->count * prev->stride;
+
+            if (r[i].offset < end)
+                continue;
+            if (r[i].offset == end && r[i].stride == f->w && prev->stride == f->w &&
+                r[i].mask == prev->mask &&
+                (uint64_t) prev->count + r[i].count <= UINT32_MAX) {
+                prev->count += r[i].count;
+                continue;
+            }
+        }
+        r[n++] = r[i];
+    }
+
+    *regions = r;
+    return n;
+}
+
+/* How many times the pointers DDELTA_FLAG_RELOC moves must outweigh its
+ * layout in bytes */
+#define ELF_RELOC_GAIN 16
+
+/*
+ * Plan DDELTA_FLAG_RELOC for the old and new file, if both are ELF
+ * executables or shared objects of the same class: the sections they share
+ * and the pointers of the new file. Returns 1 if there is nothing to map.
+ */
+static int elf_reloc(struct ddelta_alloc *alloc, const unsigned char *old,
+                     off_t oldsize, const unsigned char *new, off_t newsize,
+                     struct ddelta_reloc *reloc)
+{
+    struct ddelta_reloc_section *sections = NULL;
+    struct ddelta_reloc_region *regions = NULL;
+    struct elf_file of, nf;
+    long nsections = 0, nregions = 0;
+    int result;
+
+    memset(reloc, 0, sizeof(*reloc));
+    if ((result = elf_open(alloc, new, newsize, &nf)) != 0)
+        return result;
+    if ((result = elf_open(alloc, old, oldsize, &of)) != 0 || of.w != nf.w) {
+        result = result < 0 ? result : 1;
+        goto out;
+    }
+
+    if ((nsections = elf_map_sections(alloc, &of, &nf, &sections)) < 0 ||
+        (nregions = elf_regions(alloc, &nf, &regions)) < 0) {
+        result = -DDELTA_EALGO;
+        goto out;
+    }
+
+    result = 1;
+    if (nsections == 0 || nregions == 0 || nregions > DDELTA_RELOC_MAX_REGIONS)
+        goto out;
+
+    reloc->word_size = nf.w;
+    reloc->sections = sections;
+    reloc->nsections = nsections;
+    reloc->regions = regions;
+    reloc->nregions = nregions;
+    sections = NULL;
+    regions = NULL;
+    result = 0;
+
+out:
+    ddelta_free(alloc, sections);
+    ddelta_free(alloc, regions);
+    ddelta_free(alloc, of.sections);
+    ddelta_free(alloc, nf.sections);
+    return result;
+}
+
+/* gzip header flags */
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+
+/* Size of the header of the gzip file in |buf|, or -1 if it is none. */
+static off_t gzip_header_size(const unsigned char *buf, off_t size)
+{
+    off_t off = 10;
+
+    if (size < 18 || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != Z_DEFLATED ||
+        (buf[3] & 0xE0) != 0)
+        return -1;
+
+    if (buf[3] & GZIP_FEXTRA)
+        off += 2 + (buf[off] | buf[off + 1] << 8);
+    if (buf[3] & GZIP_FNAME)
+        while (off < size && buf[off++] != '\0')
+            ;
+    if (buf[3] & GZIP_FCOMMENT)
+        while (off < size && buf[off++] != '\0')
+            ;
+    if (buf[3] & GZIP_FHCRC)
+        off += 2;
+
+    return off + 8 <= size ? off : -1;
+}
+
+static uint32_t gzip_le32(const unsigned char *buf)
+{
+    return (uint32_t) buf[0] | (uint32_t) buf[1] << 8 |
+           (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24;
+}
+
+/* Uncompressed size of the first block of the raw deflate stream
+ * |deflated|, or -1 if it is the last one. */
+static off_t deflate_first_block(struct ddelta_alloc *alloc,
+                                 const unsigned char *deflated, off_t deflated_size)
+{
+    unsigned char buf[DDELTA_DIFF_BLOCK];
+    z_stream zs;
+    off_t size = -1;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = alloc;
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return -1;
+
+    zs.next_in = (unsigned char *) deflated;
+    zs.avail_in = deflated_size;
+    do {
+        zs.next_out = buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_BLOCK);
+    } while (ret == Z_OK && !(zs.data_type & 128));
+
+    /* Stopped after the end of a block, which was not marked last */
+    if (ret == Z_OK && !(zs.data_type & 64))
+        size = zs.total_out;
+
+    inflateEnd(&zs);
+    return size;
+}
+
+/* Smallest window, in bits from 9 to 15, that the raw deflate stream
+ * |deflated| inflates with. Its back references reach no further. */
+static int deflate_min_window(struct ddelta_alloc *alloc,
+                              const unsigned char *deflated, off_t deflated_size)
+{
+    unsigned char buf[DDELTA_DIFF_BLOCK];
+    int window_bits;
+
+    for (window_bits = 9; window_bits < 15; window_bits++) {
+        z_stream zs;
+        int ret;
+
+        memset(&zs, 0, sizeof(zs));
+        zs.zalloc = ddelta_zalloc;
+        zs.zfree = ddelta_zfree;
+        zs.opaque = alloc;
+        if (inflateInit2(&zs, -window_bits) != Z_OK)
+            break;
+
+        zs.next_in = (unsigned char *) deflated;
+        zs.avail_in = deflated_size;
+        do {
+            zs.next_out = buf;
+            zs.avail_out = sizeof(buf);
+            ret = inflate(&zs, Z_NO_FLUSH);
+        } while (ret == Z_OK);
+
+        inflateEnd(&zs);
+        if (ret == Z_STREAM_END)
+            break;
+    }
+
+    return window_bits;
+}
+
+/* Bytes zlib looks ahead of the position it compresses, MIN_LOOKAHEAD */
+#define DEFLATE_LOOKAHEAD (258 + 3 + 1)
+
+/*
+ * Whether deflating |content| with the given parameters gives exactly
+ * |deflated|, which has a first block of |first_block| bytes of content if
+ * not negative. Returns 1 if it does, 0 if not, or a negative error.
+ *
+ * Compression stops at the first difference. zlib writes a block once it
+ * has collected as many symbols as the memory level allows, so the content
+ * is first only passed up to the end of the first block and what zlib
+ * looks ahead of it: parameters giving another first block are told apart
+ * without compressing everything.
+ */
+static int deflate_same(struct ddelta_alloc *alloc,
+                        const unsigned char *deflated, off_t deflated_size,
+                        const unsigned char *content, off_t content_size,
+                        off_t first_block, int level, int window_bits,
+                        int mem_level, int strategy)
+{
+    unsigned char buf[DDELTA_DIFF_BLOCK];
+    z_stream zs;
+    off_t off = 0;
+    int ret, same, flush = Z_FINISH;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = alloc;
+    if (deflateInit2(&zs, level, Z_DEFLATED, -window_bits, mem_level,
+                     strategy) != Z_OK)
+        return -DDELTA_EALGO;
+
+    zs.next_in = (unsigned char *) content;
+    zs.avail_in = content_size;
+    if (first_block >= 0 && first_block + DEFLATE_LOOKAHEAD < content_size) {
+        zs.avail_in = first_block + DEFLATE_LOOKAHEAD;
+        flush = Z_NO_FLUSH;
+    }
+
+    for (;;) {
+        size_t n;
+
+        zs.next_out = buf;
+        zs.avail_out = sizeof(buf);
+        ret = deflate(&zs, flush);
+        n = sizeof(buf) - zs.avail_out;
+
+        same = off + (off_t) n <= deflated_size &&
+               memcmp(buf, deflated + off, n) == 0;
+        off += n;
+        if (!same || ret == Z_STREAM_END || ret == Z_STREAM_ERROR)
+            break;
+
+        if (flush == Z_NO_FLUSH && zs.avail_in == 0 && zs.avail_out > 0) {
+            /* The first block would have been written by now */
+            if (off == 0) {
+                same = 0;
+                break;
+            }
+            zs.avail_in = content_size - (zs.next_in - content);
+            flush = Z_FINISH;
+        }
+    }
+
+    deflateEnd(&zs);
+    return same && ret == Z_STREAM_END && off == deflated_size;
+}
+
+/* Fill |params| with the given parameters if they compress |content| into
+ * exactly |deflated|. Returns 0 if they do, 1 if not, or a negative error. */
+static int deflate_try(struct ddelta_alloc *alloc,
+                       const unsigned char *deflated, off_t deflated_size,
+                       const unsigned char *content, off_t content_size,
+                       off_t first_block, int level, int window_bits,
+                       int mem_level, int strategy,
+                       struct ddelta_deflate_params *params)
+{
+    const int result = deflate_same(alloc, deflated, deflated_size, content,
+                                    content_size, first_block, level,
+                                    window_bits, mem_level, strategy);
+
+    if (result <= 0)
+        return result < 0 ? result : 1;
+
+    params->level = level;
+    params->mem_level = mem_level;
+    params->strategy = strategy;
+    params->window_bits = window_bits != 15 ? window_bits : 0;
+    return 0;
+}
+
+/*
+ * Find zlib parameters that compress |content| into exactly |deflated|.
+ * Returns 1 if there are none, e.g. because another compressor was used.
+ *
+ * The levels of gzip come first, then every memory level and strategy
+ * for each window from the smallest the back references of |deflated| fit
+ * in, up to one holding all of |content|, as larger ones give the same
+ * output. Huffman-only and RLE ignore the level, like Z_FILTERED does
+ * below level 4, and Z_FIXED only writes fixed or stored blocks. Level 0
+ * is left out, as its stored blocks depend on how the input is passed to
+ * zlib.
+ */
+static int gzip_params(struct ddelta_alloc *alloc,
+                       const unsigned char *deflated, off_t deflated_size,
+                       const unsigned char *content, off_t content_size,
+                       struct ddelta_deflate_params *params)
+{
+    static const int levels[] = {6, 9, 1, 2, 3, 4, 5, 7, 8};
+    static const int mem_levels[] = {8, 9, 1, 2, 3, 4, 5, 6, 7};
+    int strategies[] = {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_FIXED,
+                        Z_HUFFMAN_ONLY, Z_RLE};
+    const off_t first_block = deflate_first_block(alloc, deflated, deflated_size);
+    /* Block type of the first block, 1 for fixed and 2 for dynamic codes */
+    const int first_type = deflated_size > 0 ? (deflated[0] >> 1) & 3 : 0;
+    int window_bits, result;
+    size_t l, m, s;
+
+    for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        if ((result = deflate_try(alloc, deflated, deflated_size, content,
+                                  content_size, first_block, levels[l], 15, 8,
+                                  Z_DEFAULT_STRATEGY, params)) != 1)
+            return result;
+
+    if (first_type == 1) {
+        strategies[0] = Z_FIXED;
+        strategies[2] = Z_DEFAULT_STRATEGY;
+    }
+
+    for (window_bits = deflate_min_window(alloc, deflated, deflated_size);;
+         window_bits++) {
+        for (m = 0; m < sizeof(mem_levels) / sizeof(mem_levels[0]); m++) {
+            for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+                const int strategy = strategies[s];
+
+                if (strategy == Z_FIXED && first_type == 2)
+                    continue;
+
+                for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+                    if ((strategy == Z_HUFFMAN_ONLY || strategy == Z_RLE) &&
+                        l > 0)
+                        break;
+                    if (strategy == Z_FILTERED && levels[l] < 4)
+                        continue;
+
+                    if ((result = deflate_try(alloc, deflated, deflated_size,
+                                              content, content_size,
+                                              first_block, levels[l],
+                                              window_bits, mem_levels[m],
+                                              strategy, params)) != 1)
+                        return result;
+                }
+            }
+        }
+
+        if (window_bits == 15 ||
+            content_size <= (1 << window_bits) - DEFLATE_LOOKAHEAD)
+            return 1;
+    }
+}
+
+/* If |*buf| is a gzip file with a single member, replace it with its
+ * content. If |params| is not NULL, this is only done if the content can
+ * be compressed into the same file again, and |params| and |*file| receive
+ * how and the original file. Returns 1 if |*buf| is left as it is. */
+static int gzip_unpack(struct ddelta_alloc *alloc, unsigned char **buf,
+                       off_t *size, unsigned char **file, off_t *file_size,
+                       struct ddelta_deflate_params *params)
+{
+    unsigned char *content = NULL;
+    const unsigned char *trailer;
+    off_t header_size, capacity = 0, content_size = 0;
+    z_stream zs;
+    int ret, result = 1;
+
+    if ((header_size = gzip_header_size(*buf, *size)) < 0)
+        return 1;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = alloc;
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return -DDELTA_EALGO;
+
+    zs.next_in = *buf + header_size;
+    zs.avail_in = *size - header_size;
+
+    do {
+        if (content_size == capacity) {
+            unsigned char *tmp;
+
+            /* Too large to diff */
+            if (capacity == INT32_MAX)
+                goto out;
+
+            capacity = MIN(MAX(4 * *size, 2 * capacity), INT32_MAX);
+            if ((tmp = ddelta_realloc(alloc, content, capacity)) == NULL) {
+                result = -DDELTA_EALGO;
+                goto out;
+            }
+            content = tmp;
+        }
+
+        zs.next_out = content + content_size;
+        zs.avail_out = capacity - content_size;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        content_size = capacity - zs.avail_out;
+    } while (ret == Z_OK);
+
+    if (ret != Z_STREAM_END || header_size + (off_t) zs.total_in + 8 != *size)
+        goto out;
+
+    trailer = *buf + header_size + zs.total_in;
+    if (gzip_le32(trailer) != crc32(0, content, content_size) ||
+        gzip_le32(trailer + 4) != (uint32_t) content_size)
+        goto out;
+
+    if (params != NULL) {
+        memset(params, 0, sizeof(*params));
+        if ((result = gzip_params(alloc, *buf + header_size, zs.total_in, content,
+                                  content_size, params)) != 0)
+            goto out;
+
+        params->content_size = content_size;
+        params->file_crc = crc32(0, *buf, *size);
+        params->header_size = header_size;
+        *file = *buf;
+        *file_size = *size;
+    } else {
+        ddelta_free(alloc, *buf);
+    }
+
+    *buf = content;
+    *size = content_size;
+    content = NULL;
+    result = 0;
+
+out:
+    inflateEnd(&zs);
+    ddelta_free(alloc, content);
+    return result;
+}
+
+/* zip archive record signatures */
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_RECORD 0x06054b50
+
+/* A deflated member found in the central directory of a zip archive */
+struct zip_entry {
+    off_t offset;
+    off_t size;
+    off_t content_size;
+    uint32_t crc;
+};
+
+static uint16_t zip_le16(const unsigned char *buf)
+{
+    return (uint16_t) (buf[0] | buf[1] << 8);
+}
+
+static int zip_entry_by_offset(const void *a, const void *b)
+{
+    const struct zip_entry *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Find the deflated members of the zip archive in |buf| through its
+ * central directory, sorted by offset and without those that overlap an
+ * earlier one. Encrypted members, and archives that need the zip64
+ * extensions, are left out. Returns the number of members, which may be
+ * 0, and sets |*entries| to them.
+ */
+static long zip_entries(struct ddelta_alloc *alloc, const unsigned char *buf,
+                        off_t size, struct zip_entry **entries)
+{
+    const unsigned char *end = NULL, *p;
+    struct zip_entry *e;
+    off_t off, cd_offset, cd_size;
+    long i, n = 0, count;
+
+    *entries = NULL;
+    if (size < 22)
+        return 0;
+
+    /* The end record is followed by a comment of up to 64 KiB */
+    for (off = size - 22; off >= 0 && off >= size - 22 - 0xFFFF; off--) {
+        if (gzip_le32(buf + off) == ZIP_END_RECORD &&
+            off + 22 + zip_le16(buf + off + 20) == size) {
+            end = buf + off;
+            break;
+        }
+    }
+    if (end == NULL || zip_le16(end + 4) != 0 || zip_le16(end + 6) != 0 ||
+        zip_le16(end + 8) != zip_le16(end + 10) || zip_le16(end + 10) == 0xFFFF)
+        return 0;
+
+    count = zip_le16(end + 10);
+    cd_size = gzip_le32(end + 12);
+    cd_offset = gzip_le32(end + 16);
+    if (cd_offset == 0xFFFFFFFF || cd_size > end - buf - cd_offset)
+        return 0;
+
+    if (count == 0 ||
+        (e = ddelta_malloc(alloc, count * sizeof(*e))) == NULL)
+        return count == 0 ? 0 : -DDELTA_EALGO;
+
+    for (p = buf + cd_offset, i = 0; i < count; i++) {
+        const unsigned char *local;
+        off_t header;
+
+        if (p + 46 > buf + cd_offset + cd_size || gzip_le32(p) != ZIP_CENTRAL_HEADER)
+            break;
+
+        header = gzip_le32(p + 42);
+        local = buf + header;
+        e[n].size = gzip_le32(p + 20);
+        e[n].content_size = gzip_le32(p + 24);
+        e[n].crc = gzip_le32(p + 16);
+
+        if (zip_le16(p + 10) == Z_DEFLATED && !(zip_le16(p + 8) & 1) &&
+            e[n].size != 0xFFFFFFFF && e[n].content_size != 0xFFFFFFFF &&
+            header + 30 <= end - buf && gzip_le32(local) == ZIP_LOCAL_HEADER) {
+            e[n].offset = header + 30 + zip_le16(local + 26) + zip_le16(local + 28);
+            if (e[n].offset + e[n].size <= end - buf)
+                n++;
+        }
+
+        p += 46 + zip_le16(p + 28) + zip_le16(p + 30) + zip_le16(p + 32);
+    }
+
+    qsort(e, n, sizeof(*e), zip_entry_by_offset);
+    for (count = n, n = 0, i = 0; i < count; i++)
+        if (n == 0 || e[i].offset >= e[n - 1].offset + e[n - 1].size)
+            e[n++] = e[i];
+
+    *entries = e;
+    return n;
+}
+
+/* Inflate the member |e| of |buf| into |out|, which has room for one byte
+ * more than its content. Returns 0 if it is intact, or 1 if not. */
+static int zip_inflate(struct ddelta_alloc *alloc, const unsigned char *buf,
+                       const struct zip_entry *e, unsigned char *out)
+{
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = ddelta_zalloc;
+    zs.zfree = ddelta_zfree;
+    zs.opaque = alloc;
+    if (inflateInit2(&zs, -15) != Z_OK)
+        return -DDELTA_EALGO;
+
+    zs.next_in = (unsigned char *) buf + e->offset;
+    zs.avail_in = e->size;
+    zs.next_out = out;
+    zs.avail_out = e->content_size + 1;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+
+    if (ret != Z_STREAM_END || (off_t) zs.total_in != e->size ||
+        (off_t) zs.total_out != e->content_size ||
+        crc32(0, out, e->content_size) != e->crc)
+        return 1;
+    return 0;
+}
+
+/*
+ * If |*buf| is a zip archive with deflated members, replace it with its
+ * content: the archive with those members inflated. If |reproduce|, only
+ * the members that zlib compresses exactly the same again are, with their
+ * parameters. |*members| and |*count| receive the members as described by
+ * struct ddelta_zip_member, and |*file_crc| the crc32 of the archive
+ * unless it is NULL.
+ * Returns 1 if |*buf| is left as it is.
+ */
+static int zip_unpack(struct ddelta_alloc *alloc, unsigned char **buf,
+                      off_t *size, int reproduce,
+                      struct ddelta_zip_member **members, uint32_t *count,
+                      uint32_t *file_crc)
+{
+    struct zip_entry *entries = NULL;
+    struct ddelta_zip_member *m = NULL;
+    unsigned char *content = NULL;
+    uint64_t capacity;
+    off_t pos = 0, content_size = 0;
+    long i, n;
+    int result = 1;
+
+    *members = NULL;
+    *count = 0;
+    if ((n = zip_entries(alloc, *buf, *size, &entries)) <= 0)
+        return n < 0 ? (int) n : 1;
+
+    capacity = *size;
+    for (i = 0; i < n; i++)
+        if (entries[i].content_size > entries[i].size)
+            capacity += entries[i].content_size - entries[i].size;
+    /* Too large to diff */
+    if (capacity > INT32_MAX)
+        goto out;
+
+    if ((content = ddelta_malloc(alloc, capacity + 1)) == NULL ||
+        (m = ddelta_calloc(alloc, n * sizeof(*m))) == NULL) {
+        result = -DDELTA_EALGO;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        const struct zip_entry *e = &entries[i];
+        struct ddelta_deflate_params params;
+        int kept;
+
+        memcpy(content + content_size, *buf + pos, e->offset - pos);
+        content_size += e->offset - pos;
+        pos = e->offset;
+
+        if ((kept = zip_inflate(alloc, *buf, e, content + content_size)) == 0 &&
+            reproduce) {
+            memset(&params, 0, sizeof(params));
+            kept = gzip_params(alloc, *buf + e->offset, e->size,
+                               content + content_size, e->content_size, &params);
+        }
+        if (kept < 0) {
+            result = kept;
+            goto out;
+        }
+        if (kept > 0)
+            continue;
+
+        m[*count].offset = reproduce ? content_size : e->offset;
+        m[*count].size = e->size;
+        m[*count].content_size = e->content_size;
+        if (reproduce) {
+            m[*count].level = params.level;
+            m[*count].mem_level = params.mem_level;
+            m[*count].strategy = params.strategy;
+            m[*count].window_bits = params.window_bits;
+        }
+        ++*count;
+        content_size += e->content_size;
+        pos += e->size;
+    }
+
+    if (*count == 0)
+        goto out;
+
+    memcpy(content + content_size, *buf + pos, *size - pos);
+    content_size += *size - pos;
+
+    if (file_crc != NULL)
+        *file_crc = crc32(0, *buf, *size);
+    ddelta_free(alloc, *buf);
+    *buf = content;
+    *size = content_size;
+    *members = m;
+    content = NULL;
+    m = NULL;
+    result = 0;
+
+out:
+    if (result != 0)
+        *count = 0;
+    ddelta_free(alloc, m);
+    ddelta_free(alloc, content);
+    ddelta_free(alloc, entries);
+    return result;
+}
+
+static int lcm(int a, int b)
+{
+    int x = a, y = b;
+
+    while (y != 0) {
+        int t = x % y;
+        x = y;
+        y = t;
+    }
+
+    return a / x * b;
+}
+
+/* Account an entry about to be written in |stats|. */
+static void account_entry(struct ddelta_generate_stats *stats,
+                          const struct ddelta_cost_profile *profile,
+                          const struct ddelta_entry_header *entry)
+{
+    if (entry->seek.value == DDELTA_FLUSH) {
+        stats->flushes++;
+        return;
+    }
+
+    stats->entries++;
+    stats->diff_bytes += entry->diff;
+    stats->extra_bytes += entry->extra;
+    if (entry->seek.value != 0)
+        stats->seeks++;
+    if (entry->seek.value < 0)
+        stats->backward_seeks++;
+
+    if (profile != NULL) {
+        stats->apply_cost += ddelta_read_cost(profile, entry->diff);
+        stats->apply_cost += ddelta_seek_cost(profile, entry->seek.value);
+    }
+}
+
+/* An entry of a patch, as saved in the cache */
+struct cache_entry {
+    int64_t newpos, oldpos;
+    int64_t diff, extra, seek;
+};
+
+/* State of generating a patch */
+struct generate_state {
+    struct patch_file *pf;
+    struct ddelta_generate_stats *stats;
+    const struct ddelta_cost_profile *profile;
+    int word_size;
+    int erase_size;
+    unsigned char *old, *new;
+    off_t oldsize, newsize;
+    /* End of the erase blocks the in-place applier is rewriting, as an
+     * offset in the old file, or 0. Matches should not read old data past
+     * it. */
+    off_t erase_limit;
+    /* Scan position, and position of the last entry in new and old */
+    off_t scan, pos;
+    off_t lastscan, lastpos, lastoffset;
+    /* CRCs of the old and new data since the last flush */
+    uint32_t oldcrc, newcrc;
+    /* Entries written so far, if they are to be saved in the cache */
+    int record;
+    struct cache_entry *entries;
+    size_t nentries, entries_alloc;
+    struct ddelta_progress_state progress;
+    struct ddelta_duty_cycle duty;
+    /* Trace of the entries, and when generating started */
+    FILE *trace;
+    uint64_t start_ns;
+    struct ddelta_alloc *alloc;
+};
+
+/* Suffix array |I| of the |size| bytes of old data at offset |start| */
+struct old_index {
+    saidx_t *I;
+    off_t start;
+    off_t size;
+};
+
+/* Write an entry for |diff| bytes of new data at |newpos| against old data
+ * at |oldpos|, followed by |extra| bytes of new data and a seek. */
+static int write_entry(struct generate_state *g, off_t newpos, off_t oldpos,
+                       off_t diff, off_t extra, off_t seek)
+{
+    struct ddelta_entry_header header;
+    struct ddelta_timer timer;
+    uint64_t nonzero = 0;
+    int result;
+
+    if (diff < 0 || extra < 0)
+        return -DDELTA_EALGO;
+
+    header.diff = (uint32_t) diff;
+    header.extra = (uint32_t) extra;
+    header.seek.value = (int32_t) seek;
+
+    if (header.diff != diff ||
+        header.extra != extra ||
+        header.seek.value == DDELTA_FLUSH ||
+        header.seek.value != seek)
+        return -DDELTA_EALGO;
+
+    if (g->record) {
+        struct cache_entry *e;
+
+        if (g->nentries == g->entries_alloc) {
+            size_t alloc = g->entries_alloc ? 2 * g->entries_alloc : 1024;
+
+            if ((e = ddelta_realloc(g->alloc, g->entries, alloc * sizeof(*e))) == NULL)
+                return -DDELTA_EALGO;
+            g->entries = e;
+            g->entries_alloc = alloc;
+        }
+
+        e = &g->entries[g->nentries++];
+        e->newpos = newpos;
+        e->oldpos = oldpos;
+        e->diff = diff;
+        e->extra = extra;
+        e->seek = seek;
+    }
+
+    account_entry(g->stats, g->profile, &header);
+    DDELTA_PROBE5(entry, newpos, oldpos, diff, extra, seek);
+    COUNT(diff_sizes[ddelta_bucket(diff, DDELTA_SIZE_BUCKETS)], 1);
+    COUNT(extra_sizes[ddelta_bucket(extra, DDELTA_SIZE_BUCKETS)], 1);
+    ddelta_timer_start(&timer);
+
+    if ((result = ddelta_entry_header_write(&header, g->pf)) == 0 &&
+        (result = write_diff(g->pf, g->old + oldpos, g->new + newpos,
+                             newpos, diff, g->word_size,
+                             g->trace != NULL ? &nonzero : NULL)) == 0)
+        result = patch_write(g->pf, g->new + newpos + diff, extra);
+
+    if (g->trace != NULL && result == 0) {
+        const struct ddelta_trace_row row = {
+            (uint64_t) newpos, (uint64_t) oldpos,
+            (uint32_t) diff, (uint32_t) extra, (int32_t) seek,
+            nonzero, ddelta_time_ns() - g->start_ns};
+
+        ddelta_trace_row(g->trace, &row);
+    }
+
+    g->oldcrc = crc32(g->oldcrc, g->old + oldpos, diff);
+    g->newcrc = crc32(g->newcrc, g->new + newpos, diff + extra);
+
+    ddelta_timer_stop(&timer, &g->stats->write_time);
+    return result;
+}
+
+/* Write a flush entry with the CRCs of the data since the last one. */
+static int write_flush(struct generate_state *g)
+{
+    struct ddelta_entry_header header;
+    struct ddelta_timer timer;
+    int result;
+
+    header.oldcrc = g->oldcrc;
+    header.newcrc = g->newcrc;
+    header.seek.value = DDELTA_FLUSH;
+    account_entry(g->stats, g->profile, &header);
+    DDELTA_PROBE2(flush, g->oldcrc, g->newcrc);
+
+    g->oldcrc = 0;
+    g->newcrc = 0;
+
+    ddelta_timer_start(&timer);
+    result = ddelta_entry_header_write(&header, g->pf);
+    ddelta_timer_stop(&timer, &g->stats->write_time);
+    return result;
+}
+
+/* Scan the new file from the current position up to |scansize|, matching
+ * against the old data in |ix|, and write the entries for it. If |nextpos|
+ * is not negative, the last entry seeks there in the old file. */
+static int scan_matches(struct generate_state *g, const struct old_index *ix,
+                        off_t scansize, off_t nextpos)
+{
+    unsigned char *old = g->old, *new = g->new;
+    off_t oldsize = g->oldsize;
+    off_t scan = g->scan, pos = g->pos, idx = 0, len = 0;
+    off_t lastscan = g->lastscan, lastpos = g->lastpos;
+    off_t lastoffset = g->lastoffset;
+    off_t oldscore, scsc;
+    off_t s, Sf, lenf, Sb, lenb;
+    off_t overlap, Ss, lens;
+    off_t i;
+    int result;
+
+    while (scan < scansize) {
+        /* If we come across a large block of data that only differs
+         * by less than 8 bytes, this loop will take a long time to
+         * go past that block of data. We need to track the number of
+         * times we're stuck in the block and break out of it. */
+        int num_less_than_eight = 0;
+        off_t prev_len, prev_oldscore, prev_pos;
+        const off_t fuzz = 8;
+
+        oldscore = 0;
+        for (scsc = scan += len; scan < scansize; scan++) {
+            if (ddelta_progress_due(&g->progress, scan) &&
+                (result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SCAN,
+                                                 scan, g->newsize)) < 0)
+                return result;
+            if (ddelta_duty_cycle_due(&g->duty))
+                ddelta_duty_cycle_run(&g->duty);
+
+            prev_len = len;
+            prev_oldscore = oldscore;
+            prev_pos = pos;
+
+            if (ix->size > 0) {
+#ifdef DDELTA_COUNTERS
+                const uint64_t steps = counters != NULL ? counters->search_steps : 0;
+#endif
+
+                len = search(ix->I, old + ix->start, ix->size,
+                             new + scan, scansize - scan,
+                             0, ix->size - 1, &idx);
+                pos = ix->start + ix->I[idx];
+
+#ifdef DDELTA_COUNTERS
+                if (counters != NULL) {
+                    counters->searches++;
+                    counters->search_steps_max = MAX(counters->search_steps_max,
+                                                     counters->search_steps - steps);
+                }
+#endif
+            } else {
+                len = 0;
+                pos = ix->start;
+            }
+
+            for (; scsc < scan + len; scsc++)
+                if ((scsc + lastoffset < oldsize) &&
+                    (old[scsc + lastoffset] == new[scsc]))
+                    oldscore++;
+
+            if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
+                break;
+
+            if ((scan + lastoffset < oldsize) &&
+                (old[scan + lastoffset] == new[scan]))
+                oldscore--;
+
+            if (prev_len - fuzz <= len && len <= prev_len &&
+                prev_oldscore - fuzz <= oldscore &&
+                oldscore <= prev_oldscore &&
+                prev_pos <= pos && pos <= prev_pos + fuzz &&
+                oldscore <= len && len <= oldscore + fuzz)
+                ++num_less_than_eight;
+            else
+                num_less_than_eight = 0;
+            if (num_less_than_eight > 100) {
+                COUNT(stuck_escapes, 1);
+                break;
+            }
+        };
+
+        /* Out of the near-equal matches, take the cheapest one to apply.
+         * Like the scan, it must beat the old alignment by more than 8 bytes. */
+        if ((g->profile != NULL || g->erase_limit > 0) && scan < scansize &&
+            len > oldscore + 8) {
+            len = select_match(g->profile,
+                               g->erase_limit > 0 ? g->erase_limit - ix->start : 0,
+                               ix->I, ix->size, old + ix->start, ix->size,
+                               new + scan, scansize - scan, len,
+                               MAX(len - fuzz, oldscore + 9),
+                               scan + lastoffset - ix->start, &idx);
+            pos = ix->start + ix->I[idx];
+        }
+
+        if (scan == scansize && nextpos >= 0)
+            pos = nextpos;
+
+        if ((len != oldscore) || (scan == scansize)) {
+#ifdef DDELTA_COUNTERS
+            const uint64_t extend_start = ddelta_time_ns();
+#endif
+
+            s = 0;
+            Sf = 0;
+            lenf = 0;
+            for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
+                if (old[lastpos + i] == new[lastscan + i])
+                    s++;
+                i++;
+                if (s * 2 - i > Sf * 2 - lenf) {
+                    Sf = s;
+                    lenf = i;
+                };
+            };
+
+            lenb = 0;
+            if (scan < scansize) {
+                s = 0;
+                Sb = 0;
+                for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
+                    if (old[pos - i] == new[scan - i])
+                        s++;
+                    if (s * 2 - i > Sb * 2 - lenb) {
+                        Sb = s;
+                        lenb = i;
+                    };
+                };
+            };
+
+            if (lastscan + lenf > scan - lenb) {
+                overlap = (lastscan + lenf) - (scan - lenb);
+                s = 0;
+                Ss = 0;
+                lens = 0;
+                for (i = 0; i < overlap; i++) {
+                    if (new[lastscan + lenf - overlap + i] ==
+                        old[lastpos + lenf - overlap + i])
+                        s++;
+                    if (new[scan - lenb + i] == old[pos - lenb + i])
+                        s--;
+                    if (s > Ss) {
+                        Ss = s;
+                        lens = i + 1;
+                    };
+                };
+
+                lenf += lens - overlap;
+                lenb -= lens;
+            };
+
+            COUNT(extend_ns, ddelta_time_ns() - extend_start);
+
+            if ((result = write_entry(g, lastscan, lastpos, lenf,
+                                      (scan - lenb) - (lastscan + lenf),
+                                      (pos - lenb) - (lastpos + lenf))) < 0)
+                return result;
+
+            lastscan = scan - lenb;
+            lastpos = pos - lenb;
+            lastoffset = pos - scan;
+        };
+    };
+
+    g->scan = scan;
+    g->pos = pos;
+    g->lastscan = lastscan;
+    g->lastpos = lastpos;
+    g->lastoffset = lastoffset;
+    return 0;
+}
+
+/* scan_matches(), timed. Writing the entries is accounted separately. */
+static int scan_range(struct generate_state *g, const struct old_index *ix,
+                      off_t scansize, off_t nextpos)
+{
+    const struct ddelta_phase_time written = g->stats->write_time;
+    struct ddelta_timer timer;
+    int result;
+
+    DDELTA_PROBE2(scan__start, g->scan, scansize);
+    ddelta_timer_start(&timer);
+    result = scan_matches(g, ix, scansize, nextpos);
+    ddelta_timer_stop(&timer, &g->stats->scan_time);
+    DDELTA_PROBE3(scan__done, g->scan, scansize, result);
+
+    g->stats->scan_time.wall_ns -= g->stats->write_time.wall_ns - written.wall_ns;
+    g->stats->scan_time.cpu_ns -= g->stats->write_time.cpu_ns - written.cpu_ns;
+    return result;
+}
+
+/* Sort the suffixes of the |size| bytes at |buf| into |I|, timed. Returns
+ * non-zero on failure, like divsufsort(). */
+static int sort_suffixes(struct generate_state *g, const unsigned char *buf,
+                         saidx_t *I, off_t size)
+{
+    struct ddelta_timer timer;
+    int result;
+
+    DDELTA_PROBE1(sort__start, size);
+    ddelta_timer_start(&timer);
+    result = divsufsort(buf, I, (int32_t) size);
+    ddelta_timer_stop(&timer, &g->stats->sort_time);
+    DDELTA_PROBE2(sort__done, size, result);
+    return result;
+}
+
+/* Generate the entries for the whole file, in flush blocks of |blocksize|
+ * bytes if non-zero. After each block, the old file is updated with it, as
+ * the in-place applier does. */
+static int generate_blocks(struct generate_state *g, saidx_t *I,
+                           int blocksize)
+{
+    struct old_index ix = {I, 0, 0};
+    off_t scansize, flushed = 0;
+    int result;
+
+    if (blocksize > 0)
+        scansize = MIN(blocksize, g->newsize);
+    else
+        scansize = g->newsize;
+
+    for (;;) {
+        /*
+         * In-place, the old and new files share offsets on the device. The
+         * |flushed| bytes before this block were written already, so the
+         * old data there is the new data copied below; old data from there
+         * on is untouched. Reading within the erase blocks this block
+         * rewrites, or those rewritten before, lets the applier erase each
+         * one once, after its last read. The blocksize is a multiple of the
+         * erase size, so rounding only matters for a short last block.
+         */
+        if (blocksize > 0 && g->erase_size > 0)
+            g->erase_limit = (flushed + blocksize + g->erase_size - 1) /
+                             g->erase_size * g->erase_size;
+
+        if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SORT,
+                                             g->scan, g->newsize)) < 0)
+            return result;
+        if (sort_suffixes(g, g->old, I, g->oldsize))
+            return -DDELTA_EALGO;
+        if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SCAN,
+                                             g->scan, g->newsize)) < 0)
+            return result;
+
+        ix.size = g->oldsize;
+        if ((result = scan_range(g, &ix, scansize, -1)) < 0)
+            return result;
+        if ((result = write_flush(g)) < 0)
+            return result;
+
+        if (g->scan >= g->newsize)
+            return 0;
+
+        /* The verifier must be done with the old data we overwrite */
+        if (g->pf->verifier != NULL &&
+            (result = verifier_sync(g->pf->verifier)) < 0)
+            return result;
+
+        memcpy(g->old + scansize - blocksize, g->new + scansize - blocksize, blocksize);
+        g->oldsize = MAX(g->oldsize, scansize);
+        flushed = scansize;
+        scansize = MIN(scansize + blocksize, g->newsize);
+    }
+}
+
+/* Cache files start with this, followed by the rest of the header */
+#define DDELTA_CACHE_MAGIC "DDELTAC2"
+/* Written in host byte order, to recognize caches of other hosts */
+#define DDELTA_CACHE_BYTE_ORDER 0x01020304
+/* Size of the regions of the new file compared with the cached one */
+#define DDELTA_CACHE_REGION 4096
+
+/* A cache file consists of this header, in big-endian byte order like the
+ * patch headers, followed by
+ *
+ * 1. the crc32 of each full region of the new file, counted from the start
+ * 2. the same, counted from the end
+ * 3. the entries of the patch
+ * 4. the suffix array of the old data
+ *
+ * These are in host byte order, as loading them must be fast, so caches
+ * are only used on hosts with the same byte order and saidx_t.
+ */
+struct cache_header {
+    char magic[8];
+    /* Header flags of the patch, and the old data as diffed */
+    uint32_t flags;
+    uint32_t oldcrc;
+    /* DDELTA_CACHE_BYTE_ORDER as the host stores it, and sizeof(saidx_t) */
+    uint32_t byte_order;
+    uint32_t index_size;
+    uint64_t oldsize;
+    uint64_t newsize;
+    uint64_t nentries;
+};
+
+/* Contents of a cache file */
+struct generate_cache {
+    struct cache_header header;
+    uint32_t *hashes;
+    struct cache_entry *entries;
+};
+
+/* Store the crc32 of the full regions of |buf| in |hashes|, counted from
+ * the start and then from the end. */
+static void region_hashes(const unsigned char *buf, off_t size,
+                          uint32_t *hashes)
+{
+    const off_t n = size / DDELTA_CACHE_REGION;
+    off_t k;
+
+    for (k = 0; k < n; k++) {
+        hashes[k] = crc32(0, buf + k * DDELTA_CACHE_REGION, DDELTA_CACHE_REGION);
+        hashes[n + k] = crc32(0, buf + size - (k + 1) * DDELTA_CACHE_REGION,
+                              DDELTA_CACHE_REGION);
+    }
+}
+
+/* Check that the cached entries form a patch for a new file of |newsize|
+ * bytes, not reading past |oldsize| bytes of old data. */
+static int cache_entries_valid(const struct cache_entry *e, uint64_t n,
+                               off_t oldsize, off_t newsize)
+{
+    int64_t newpos = 0, oldpos = 0;
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        if (e[i].newpos != newpos || e[i].oldpos != oldpos ||
+            e[i].diff < 0 || e[i].extra < 0 || e[i].oldpos < 0 ||
+            (e[i].diff == 0 && e[i].extra == 0 && e[i].seek == 0) ||
+            e[i].diff > oldsize - e[i].oldpos ||
+            e[i].diff + e[i].extra > newsize - e[i].newpos)
+            return 0;
+
+        newpos += e[i].diff + e[i].extra;
+        oldpos += e[i].diff + e[i].seek;
+    }
+
+    return newpos == newsize;
+}
+
+/* Convert |h| between host and file byte order, both ways. */
+static void cache_header_swap(struct cache_header *h)
+{
+    h->flags = ddelta_htobe32(h->flags);
+    h->oldcrc = ddelta_htobe32(h->oldcrc);
+    h->index_size = ddelta_htobe32(h->index_size);
+    h->oldsize = ddelta_htobe64(h->oldsize);
+    h->newsize = ddelta_htobe64(h->newsize);
+    h->nentries = ddelta_htobe64(h->nentries);
+}
+
+/* Load the cache in |path| into |c|, and the suffix array it stores into
+ * |I|. Returns 1 if there is no cache, or it is for other old data or a
+ * patch with other flags. */
+static int cache_load(const char *path, const struct generate_state *g,
+                      uint32_t flags, saidx_t *I, struct generate_cache *c)
+{
+    FILE *f;
+    size_t nhashes;
+    off_t i;
+    int result = 1;
+
+    memset(c, 0, sizeof(*c));
+
+    if ((f = fopen(path, "rb")) == NULL)
+        return 1;
+
+    if (fread(&c->header, sizeof(c->header), 1, f) < 1)
+        goto out;
+    cache_header_swap(&c->header);
+    if (memcmp(c->header.magic, DDELTA_CACHE_MAGIC, sizeof(c->header.magic)) != 0 ||
+        c->header.byte_order != DDELTA_CACHE_BYTE_ORDER ||
+        c->header.index_size != sizeof(saidx_t) ||
+        c->header.flags != flags ||
+        c->header.oldsize != (uint64_t) g->oldsize ||
+        c->header.oldcrc != crc32(0, g->old, g->oldsize) ||
+        c->header.newsize > INT32_MAX ||
+        c->header.nentries > 2 * c->header.newsize + 2)
+        goto out;
+
+    nhashes = 2 * (c->header.newsize / DDELTA_CACHE_REGION);
+    c->hashes = ddelta_malloc(g->alloc, nhashes * sizeof(*c->hashes) + 1);
+    c->entries = ddelta_malloc(g->alloc, c->header.nentries * sizeof(*c->entries) + 1);
+    if (c->hashes == NULL || c->entries == NULL) {
+        result = -DDELTA_EALGO;
+        goto out;
+    }
+
+    if ((nhashes > 0 && fread(c->hashes, nhashes * sizeof(*c->hashes), 1, f) < 1) ||
+        (c->header.nentries > 0 &&
+         fread(c->entries, c->header.nentries * sizeof(*c->entries), 1, f) < 1) ||
+        (g->oldsize > 0 && fread(I, g->oldsize * sizeof(*I), 1, f) < 1))
+        goto out;
+
+    if (!cache_entries_valid(c->entries, c->header.nentries, g->oldsize,
+                             c->header.newsize))
+        goto out;
+    for (i = 0; i < g->oldsize; i++)
+        if (I[i] < 0 || I[i] >= g->oldsize)
+            goto out;
+
+    result = 0;
+
+out:
+    fclose(f);
+    if (result != 0) {
+        ddelta_free(g->alloc, c->hashes);
+        ddelta_free(g->alloc, c->entries);
+        memset(c, 0, sizeof(*c));
+    }
+    return result;
+}
+
+/* Save the entries written and the suffix array |I| of the old data to
+ * |path|. The cache only makes later runs faster, so errors are ignored. */
+static void cache_save(const char *path, const struct generate_state *g,
+                       uint32_t flags, const saidx_t *I,
+                       const uint32_t *hashes)
+{
+    struct cache_header header;
+    const size_t nhashes = 2 * (g->newsize / DDELTA_CACHE_REGION);
+    FILE *f;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DDELTA_CACHE_MAGIC, sizeof(header.magic));
+    header.flags = flags;
+    header.oldcrc = crc32(0, g->old, g->oldsize);
+    header.oldsize = g->oldsize;
+    header.newsize = g->newsize;
+    header.nentries = g->nentries;
+    header.byte_order = DDELTA_CACHE_BYTE_ORDER;
+    header.index_size = sizeof(saidx_t);
+    cache_header_swap(&header);
+
+    if ((f = fopen(path, "wb")) == NULL)
+        return;
+
+    if (fwrite(&header, sizeof(header), 1, f) < 1 ||
+        (nhashes > 0 && fwrite(hashes, nhashes * sizeof(*hashes), 1, f) < 1) ||
+        (g->nentries > 0 && fwrite(g->entries, g->nentries * sizeof(*g->entries), 1, f) < 1) ||
+        (g->oldsize > 0 && fwrite(I, g->oldsize * sizeof(*I), 1, f) < 1)) {
+        fclose(f);
+        remove(path);
+        return;
+    }
+
+    if (fclose(f) != 0)
+        remove(path);
+}
+
+/* Generate the entries for the whole file from the cached patch of a
+ * previous new file, whose region hashes are compared to |hashes|. The
+ * entries of the unchanged regions at the start and the end are written
+ * again, and only the part in between is scanned. Reused entries are
+ * encoded from the actual data, so hash collisions make the patch larger,
+ * but never wrong. */
+static int generate_cached(struct generate_state *g, saidx_t *I,
+                           const struct generate_cache *c,
+                           const uint32_t *hashes)
+{
+    const off_t prevsize = c->header.newsize;
+    const off_t prevregions = prevsize / DDELTA_CACHE_REGION;
+    const off_t newregions = g->newsize / DDELTA_CACHE_REGION;
+    const off_t delta = g->newsize - prevsize;
+    struct old_index ix = {I, 0, g->oldsize};
+    off_t p, s, same_start, same_end, splice, nextpos = -1;
+    uint64_t i;
+    int result;
+
+    for (p = 0; p < MIN(prevregions, newregions) &&
+                hashes[p] == c->hashes[p]; p++)
+        ;
+    for (s = 0; s < MIN(prevregions, newregions) &&
+                hashes[newregions + s] == c->hashes[prevregions + s]; s++)
+        ;
+
+    if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SCAN, 0,
+                                         g->newsize)) < 0)
+        return result;
+
+    same_start = p * DDELTA_CACHE_REGION;
+    same_end = MIN(s * DDELTA_CACHE_REGION, MIN(prevsize, g->newsize) - same_start);
+
+    /* Entries within the unchanged start */
+    for (i = 0; i < c->header.nentries; i++) {
+        const struct cache_entry *e = &c->entries[i];
+
+        if (e->newpos + e->diff + e->extra > same_start)
+            break;
+        if ((result = write_entry(g, e->newpos, e->oldpos, e->diff, e->extra,
+                                  e->seek)) < 0)
+            return result;
+
+        g->lastscan = e->newpos + e->diff + e->extra;
+        g->lastpos = e->oldpos + e->diff + e->seek;
+    }
+
+    /* Entries within the unchanged end, which the scan must lead to */
+    while (i < c->header.nentries && c->entries[i].newpos < prevsize - same_end)
+        i++;
+    if (i < c->header.nentries) {
+        splice = c->entries[i].newpos + delta;
+        nextpos = c->entries[i].oldpos;
+    } else {
+        splice = g->newsize;
+    }
+
+    g->scan = g->lastscan;
+    g->pos = g->lastpos;
+    g->lastoffset = g->lastpos - g->lastscan;
+
+    if (splice > g->scan) {
+        if ((result = scan_range(g, &ix, splice, nextpos)) < 0)
+            return result;
+    } else if (nextpos >= 0 && nextpos != g->lastpos) {
+        if ((result = write_entry(g, g->lastscan, g->lastpos, 0, 0,
+                                  nextpos - g->lastpos)) < 0)
+            return result;
+    }
+
+    for (; i < c->header.nentries; i++) {
+        const struct cache_entry *e = &c->entries[i];
+
+        if ((result = write_entry(g, e->newpos + delta, e->oldpos, e->diff,
+                                  e->extra, e->seek)) < 0)
+            return result;
+    }
+
+    return write_flush(g);
+}
+
+/* Size of tar header and data blocks */
+#define TAR_BLOCK 512
+/* Number of hashes in the content sketch of a tar member */
+#define TAR_SKETCH 8
+
+/* A member of a tar archive, including its headers */
+struct tar_member {
+    /* Offset of the first header and of the end of the padded data */
+    off_t start, end;
+    uint64_t name_hash;
+    /* The TAR_SKETCH smallest hashes of the data's 8-byte substrings */
+    uint64_t sketch[TAR_SKETCH];
+    int nsketch;
+    /* Index of the matching member of the other archive, or -1 */
+    long match;
+};
+
+static uint64_t hash_bytes(uint64_t h, const unsigned char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len && buf[i] != '\0'; i++)
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
+
+    return h;
+}
+
+/* Parse a numeric tar header field, in octal or GNU base-256 format */
+static int tar_number(const unsigned char *field, size_t len, off_t *value)
+{
+    size_t i = 0;
+
+    *value = 0;
+
+    if (field[0] & 0x80) {
+        for (i = 1; i < len; i++) {
+            if (*value > (INT32_MAX >> 8))
+                return -1;
+            *value = (*value << 8) | field[i];
+        }
+        return 0;
+    }
+
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (*value > (INT32_MAX >> 3))
+            return -1;
+        *value = (*value << 3) | (field[i] - '0');
+    }
+
+    return 0;
+}
+
+static int tar_header_valid(const unsigned char *hdr)
+{
+    off_t chksum;
+    unsigned long sum = 0;
+    int i;
+
+    if (tar_number(hdr + 148, 8, &chksum) < 0)
+        return 0;
+
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+
+    return (off_t) sum == chksum;
+}
+
+static void tar_sketch(struct tar_member *m, const unsigned char *data,
+                       off_t size)
+{
+    off_t i;
+
+    m->nsketch = 0;
+
+    for (i = 0; i + 8 <= size; i++) {
+        uint64_t h = 0;
+        int j, k;
+
+        for (j = 0; j < 8; j++)
+            h |= (uint64_t) data[i + j] << (8 * j);
+        h *= 0x9E3779B97F4A7C15ULL;
+
+        /* Insert into the sorted sketch, unless already present */
+        if (m->nsketch == TAR_SKETCH && h >= m->sketch[TAR_SKETCH - 1])
+            continue;
+        for (k = 0; k < m->nsketch && m->sketch[k] < h; k++)
+            ;
+        if (k < m->nsketch && m->sketch[k] == h)
+            continue;
+        if (m->nsketch < TAR_SKETCH)
+            m->nsketch++;
+        for (j = m->nsketch - 1; j > k; j--)
+            m->sketch[j] = m->sketch[j - 1];
+        m->sketch[k] = h;
+    }
+}
+
+/* Number of hashes two sketches have in common */
+static int tar_similarity(const struct tar_member *a,
+                          const struct tar_member *b)
+{
+    int i = 0, j = 0, n = 0;
+
+    while (i < a->nsketch && j < b->nsketch) {
+        if (a->sketch[i] < b->sketch[j]) {
+            i++;
+        } else if (a->sketch[i] > b->sketch[j]) {
+            j++;
+        } else {
+            n++;
+            i++;
+            j++;
+        }
+    }
+
+    return n;
+}
+
+/* Split the tar archive in |buf| into its members. The end-of-archive
+ * blocks are not part of any member. Returns the number of members, or -1
+ * if |buf| is not a tar archive or we are out of memory. */
+static long tar_parse(struct ddelta_alloc *a, const unsigned char *buf,
+                      off_t size, struct tar_member **members)
+{
+    struct tar_member *m = NULL;
+    long n = 0, alloc = 0;
+    off_t off = 0, start = 0;
+    uint64_t name_hash = 0;
+    int long_name = 0;
+
+    while (off + TAR_BLOCK <= size) {
+        const unsigned char *hdr = buf + off;
+        off_t datasize, end;
+
+        if (hdr[0] == '\0')
+            break;
+        if (!tar_header_valid(hdr) || tar_number(hdr + 124, 12, &datasize) < 0)
+            goto invalid;
+
+        end = off + TAR_BLOCK + (datasize + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (end > size)
+            goto invalid;
+
+        switch (hdr[156]) {
+        case 'L':
+            /* GNU long name of the next member */
+            name_hash = hash_bytes(0xcbf29ce484222325ULL, hdr + TAR_BLOCK, datasize);
+            long_name = 1;
+            /* fall through */
+        case 'K':
+        case 'x':
+        case 'g':
+            off = end;
+            continue;
+        }
+
+        if (n == alloc) {
+            struct tar_member *tmp;
+
+            alloc = alloc ? 2 * alloc : 64;
+            if ((tmp = ddelta_realloc(a, m, alloc * sizeof(*m))) == NULL)
+                goto invalid;
+            m = tmp;
+        }
+
+        if (!long_name) {
+            name_hash = hash_bytes(0xcbf29ce484222325ULL, hdr + 345, 155);
+            name_hash = hash_bytes(name_hash, hdr, 100);
+        }
+
+        m[n].start = start;
+        m[n].end = end;
+        m[n].name_hash = name_hash;
+        m[n].match = -1;
+        tar_sketch(&m[n], hdr + TAR_BLOCK, datasize);
+        n++;
+
+        long_name = 0;
+        off = start = end;
+    }
+
+    if (n == 0)
+        goto invalid;
+
+    *members = m;
+    return n;
+
+invalid:
+    ddelta_free(a, m);
+    return -1;
+}
+
+static int tar_member_by_name(const void *a, const void *b)
+{
+    const struct tar_member *const *x = a, *const *y = b;
+
+    if ((*x)->name_hash != (*y)->name_hash)
+        return (*x)->name_hash < (*y)->name_hash ? -1 : 1;
+    return (*x)->start < (*y)->start ? -1 : (*x)->start > (*y)->start;
+}
+
+/* Match each new member to an old one: by name first, and otherwise to
+ * the old member with the most similar content. */
+static int tar_match(struct ddelta_alloc *a, struct tar_member *om, long on,
+                     struct tar_member *nm, long nn)
+{
+    struct tar_member **byname;
+    long i, j;
+
+    if ((byname = ddelta_malloc(a, on * sizeof(*byname))) == NULL)
+        return -DDELTA_EALGO;
+
+    for (i = 0; i < on; i++)
+        byname[i] = &om[i];
+    qsort(byname, on, sizeof(*byname), tar_member_by_name);
+
+    for (i = 0; i < nn; i++) {
+        long lo = 0, hi = on;
+
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+
+            if (byname[mid]->name_hash < nm[i].name_hash)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        /* With duplicate names, prefer a member not matched yet */
+        for (j = lo; j < on && byname[j]->name_hash == nm[i].name_hash; j++) {
+            if (nm[i].match < 0 || byname[j]->match < 0)
+                nm[i].match = byname[j] - om;
+            if (byname[j]->match < 0)
+                break;
+        }
+        if (nm[i].match >= 0)
+            om[nm[i].match].match = i;
+    }
+
+    for (i = 0; i < nn; i++) {
+        int best = 0;
+
+        if (nm[i].match >= 0)
+            continue;
 
-    scan = 0;
-    len = 0;
-    lastscan = 0;
-    lastpos = 0;
-    lastoffset = 0;
+        for (j = 0; j < on; j++) {
+            int sim = tar_similarity(&nm[i], &om[j]);
 
-    if (blocksize > 0)
-        scansize = MIN(blocksize, newsize);
-    else
-        scansize = newsize;
+            if (sim > best) {
+                best = sim;
+                nm[i].match = j;
+            }
+        }
+    }
+
+    ddelta_free(a, byname);
+    return 0;
+}
 
-next:
-    len = 0;
-    oldcrc = 0;
-    newcrc = 0;
+/* Generate the entries for a tar archive, member by member. Each member is
+ * matched against an index of its old member, or of the whole old file if
+ * there is none. Returns 1 if the files are not both tar archives. */
+static int generate_tar(struct generate_state *g, saidx_t *I)
+{
+    struct tar_member *om = NULL, *nm = NULL;
+    struct old_index whole = {I, 0, 0};
+    struct old_index member = {NULL, 0, 0};
+    long on, nn, i;
+    off_t maxsize = 0;
+    int result = 1;
+
+    if ((on = tar_parse(g->alloc, g->old, g->oldsize, &om)) < 0)
+        goto out;
+    if ((nn = tar_parse(g->alloc, g->new, g->newsize, &nm)) < 0)
+        goto out;
+
+    if ((result = tar_match(g->alloc, om, on, nm, nn)) < 0)
+        goto out;
 
-    if (divsufsort(old, I, (int32_t) oldsize)) {
+    for (i = 0; i < on; i++)
+        maxsize = MAX(maxsize, om[i].end - om[i].start);
+    if ((member.I = ddelta_malloc(g->alloc, (maxsize + 1) * sizeof(saidx_t))) == NULL) {
         result = -DDELTA_EALGO;
         goto out;
     }
 
-    while (scan < scansize) {
-        /* If we come across a large block of data that only differs
-         * by less than 8 bytes, this loop will take a long time to
-         * go past that block of data. We need to track the number of
-         * times we're stuck in the block and break out of it. */
-        int num_less_than_eight = 0;
-        off_t prev_len, prev_oldscore, prev_pos;
+    if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SCAN, 0,
+                                         g->newsize)) < 0)
+        goto out;
 
-        oldscore = 0;
-        for (scsc = scan += len; scan < scansize; scan++) {
-            const off_t fuzz = 8;
+    /* Members, followed by the end of archive against the old one */
+    for (i = 0; i <= nn; i++) {
+        const struct old_index *ix = &member;
+        off_t end = i < nn ? nm[i].end : g->newsize;
+        off_t nextpos = -1;
+
+        if (i < nn && nm[i].match >= 0) {
+            member.start = om[nm[i].match].start;
+            member.size = om[nm[i].match].end - member.start;
+        } else if (i == nn && om[on - 1].end < g->oldsize) {
+            member.start = om[on - 1].end;
+            member.size = g->oldsize - member.start;
+        } else {
+            if (whole.size == 0 && g->oldsize > 0) {
+                if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SORT,
+                                                     g->scan, g->newsize)) < 0)
+                    goto out;
+                if (sort_suffixes(g, g->old, I, g->oldsize)) {
+                    result = -DDELTA_EALGO;
+                    goto out;
+                }
+                whole.size = g->oldsize;
+                if ((result = ddelta_progress_report(&g->progress, DDELTA_PHASE_SCAN,
+                                                     g->scan, g->newsize)) < 0)
+                    goto out;
+            }
+            ix = &whole;
+        }
 
-            prev_len = len;
-            prev_oldscore = oldscore;
-            prev_pos = pos;
+        if (ix == &member &&
+            sort_suffixes(g, g->old + member.start, member.I, member.size)) {
+            result = -DDELTA_EALGO;
+            goto out;
+        }
 
-            len = search(I, old, oldsize, new + scan, scansize - scan,
-                         0, oldsize - 1, &pos);
+        /* Let the last entry of the member seek to the next old member */
+        if (i + 1 < nn && nm[i + 1].match >= 0)
+            nextpos = om[nm[i + 1].match].start;
+        else if (i + 1 == nn && om[on - 1].end < g->oldsize)
+            nextpos = om[on - 1].end;
 
-            for (; scsc < scan + len; scsc++)
-                if ((scsc + lastoffset < oldsize) &&
-                    (old[scsc + lastoffset] == new[scsc]))
-                    oldscore++;
+        if ((result = scan_range(g, ix, end, nextpos)) < 0)
+            goto out;
+    }
 
-            if (((len == oldscore) && (len != 0)) || (len > oldscore + 8))
-                break;
+    result = write_flush(g);
 
-            if ((scan + lastoffset < oldsize) &&
-                (old[scan + lastoffset] == new[scan]))
-                oldscore--;
+out:
+    ddelta_free(g->alloc, member.I);
+    ddelta_free(g->alloc, om);
+    ddelta_free(g->alloc, nm);
+    return result;
+}
 
-            if (prev_len - fuzz <= len && len <= prev_len &&
-                prev_oldscore - fuzz <= oldscore &&
-                oldscore <= prev_oldscore &&
-                prev_pos <= pos && pos <= prev_pos + fuzz &&
-                oldscore <= len && len <= oldscore + fuzz)
-                ++num_less_than_eight;
-            else
-                num_less_than_eight = 0;
-            if (num_less_than_eight > 100)
-                break;
-        };
+int ddelta_generate(int oldfd, int newfd, int patchfd, int blocksize)
+{
+    struct ddelta_generate_options options = {0};
 
-        if ((len != oldscore) || (scan == scansize)) {
-            s = 0;
-            Sf = 0;
-            lenf = 0;
-            for (i = 0; (lastscan + i < scan) && (lastpos + i < oldsize);) {
-                if (old[lastpos + i] == new[lastscan + i])
-                    s++;
-                i++;
-                if (s * 2 - i > Sf * 2 - lenf) {
-                    Sf = s;
-                    lenf = i;
-                };
-            };
+    options.blocksize = blocksize;
+    return ddelta_generate_opts(oldfd, newfd, patchfd, &options, NULL);
+}
 
-            lenb = 0;
-            if (scan < scansize) {
-                s = 0;
-                Sb = 0;
-                for (i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
-                    if (old[pos - i] == new[scan - i])
-                        s++;
-                    if (s * 2 - i > Sb * 2 - lenb) {
-                        Sb = s;
-                        lenb = i;
-                    };
-                };
-            };
+/* Projected peak memory for files of |oldsize| and |newsize| bytes, with
+ * |gzsize| bytes of compressed new file kept besides its content. */
+static uint64_t generate_memory(uint64_t oldsize, uint64_t newsize, int tar,
+                                uint64_t gzsize, int verify, int cache)
+{
+    const uint64_t maxsize = MAX(oldsize, newsize) + 1;
+    uint64_t size = ddelta_arena_space(newsize + 1) + ddelta_arena_space(maxsize) +
+                    ddelta_arena_space(maxsize * sizeof(saidx_t));
+
+    /* The suffix array of the largest member */
+    if (tar)
+        size += maxsize * sizeof(saidx_t);
+    if (verify)
+        size += DDELTA_VERIFY_QUEUE;
+    if (cache)
+        size += 2 * (newsize / DDELTA_CACHE_REGION) * sizeof(uint32_t);
+
+    return size + gzsize;
+}
 
-            if (lastscan + lenf > scan - lenb) {
-                overlap = (lastscan + lenf) - (scan - lenb);
-                s = 0;
-                Ss = 0;
-                lens = 0;
-                for (i = 0; i < overlap; i++) {
-                    if (new[lastscan + lenf - overlap + i] ==
-                        old[lastpos + lenf - overlap + i])
-                        s++;
-                    if (new[scan - lenb + i] == old[pos - lenb + i])
-                        s--;
-                    if (s > Ss) {
-                        Ss = s;
-                        lens = i + 1;
-                    };
-                };
+uint64_t ddelta_generate_memory(uint64_t oldsize, uint64_t newsize,
+                                const struct ddelta_generate_options *options)
+{
+    if (options == NULL)
+        return generate_memory(oldsize, newsize, 0, 0, 0, 0);
 
-                lenf += lens - overlap;
-                lenb -= lens;
-            };
+    return generate_memory(oldsize, newsize, options->tar,
+                           options->gzip ? newsize : 0, options->verify,
+                           options->cache != NULL);
+}
 
-            if (lenf < 0 || (scan - lenb) - (lastscan + lenf) < 0) {
-                result = -DDELTA_EALGO;
-                goto out;
-            }
+/* Generate a patch from |oldf| to |newf|, written to |patchfd| unless |pf|
+ * has a write callback. */
+static int generate(const struct input_file *oldf, const struct input_file *newf,
+                    int patchfd, struct patch_file pf,
+                    const struct ddelta_generate_options *options,
+                    struct ddelta_generate_stats *stats)
+{
+    struct ddelta_header file_header = {
+        DDELTA_MAGIC,
+        0,
+        0,
+        0};
+    struct ddelta_entry_header header;
+    struct generate_state g;
+    struct ddelta_generate_stats dummy_stats;
+    struct ddelta_deflate_params deflate;
+    struct ddelta_zip_header zip;
+    struct ddelta_zip_member *zip_members = NULL, *old_members = NULL;
+    struct ddelta_reloc reloc;
+    unsigned char *old = NULL, *new = NULL, *newgz = NULL;
+    off_t oldsize, newsize, newgzsize = 0, newfilesize;
+    saidx_t *I = NULL;
+    struct ddelta_arena arena = {NULL, 0, 0, 0, 0, NULL, 0};
+    struct ddelta_alloc alloc;
+    off_t oldcap = 0, newcap = 0;
+    struct verifier verifier;
+    struct generate_cache cache;
+    const char *cache_path = NULL;
+    uint32_t *hashes = NULL;
+    uint32_t flags;
+    int blocksize = 0;
+    int word_size = 1;
+    int filter = DDELTA_FILTER_NONE;
+    int elf = 0;
+    int tar = 0;
+    int gzip = 0;
+    int verify = 0;
+    int align = 1;
+    uint64_t memory_limit = 0;
+    const struct ddelta_device_profile *device = NULL;
+    const uint64_t start_us = ddelta_time_us();
+    const uint64_t start_cpu = ddelta_cpu_ns(1);
+    struct ddelta_timer read_timer;
+    int result = 0;
 
-            header.diff = (uint32_t) lenf;
-            header.extra = (uint32_t)((scan - lenb) - (lastscan + lenf));
-            header.seek.value = (pos - lenb) - (lastpos + lenf);
+    memset(&g, 0, sizeof(g));
+    memset(&cache, 0, sizeof(cache));
+    memset(&zip, 0, sizeof(zip));
+    memset(&reloc, 0, sizeof(reloc));
+    g.start_ns = ddelta_time_ns();
+    g.alloc = &alloc;
+    ddelta_alloc_init(&alloc, NULL, 0);
+
+    if (options != NULL) {
+        blocksize = options->blocksize;
+        g.erase_size = options->erase_size;
+        g.profile = options->cost;
+        if (options->word_size > 1)
+            word_size = options->word_size;
+        filter = options->filter;
+        elf = options->elf;
+        tar = options->tar;
+        gzip = options->gzip;
+        verify = options->verify;
+        cache_path = options->cache;
+        ddelta_progress_init(&g.progress, options->progress,
+                             options->progress_data, options->progress_interval);
+        ddelta_duty_cycle_init(&g.duty, options->cpu_percent);
+        memory_limit = options->memory_limit;
+        device = options->device;
+        g.trace = options->trace;
+        ddelta_alloc_init(&alloc, options->allocator, options->memory_cap);
+    }
+    if ((tar || gzip || cache_path != NULL) && blocksize != 0)
+        return -DDELTA_EINVAL;
+    if (blocksize < 0 && (blocksize != DDELTA_BLOCKSIZE_AUTO ||
+                          device == NULL || device->scratch == 0))
+        return -DDELTA_EINVAL;
+    if (tar && cache_path != NULL)
+        return -DDELTA_EINVAL;
+    if (word_size != 1 && word_size != 4 && word_size != 8)
+        return -DDELTA_EINVAL;
+    if (filter < DDELTA_FILTER_NONE || filter > DDELTA_FILTER_ARMTHUMB)
+        return -DDELTA_EINVAL;
+    if (stats == NULL)
+        stats = &dummy_stats;
+    memset(stats, 0, sizeof(*stats));
+#ifdef DDELTA_COUNTERS
+    counters = &stats->counters;
+    counters->enabled = 1;
+#endif
 
-            if (header.diff != lenf ||
-                header.extra != (scan - lenb) - (lastscan + lenf) ||
-                header.seek.value == DDELTA_FLUSH ||
-                header.seek.value != (pos - lenb) - (lastpos + lenf)) {
-                result = -DDELTA_EALGO;
-                goto out;
+    /* Refuse what the device or the memory limit cannot fit before reading
+     * anything. The filter is not known yet with elf, so assume one. */
+    if (device != NULL && device->ram > 0) {
+        const uint32_t filtered = filter != DDELTA_FILTER_NONE || elf ? DDELTA_FLAG_FILTER_MASK : 0;
+
+        if (gzip && ddelta_apply_memory(filtered | DDELTA_FLAG_DEFLATE_NEW |
+                                        DDELTA_FLAG_INFLATE_OLD, 0) > device->ram)
+            gzip = 0;
+        if (ddelta_apply_memory(filtered, 0) > device->ram)
+            return -DDELTA_EBUDGET;
+    }
+    if (device != NULL && device->scratch > 0 && blocksize != 0) {
+        int step = g.erase_size > 0 ? g.erase_size : 1;
+
+        if (filter != DDELTA_FILTER_NONE || elf)
+            step = lcm(step, DDELTA_FILTER_WINDOW);
+        if (blocksize == DDELTA_BLOCKSIZE_AUTO)
+            blocksize = (int) (MIN(device->scratch, INT32_MAX) / step * step);
+        else if ((uint64_t) (blocksize + step - 1) / step * step > device->scratch)
+            blocksize = 0;
+        if (blocksize == 0)
+            return -DDELTA_EBUDGET;
+    }
+    {
+        const off_t n = input_size(newf);
+        const off_t o = input_size(oldf);
+
+        if (n >= 0 && o >= 0) {
+            stats->memory_projected = generate_memory(o, n, tar, gzip ? n : 0, verify,
+                                                      cache_path != NULL);
+            if (memory_limit > 0 && stats->memory_projected > memory_limit)
+                return -DDELTA_EBUDGET;
+        }
+    }
+
+    if ((result = ddelta_progress_report(&g.progress, DDELTA_PHASE_READ, 0, 0)) < 0)
+        return result;
+    DDELTA_PROBE0(read__start);
+    ddelta_timer_start(&read_timer);
+
+    /* Unless gzip may replace the contents, the sizes of all large buffers
+     * are known up front, so take them from one huge page backed arena,
+     * which the random accesses of search() miss the TLB much less in. */
+    if (!gzip) {
+        const off_t n = input_size(newf);
+        const off_t o = input_size(oldf);
+
+        if (n >= 0 && o >= 0 && n <= INT32_MAX && o <= INT32_MAX) {
+            newcap = n + 1;
+            oldcap = MAX(o, n) + 1;
+            if (ddelta_arena_init(&arena, ddelta_arena_space(newcap) +
+                                          ddelta_arena_space(oldcap) +
+                                          ddelta_arena_space(oldcap * sizeof(saidx_t)),
+                                  &alloc) == 0) {
+                new = ddelta_arena_alloc(&arena, newcap);
+                old = ddelta_arena_alloc(&arena, oldcap);
+                I = ddelta_arena_alloc(&arena, oldcap * sizeof(saidx_t));
             }
+        }
+    }
+
+    newsize = read_file(newf, &alloc, &new, newcap);
+    if (newsize > INT32_MAX) {
+        result = -DDELTA_ENEWIO;
+        goto out;
+    } else if (newsize < 0) {
+        result = -DDELTA_ENEWIO;
+        goto out;
+    }
+
+    oldsize = read_file(oldf, &alloc, &old, oldcap);
+    if (oldsize > INT32_MAX) {
+        result = -DDELTA_EOLDIO;
+        goto out;
+    } else if (oldsize < 0) {
+        result = -DDELTA_EOLDIO;
+        goto out;
+    }
+    stats->bytes_read = oldsize + newsize;
+    newfilesize = newsize;
 
-            if ((result = ddelta_entry_header_write(&header, pf)) < 0)
+    /* The old content only helps if we can diff the new content */
+    if (gzip) {
+        if ((result = gzip_unpack(&alloc, &new, &newsize, &newgz, &newgzsize, &deflate)) < 0)
+            goto out;
+        if (result == 0) {
+            file_header.flags |= DDELTA_FLAG_DEFLATE_NEW;
+            if ((result = gzip_unpack(&alloc, &old, &oldsize, NULL, NULL, NULL)) < 0)
                 goto out;
+            if (result == 0)
+                file_header.flags |= DDELTA_FLAG_INFLATE_OLD;
+        } else if ((result = zip_unpack(&alloc, &new, &newsize, 1, &zip_members,
+                                        &zip.new_members, &zip.file_crc)) == 0) {
+            file_header.flags |= DDELTA_FLAG_ZIP;
+            zip.content_size = newsize;
+            if ((result = zip_unpack(&alloc, &old, &oldsize, 0, &old_members,
+                                     &zip.old_members, NULL)) < 0)
+                goto out;
+        }
+        if (result < 0)
+            goto out;
+        result = 0;
+
+        /* Now that the content size is known */
+        stats->memory_projected = generate_memory(oldsize, newsize, tar,
+                                                  newgzsize + (uint64_t) (zip.old_members + zip.new_members) *
+                                                                  sizeof(struct ddelta_zip_member),
+                                                  verify, cache_path != NULL);
+        if (memory_limit > 0 && stats->memory_projected > memory_limit) {
+            result = -DDELTA_EBUDGET;
+            goto out;
+        }
+    }
 
-            for (i = 0; i < lenf; i++) {
-                if (fputc(new[lastscan + i] - old[lastpos + i], pf) == EOF) {
-                    result = -DDELTA_EPATCHIO;
-                    goto out;
-                }
-            }
+    if (elf)
+        elf_options(new, newsize, &filter, &word_size);
+
+    /* Pointers are rewritten before the filters change the code around
+     * them. In-place updates would have the applier rewrite the flushed
+     * blocks of the old file, so there are none.
+     *
+     * Pointers that moved together already diff to repeated words, so the
+     * new file is put back as it was unless the moved ones outweigh the
+     * layout by far. */
+    if (elf && blocksize == 0) {
+        if ((result = elf_reloc(&alloc, old, oldsize, new, newsize, &reloc)) < 0)
+            goto out;
+        if (result == 0 &&
+            ddelta_reloc_encode(&reloc, new, newsize, 0) * reloc.word_size <=
+                ELF_RELOC_GAIN * (sizeof(struct ddelta_reloc_header) +
+                                  reloc.nsections * sizeof(struct ddelta_reloc_section) +
+                                  reloc.nregions * sizeof(struct ddelta_reloc_region))) {
+            ddelta_reloc_decode(&reloc, new, newsize, 0);
+            ddelta_free(&alloc, reloc.sections);
+            ddelta_free(&alloc, reloc.regions);
+            memset(&reloc, 0, sizeof(reloc));
+        } else if (result == 0) {
+            file_header.flags |= DDELTA_FLAG_RELOC;
+        }
+        result = 0;
+    }
 
-            if ((scan - lenb) - (lastscan + lenf)) {
-                if (fwrite(new + lastscan + lenf,
-                           (scan - lenb) - (lastscan + lenf), 1, pf) < 1) {
-                    result = -DDELTA_EPATCHIO;
-                    goto out;
-                }
-            }
+    ddelta_filter_encode(filter, new, newsize, 0);
+    ddelta_filter_encode(filter, old, oldsize, 0);
 
-            oldcrc = crc32(oldcrc, old + lastpos, lenf);
-            newcrc = crc32(newcrc, new + lastscan, scan - lenb - lastscan);
+    /* The arena is zeroed and large enough already */
+    if (newsize > oldsize && arena.base == NULL) {
+        unsigned char *tmp = ddelta_realloc(&alloc, old, newsize);
+        if (tmp == NULL) {
+            result = -DDELTA_EOLDIO;
+            goto out;
+        }
+        memset(tmp + oldsize, 0, newsize - oldsize);
+        old = tmp;
+    }
 
-            lastscan = scan - lenb;
-            lastpos = pos - lenb;
-            lastoffset = pos - scan;
-        };
-    };
+    if (arena.base != NULL) {
+        stats->memory_peak = arena.peak;
+    } else {
+        I = ddelta_malloc(&alloc, (MAX(oldsize, newsize) + 1) * sizeof(saidx_t));
+        if (I == NULL) {
+            result = -DDELTA_EALGO;
+            goto out;
+        }
+        stats->memory_peak = (uint64_t) (MAX(oldsize, newsize) + 1) * (1 + sizeof(saidx_t)) +
+                             (uint64_t) (newsize + 1 + newgzsize);
+    }
+    ddelta_timer_stop(&read_timer, &stats->read_time);
+    DDELTA_PROBE2(read__done, oldsize, newsize);
 
-    header.oldcrc = oldcrc;
-    header.newcrc = newcrc;
-    header.seek.value = DDELTA_FLUSH;
-    if ((result = ddelta_entry_header_write(&header, pf)) < 0)
+    /* Create the patch file */
+    if (pf.write == NULL && (pf.file = fdopen(patchfd, "wb")) == NULL) {
+        result = -DDELTA_EPATCHIO;
+        goto out;
+    }
+
+    g.pf = &pf;
+    g.stats = stats;
+    g.word_size = word_size;
+    g.old = old;
+    g.new = new;
+    g.oldsize = oldsize;
+    g.newsize = newsize;
+
+    file_header.new_file_size = (uint64_t) (newgz != NULL ? newgzsize : newsize);
+    if (zip_members != NULL)
+        file_header.new_file_size = (uint64_t) newfilesize;
+
+    if (verify) {
+        if ((result = verifier_start(&verifier, &alloc, old, &g.oldsize, new,
+                                     newsize, file_header.new_file_size)) < 0)
+            goto out;
+        pf.verifier = &verifier;
+    }
+
+    if (word_size == 4)
+        file_header.flags |= DDELTA_FLAG_WORD32;
+    else if (word_size == 8)
+        file_header.flags |= DDELTA_FLAG_WORD64;
+    file_header.flags |= (uint32_t) filter << DDELTA_FLAG_FILTER_SHIFT;
+    flags = file_header.flags;
+    if ((result = ddelta_header_write(&file_header, &pf)) < 0)
+        goto out;
+    if (g.trace != NULL)
+        ddelta_trace_header(g.trace);
+    if (newgz != NULL &&
+        (result = ddelta_deflate_params_write(&deflate, newgz, &pf)) < 0)
+        goto out;
+    if (zip_members != NULL &&
+        (result = ddelta_zip_write(&zip, old_members, zip_members, &pf)) < 0)
+        goto out;
+    if (reloc.sections != NULL && (result = ddelta_reloc_write(&reloc, &pf)) < 0)
         goto out;
 
+    /* Flush blocks must cover whole erase blocks and filter windows */
+    if (g.erase_size > 0)
+        align = g.erase_size;
+    if (filter != DDELTA_FILTER_NONE)
+        align = lcm(align, DDELTA_FILTER_WINDOW);
+    if (blocksize > 0)
+        blocksize = (blocksize + align - 1) / align * align;
+    stats->blocksize = blocksize;
+    stats->apply_memory = ddelta_apply_memory(flags, newgz != NULL ? deflate.mem_level : 0);
+
+    result = 1;
+    if (cache_path != NULL) {
+        hashes = ddelta_malloc(&alloc, 2 * (newsize / DDELTA_CACHE_REGION) * sizeof(*hashes) + 1);
+        if (hashes == NULL) {
+            result = -DDELTA_EALGO;
+            goto out;
+        }
+        region_hashes(new, newsize, hashes);
 
-    if (scan < newsize) {
-        memcpy(old + scansize - blocksize, new + scansize - blocksize, blocksize);
-        oldsize = MAX(oldsize, scansize);
-        scansize = MIN(scansize + blocksize, newsize);
-        goto next;
+        g.record = 1;
+        if ((result = cache_load(cache_path, &g, flags, I, &cache)) == 0)
+            result = generate_cached(&g, I, &cache, hashes);
+    } else if (tar) {
+        result = generate_tar(&g, I);
     }
+    if (result == 1)
+        result = generate_blocks(&g, I, blocksize);
+    if (result < 0)
+        goto out;
 
     memset(&header, 0, sizeof(header));
-    if ((result = ddelta_entry_header_write(&header, pf)) < 0)
+    if ((result = ddelta_entry_header_write(&header, &pf)) < 0)
         goto out;
 
+    if (cache_path != NULL)
+        cache_save(cache_path, &g, flags, I, hashes);
+
 out:
-    if (pf != NULL) {
+    if (pf.verifier != NULL) {
+        int verified = verifier_finish(pf.verifier);
+
+        if (result == 0)
+            result = verified;
+    }
+
+    if (pf.file != NULL) {
         int save_errno = errno;
 
-        if (fclose(pf) && result == 0) {
+        if (fclose(pf.file) && result == 0) {
             result = -DDELTA_EPATCHIO;
         } else {
             errno = save_errno;
         }
     }
 
+    stats->elapsed_us = ddelta_time_us() - start_us;
+    stats->throttled_us = g.duty.throttled_us;
+    stats->cpu_us = (ddelta_cpu_ns(1) - start_cpu) / 1000;
+    stats->max_rss = ddelta_max_rss();
+    stats->bytes_written = pf.written;
+    stats->allocated_peak = alloc.peak;
+    /* Whatever failed after an allocation failed did so for lack of memory */
+    if (result < 0 && result != -DDELTA_ECANCELED && alloc.failed)
+        result = -DDELTA_ENOMEM;
+    DDELTA_PROBE2(generate__done, result, pf.written);
+#ifdef DDELTA_COUNTERS
+    counters = NULL;
+#endif
+
     /* Free the memory we used */
-    free(I);
-    free(old);
-    free(new);
+    if (arena.base != NULL) {
+        ddelta_arena_free(&arena);
+    } else {
+        ddelta_free(&alloc, I);
+        ddelta_free(&alloc, old);
+        ddelta_free(&alloc, new);
+    }
+    ddelta_free(&alloc, newgz);
+    ddelta_free(&alloc, zip_members);
+    ddelta_free(&alloc, old_members);
+    ddelta_free(&alloc, reloc.sections);
+    ddelta_free(&alloc, reloc.regions);
+    ddelta_free(&alloc, hashes);
+    ddelta_free(&alloc, cache.hashes);
+    ddelta_free(&alloc, cache.entries);
+    ddelta_free(&alloc, g.entries);
 
     return result;
 }
 
+int ddelta_generate_opts(int oldfd, int newfd, int patchfd,
+                         const struct ddelta_generate_options *options,
+                         struct ddelta_generate_stats *stats)
+{
+    const struct input_file oldf = {oldfd, NULL, 0};
+    const struct input_file newf = {newfd, NULL, 0};
+    const struct patch_file pf = {NULL, NULL, NULL, NULL, 0};
+
+    return generate(&oldf, &newf, patchfd, pf, options, stats);
+}
+
+int ddelta_generate_mem(const void *olddata, size_t oldsize,
+                        const void *newdata, size_t newsize,
+                        ddelta_write_fn write, void *write_data,
+                        const struct ddelta_generate_options *options,
+                        struct ddelta_generate_stats *stats)
+{
+    const struct input_file oldf = {-1, olddata, (off_t) oldsize};
+    const struct input_file newf = {-1, newdata, (off_t) newsize};
+    const struct patch_file pf = {NULL, write, write_data, NULL, 0};
+
+    return generate(&oldf, &newf, -1, pf, options, stats);
+}
+
 #ifndef DDELTA_NO_MAIN
+static volatile sig_atomic_t interrupted;
+
+static void on_interrupt(int sig)
+{
+    (void) sig;
+    interrupted = 1;
+}
+
+/* Show progress if |data| points to a non-zero int, and cancel on SIGINT */
+static int show_progress(const struct ddelta_progress *progress, void *data)
+{
+    static const char *const phases[] = {"read", "sort", "scan", "apply", "flush"};
+
+    if (*(const int *) data)
+        fprintf(stderr, "\r%-5s %3u%% %8llu KiB/s",
+                phases[progress->phase],
+                (unsigned) (progress->total ? progress->done * 100 / progress->total : 0),
+                (unsigned long long) progress->rate / 1024);
+
+    return interrupted;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] oldfile newfile patchfile [blocksize|auto]\n"
+            "\n"
+            "Storage profile of the applying device:\n"
+            "  --seek-cost=US        cost of a non-sequential read in microseconds\n"
+            "  --read-bandwidth=BPS  sequential read bandwidth in bytes per second\n"
+            "  --cache-size=BYTES    RAM available for caching old file data\n"
+            "  --erase-size=BYTES    align flush blocks to the flash erase size\n"
+            "  --device-ram=BYTES    memory available for applying the patch\n"
+            "  --scratch=BYTES       free space for in-place updates, which picks\n"
+            "                        the blocksize with 'auto'\n"
+            "\n"
+            "Patch format:\n"
+            "  --word-size=1|4|8     compute diffs on little-endian words of this size\n"
+            "  --filter=NAME         branch filter: none, x86, arm or thumb\n"
+            "  --elf                 choose filter and word size for ELF files\n"
+            "  --tar                 diff tar archives member by member\n"
+            "  --gzip                diff the content of gzip files and zip archives\n"
+            "\n"
+            "Generation:\n"
+            "  --cache=FILE          reuse and update the results of a previous run\n"
+            "  --progress            show progress\n"
+            "  --cpu=PERCENT         limit the CPU time used for scanning\n"
+            "  --memory-limit=BYTES  fail early if generating needs more memory\n"
+            "  --memory-cap=BYTES    fail if more memory is allocated at once\n"
+            "  --verify              apply the patch in memory while writing it, and\n"
+            "                        fail if it does not give newfile\n"
+            "  --stats=json          print timings and statistics to stdout\n"
+            "  --counters            print the scan counters of DDELTA_COUNTERS builds\n"
+            "  --trace=FILE          write the entries to FILE as CSV\n",
+            prog);
+}
+
 int main(int argc, char *argv[])
 {
+    static const struct option long_options[] = {
+        {"seek-cost", required_argument, NULL, 's'},
+        {"read-bandwidth", required_argument, NULL, 'b'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"erase-size", required_argument, NULL, 'e'},
+        {"word-size", required_argument, NULL, 'w'},
+        {"filter", required_argument, NULL, 'f'},
+        {"elf", no_argument, NULL, 'E'},
+        {"tar", no_argument, NULL, 'T'},
+        {"gzip", no_argument, NULL, 'z'},
+        {"verify", no_argument, NULL, 'V'},
+        {"cache", required_argument, NULL, 'C'},
+        {"progress", no_argument, NULL, 'p'},
+        {"cpu", required_argument, NULL, 'u'},
+        {"memory-limit", required_argument, NULL, 'm'},
+        {"memory-cap", required_argument, NULL, 'M'},
+        {"device-ram", required_argument, NULL, 'R'},
+        {"scratch", required_argument, NULL, 'S'},
+        {"stats", required_argument, NULL, 'j'},
+        {"counters", no_argument, NULL, 'k'},
+        {"trace", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    struct ddelta_generate_options options = {0};
+    struct ddelta_generate_stats stats;
+    struct ddelta_cost_profile profile = {0};
+    struct ddelta_device_profile device = {0};
+    struct stat oldst, newst;
+    const char *prog = argv[0];
+    int verbose = 0;
+    int json = 0;
+    int show_counters = 0;
     int oldfd;
     int newfd;
     int patchfd;
-    int blocksize;
+    int opt;
     int err;
 
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            profile.seek_cost = strtoul(optarg, NULL, 0);
+            options.cost = &profile;
+            break;
+        case 'b':
+            profile.read_bandwidth = strtoul(optarg, NULL, 0);
+            options.cost = &profile;
+            break;
+        case 'c':
+            profile.cache_size = strtoul(optarg, NULL, 0);
+            options.cost = &profile;
+            break;
+        case 'e':
+            options.erase_size = atoi(optarg);
+            break;
+        case 'w':
+            options.word_size = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "none") == 0) {
+                options.filter = DDELTA_FILTER_NONE;
+            } else if (strcmp(optarg, "x86") == 0) {
+                options.filter = DDELTA_FILTER_X86;
+            } else if (strcmp(optarg, "arm") == 0) {
+                options.filter = DDELTA_FILTER_ARM;
+            } else if (strcmp(optarg, "thumb") == 0) {
+                options.filter = DDELTA_FILTER_ARMTHUMB;
+            } else {
+                fprintf(stderr, "unknown filter: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'E':
+            options.elf = 1;
+            break;
+        case 'T':
+            options.tar = 1;
+            break;
+        case 'z':
+            options.gzip = 1;
+            break;
+        case 'V':
+            options.verify = 1;
+            break;
+        case 'C':
+            options.cache = optarg;
+            break;
+        case 'p':
+            verbose = 1;
+            break;
+        case 'u':
+            options.cpu_percent = atoi(optarg);
+            break;
+        case 'm':
+            options.memory_limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'M':
+            options.memory_cap = strtoull(optarg, NULL, 0);
+            break;
+        case 'R':
+            device.ram = strtoull(optarg, NULL, 0);
+            options.device = &device;
+            break;
+        case 'S':
+            device.scratch = strtoull(optarg, NULL, 0);
+            options.device = &device;
+            break;
+        case 'j':
+            if (strcmp(optarg, "json") != 0) {
+                fprintf(stderr, "unknown stats format: %s\n", optarg);
+                return 1;
+            }
+            json = 1;
+            break;
+        case 'k':
+            show_counters = 1;
+            break;
+        case 't':
+            if ((options.trace = fopen(optarg, "w")) == NULL) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(prog);
+            return 1;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc < 4) {
-        fprintf(stderr, "usage: %s oldfile newfile patchfile [blocksize]\n", argv[0]);
+        usage(prog);
         return 1;
     }
 
@@ -466,12 +3602,56 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    blocksize = argc >= 5 ? atoi(argv[4]) : 0;
-    err = ddelta_generate(oldfd, newfd, patchfd, blocksize);
+    if (argc >= 5 && strcmp(argv[4], "auto") == 0)
+        options.blocksize = DDELTA_BLOCKSIZE_AUTO;
+    else
+        options.blocksize = argc >= 5 ? atoi(argv[4]) : 0;
+
+    if (verbose && fstat(oldfd, &oldst) == 0 && fstat(newfd, &newst) == 0)
+        fprintf(stderr, "projected memory: %llu KiB\n",
+                (unsigned long long) ddelta_generate_memory(oldst.st_size, newst.st_size,
+                                                            &options) / 1024);
+    options.progress = show_progress;
+    options.progress_data = &verbose;
+    signal(SIGINT, on_interrupt);
+
+    err = ddelta_generate_opts(oldfd, newfd, patchfd, &options, &stats);
+    if (verbose)
+        fprintf(stderr, "\n");
+    if (options.trace != NULL && fclose(options.trace) != 0 && err >= 0) {
+        perror("trace");
+        return 1;
+    }
     if (err < 0) {
         fprintf(stderr, "An error %d occured: %s", -err, strerror(errno));
         return -err;
     }
+
+    if (verbose)
+        fprintf(stderr, "peak memory: %llu KiB, %llu KiB allocated, %llu KiB to apply\n",
+                (unsigned long long) stats.memory_peak / 1024,
+                (unsigned long long) stats.allocated_peak / 1024,
+                (unsigned long long) stats.apply_memory / 1024);
+    if (options.blocksize == DDELTA_BLOCKSIZE_AUTO)
+        fprintf(stderr, "blocksize: %llu\n", (unsigned long long) stats.blocksize);
+
+    if (options.cpu_percent > 0)
+        fprintf(stderr, "took %llu ms, throttled %llu ms\n",
+                (unsigned long long) stats.elapsed_us / 1000,
+                (unsigned long long) stats.throttled_us / 1000);
+
+    if (options.cost != NULL)
+        fprintf(stderr, "estimated apply cost: %llu us (%llu entries, %llu seeks, %llu backward, %llu bytes read)\n",
+                (unsigned long long) stats.apply_cost,
+                (unsigned long long) stats.entries,
+                (unsigned long long) stats.seeks,
+                (unsigned long long) stats.backward_seeks,
+                (unsigned long long) stats.diff_bytes);
+
+    if (show_counters)
+        ddelta_scan_counters_print(stderr, &stats.counters);
+    if (json)
+        ddelta_generate_stats_json(stdout, &stats);
     return 0;
 }
 #endif
@@ -0,0 +1,386 @@
+/* ddelta_info.c - Report the structure and apply cost of a patch
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "ddelta.h"
+#include "ddelta_cost.h"
+#include "ddelta_stats.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Buckets of the seek distance histograms, by bit length */
+#define SEEK_BUCKETS 33
+
+/* What reading a patch found */
+struct patch_info {
+    struct ddelta_header header;
+    struct ddelta_deflate_params params;
+    struct ddelta_zip_header zip;
+    struct ddelta_reloc_header reloc;
+    /* Whether the terminating entry was found */
+    int complete;
+    uint64_t entries;
+    uint64_t flushes;
+    uint64_t diff_bytes;
+    uint64_t extra_bytes;
+    /* Diff bytes that are zero, if the diff data was read */
+    int zero_counted;
+    uint64_t zero_bytes;
+    /* Runs of old data read without seeking in between */
+    uint64_t runs;
+    /* Seeks by distance, and the distances summed up */
+    uint64_t forward[SEEK_BUCKETS];
+    uint64_t backward[SEEK_BUCKETS];
+    uint64_t forward_distance;
+    uint64_t backward_distance;
+    /* Estimated cost of reading the old file, in microseconds */
+    uint64_t read_cost;
+    uint64_t seek_cost;
+};
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static int32_t from_unsigned(uint32_t u)
+{
+    return u & 0x80000000 ? -(int32_t) ~(u - 1) : (int32_t) u;
+}
+
+/* Skip |size| bytes of the patch, seeking over them if |seekable|, and add
+ * the number of zero bytes among them to |*zero| unless it is NULL. */
+static int skip(FILE *patch, uint64_t size, int seekable, uint64_t *zero)
+{
+    unsigned char buf[64 * 1024];
+
+    if (seekable && zero == NULL)
+        return fseeko(patch, (off_t) size, SEEK_CUR) == 0 ? 0 : -DDELTA_EPATCHIO;
+
+    while (size > 0) {
+        const size_t n = size < sizeof(buf) ? (size_t) size : sizeof(buf);
+
+        if (fread(buf, 1, n, patch) < n)
+            return -DDELTA_EPATCHIO;
+        if (zero != NULL)
+            *zero += n - ddelta_nonzero_bytes(buf, n);
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Read the patch |patch|, reading the diff data only if it is not
+ * |seekable| or if |count_zero|. */
+static int read_patch(FILE *patch, int seekable, int count_zero,
+                      const struct ddelta_cost_profile *profile,
+                      struct patch_info *info)
+{
+    unsigned char raw[sizeof(struct ddelta_entry_header)];
+    int moved = 1;
+    int err;
+
+    memset(info, 0, sizeof(*info));
+    info->zero_counted = count_zero || !seekable;
+
+    if ((err = ddelta_header_read(&info->header, patch)) < 0)
+        return err;
+
+    if (info->header.flags & DDELTA_FLAG_DEFLATE_NEW) {
+        unsigned char params[sizeof(struct ddelta_deflate_params)];
+
+        if (fread(params, sizeof(params), 1, patch) < 1)
+            return -DDELTA_EPATCHIO;
+        info->params.content_size = get_be64(params);
+        info->params.file_crc = get_be32(params + 8);
+        info->params.header_size = get_be32(params + 12);
+        info->params.level = params[16];
+        info->params.mem_level = params[17];
+        info->params.strategy = params[18];
+        info->params.window_bits = params[19] != 0 ? params[19] : 15;
+
+        if ((err = skip(patch, info->params.header_size, seekable, NULL)) < 0)
+            return err;
+    }
+
+    if (info->header.flags & DDELTA_FLAG_ZIP) {
+        unsigned char zip[sizeof(struct ddelta_zip_header)];
+
+        if (fread(zip, sizeof(zip), 1, patch) < 1)
+            return -DDELTA_EPATCHIO;
+        info->zip.content_size = get_be64(zip);
+        info->zip.file_crc = get_be32(zip + 8);
+        info->zip.old_members = get_be32(zip + 12);
+        info->zip.new_members = get_be32(zip + 16);
+
+        if ((err = skip(patch, ((uint64_t) info->zip.old_members + info->zip.new_members) *
+                                   sizeof(struct ddelta_zip_member),
+                        seekable, NULL)) < 0)
+            return err;
+    }
+
+    if (info->header.flags & DDELTA_FLAG_RELOC) {
+        unsigned char reloc[sizeof(struct ddelta_reloc_header)];
+
+        if (fread(reloc, sizeof(reloc), 1, patch) < 1)
+            return -DDELTA_EPATCHIO;
+        info->reloc.sections = get_be32(reloc);
+        info->reloc.regions = get_be32(reloc + 4);
+        info->reloc.word_size = reloc[8];
+
+        if ((err = skip(patch, (uint64_t) info->reloc.sections * sizeof(struct ddelta_reloc_section) +
+                                   (uint64_t) info->reloc.regions * sizeof(struct ddelta_reloc_region),
+                        seekable, NULL)) < 0)
+            return err;
+    }
+
+    while (fread(raw, sizeof(raw), 1, patch) == 1) {
+        const uint32_t diff = get_be32(raw);
+        const uint32_t extra = get_be32(raw + 4);
+        const int32_t seek = from_unsigned(get_be32(raw + 8));
+
+        if (diff == 0 && extra == 0 && seek == 0) {
+            info->complete = 1;
+            return 0;
+        }
+
+        if (seek == DDELTA_FLUSH) {
+            info->flushes++;
+            continue;
+        }
+
+        info->entries++;
+        info->diff_bytes += diff;
+        info->extra_bytes += extra;
+
+        if (diff > 0 && moved) {
+            info->runs++;
+            moved = 0;
+        }
+        if (seek > 0) {
+            info->forward[ddelta_bucket(seek, SEEK_BUCKETS)]++;
+            info->forward_distance += seek;
+            moved = 1;
+        } else if (seek < 0) {
+            info->backward[ddelta_bucket(-(int64_t) seek, SEEK_BUCKETS)]++;
+            info->backward_distance += -(int64_t) seek;
+            moved = 1;
+        }
+
+        if (profile != NULL) {
+            info->read_cost += ddelta_read_cost(profile, diff);
+            info->seek_cost += ddelta_seek_cost(profile, seek);
+        }
+
+        if ((err = skip(patch, diff, seekable,
+                        info->zero_counted ? &info->zero_bytes : NULL)) < 0 ||
+            (err = skip(patch, extra, seekable, NULL)) < 0)
+            return err;
+    }
+
+    return ferror(patch) ? -DDELTA_EPATCHIO : 0;
+}
+
+static void print_info(const struct patch_info *info,
+                       const struct ddelta_cost_profile *profile)
+{
+    static const char *const filters[] = {"none", "x86", "arm", "thumb"};
+    const uint32_t flags = info->header.flags;
+    const uint64_t content_size = flags & DDELTA_FLAG_DEFLATE_NEW ? info->params.content_size
+                                  : flags & DDELTA_FLAG_ZIP       ? info->zip.content_size
+                                                                  : info->header.new_file_size;
+    uint64_t forward = 0, backward = 0;
+    int i;
+
+    for (i = 0; i < SEEK_BUCKETS; i++) {
+        forward += info->forward[i];
+        backward += info->backward[i];
+    }
+
+    printf("format:      %.8s", info->header.magic);
+    if (flags & DDELTA_FLAG_WORD32)
+        printf(", 32-bit words");
+    if (flags & DDELTA_FLAG_WORD64)
+        printf(", 64-bit words");
+    if (flags & DDELTA_FLAG_FILTER_MASK)
+        printf(", %s filter", filters[(flags & DDELTA_FLAG_FILTER_MASK) >> DDELTA_FLAG_FILTER_SHIFT]);
+    if (flags & DDELTA_FLAG_INFLATE_OLD)
+        printf(", gzip old file");
+    if (flags & DDELTA_FLAG_DEFLATE_NEW)
+        printf(", gzip new file");
+    if (flags & DDELTA_FLAG_ZIP)
+        printf(", zip archives");
+    if (flags & DDELTA_FLAG_RELOC)
+        printf(", relocated pointers");
+    printf("\n");
+
+    printf("new file:    %" PRIu64 " bytes\n", info->header.new_file_size);
+    if (flags & DDELTA_FLAG_DEFLATE_NEW)
+        printf("deflate:     %" PRIu64 " bytes of content, level %u, memory level %u, "
+               "strategy %u, %u-bit window\n",
+               info->params.content_size, info->params.level,
+               info->params.mem_level, info->params.strategy,
+               info->params.window_bits);
+    if (flags & DDELTA_FLAG_ZIP)
+        printf("zip:         %" PRIu64 " bytes of content, %" PRIu32 " old and %" PRIu32
+               " new members deflated\n",
+               info->zip.content_size, info->zip.old_members, info->zip.new_members);
+    if (flags & DDELTA_FLAG_RELOC)
+        printf("reloc:       %" PRIu32 " sections, %" PRIu32 " regions of %u-bit pointers\n",
+               info->reloc.sections, info->reloc.regions, info->reloc.word_size * 8u);
+
+    printf("entries:     %" PRIu64 ", %" PRIu64 " flush entries\n",
+           info->entries, info->flushes);
+    printf("diff:        %" PRIu64 " bytes", info->diff_bytes);
+    if (info->zero_counted)
+        printf(", %" PRIu64 " zero (%.1f%%)", info->zero_bytes,
+               info->diff_bytes ? 100.0 * info->zero_bytes / info->diff_bytes : 0.0);
+    printf("\n");
+    printf("extra:       %" PRIu64 " bytes\n", info->extra_bytes);
+    printf("old reads:   %" PRIu64 " sequential runs of %" PRIu64 " bytes on average\n",
+           info->runs, info->runs ? info->diff_bytes / info->runs : 0);
+    printf("seeks:       %" PRIu64 " forward over %" PRIu64 " bytes, %" PRIu64
+           " backward over %" PRIu64 " bytes\n",
+           forward, info->forward_distance, backward, info->backward_distance);
+    if (profile != NULL)
+        printf("apply cost:  %" PRIu64 " us, %" PRIu64 " us reading and %" PRIu64 " us seeking\n",
+               info->read_cost + info->seek_cost, info->read_cost, info->seek_cost);
+
+    if (forward + backward > 0) {
+        printf("\n%-12s %12s %12s\n", "seek", "forward", "backward");
+        for (i = 1; i < SEEK_BUCKETS; i++) {
+            if (info->forward[i] == 0 && info->backward[i] == 0)
+                continue;
+            printf("< 2^%-8d %12" PRIu64 " %12" PRIu64 "\n",
+                   i, info->forward[i], info->backward[i]);
+        }
+    }
+
+    if (!info->complete)
+        printf("\npatch is truncated\n");
+    else if (info->diff_bytes + info->extra_bytes != content_size)
+        printf("\npatch gives %" PRIu64 " bytes instead of %" PRIu64 "\n",
+               info->diff_bytes + info->extra_bytes, content_size);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [options] patchfile|-\n"
+            "\n"
+            "  --data                read the diff data to count its zero bytes,\n"
+            "                        rather than only the entry headers\n"
+            "\n"
+            "Storage profile of the applying device, to estimate the I/O cost:\n"
+            "  --seek-cost=US        cost of a non-sequential read in microseconds\n"
+            "  --read-bandwidth=BPS  sequential read bandwidth in bytes per second\n"
+            "  --cache-size=BYTES    RAM available for caching old file data\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"data", no_argument, NULL, 'd'},
+        {"seek-cost", required_argument, NULL, 's'},
+        {"read-bandwidth", required_argument, NULL, 'b'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    struct ddelta_cost_profile profile = {0};
+    const struct ddelta_cost_profile *cost = NULL;
+    struct patch_info info;
+    struct stat st;
+    FILE *patch;
+    int count_zero = 0;
+    int seekable;
+    int opt;
+    int err;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            count_zero = 1;
+            break;
+        case 's':
+            profile.seek_cost = strtoul(optarg, NULL, 0);
+            cost = &profile;
+            break;
+        case 'b':
+            profile.read_bandwidth = strtoul(optarg, NULL, 0);
+            cost = &profile;
+            break;
+        case 'c':
+            profile.cache_size = strtoul(optarg, NULL, 0);
+            cost = &profile;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[optind], "-") == 0) {
+        patch = stdin;
+    } else if ((patch = fopen(argv[optind], "rb")) == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    seekable = fstat(fileno(patch), &st) == 0 && S_ISREG(st.st_mode);
+
+    err = read_patch(patch, seekable, count_zero, cost, &info);
+    if (patch != stdin)
+        fclose(patch);
+    if (err == -DDELTA_EMAGIC) {
+        fprintf(stderr, "%s: not a ddelta patch, or unknown flags\n", argv[optind]);
+        return 1;
+    }
+    if (err < 0 && info.entries == 0) {
+        fprintf(stderr, "%s: cannot read the patch\n", argv[optind]);
+        return 1;
+    }
+
+    print_info(&info, cost);
+    return info.complete ? 0 : 1;
+}
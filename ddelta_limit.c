@@ -0,0 +1,102 @@
+/* ddelta_limit.c - I/O rate and CPU time limits
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "ddelta_limit.h"
+#include "ddelta_progress.h"
+
+#include <errno.h>
+#include <time.h>
+
+void ddelta_sleep_us(uint64_t us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+void ddelta_rate_init(struct ddelta_rate_limit *l, uint64_t rate)
+{
+    l->rate = rate;
+    l->tokens = 0;
+    l->last_us = rate > 0 ? ddelta_time_us() : 0;
+    l->bytes = 0;
+    l->throttled_us = 0;
+}
+
+void ddelta_rate_consume(struct ddelta_rate_limit *l, uint64_t bytes)
+{
+    const int64_t burst = l->rate * DDELTA_RATE_BURST_US / 1000000;
+    uint64_t now, wait;
+
+    l->bytes += bytes;
+    if (l->rate == 0)
+        return;
+
+    now = ddelta_time_us();
+    if (now > l->last_us) {
+        l->tokens += (now - l->last_us) * l->rate / 1000000;
+        if (l->tokens > burst)
+            l->tokens = burst;
+        l->last_us = now;
+    }
+
+    l->tokens -= bytes;
+    if (l->tokens >= 0)
+        return;
+
+    /* Wait until the debt is paid off */
+    wait = (uint64_t) -l->tokens * 1000000 / l->rate;
+    ddelta_sleep_us(wait);
+    l->throttled_us += wait;
+    l->tokens = 0;
+    l->last_us = now + wait;
+}
+
+void ddelta_duty_cycle_init(struct ddelta_duty_cycle *d, int percent)
+{
+    d->percent = percent > 0 && percent < 100 ? percent : 0;
+    d->count = DDELTA_DUTY_CHECK;
+    d->start_us = d->percent > 0 ? ddelta_time_us() : 0;
+    d->throttled_us = 0;
+}
+
+void ddelta_duty_cycle_run(struct ddelta_duty_cycle *d)
+{
+    const uint64_t busy = ddelta_time_us() - d->start_us;
+    uint64_t pause;
+
+    d->count = DDELTA_DUTY_CHECK;
+    if (busy < DDELTA_DUTY_PERIOD_US)
+        return;
+
+    pause = busy * (100 - d->percent) / d->percent;
+    ddelta_sleep_us(pause);
+    d->throttled_us += pause;
+    d->start_us = ddelta_time_us();
+}
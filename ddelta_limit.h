@@ -0,0 +1,63 @@
+#ifndef DDELTA_LIMIT_H
+#define DDELTA_LIMIT_H
+
+#include <stdint.h>
+
+/**
+ * Token bucket limiting I/O to 'rate' bytes per second, with bursts of up
+ * to DDELTA_RATE_BURST_US worth of data. It also counts the bytes passed
+ * through it.
+ */
+struct ddelta_rate_limit {
+    uint64_t rate;
+    int64_t tokens;
+    uint64_t last_us;
+    uint64_t bytes;
+    uint64_t throttled_us;
+};
+
+#define DDELTA_RATE_BURST_US 100000
+
+/**
+ * Limit the time the calling thread is busy to 'percent' of the time, by
+ * sleeping after each DDELTA_DUTY_PERIOD_US busy. The time is checked
+ * every DDELTA_DUTY_CHECK calls of ddelta_duty_cycle_due().
+ */
+struct ddelta_duty_cycle {
+    int percent;
+    unsigned int count;
+    uint64_t start_us;
+    uint64_t throttled_us;
+};
+
+#define DDELTA_DUTY_PERIOD_US 10000
+#define DDELTA_DUTY_CHECK 4096
+
+/**
+ * Sleep for |us| microseconds.
+ */
+void ddelta_sleep_us(uint64_t us);
+
+/**
+ * Set up |l| for |rate| bytes per second, 0 for no limit.
+ */
+void ddelta_rate_init(struct ddelta_rate_limit *l, uint64_t rate);
+
+/**
+ * Account |bytes| of I/O, sleeping if they exceed the rate.
+ */
+void ddelta_rate_consume(struct ddelta_rate_limit *l, uint64_t bytes);
+
+/**
+ * Set up |d| for |percent| of CPU time, 0 or 100 for no limit.
+ */
+void ddelta_duty_cycle_init(struct ddelta_duty_cycle *d, int percent);
+
+/**
+ * Sleep if the busy period is over. Call when ddelta_duty_cycle_due().
+ */
+void ddelta_duty_cycle_run(struct ddelta_duty_cycle *d);
+
+#define ddelta_duty_cycle_due(d) ((d)->percent > 0 && --(d)->count == 0)
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef DDELTA_PROBE_H
+#define DDELTA_PROBE_H
+
+/*
+ * Static tracepoints of the "ddelta" provider, for bpftrace and perf.
+ *
+ * With systemtap's <sys/sdt.h>, each probe is a single nop recorded in an
+ * ELF note, which tools turn into a breakpoint when they attach. Without
+ * it, or with DDELTA_NO_PROBES, the probes compile to nothing.
+ *
+ * ddelta_generate:
+ *   read__start(), read__done(oldsize, newsize)
+ *   sort__start(size), sort__done(size, result)
+ *   scan__start(pos, end), scan__done(pos, end, result)
+ *   entry(newpos, oldpos, diff, extra, seek)
+ *   flush(oldcrc, newcrc)
+ *   generate__done(result, patch size)
+ *
+ * ddelta_apply:
+ *   apply__start(new file size, flags)
+ *   entry(newpos, diff, extra, seek)
+ *   flush__start(newpos), flush__done(newpos, result)
+ *   fsync__start(fd), fsync__done(fd, result)
+ *   apply__done(result, bytes of content written)
+ */
+
+#if !defined(DDELTA_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DDELTA_PROBES 1
+#endif
+#endif
+
+#ifdef DDELTA_PROBES
+#define DDELTA_PROBE0(name) DTRACE_PROBE(ddelta, name)
+#define DDELTA_PROBE1(name, a) DTRACE_PROBE1(ddelta, name, a)
+#define DDELTA_PROBE2(name, a, b) DTRACE_PROBE2(ddelta, name, a, b)
+#define DDELTA_PROBE3(name, a, b, c) DTRACE_PROBE3(ddelta, name, a, b, c)
+#define DDELTA_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ddelta, name, a, b, c, d)
+#define DDELTA_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(ddelta, name, a, b, c, d, e)
+#else
+#define DDELTA_PROBE0(name) do { } while (0)
+#define DDELTA_PROBE1(name, a) do { } while (0)
+#define DDELTA_PROBE2(name, a, b) do { } while (0)
+#define DDELTA_PROBE3(name, a, b, c) do { } while (0)
+#define DDELTA_PROBE4(name, a, b, c, d) do { } while (0)
+#define DDELTA_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+/* ddelta_progress.c - Progress reporting
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "ddelta.h"
+#include "ddelta_progress.h"
+
+#include <time.h>
+
+uint64_t ddelta_time_us(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+        return 0;
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ddelta_progress_init(struct ddelta_progress_state *p,
+                          ddelta_progress_fn fn, void *data,
+                          uint64_t interval)
+{
+    p->fn = fn;
+    p->data = data;
+    p->interval = interval > 0 ? interval : DDELTA_PROGRESS_INTERVAL;
+    p->next = 0;
+    p->start_us = fn != NULL ? ddelta_time_us() : 0;
+}
+
+int ddelta_progress_report(struct ddelta_progress_state *p, int phase,
+                           uint64_t done, uint64_t total)
+{
+    struct ddelta_progress progress;
+
+    if (p->fn == NULL)
+        return 0;
+
+    progress.phase = phase;
+    progress.done = done;
+    progress.total = total;
+    progress.elapsed_us = ddelta_time_us() - p->start_us;
+    progress.rate = progress.elapsed_us > 0 ? done * 1000000 / progress.elapsed_us : 0;
+
+    p->next = done + p->interval;
+
+    return p->fn(&progress, p->data) != 0 ? -DDELTA_ECANCELED : 0;
+}
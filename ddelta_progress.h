@@ -0,0 +1,43 @@
+#ifndef DDELTA_PROGRESS_H
+#define DDELTA_PROGRESS_H
+
+#include "ddelta.h"
+
+#include <stdint.h>
+
+/* Default number of new file bytes between progress reports */
+#define DDELTA_PROGRESS_INTERVAL (1024 * 1024)
+
+/**
+ * State of reporting progress to a ddelta_progress_fn.
+ */
+struct ddelta_progress_state {
+    ddelta_progress_fn fn;
+    void *data;
+    uint64_t interval;
+    /* Progress is due once this many bytes are done */
+    uint64_t next;
+    uint64_t start_us;
+};
+
+/**
+ * Monotonic time in microseconds.
+ */
+uint64_t ddelta_time_us(void);
+
+void ddelta_progress_init(struct ddelta_progress_state *p,
+                          ddelta_progress_fn fn, void *data,
+                          uint64_t interval);
+
+/**
+ * Report progress, if there is a callback.
+ *
+ * @return 0, or -DDELTA_ECANCELED if the callback asked to cancel
+ */
+int ddelta_progress_report(struct ddelta_progress_state *p, int phase,
+                           uint64_t done, uint64_t total);
+
+/* Whether progress should be reported with |done| bytes done */
+#define ddelta_progress_due(p, done) ((p)->fn != NULL && (uint64_t) (done) >= (p)->next)
+
+#endif
@@ -0,0 +1,171 @@
+/* ddelta_reloc.c - Pointers of ELF files as addresses of another layout
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ddelta_reloc.h"
+
+/* Largest value of a pointer of |word_size| bytes */
+static uint64_t word_max(int word_size)
+{
+    return word_size == 8 ? UINT64_MAX : UINT32_MAX;
+}
+
+int ddelta_reloc_section_valid(const struct ddelta_reloc *r, uint32_t i)
+{
+    const struct ddelta_reloc_section *s = &r->sections[i];
+    const struct ddelta_reloc_section *prev = s - 1;
+    const uint64_t max = word_max(r->word_size);
+
+    /* Written so that a section may end at the largest address */
+    if (s->size == 0 || s->old_addr > max || s->new_addr > max ||
+        s->size - 1 > max - s->old_addr || s->size - 1 > max - s->new_addr)
+        return 0;
+
+    return i == 0 ||
+           (s->old_addr > prev->old_addr && s->old_addr - prev->old_addr >= prev->size &&
+            s->new_addr > prev->new_addr && s->new_addr - prev->new_addr >= prev->size);
+}
+
+int ddelta_reloc_region_valid(const struct ddelta_reloc *r, uint32_t i)
+{
+    const struct ddelta_reloc_region *g = &r->regions[i];
+    const struct ddelta_reloc_region *prev = g - 1;
+    const unsigned int w = r->word_size;
+
+    if (g->count == 0 || g->stride == 0 || g->stride % w != 0 || g->stride / w > 16 ||
+        g->mask == 0 || (g->stride / w < 16 && g->mask >> (g->stride / w) != 0) ||
+        g->offset % w != 0 ||
+        (uint64_t) g->count * g->stride > UINT64_MAX - g->offset)
+        return 0;
+
+    return i == 0 || g->offset - prev->offset >= (uint64_t) prev->count * prev->stride;
+}
+
+static uint64_t get_word(const unsigned char *p, int w)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < w; i++)
+        v |= (uint64_t) p[i] << (8 * i);
+    return v;
+}
+
+static void put_word(unsigned char *p, uint64_t v, int w)
+{
+    int i;
+
+    for (i = 0; i < w; i++)
+        p[i] = (unsigned char) (v >> (8 * i));
+}
+
+/*
+ * Map |v| from the addresses of the new file to those of the old one
+ * (encode), or back. An address in a section moves with it. Any other
+ * address has the same rank among those outside the sections in both
+ * files, which keeps the mapping one to one for every value.
+ */
+static uint64_t map_value(const struct ddelta_reloc *r, uint64_t v, int encode)
+{
+    uint64_t rank = v;
+    uint32_t i;
+
+    for (i = 0; i < r->nsections; i++) {
+        const struct ddelta_reloc_section *s = &r->sections[i];
+        const uint64_t from = encode ? s->new_addr : s->old_addr;
+        const uint64_t to = encode ? s->old_addr : s->new_addr;
+
+        if (v < from)
+            break;
+        if (v - from < s->size)
+            return to + (v - from);
+        rank -= s->size;
+    }
+
+    for (i = 0; i < r->nsections; i++) {
+        const struct ddelta_reloc_section *s = &r->sections[i];
+
+        if ((encode ? s->old_addr : s->new_addr) > rank)
+            break;
+        rank += s->size;
+    }
+
+    return rank;
+}
+
+static uint64_t reloc(const struct ddelta_reloc *r, unsigned char *buf,
+                      size_t size, uint64_t pos, int encode)
+{
+    const uint64_t end = pos + size;
+    const unsigned int w = r->word_size;
+    uint32_t lo = 0, hi = r->nregions;
+    uint64_t changed = 0;
+
+    /* The first region that does not end before |buf| */
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        const struct ddelta_reloc_region *g = &r->regions[mid];
+
+        if (g->offset + (uint64_t) g->count * g->stride <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < r->nregions && r->regions[lo].offset < end; lo++) {
+        const struct ddelta_reloc_region *g = &r->regions[lo];
+        uint64_t k = g->offset < pos ? (pos - g->offset) / g->stride : 0;
+
+        for (; k < g->count && g->offset + k * g->stride < end; k++) {
+            const uint64_t element = g->offset + k * g->stride;
+            unsigned int j;
+
+            for (j = 0; j < g->stride / w; j++) {
+                const uint64_t at = element + (uint64_t) j * w;
+                uint64_t v;
+
+                if (!(g->mask >> j & 1) || at < pos || at + w > end)
+                    continue;
+                v = get_word(buf + (at - pos), w);
+                if (map_value(r, v, encode) != v) {
+                    put_word(buf + (at - pos), map_value(r, v, encode), w);
+                    changed++;
+                }
+            }
+        }
+    }
+
+    return changed;
+}
+
+uint64_t ddelta_reloc_encode(const struct ddelta_reloc *r, unsigned char *buf,
+                             size_t size, uint64_t pos)
+{
+    return reloc(r, buf, size, pos, 1);
+}
+
+uint64_t ddelta_reloc_decode(const struct ddelta_reloc *r, unsigned char *buf,
+                             size_t size, uint64_t pos)
+{
+    return reloc(r, buf, size, pos, 0);
+}
@@ -0,0 +1,39 @@
+#ifndef DDELTA_RELOC_H
+#define DDELTA_RELOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ddelta.h"
+
+/**
+ * The layout of DDELTA_FLAG_RELOC, with its sections and regions in host
+ * byte order.
+ */
+struct ddelta_reloc {
+    int word_size;
+    struct ddelta_reloc_section *sections;
+    uint32_t nsections;
+    struct ddelta_reloc_region *regions;
+    uint32_t nregions;
+};
+
+/**
+ * Whether section or region |i| of |r| is valid, given those before it.
+ */
+int ddelta_reloc_section_valid(const struct ddelta_reloc *r, uint32_t i);
+int ddelta_reloc_region_valid(const struct ddelta_reloc *r, uint32_t i);
+
+/**
+ * Rewrite the pointers of the new file in |buf| to addresses of the old
+ * file (encode), or back (decode). |pos| is the offset of |buf| in the new
+ * file; pointers that are not wholly in |buf| are left as they are.
+ *
+ * @return the number of pointers that changed
+ */
+uint64_t ddelta_reloc_encode(const struct ddelta_reloc *r, unsigned char *buf,
+                             size_t size, uint64_t pos);
+uint64_t ddelta_reloc_decode(const struct ddelta_reloc *r, unsigned char *buf,
+                             size_t size, uint64_t pos);
+
+#endif
@@ -0,0 +1,331 @@
+/* ddelta_stats.c - Timers and statistics reports
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "ddelta.h"
+#include "ddelta_stats.h"
+
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts) < 0)
+        return 0;
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t ddelta_time_ns(void)
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+uint64_t ddelta_cpu_ns(int process)
+{
+    return clock_ns(process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID);
+}
+
+uint64_t ddelta_max_rss(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+
+#ifdef __APPLE__
+    return (uint64_t) ru.ru_maxrss;
+#else
+    return (uint64_t) ru.ru_maxrss * 1024;
+#endif
+}
+
+void ddelta_timer_start(struct ddelta_timer *t)
+{
+    t->wall_ns = ddelta_time_ns();
+    t->cpu_ns = ddelta_cpu_ns(0);
+}
+
+void ddelta_timer_stop(const struct ddelta_timer *t,
+                       struct ddelta_phase_time *phase)
+{
+    phase->wall_ns += ddelta_time_ns() - t->wall_ns;
+    phase->cpu_ns += ddelta_cpu_ns(0) - t->cpu_ns;
+}
+
+uint64_t ddelta_lap_ns(uint64_t start, uint64_t *phase)
+{
+    const uint64_t now = ddelta_time_ns();
+
+    *phase += now - start;
+    return now;
+}
+
+static void json_u64(FILE *f, const char *indent, const char *key,
+                     uint64_t value, int last)
+{
+    fprintf(f, "%s\"%s\": %" PRIu64 "%s\n", indent, key, value, last ? "" : ",");
+}
+
+static void json_phase(FILE *f, const char *key,
+                       const struct ddelta_phase_time *t, int last)
+{
+    fprintf(f, "    \"%s\": {\"wall_ns\": %" PRIu64 ", \"cpu_ns\": %" PRIu64 "}%s\n",
+            key, t->wall_ns, t->cpu_ns, last ? "" : ",");
+}
+
+static const char *const io_names[DDELTA_IO_OPS] = {
+    "patch_read", "old_read", "seek", "write", "sync", "open", "rename", "unlink",
+};
+
+int ddelta_bucket(uint64_t n, int buckets)
+{
+    int bucket = 0;
+
+    while (n > 0 && bucket < buckets - 1) {
+        n >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+void ddelta_io_account(struct ddelta_io_class *c, uint64_t ns, uint64_t bytes)
+{
+    c->calls++;
+    c->bytes += bytes;
+    c->ns += ns;
+    if (ns > c->max_ns)
+        c->max_ns = ns;
+    c->latency[ddelta_bucket(ns, DDELTA_LATENCY_BUCKETS)]++;
+}
+
+static void json_buckets(FILE *f, const char *indent, const char *key,
+                         const uint64_t *buckets, int n, int last)
+{
+    int i;
+
+    fprintf(f, "%s\"%s\": [", indent, key);
+    for (i = 0; i < n; i++)
+        fprintf(f, "%s%" PRIu64, i ? ", " : "", buckets[i]);
+    fprintf(f, "]%s\n", last ? "" : ",");
+}
+
+static void json_counters(FILE *f, const struct ddelta_scan_counters *c)
+{
+    fprintf(f, "  \"counters\": {\n");
+    json_u64(f, "    ", "searches", c->searches, 0);
+    json_u64(f, "    ", "search_steps", c->search_steps, 0);
+    json_u64(f, "    ", "search_steps_max", c->search_steps_max, 0);
+    json_u64(f, "    ", "compared_bytes", c->compared_bytes, 0);
+    json_u64(f, "    ", "memcmp_calls", c->memcmp_calls, 0);
+    json_u64(f, "    ", "stuck_escapes", c->stuck_escapes, 0);
+    json_u64(f, "    ", "extend_ns", c->extend_ns, 0);
+    json_buckets(f, "    ", "diff_sizes", c->diff_sizes, DDELTA_SIZE_BUCKETS, 0);
+    json_buckets(f, "    ", "extra_sizes", c->extra_sizes, DDELTA_SIZE_BUCKETS, 1);
+    fprintf(f, "  },\n");
+}
+
+void ddelta_generate_stats_json(FILE *f, const struct ddelta_generate_stats *stats)
+{
+    fprintf(f, "{\n");
+    json_u64(f, "  ", "elapsed_us", stats->elapsed_us, 0);
+    json_u64(f, "  ", "cpu_us", stats->cpu_us, 0);
+    json_u64(f, "  ", "throttled_us", stats->throttled_us, 0);
+    fprintf(f, "  \"phases\": {\n");
+    json_phase(f, "read", &stats->read_time, 0);
+    json_phase(f, "sort", &stats->sort_time, 0);
+    json_phase(f, "scan", &stats->scan_time, 0);
+    json_phase(f, "write", &stats->write_time, 1);
+    fprintf(f, "  },\n");
+    json_u64(f, "  ", "max_rss", stats->max_rss, 0);
+    json_u64(f, "  ", "memory_peak", stats->memory_peak, 0);
+    json_u64(f, "  ", "memory_projected", stats->memory_projected, 0);
+    json_u64(f, "  ", "allocated_peak", stats->allocated_peak, 0);
+    json_u64(f, "  ", "apply_memory", stats->apply_memory, 0);
+    json_u64(f, "  ", "bytes_read", stats->bytes_read, 0);
+    json_u64(f, "  ", "bytes_written", stats->bytes_written, 0);
+    if (stats->counters.enabled)
+        json_counters(f, &stats->counters);
+    json_u64(f, "  ", "blocksize", stats->blocksize, 0);
+    json_u64(f, "  ", "entries", stats->entries, 0);
+    json_u64(f, "  ", "diff_bytes", stats->diff_bytes, 0);
+    json_u64(f, "  ", "extra_bytes", stats->extra_bytes, 0);
+    json_u64(f, "  ", "seeks", stats->seeks, 0);
+    json_u64(f, "  ", "backward_seeks", stats->backward_seeks, 0);
+    json_u64(f, "  ", "flushes", stats->flushes, 0);
+    json_u64(f, "  ", "apply_cost_us", stats->apply_cost, 1);
+    fprintf(f, "}\n");
+}
+
+static int io_counted(const struct ddelta_apply_stats *stats)
+{
+    int i;
+
+    for (i = 0; i < DDELTA_IO_OPS; i++)
+        if (stats->io[i].calls > 0)
+            return 1;
+
+    return 0;
+}
+
+static void json_io(FILE *f, const struct ddelta_apply_stats *stats)
+{
+    int i;
+
+    fprintf(f, "  \"io\": {\n");
+    for (i = 0; i < DDELTA_IO_OPS; i++) {
+        const struct ddelta_io_class *c = &stats->io[i];
+
+        fprintf(f, "    \"%s\": {\n", io_names[i]);
+        json_u64(f, "      ", "calls", c->calls, 0);
+        json_u64(f, "      ", "bytes", c->bytes, 0);
+        json_u64(f, "      ", "ns", c->ns, 0);
+        json_u64(f, "      ", "max_ns", c->max_ns, 0);
+        json_buckets(f, "      ", "latency", c->latency, DDELTA_LATENCY_BUCKETS, 1);
+        fprintf(f, "    }%s\n", i < DDELTA_IO_OPS - 1 ? "," : "");
+    }
+    fprintf(f, "  },\n");
+}
+
+void ddelta_apply_stats_json(FILE *f, const struct ddelta_apply_stats *stats)
+{
+    fprintf(f, "{\n");
+    json_u64(f, "  ", "elapsed_us", stats->elapsed_us, 0);
+    json_u64(f, "  ", "cpu_us", stats->cpu_us, 0);
+    json_u64(f, "  ", "throttled_us", stats->throttled_us, 0);
+    fprintf(f, "  \"phases\": {\n");
+    json_u64(f, "    ", "patch_read_ns", stats->patch_read_ns, 0);
+    json_u64(f, "    ", "old_read_ns", stats->old_read_ns, 0);
+    json_u64(f, "    ", "add_ns", stats->add_ns, 0);
+    json_u64(f, "    ", "write_ns", stats->write_ns, 0);
+    json_u64(f, "    ", "flush_ns", stats->flush_ns, 1);
+    fprintf(f, "  },\n");
+    if (io_counted(stats))
+        json_io(f, stats);
+    json_u64(f, "  ", "max_rss", stats->max_rss, 0);
+    json_u64(f, "  ", "allocated_peak", stats->allocated_peak, 0);
+    json_u64(f, "  ", "bytes_read", stats->bytes_read, 0);
+    json_u64(f, "  ", "bytes_written", stats->bytes_written, 0);
+    json_u64(f, "  ", "entries", stats->entries, 0);
+    json_u64(f, "  ", "diff_bytes", stats->diff_bytes, 0);
+    json_u64(f, "  ", "extra_bytes", stats->extra_bytes, 0);
+    json_u64(f, "  ", "flushes", stats->flushes, 1);
+    fprintf(f, "}\n");
+}
+
+void ddelta_scan_counters_print(FILE *f, const struct ddelta_scan_counters *c)
+{
+    int i;
+
+    if (!c->enabled) {
+        fprintf(f, "counters: not built with DDELTA_COUNTERS\n");
+        return;
+    }
+
+    fprintf(f, "searches: %" PRIu64 ", %.1f steps on average, %" PRIu64 " at most\n",
+            c->searches, c->searches ? (double) c->search_steps / c->searches : 0.0,
+            c->search_steps_max);
+    fprintf(f, "compared: %" PRIu64 " bytes in matchlen, %" PRIu64 " memcmp calls\n",
+            c->compared_bytes, c->memcmp_calls);
+    fprintf(f, "stuck escapes: %" PRIu64 "\n", c->stuck_escapes);
+    fprintf(f, "extending matches: %" PRIu64 " ms\n", c->extend_ns / 1000000);
+    fprintf(f, "%-12s %12s %12s\n", "entry size", "diff", "extra");
+    for (i = 0; i < DDELTA_SIZE_BUCKETS; i++) {
+        if (c->diff_sizes[i] == 0 && c->extra_sizes[i] == 0)
+            continue;
+        if (i == 0)
+            fprintf(f, "%-12s", "0");
+        else
+            fprintf(f, "< 2^%-8d", i);
+        fprintf(f, " %12" PRIu64 " %12" PRIu64 "\n", c->diff_sizes[i], c->extra_sizes[i]);
+    }
+}
+
+/* Upper bound of the latency of the |p| percent quickest operations of
+ * |c|, in nanoseconds, from the histogram */
+static uint64_t io_percentile(const struct ddelta_io_class *c, int p)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < DDELTA_LATENCY_BUCKETS - 1; i++) {
+        n += c->latency[i];
+        if (n * 100 >= c->calls * p)
+            return i > 0 && ((uint64_t) 1 << i) < c->max_ns ? (uint64_t) 1 << i : c->max_ns;
+    }
+
+    return c->max_ns;
+}
+
+void ddelta_io_stats_print(FILE *f, const struct ddelta_apply_stats *stats)
+{
+    int i;
+
+    if (!io_counted(stats)) {
+        fprintf(f, "io: nothing counted\n");
+        return;
+    }
+
+    fprintf(f, "%-10s %10s %14s %10s %10s %10s %10s\n",
+            "io", "calls", "bytes", "total ms", "p50 us", "p99 us", "max us");
+    for (i = 0; i < DDELTA_IO_OPS; i++) {
+        const struct ddelta_io_class *c = &stats->io[i];
+
+        if (c->calls == 0)
+            continue;
+        fprintf(f, "%-10s %10" PRIu64 " %14" PRIu64 " %10" PRIu64
+                   " %10.1f %10.1f %10.1f\n",
+                io_names[i], c->calls, c->bytes, c->ns / 1000000,
+                io_percentile(c, 50) / 1000.0, io_percentile(c, 99) / 1000.0,
+                c->max_ns / 1000.0);
+    }
+}
+
+void ddelta_trace_header(FILE *f)
+{
+    fputs("new_offset,old_offset,diff,extra,seek,diff_nonzero,time_ns\n", f);
+}
+
+void ddelta_trace_row(FILE *f, const struct ddelta_trace_row *row)
+{
+    fprintf(f, "%" PRIu64 ",%" PRIu64 ",%" PRIu32 ",%" PRIu32 ",%" PRId32
+               ",%" PRIu64 ",%" PRIu64 "\n",
+            row->new_offset, row->old_offset, row->diff, row->extra,
+            row->seek, row->diff_nonzero, row->time_ns);
+}
+
+uint64_t ddelta_nonzero_bytes(const unsigned char *data, size_t size)
+{
+    uint64_t n = 0;
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        n += data[i] != 0;
+
+    return n;
+}
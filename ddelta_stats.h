@@ -0,0 +1,106 @@
+#ifndef DDELTA_STATS_H
+#define DDELTA_STATS_H
+
+#include "ddelta.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Start of a timed phase.
+ */
+struct ddelta_timer {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+};
+
+/**
+ * Monotonic time in nanoseconds.
+ */
+uint64_t ddelta_time_ns(void);
+
+/**
+ * CPU time of the calling thread, or of the process if |process| is
+ * non-zero, in nanoseconds.
+ */
+uint64_t ddelta_cpu_ns(int process);
+
+/**
+ * Peak resident set size of the process, in bytes.
+ */
+uint64_t ddelta_max_rss(void);
+
+void ddelta_timer_start(struct ddelta_timer *t);
+
+/**
+ * Add the wall and CPU time since ddelta_timer_start() to |phase|.
+ */
+void ddelta_timer_stop(const struct ddelta_timer *t,
+                       struct ddelta_phase_time *phase);
+
+/**
+ * Add the wall time since |start| to |*phase| and return the current time,
+ * which the next phase starts at. This only reads the monotonic clock, so
+ * it is cheap enough to call for each block of data.
+ */
+uint64_t ddelta_lap_ns(uint64_t start, uint64_t *phase);
+
+/**
+ * Bucket of |n| in a histogram by powers of two with |buckets| buckets:
+ * the number of bits of |n|, at most |buckets| - 1.
+ */
+int ddelta_bucket(uint64_t n, int buckets);
+
+/**
+ * Add an I/O operation on |bytes| bytes that took |ns| nanoseconds to |c|.
+ */
+void ddelta_io_account(struct ddelta_io_class *c, uint64_t ns, uint64_t bytes);
+
+/**
+ * Print |stats| to |f| as a JSON object.
+ */
+void ddelta_generate_stats_json(FILE *f, const struct ddelta_generate_stats *stats);
+void ddelta_apply_stats_json(FILE *f, const struct ddelta_apply_stats *stats);
+
+/**
+ * Print the scan counters |c| to |f| as text.
+ */
+void ddelta_scan_counters_print(FILE *f, const struct ddelta_scan_counters *c);
+
+/**
+ * Print the I/O operations in |stats| to |f| as text.
+ */
+void ddelta_io_stats_print(FILE *f, const struct ddelta_apply_stats *stats);
+
+/**
+ * An entry of a patch, as a row of a trace. The offsets are those of the
+ * data as diffed, i.e. of the content of gzip files.
+ */
+struct ddelta_trace_row {
+    uint64_t new_offset;
+    uint64_t old_offset;
+    uint32_t diff;
+    uint32_t extra;
+    int32_t seek;
+    /** Bytes of diff data that are not zero */
+    uint64_t diff_nonzero;
+    /** Time since generating or applying started, in nanoseconds */
+    uint64_t time_ns;
+};
+
+/**
+ * Write the CSV header of a trace to |f|.
+ */
+void ddelta_trace_header(FILE *f);
+
+/**
+ * Write |row| to the trace |f| as a CSV line.
+ */
+void ddelta_trace_row(FILE *f, const struct ddelta_trace_row *row);
+
+/**
+ * Number of bytes in the |size| bytes at |data| that are not zero.
+ */
+uint64_t ddelta_nonzero_bytes(const unsigned char *data, size_t size);
+
+#endif
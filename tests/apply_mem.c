@@ -0,0 +1,305 @@
+/* apply_mem.c - Round trips through the in-memory and incremental apply
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Generates patches between two files made up in memory, and checks that
+ * ddelta_apply_mem() and the incremental ddelta_apply_ctx_feed(), fed in
+ * pieces of varying size, give the new file. Patches generated with a
+ * blocksize must be refused by both, and give the new file when applied in
+ * place with ddelta_apply(). A progress callback canceling midway must make
+ * generating and both ways of applying fail with -DDELTA_ECANCELED, and a
+ * read rate limit must make applying wait.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OLD_SIZE (192 * 1024)
+#define BLOCKSIZE (32 * 1024)
+
+/* Records of counters and random words as the old file. The new file has
+ * some of them changed, a few bytes inserted and removed, and the first
+ * quarter moved to the end, so that later blocks read old data that the
+ * earlier ones overwrite in place. */
+static void make_files(struct buffer *old, struct buffer *new)
+{
+    uint32_t state = 2463534242u;
+    size_t i, quarter;
+
+    for (i = 0; old->size < OLD_SIZE; i++) {
+        uint32_t record[4] = {(uint32_t) i, next_random(&state) % 1000,
+                              0x08000000u + (uint32_t) i * 16, 0};
+
+        record[3] = next_random(&state) % 7 == 0 ? next_random(&state) : 0;
+        buffer_write(old, record, sizeof(record));
+    }
+
+    quarter = old->size / 4;
+    buffer_write(new, old->data + quarter, old->size - quarter);
+    for (i = 0; i < new->size; i += 1000 + next_random(&state) % 3000)
+        new->data[i] += 1 + next_random(&state) % 200;
+    memmove(new->data + 5003, new->data + 5000, new->size - 5003);
+    memcpy(new->data + 5000, "new", 3);
+    memmove(new->data + 70000, new->data + 70050, new->size - 70050);
+    new->size -= 50;
+    buffer_write(new, old->data, quarter);
+}
+
+static int check_plain(const struct buffer *old, const struct buffer *new,
+                       int word_size)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer patch = {0}, out = {0};
+    char what[64];
+    int err, failed = 0;
+
+    options.word_size = word_size;
+    snprintf(what, sizeof(what), "word size %d", word_size);
+
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, &options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: generating: %d\n", what, err);
+        return 1;
+    }
+
+    if ((err = ddelta_apply_mem(patch.data, patch.size, old->data, old->size,
+                                buffer_write, &out, NULL, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_mem: %d\n", what, err);
+        failed++;
+    } else {
+        failed += check_output(what, &out, new);
+    }
+
+    out.size = 0;
+    if ((err = apply_ctx(&patch, old, &out, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_ctx_feed: %d\n", what, err);
+        failed++;
+    } else {
+        failed += check_output(what, &out, new);
+    }
+
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+static int check_in_place(const struct buffer *old, const struct buffer *new)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer patch = {0}, out = {0};
+    char dir[] = "/tmp/ddelta-test.XXXXXX";
+    char patchpath[64], oldpath[64], newpath[64];
+    int err, failed = 0;
+
+    options.blocksize = BLOCKSIZE;
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, &options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: blocksize: generating: %d\n", err);
+        return 1;
+    }
+
+    if ((err = ddelta_apply_mem(patch.data, patch.size, old->data, old->size,
+                                buffer_write, &out, NULL, NULL)) != -DDELTA_EINVAL) {
+        fprintf(stderr, "FAIL: blocksize: ddelta_apply_mem gave %d\n", err);
+        failed++;
+    }
+    out.size = 0;
+    if ((err = apply_ctx(&patch, old, &out, NULL)) != -DDELTA_EINVAL) {
+        fprintf(stderr, "FAIL: blocksize: ddelta_apply_ctx_feed gave %d\n", err);
+        failed++;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        failed++;
+        goto out;
+    }
+    snprintf(patchpath, sizeof(patchpath), "%s/patch", dir);
+    snprintf(oldpath, sizeof(oldpath), "%s/old", dir);
+    snprintf(newpath, sizeof(newpath), "%s/new", dir);
+
+    /* Applied to another file, the blocks would read stale old data */
+    if (write_file(patchpath, &patch) < 0 || write_file(oldpath, old) < 0 ||
+        (err = apply_file(patchpath, oldpath, newpath)) != -DDELTA_EINVAL) {
+        fprintf(stderr, "FAIL: blocksize: ddelta_apply to a file gave %d\n", err);
+        failed++;
+    }
+    unlink(newpath);
+
+    if (write_file(oldpath, old) < 0 ||
+        (err = apply_file(patchpath, oldpath, dir)) < 0) {
+        fprintf(stderr, "FAIL: blocksize: ddelta_apply in place: %d\n", err);
+        failed++;
+    } else {
+        /* The old file keeps its size if the new one is smaller */
+        out.size = 0;
+        if (read_file(oldpath, &out) == 0 && out.size > new->size)
+            out.size = new->size;
+        failed += check_output("blocksize: in place", &out, new);
+    }
+
+    unlink(patchpath);
+    unlink(oldpath);
+    rmdir(dir);
+out:
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+/* Progress seen by cancel_midway(), which cancels once some but not all
+ * of the new file is done */
+struct cancel {
+    int calls;
+    int midway;
+};
+
+static int cancel_midway(const struct ddelta_progress *progress, void *data)
+{
+    struct cancel *c = data;
+
+    c->calls++;
+    if (progress->done > 0 && progress->done < progress->total) {
+        c->midway = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int check_cancel(const struct buffer *old, const struct buffer *new)
+{
+    struct ddelta_generate_options generate_options = {0};
+    struct ddelta_apply_options options = {0};
+    struct cancel cancel = {0};
+    struct buffer patch = {0}, out = {0};
+    int err, failed = 0;
+
+    generate_options.progress = cancel_midway;
+    generate_options.progress_data = &cancel;
+    generate_options.progress_interval = 4096;
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, &generate_options, NULL)) !=
+            -DDELTA_ECANCELED ||
+        !cancel.midway) {
+        fprintf(stderr, "FAIL: canceling generating gave %d after %d calls\n",
+                err, cancel.calls);
+        failed++;
+    }
+
+    patch.size = 0;
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, NULL, NULL)) < 0) {
+        fprintf(stderr, "FAIL: cancel: generating: %d\n", err);
+        failed++;
+        goto out;
+    }
+
+    options.progress = cancel_midway;
+    options.progress_data = &cancel;
+    options.progress_interval = 4096;
+    memset(&cancel, 0, sizeof(cancel));
+    if ((err = ddelta_apply_mem(patch.data, patch.size, old->data, old->size,
+                                buffer_write, &out, &options, NULL)) != -DDELTA_ECANCELED ||
+        !cancel.midway) {
+        fprintf(stderr, "FAIL: canceling ddelta_apply_mem gave %d after %d calls\n",
+                err, cancel.calls);
+        failed++;
+    }
+
+    out.size = 0;
+    memset(&cancel, 0, sizeof(cancel));
+    if ((err = apply_ctx(&patch, old, &out, &options)) != -DDELTA_ECANCELED ||
+        !cancel.midway) {
+        fprintf(stderr, "FAIL: canceling ddelta_apply_ctx_feed gave %d after %d calls\n",
+                err, cancel.calls);
+        failed++;
+    }
+
+out:
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+/* Reading at 1 MB/s, applying must wait for the rate limit once its burst
+ * is used up, and still give the new file */
+static int check_throttle(const struct buffer *old, const struct buffer *new)
+{
+    struct ddelta_apply_options options = {0};
+    struct ddelta_apply_stats stats;
+    struct buffer patch = {0}, out = {0};
+    int err, failed = 0;
+
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, NULL, NULL)) < 0) {
+        fprintf(stderr, "FAIL: throttle: generating: %d\n", err);
+        return 1;
+    }
+
+    options.read_rate = 1000000;
+    if ((err = ddelta_apply_mem(patch.data, patch.size, old->data, old->size,
+                                buffer_write, &out, &options, &stats)) < 0) {
+        fprintf(stderr, "FAIL: throttle: ddelta_apply_mem: %d\n", err);
+        failed++;
+    } else if (stats.throttled_us == 0) {
+        fprintf(stderr, "FAIL: throttle: read %llu bytes without waiting\n",
+                (unsigned long long) stats.bytes_read);
+        failed++;
+    } else {
+        failed += check_output("throttle", &out, new);
+    }
+
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+int main(void)
+{
+    struct buffer old = {0}, new = {0};
+    int failed = 0;
+
+    make_files(&old, &new);
+
+    failed += check_plain(&old, &new, 1);
+    failed += check_plain(&old, &new, 4);
+    failed += check_plain(&old, &new, 8);
+    failed += check_in_place(&old, &new);
+    failed += check_cancel(&old, &new);
+    failed += check_throttle(&old, &new);
+
+    free(old.data);
+    free(new.data);
+    if (failed > 0)
+        return 1;
+    printf("apply_mem: ok\n");
+    return 0;
+}
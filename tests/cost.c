@@ -0,0 +1,189 @@
+/* cost.c - Matches chosen for a storage profile
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Generates a patch between files that repeat a block after each of their
+ * chunks, and references it from the middle of each chunk of the new file,
+ * with and without a storage profile. With the profile, the patch must
+ * read the nearest copy of the block, which makes it cheaper to apply
+ * than the one without, cost what the generator estimated, and give the
+ * new file.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta.h"
+#include "ddelta_cost.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNKS 8
+#define CHUNK_SIZE 3000
+#define BLOCK_SIZE 2048
+
+/* Chunks of random bytes, each followed by the same block in the old file,
+ * and with the block in their middle in the new file */
+static void make_files(struct buffer *old, struct buffer *new)
+{
+    unsigned char chunk[CHUNK_SIZE], block[BLOCK_SIZE];
+    uint32_t state = 123456789u;
+    size_t i, j;
+
+    for (j = 0; j < BLOCK_SIZE; j++)
+        block[j] = (unsigned char) next_random(&state);
+
+    for (i = 0; i < CHUNKS; i++) {
+        for (j = 0; j < CHUNK_SIZE; j++)
+            chunk[j] = (unsigned char) next_random(&state);
+
+        buffer_write(old, chunk, CHUNK_SIZE);
+        buffer_write(old, block, BLOCK_SIZE);
+        buffer_write(new, chunk, CHUNK_SIZE / 2);
+        buffer_write(new, block, BLOCK_SIZE);
+        buffer_write(new, chunk + CHUNK_SIZE / 2, CHUNK_SIZE - CHUNK_SIZE / 2);
+    }
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+/* Estimated I/O cost of applying |patch| with |profile|, as ddelta_info
+ * computes it from the entries of a DDELTA50 patch */
+static uint64_t patch_cost(const struct buffer *patch,
+                           const struct ddelta_cost_profile *profile)
+{
+    size_t off = DDELTA_HEADER_SIZE;
+    uint64_t cost = 0;
+
+    while (off + sizeof(struct ddelta_entry_header) <= patch->size) {
+        const uint32_t diff = get_be32(patch->data + off);
+        const uint32_t extra = get_be32(patch->data + off + 4);
+        const int32_t seek = (int32_t) get_be32(patch->data + off + 8);
+
+        if (diff == 0 && extra == 0 && seek == 0)
+            break;
+        if (seek != DDELTA_FLUSH)
+            cost += ddelta_read_cost(profile, diff) + ddelta_seek_cost(profile, seek);
+        off += sizeof(struct ddelta_entry_header) + diff + extra;
+    }
+
+    return cost;
+}
+
+/* Seeking back must never cost less than skipping as far ahead */
+static int check_seek_cost(const struct ddelta_cost_profile *profile)
+{
+    static const off_t seeks[] = {1, 100, 4096, 100000, 1 << 20, 1 << 30};
+    int failed = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(seeks) / sizeof(seeks[0]); i++) {
+        if (ddelta_seek_cost(profile, -seeks[i]) < ddelta_seek_cost(profile, seeks[i]) ||
+            ddelta_seek_cost(profile, seeks[i]) > profile->seek_cost) {
+            fprintf(stderr, "FAIL: seeking by %ld costs %llu back and %llu ahead\n",
+                    (long) seeks[i],
+                    (unsigned long long) ddelta_seek_cost(profile, -seeks[i]),
+                    (unsigned long long) ddelta_seek_cost(profile, seeks[i]));
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+static int check_profile(const struct buffer *old, const struct buffer *new,
+                         const struct ddelta_cost_profile *profile)
+{
+    struct ddelta_generate_options options = {0};
+    struct ddelta_generate_stats stats;
+    struct buffer plain = {0}, costed = {0}, out = {0};
+    int err, failed = 0;
+
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &plain, &options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: generating without a profile: %d\n", err);
+        failed++;
+        goto out;
+    }
+    options.cost = profile;
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &costed, &options, &stats)) < 0) {
+        fprintf(stderr, "FAIL: generating with a profile: %d\n", err);
+        failed++;
+        goto out;
+    }
+
+    if (stats.apply_cost != patch_cost(&costed, profile)) {
+        fprintf(stderr, "FAIL: estimated apply cost %llu, the patch costs %llu\n",
+                (unsigned long long) stats.apply_cost,
+                (unsigned long long) patch_cost(&costed, profile));
+        failed++;
+    }
+    if (stats.apply_cost >= patch_cost(&plain, profile)) {
+        fprintf(stderr, "FAIL: apply cost %llu with the profile, %llu without\n",
+                (unsigned long long) stats.apply_cost,
+                (unsigned long long) patch_cost(&plain, profile));
+        failed++;
+    }
+
+    if ((err = ddelta_apply_mem(costed.data, costed.size, old->data, old->size,
+                                buffer_write, &out, NULL, NULL)) < 0) {
+        fprintf(stderr, "FAIL: profile: ddelta_apply_mem: %d\n", err);
+        failed++;
+    } else {
+        failed += check_output("profile", &out, new);
+    }
+
+out:
+    free(plain.data);
+    free(costed.data);
+    free(out.data);
+    return failed;
+}
+
+int main(void)
+{
+    /* A seek costs as much as reading 100 KB */
+    const struct ddelta_cost_profile profile = {10000, 10000000, 64 * 1024};
+    struct buffer old = {0}, new = {0};
+    int failed = 0;
+
+    make_files(&old, &new);
+
+    failed += check_seek_cost(&profile);
+    failed += check_profile(&old, &new, &profile);
+
+    free(old.data);
+    free(new.data);
+    if (failed > 0)
+        return 1;
+    printf("cost: ok\n");
+    return 0;
+}
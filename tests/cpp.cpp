@@ -0,0 +1,199 @@
+/* cpp.cpp - Round trips through the C++ interface
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Generates and applies a patch through ddelta.hpp, with whole buffers and
+ * with an apply_context fed in pieces, and checks that the errors of the C
+ * functions and of the writers reach the caller as ddelta::errc values and
+ * exceptions.
+ */
+
+#include "ddelta.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failed = 0;
+
+void check(bool ok, const char *what)
+{
+    if (!ok) {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        failed++;
+    }
+}
+
+std::uint32_t next_random(std::uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+/* Random words, of which the new file changes some and moves the first
+ * quarter to the end */
+void make_files(std::vector<unsigned char> &old, std::vector<unsigned char> &new_file)
+{
+    std::uint32_t state = 521288629u;
+
+    for (int i = 0; i < 64 * 1024; i++)
+        old.push_back(static_cast<unsigned char>(next_random(state) % 16));
+
+    new_file.assign(old.begin() + old.size() / 4, old.end());
+    new_file.insert(new_file.end(), old.begin(), old.begin() + old.size() / 4);
+    for (std::size_t i = 0; i < new_file.size(); i += 1000 + next_random(state) % 2000)
+        new_file[i] ^= 0x80;
+}
+
+/* A writer appending to a vector */
+struct vector_writer {
+    std::vector<std::byte> &out;
+
+    void operator()(ddelta::bytes chunk)
+    {
+        out.insert(out.end(), chunk.data(), chunk.data() + chunk.size());
+    }
+};
+
+bool same(const std::vector<std::byte> &out, const std::vector<unsigned char> &new_file)
+{
+    return out.size() == new_file.size() &&
+           std::memcmp(out.data(), new_file.data(), out.size()) == 0;
+}
+
+void check_round_trip(const std::vector<unsigned char> &old,
+                      const std::vector<unsigned char> &new_file)
+{
+    std::vector<std::byte> patch, out;
+    std::error_code ec;
+
+    ec = ddelta::generate(old, new_file, vector_writer{patch});
+    check(!ec, "generate");
+
+    ec = ddelta::apply(patch, old, [&out](ddelta::bytes chunk) {
+        out.insert(out.end(), chunk.data(), chunk.data() + chunk.size());
+        return true;
+    });
+    check(!ec, "apply");
+    check(same(out, new_file), "apply: output differs from the new file");
+
+    /* Into a buffer_writer of the exact size, and of one byte less */
+    std::vector<std::byte> buf(new_file.size());
+    ddelta::buffer_writer exact(buf.data(), buf.size());
+    ec = ddelta::apply(patch, old, exact);
+    check(!ec && exact.size() == new_file.size(), "apply to a buffer");
+    ddelta::buffer_writer small(buf.data(), buf.size() - 1);
+    ec = ddelta::apply(patch, old, small);
+    check(ec == ddelta::errc::new_io, "apply to a short buffer");
+
+    /* Incrementally, in pieces of 1 to 4099 bytes */
+    out.clear();
+    ec.clear();
+    vector_writer writer{out};
+    ddelta::apply_context<vector_writer> ctx(old, writer);
+    std::size_t off = 0, n = 1;
+    while (!ec && !ctx.done() && off < patch.size()) {
+        n = n * 7 % 4099 + 1;
+        if (n > patch.size() - off)
+            n = patch.size() - off;
+        ec = ctx.feed(ddelta::bytes(patch.data() + off, n));
+        off += n;
+    }
+    check(!ec && ctx.done(), "apply_context::feed");
+    ec = ctx.finish();
+    check(!ec, "apply_context::finish");
+    check(same(out, new_file), "apply_context: output differs from the new file");
+
+    /* Stopping short of the end of the patch */
+    out.clear();
+    ddelta::apply_context<vector_writer> partial(old, writer);
+    ec = partial.feed(ddelta::bytes(patch.data(), patch.size() / 2));
+    check(!ec && !partial.done(), "apply_context::feed of half the patch");
+    ec = partial.finish();
+    check(ec == ddelta::errc::patch_io, "apply_context::finish of half the patch");
+}
+
+void check_errors(const std::vector<unsigned char> &old,
+                  const std::vector<unsigned char> &new_file)
+{
+    ddelta_generate_options options = {};
+    std::vector<std::byte> patch, out;
+    std::error_code ec;
+
+    ec = ddelta::apply(ddelta::bytes(old), old, vector_writer{out});
+    check(ec == ddelta::errc::magic, "apply of a bad magic");
+    check(ec.category() == ddelta::error_category() &&
+              std::string(ec.category().name()) == "ddelta" && !ec.message().empty(),
+          "error category");
+    check(ddelta::to_error_code(0) == std::error_code() &&
+              ddelta::to_error_code(-DDELTA_EBUDGET) == ddelta::errc::budget,
+          "to_error_code");
+
+    /* Patches for in-place updates need the old file */
+    options.blocksize = 16 * 1024;
+    ec = ddelta::generate(old, new_file, vector_writer{patch}, &options);
+    check(!ec, "generate with a blocksize");
+    ec = ddelta::apply(patch, old, vector_writer{out});
+    check(ec == ddelta::errc::invalid, "apply of a patch with a blocksize");
+
+    options = {};
+    options.memory_limit = 1;
+    patch.clear();
+    ec = ddelta::generate(old, new_file, vector_writer{patch}, &options);
+    check(ec == ddelta::errc::budget, "generate below the memory limit");
+
+    /* Exceptions of the writer are rethrown */
+    try {
+        ddelta::generate(old, new_file, [](ddelta::bytes) {
+            throw std::runtime_error("writer");
+        });
+        check(false, "exception from the writer");
+    } catch (const std::runtime_error &) {
+    }
+}
+
+} // namespace
+
+int main()
+{
+    std::vector<unsigned char> old, new_file;
+
+    make_files(old, new_file);
+
+    check_round_trip(old, new_file);
+    check_errors(old, new_file);
+
+    if (failed > 0)
+        return 1;
+    std::printf("cpp: ok\n");
+    return 0;
+}
@@ -0,0 +1,816 @@
+/* formats.c - Round trips of the patch format options
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Generates patches with each format option between files made up in
+ * memory: branch filters on made-up code, ELF files with relocated
+ * pointers, tar archives, gzip files and zip archives, and with the cache
+ * and the verifier. Each patch must have the flags of its option, and give
+ * the new file with ddelta_apply_mem(), ddelta_apply_ctx_feed() and
+ * ddelta_apply() from files. A patch for an erase block size must flush at
+ * erase block boundaries, and give the new file in place.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Scratch directory for the files of ddelta_apply() and the cache */
+static char dir[] = "/tmp/ddelta-test.XXXXXX";
+
+static void put16(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char) v;
+    p[1] = (unsigned char) (v >> 8);
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+    put32(p, (uint32_t) v);
+    put32(p + 4, (uint32_t) (v >> 32));
+}
+
+/* Put |v| in |w| bytes, for the fields of ELF32 and ELF64 */
+static void put_word(unsigned char *p, uint64_t v, int w)
+{
+    if (w == 8)
+        put64(p, v);
+    else
+        put32(p, (uint32_t) v);
+}
+
+/* Text records of |count| numbered lines, some of them changed for |seed| */
+static void make_text(struct buffer *b, int count, uint32_t seed)
+{
+    uint32_t state = 2463534242u;
+    char line[80];
+    int i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t r = next_random(&state);
+
+        if (seed != 0 && i % 97 == (int) (seed % 97))
+            r ^= seed;
+        snprintf(line, sizeof(line), "record %6d: value %10u, flags %04x\n",
+                 i, r % 100000, (unsigned int) (r >> 20));
+        buffer_write(b, line, strlen(line));
+    }
+}
+
+/* The flags of the DDELTA51 header of |patch|, or 0 for DDELTA50 */
+static uint32_t patch_flags(const struct buffer *patch)
+{
+    const unsigned char *p = patch->data;
+
+    if (patch->size < 24 || memcmp(p, "DDELTA51", 8) != 0)
+        return 0;
+    return (uint32_t) p[16] << 24 | (uint32_t) p[17] << 16 | (uint32_t) p[18] << 8 | p[19];
+}
+
+/* Apply |patch| with each of the interfaces and compare to |new| */
+static int check_apply(const char *what, const struct buffer *patch,
+                       const struct buffer *old, const struct buffer *new)
+{
+    struct buffer out = {0};
+    char patchpath[64], oldpath[64], newpath[64];
+    int err, failed = 0;
+
+    if ((err = ddelta_apply_mem(patch->data, patch->size, old->data, old->size,
+                                buffer_write, &out, NULL, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_mem: %d\n", what, err);
+        failed++;
+    } else {
+        failed += check_output(what, &out, new);
+    }
+
+    out.size = 0;
+    if ((err = apply_ctx(patch, old, &out, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_ctx_feed: %d\n", what, err);
+        failed++;
+    } else {
+        failed += check_output(what, &out, new);
+    }
+
+    snprintf(patchpath, sizeof(patchpath), "%s/patch", dir);
+    snprintf(oldpath, sizeof(oldpath), "%s/old", dir);
+    snprintf(newpath, sizeof(newpath), "%s/new", dir);
+    out.size = 0;
+    if (write_file(patchpath, patch) < 0 || write_file(oldpath, old) < 0 ||
+        (err = apply_file(patchpath, oldpath, newpath)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply: %d\n", what, err);
+        failed++;
+    } else if (read_file(newpath, &out) < 0) {
+        perror(newpath);
+        failed++;
+    } else {
+        failed += check_output(what, &out, new);
+    }
+    unlink(patchpath);
+    unlink(oldpath);
+    unlink(newpath);
+
+    free(out.data);
+    return failed;
+}
+
+/* Generate a patch with |options|, which must have all of |flags| set and
+ * none of |unset|, and apply it */
+static int check_format(const char *what, const struct buffer *old,
+                        const struct buffer *new,
+                        const struct ddelta_generate_options *options,
+                        uint32_t flags, uint32_t unset)
+{
+    struct buffer patch = {0};
+    int err, failed = 0;
+
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: generating: %d\n", what, err);
+        return 1;
+    }
+
+    if ((patch_flags(&patch) & (flags | unset)) != flags) {
+        fprintf(stderr, "FAIL: %s: flags are %#x\n", what, patch_flags(&patch));
+        failed++;
+    }
+    failed += check_apply(what, &patch, old, new);
+
+    free(patch.data);
+    return failed;
+}
+
+/* Like check_format(), for a patch applied in place, which must not have
+ * any of |unset| */
+static int check_format_in_place(const char *what, const struct buffer *old,
+                                 const struct buffer *new,
+                                 const struct ddelta_generate_options *options,
+                                 uint32_t unset)
+{
+    struct buffer patch = {0}, out = {0};
+    char patchpath[64], oldpath[64];
+    int err, failed = 0;
+
+    if ((err = ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                                   buffer_write, &patch, options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: %s: generating: %d\n", what, err);
+        return 1;
+    }
+
+    if (patch_flags(&patch) & unset) {
+        fprintf(stderr, "FAIL: %s: flags are %#x\n", what, patch_flags(&patch));
+        failed++;
+    }
+
+    snprintf(patchpath, sizeof(patchpath), "%s/patch", dir);
+    snprintf(oldpath, sizeof(oldpath), "%s/old", dir);
+    if (write_file(patchpath, &patch) < 0 || write_file(oldpath, old) < 0 ||
+        (err = apply_file(patchpath, oldpath, dir)) < 0) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply in place: %d\n", what, err);
+        failed++;
+    } else {
+        if (read_file(oldpath, &out) == 0 && out.size > new->size)
+            out.size = new->size;
+        failed += check_output(what, &out, new);
+    }
+    unlink(patchpath);
+    unlink(oldpath);
+
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+/* Records of made-up code are calls to the first record of one of a few
+ * functions, or other instructions. */
+#define CODE_RECORDS 12000
+#define CODE_INSERTED 300
+#define CODE_FUNCTIONS 40
+
+/* Emit a call at |pos| to |target| in the encoding of |filter| */
+static void put_call(unsigned char *p, int filter, uint32_t pos, uint32_t target)
+{
+    uint32_t offset;
+
+    switch (filter) {
+    case DDELTA_FILTER_X86:
+        p[0] = 0xE8;
+        put32(p + 1, target - (pos + 5));
+        break;
+    case DDELTA_FILTER_ARM:
+        put32(p, 0xEB000000u | ((target - (pos + 8)) >> 2 & 0xFFFFFF));
+        break;
+    case DDELTA_FILTER_ARMTHUMB:
+        offset = target - (pos + 4);
+        put16(p, 0xF000 | (offset >> 12 & 0x7FF));
+        put16(p + 2, 0xF800 | (offset >> 1 & 0x7FF));
+        break;
+    }
+}
+
+/* Code for |filter|, where the new file has instructions inserted before
+ * most of the calls, which changes their relative targets. */
+static void make_code(struct buffer *old, struct buffer *new, int filter)
+{
+    const unsigned int size = filter == DDELTA_FILTER_X86 ? 5 : 4;
+    uint32_t state = 88172645u;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        struct buffer *b = pass == 0 ? old : new;
+        const int inserted = pass == 0 ? 0 : CODE_INSERTED;
+        uint32_t seed = state;
+        int i;
+
+        for (i = 0; i < CODE_RECORDS + inserted; i++) {
+            /* Records after the inserted ones are the old ones */
+            const int record = i < 1000 ? i : i < 1000 + inserted ? -1 : i - inserted;
+            unsigned char p[5];
+            uint32_t r = next_random(&seed);
+
+            if (record >= 0 && r % 5 == 0) {
+                int target = (int) (r >> 8) % CODE_FUNCTIONS * (CODE_RECORDS / CODE_FUNCTIONS);
+
+                if (target >= 1000)
+                    target += inserted;
+                put_call(p, filter, b->size, (uint32_t) target * size);
+            } else {
+                /* Neither a call nor the second half of a Thumb one */
+                put32(p, (r & 0x07FFFFFFu) | 0x10000000u);
+                p[4] = (unsigned char) r;
+                if (p[0] == 0xE8)
+                    p[0] = 0x90;
+            }
+            buffer_write(b, p, size);
+        }
+    }
+}
+
+static int check_filters(void)
+{
+    static const int filters[] = {DDELTA_FILTER_X86, DDELTA_FILTER_ARM, DDELTA_FILTER_ARMTHUMB};
+    static const char *const names[] = {"x86 filter", "arm filter", "thumb filter"};
+    int failed = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(filters) / sizeof(filters[0]); i++) {
+        struct ddelta_generate_options options = {0};
+        struct buffer old = {0}, new = {0};
+
+        make_code(&old, &new, filters[i]);
+        options.filter = filters[i];
+        options.word_size = 4;
+        failed += check_format(names[i], &old, &new, &options,
+                               (uint32_t) filters[i] << DDELTA_FLAG_FILTER_SHIFT | DDELTA_FLAG_WORD32,
+                               0);
+        free(old.data);
+        free(new.data);
+    }
+
+    return failed;
+}
+
+/* The made-up ELF files have these sections, at their file offsets */
+enum {
+    ELF_NULL,
+    ELF_TEXT,
+    ELF_RODATA,
+    ELF_DATA_REL_RO,
+    ELF_RELA_DYN,
+    ELF_SHSTRTAB,
+    ELF_SECTIONS
+};
+
+#define ELF_POINTERS 2000
+#define ELF_STRING 16
+
+static const char elf_names[] = "\0.text\0.rodata\0.data.rel.ro\0.rela.dyn\0.shstrtab";
+
+static void elf_section(unsigned char *h, int w, uint32_t name, uint32_t type,
+                        uint64_t flags, uint64_t offset, uint64_t size,
+                        uint64_t entsize)
+{
+    put32(h, name);
+    put32(h + 4, type);
+    put_word(h + 8, flags, w);
+    put_word(h + (w == 8 ? 16 : 12), type == 0 ? 0 : offset, w);
+    put_word(h + (w == 8 ? 24 : 16), offset, w);
+    put_word(h + (w == 8 ? 32 : 20), size, w);
+    put_word(h + (w == 8 ? 48 : 32), w, w);
+    put_word(h + (w == 8 ? 56 : 36), entsize, w);
+}
+
+/*
+ * A shared object for x86-64 (|w| 8) or i386 (|w| 4) with |text| bytes of
+ * code, followed by strings and a table of pointers to them, with a
+ * relative relocation for each.
+ */
+static void make_elf(struct buffer *b, int w, uint32_t text)
+{
+    const uint32_t ehsize = w == 8 ? 64 : 52;
+    const uint32_t shentsize = w == 8 ? 64 : 40;
+    const uint32_t relsize = w == 8 ? 24 : 8;
+    uint64_t offsets[ELF_SECTIONS + 1];
+    unsigned char *p;
+    uint32_t state = 3141592653u;
+    uint32_t i;
+
+    offsets[ELF_TEXT] = ehsize + (w == 8 ? 0 : 12);
+    offsets[ELF_RODATA] = offsets[ELF_TEXT] + text;
+    offsets[ELF_DATA_REL_RO] = offsets[ELF_RODATA] + ELF_POINTERS * ELF_STRING;
+    offsets[ELF_RELA_DYN] = offsets[ELF_DATA_REL_RO] + ELF_POINTERS * w;
+    offsets[ELF_SHSTRTAB] = offsets[ELF_RELA_DYN] + ELF_POINTERS * relsize;
+    offsets[ELF_SECTIONS] = offsets[ELF_SHSTRTAB] + ((sizeof(elf_names) + 7) & ~7u);
+
+    p = calloc(1, offsets[ELF_SECTIONS] + ELF_SECTIONS * shentsize);
+    if (p == NULL)
+        return;
+
+    memcpy(p, "\177ELF", 4);
+    p[4] = w == 8 ? 2 : 1;
+    p[5] = 1;
+    p[6] = 1;
+    put16(p + 16, 3);
+    put16(p + 18, w == 8 ? 62 : 3);
+    put32(p + 20, 1);
+    put_word(p + (w == 8 ? 40 : 32), offsets[ELF_SECTIONS], w);
+    put16(p + (w == 8 ? 52 : 40), ehsize);
+    put16(p + (w == 8 ? 58 : 46), shentsize);
+    put16(p + (w == 8 ? 60 : 48), ELF_SECTIONS);
+    put16(p + (w == 8 ? 62 : 50), ELF_SHSTRTAB);
+
+    for (i = 0; i < text; i++)
+        p[offsets[ELF_TEXT] + i] = (unsigned char) (next_random(&state) % 0xE0);
+    for (i = 0; i < ELF_POINTERS; i++) {
+        unsigned char *rel = p + offsets[ELF_RELA_DYN] + i * relsize;
+        const uint64_t place = offsets[ELF_DATA_REL_RO] + (uint64_t) i * w;
+        const uint64_t string = offsets[ELF_RODATA] + (uint64_t) (i * 7 % ELF_POINTERS) * ELF_STRING;
+
+        snprintf((char *) p + offsets[ELF_RODATA] + i * ELF_STRING, ELF_STRING,
+                 "string %u", i);
+        put_word(p + place, string, w);
+        /* R_X86_64_RELATIVE and R_386_RELATIVE */
+        put_word(rel, place, w);
+        put_word(rel + w, 8, w);
+        if (w == 8)
+            put_word(rel + 2 * w, string, w);
+    }
+    memcpy(p + offsets[ELF_SHSTRTAB], elf_names, sizeof(elf_names));
+
+    p += offsets[ELF_SECTIONS];
+    elf_section(p + shentsize * ELF_NULL, w, 0, 0, 0, 0, 0, 0);
+    elf_section(p + shentsize * ELF_TEXT, w, 1, 1, 0x6, offsets[ELF_TEXT], text, 0);
+    elf_section(p + shentsize * ELF_RODATA, w, 7, 1, 0x2, offsets[ELF_RODATA],
+                ELF_POINTERS * ELF_STRING, 0);
+    elf_section(p + shentsize * ELF_DATA_REL_RO, w, 15, 1, 0x3, offsets[ELF_DATA_REL_RO],
+                ELF_POINTERS * w, 0);
+    elf_section(p + shentsize * ELF_RELA_DYN, w, 28, w == 8 ? 4 : 9, 0x2,
+                offsets[ELF_RELA_DYN], ELF_POINTERS * relsize, relsize);
+    elf_section(p + shentsize * ELF_SHSTRTAB, w, 38, 3, 0, offsets[ELF_SHSTRTAB],
+                sizeof(elf_names), 0);
+    p -= offsets[ELF_SECTIONS];
+
+    buffer_write(b, p, offsets[ELF_SECTIONS] + ELF_SECTIONS * shentsize);
+    free(p);
+}
+
+static int check_elf(void)
+{
+    static const int sizes[] = {8, 4};
+    int failed = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        const int w = sizes[i];
+        struct ddelta_generate_options options = {0};
+        struct buffer old = {0}, new = {0};
+
+        /* Code added to the new file moves the pointers after it */
+        make_elf(&old, w, 8192);
+        make_elf(&new, w, 8192 + 4160);
+        options.elf = 1;
+        failed += check_format(w == 8 ? "elf64 relocations" : "elf32 relocations",
+                               &old, &new, &options,
+                               DDELTA_FLAG_RELOC | (w == 8 ? DDELTA_FLAG_WORD64 : DDELTA_FLAG_WORD32) |
+                                   (uint32_t) DDELTA_FILTER_X86 << DDELTA_FLAG_FILTER_SHIFT,
+                               0);
+
+        /* Not for in-place updates */
+        options.blocksize = 64 * 1024;
+        failed += check_format_in_place(w == 8 ? "elf64 with a blocksize" : "elf32 with a blocksize",
+                                        &old, &new, &options, DDELTA_FLAG_RELOC);
+        free(old.data);
+        free(new.data);
+    }
+
+    return failed;
+}
+
+/* Append a member named |name| with |content| to the tar archive |b| */
+static void tar_member(struct buffer *b, const char *name, const struct buffer *content)
+{
+    static const unsigned char zeros[512];
+    unsigned char header[512] = {0};
+    unsigned int sum = 0;
+    size_t i;
+
+    snprintf((char *) header, 100, "%s", name);
+    memcpy(header + 100, "0000644", 8);
+    memcpy(header + 108, "0001750", 8);
+    memcpy(header + 116, "0001750", 8);
+    snprintf((char *) header + 124, 12, "%011o", (unsigned int) content->size);
+    memcpy(header + 136, "14371573624", 12);
+    memset(header + 148, ' ', 8);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    for (i = 0; i < sizeof(header); i++)
+        sum += header[i];
+    snprintf((char *) header + 148, 8, "%06o", sum);
+
+    buffer_write(b, header, sizeof(header));
+    buffer_write(b, content->data, content->size);
+    buffer_write(b, zeros, (512 - content->size % 512) % 512);
+}
+
+static void tar_end(struct buffer *b)
+{
+    static const unsigned char zeros[1024];
+
+    buffer_write(b, zeros, sizeof(zeros));
+}
+
+#define ARCHIVE_MEMBERS 6
+
+/* The members of the old and new archives: the new one has them in
+ * reverse order, with one of them changed and one added. */
+static void make_members(struct buffer *old, struct buffer *new)
+{
+    int i;
+
+    for (i = 0; i < ARCHIVE_MEMBERS; i++) {
+        make_text(&old[i], 200 + 150 * i, 0);
+        make_text(&new[ARCHIVE_MEMBERS - 1 - i], 200 + 150 * i, i == 2 ? 12345 : 0);
+    }
+    make_text(&new[ARCHIVE_MEMBERS], 400, 777);
+}
+
+static int check_tar(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old[ARCHIVE_MEMBERS] = {{0}}, new[ARCHIVE_MEMBERS + 1] = {{0}};
+    struct buffer oldtar = {0}, newtar = {0};
+    char name[32];
+    int i, failed;
+
+    make_members(old, new);
+    for (i = 0; i < ARCHIVE_MEMBERS; i++) {
+        snprintf(name, sizeof(name), "dir/file%d.txt", i);
+        tar_member(&oldtar, name, &old[i]);
+        snprintf(name, sizeof(name), "dir/file%d.txt", ARCHIVE_MEMBERS - 1 - i);
+        tar_member(&newtar, name, &new[i]);
+    }
+    tar_member(&newtar, "dir/added.txt", &new[ARCHIVE_MEMBERS]);
+    tar_end(&oldtar);
+    tar_end(&newtar);
+
+    options.tar = 1;
+    failed = check_format("tar", &oldtar, &newtar, &options, 0, 0);
+
+    for (i = 0; i < ARCHIVE_MEMBERS; i++)
+        free(old[i].data);
+    for (i = 0; i <= ARCHIVE_MEMBERS; i++)
+        free(new[i].data);
+    free(oldtar.data);
+    free(newtar.data);
+    return failed;
+}
+
+/* Compress |in| with zlib at |level|, as a gzip file if |window_bits| is
+ * 31 or raw deflate data if it is -15 */
+static int compress_buffer(struct buffer *out, const struct buffer *in,
+                           int level, int window_bits)
+{
+    unsigned char buf[4096];
+    z_stream z;
+    int ret;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    z.next_in = in->data;
+    z.avail_in = (uInt) in->size;
+    do {
+        z.next_out = buf;
+        z.avail_out = sizeof(buf);
+        ret = deflate(&z, Z_FINISH);
+        buffer_write(out, buf, sizeof(buf) - z.avail_out);
+    } while (ret == Z_OK);
+
+    deflateEnd(&z);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+static int check_gzip(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old = {0}, new = {0}, oldgz = {0}, newgz = {0};
+    int failed = 0;
+
+    make_text(&old, 3000, 0);
+    make_text(&new, 3000, 4242);
+    if (compress_buffer(&oldgz, &old, 6, 31) < 0 || compress_buffer(&newgz, &new, 9, 31) < 0) {
+        fprintf(stderr, "FAIL: gzip: compressing\n");
+        failed++;
+        goto out;
+    }
+
+    options.gzip = 1;
+    failed += check_format("gzip", &oldgz, &newgz, &options,
+                           DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW, 0);
+    options.verify = 1;
+    failed += check_format("gzip verified", &oldgz, &newgz, &options,
+                           DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW, 0);
+
+out:
+    free(old.data);
+    free(new.data);
+    free(oldgz.data);
+    free(newgz.data);
+    return failed;
+}
+
+/* A zip archive of |count| members, deflated at |level| but for the
+ * first, which is stored */
+static int make_zip(struct buffer *b, const struct buffer *members, int count,
+                    int level)
+{
+    struct buffer central = {0};
+    unsigned char h[46];
+    uint32_t offset;
+    int i, err = 0;
+
+    for (i = 0; i < count && err == 0; i++) {
+        const uint32_t crc = (uint32_t) crc32(0, members[i].data, (uInt) members[i].size);
+        const int method = i == 0 ? 0 : 8;
+        struct buffer data = {0};
+        char name[32];
+        const size_t namelen = (size_t) snprintf(name, sizeof(name), "file%d.txt", i);
+
+        if (method == 0)
+            buffer_write(&data, members[i].data, members[i].size);
+        else
+            err = compress_buffer(&data, &members[i], level, -15);
+        offset = (uint32_t) b->size;
+
+        memset(h, 0, sizeof(h));
+        put32(h, 0x04034b50);
+        put16(h + 4, 20);
+        put16(h + 8, method);
+        put16(h + 10, 0x6000);
+        put16(h + 12, 0x5921);
+        put32(h + 14, crc);
+        put32(h + 18, (uint32_t) data.size);
+        put32(h + 22, (uint32_t) members[i].size);
+        put16(h + 26, namelen);
+        buffer_write(b, h, 30);
+        buffer_write(b, name, namelen);
+        buffer_write(b, data.data, data.size);
+
+        memset(h, 0, sizeof(h));
+        put32(h, 0x02014b50);
+        put16(h + 4, 20);
+        put16(h + 6, 20);
+        put16(h + 10, method);
+        put16(h + 12, 0x6000);
+        put16(h + 14, 0x5921);
+        put32(h + 16, crc);
+        put32(h + 20, (uint32_t) data.size);
+        put32(h + 24, (uint32_t) members[i].size);
+        put16(h + 28, namelen);
+        put32(h + 42, offset);
+        buffer_write(&central, h, 46);
+        buffer_write(&central, name, namelen);
+        free(data.data);
+    }
+
+    offset = (uint32_t) b->size;
+    buffer_write(b, central.data, central.size);
+    memset(h, 0, sizeof(h));
+    put32(h, 0x06054b50);
+    put16(h + 8, count);
+    put16(h + 10, count);
+    put32(h + 12, (uint32_t) central.size);
+    put32(h + 16, offset);
+    buffer_write(b, h, 22);
+
+    free(central.data);
+    return err;
+}
+
+static int check_zip(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old[ARCHIVE_MEMBERS] = {{0}}, new[ARCHIVE_MEMBERS + 1] = {{0}};
+    struct buffer oldzip = {0}, newzip = {0};
+    int i, failed = 0;
+
+    make_members(old, new);
+    if (make_zip(&oldzip, old, ARCHIVE_MEMBERS, 6) < 0 ||
+        make_zip(&newzip, new, ARCHIVE_MEMBERS + 1, 9) < 0) {
+        fprintf(stderr, "FAIL: zip: compressing\n");
+        failed++;
+    } else {
+        options.gzip = 1;
+        failed += check_format("zip", &oldzip, &newzip, &options, DDELTA_FLAG_ZIP,
+                               DDELTA_FLAG_INFLATE_OLD | DDELTA_FLAG_DEFLATE_NEW);
+    }
+
+    for (i = 0; i < ARCHIVE_MEMBERS; i++)
+        free(old[i].data);
+    for (i = 0; i <= ARCHIVE_MEMBERS; i++)
+        free(new[i].data);
+    free(oldzip.data);
+    free(newzip.data);
+    return failed;
+}
+
+/* A second run with the cache of the first must give the same patch for
+ * the same files, and a working one after the new file changed */
+static int check_cache(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old = {0}, new = {0}, changed = {0}, first = {0}, second = {0};
+    char cache[64];
+    int err, failed = 0;
+
+    make_text(&old, 5000, 0);
+    make_text(&new, 5000, 99);
+    make_text(&changed, 5000, 31337);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    options.cache = cache;
+    options.word_size = 4;
+
+    if ((err = ddelta_generate_mem(old.data, old.size, new.data, new.size,
+                                   buffer_write, &first, &options, NULL)) < 0 ||
+        (err = ddelta_generate_mem(old.data, old.size, new.data, new.size,
+                                   buffer_write, &second, &options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: cache: generating: %d\n", err);
+        failed++;
+    } else if (first.size != second.size || memcmp(first.data, second.data, first.size) != 0) {
+        fprintf(stderr, "FAIL: cache: the cached patch differs\n");
+        failed++;
+    } else {
+        failed += check_apply("cache", &second, &old, &new);
+    }
+    failed += check_format("cache after a change", &old, &changed, &options,
+                           DDELTA_FLAG_WORD32, 0);
+
+    unlink(cache);
+    free(old.data);
+    free(new.data);
+    free(changed.data);
+    free(first.data);
+    free(second.data);
+    return failed;
+}
+
+static int check_verify(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old = {0}, new = {0};
+    int failed;
+
+    make_code(&old, &new, DDELTA_FILTER_X86);
+    options.verify = 1;
+    options.filter = DDELTA_FILTER_X86;
+    options.word_size = 8;
+    failed = check_format("verify", &old, &new, &options,
+                          DDELTA_FLAG_WORD64 | (uint32_t) DDELTA_FILTER_X86 << DDELTA_FLAG_FILTER_SHIFT,
+                          0);
+
+    free(old.data);
+    free(new.data);
+    return failed;
+}
+
+/* A blocksize that is not a multiple of the erase size is rounded up to
+ * one, so that every flush of an in-place update ends on an erase block */
+static int check_erase_size(void)
+{
+    struct ddelta_generate_options options = {0};
+    struct buffer old = {0}, new = {0}, patch = {0};
+    const unsigned char *p;
+    size_t off;
+    uint64_t written = 0;
+    int err, flushes = 0, failed = 0;
+
+    make_text(&old, 5000, 0);
+    make_text(&new, 5000, 4711);
+    options.blocksize = 10000;
+    options.erase_size = 4096;
+
+    if ((err = ddelta_generate_mem(old.data, old.size, new.data, new.size,
+                                   buffer_write, &patch, &options, NULL)) < 0) {
+        fprintf(stderr, "FAIL: erase size: generating: %d\n", err);
+        failed++;
+        goto out;
+    }
+
+    /* Walk the entries, counting the new bytes up to each flush */
+    off = patch_flags(&patch) != 0 ? DDELTA_HEADER_EXT_SIZE : DDELTA_HEADER_SIZE;
+    while (off + sizeof(struct ddelta_entry_header) <= patch.size) {
+        uint32_t diff, extra, seek;
+
+        p = patch.data + off;
+        diff = (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+        extra = (uint32_t) p[4] << 24 | (uint32_t) p[5] << 16 | (uint32_t) p[6] << 8 | p[7];
+        seek = (uint32_t) p[8] << 24 | (uint32_t) p[9] << 16 | (uint32_t) p[10] << 8 | p[11];
+        off += sizeof(struct ddelta_entry_header);
+
+        if (seek == (uint32_t) DDELTA_FLUSH) {
+            if (written % options.erase_size != 0 && written != new.size) {
+                fprintf(stderr, "FAIL: erase size: flush at %llu\n",
+                        (unsigned long long) written);
+                failed++;
+            }
+            flushes++;
+            continue;
+        }
+        if (diff == 0 && extra == 0 && seek == 0)
+            break;
+        written += (uint64_t) diff + extra;
+        off += (size_t) diff + extra;
+    }
+    if (flushes < 2) {
+        fprintf(stderr, "FAIL: erase size: %d flushes\n", flushes);
+        failed++;
+    }
+
+    failed += check_format_in_place("erase size", &old, &new, &options, 0);
+
+out:
+    free(old.data);
+    free(new.data);
+    free(patch.data);
+    return failed;
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    failed += check_filters();
+    failed += check_elf();
+    failed += check_tar();
+    failed += check_gzip();
+    failed += check_zip();
+    failed += check_cache();
+    failed += check_verify();
+    failed += check_erase_size();
+
+    rmdir(dir);
+    if (failed > 0)
+        return 1;
+    printf("formats: ok\n");
+    return 0;
+}
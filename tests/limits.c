@@ -0,0 +1,260 @@
+/* limits.c - Memory limits, caps and device budgets
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checks that generating and applying a patch succeed within their
+ * projected memory and the peak they allocated, and fail with
+ * -DDELTA_EBUDGET below the projection, with -DDELTA_ENOMEM below the
+ * peak, and with -DDELTA_EBUDGET for a device without the memory or
+ * scratch space for the patch.
+ */
+
+#define _GNU_SOURCE
+#include "ddelta.h"
+#include "util.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OLD_RECORDS 16384
+#define BLOCKSIZE (32 * 1024)
+
+/* Records of random words, of which the new file changes some and moves
+ * the first half to the end */
+static void make_files(struct buffer *old, struct buffer *new)
+{
+    uint32_t state = 362436069u;
+    size_t i, half;
+
+    for (i = 0; i < OLD_RECORDS; i++) {
+        uint32_t record[4] = {(uint32_t) i, next_random(&state) % 5000,
+                              0x00400000u + (uint32_t) i * 8, next_random(&state)};
+
+        buffer_write(old, record, sizeof(record));
+    }
+
+    half = old->size / 2;
+    buffer_write(new, old->data + half, old->size - half);
+    buffer_write(new, old->data, half);
+    for (i = 0; i < new->size; i += 500 + next_random(&state) % 1500)
+        new->data[i] ^= 0x5A;
+}
+
+static int generate(const struct buffer *old, const struct buffer *new,
+                    const struct ddelta_generate_options *options,
+                    struct buffer *patch, struct ddelta_generate_stats *stats)
+{
+    patch->size = 0;
+    return ddelta_generate_mem(old->data, old->size, new->data, new->size,
+                               buffer_write, patch, options, stats);
+}
+
+static int check_generate(const struct buffer *old, const struct buffer *new)
+{
+    struct ddelta_generate_options options = {0};
+    struct ddelta_generate_stats stats;
+    struct ddelta_device_profile device = {0};
+    struct buffer patch = {0};
+    uint64_t projected, peak;
+    int err, failed = 0;
+
+    options.word_size = 4;
+    projected = ddelta_generate_memory(old->size, new->size, &options);
+    if ((err = generate(old, new, &options, &patch, &stats)) < 0) {
+        fprintf(stderr, "FAIL: generating without limits: %d\n", err);
+        return 1;
+    }
+    peak = stats.allocated_peak;
+
+    options.memory_limit = projected;
+    if ((err = generate(old, new, &options, &patch, NULL)) < 0) {
+        fprintf(stderr, "FAIL: generating within the projection: %d\n", err);
+        failed++;
+    }
+    options.memory_limit = projected - 1;
+    if ((err = generate(old, new, &options, &patch, NULL)) != -DDELTA_EBUDGET) {
+        fprintf(stderr, "FAIL: generating below the projection gave %d\n", err);
+        failed++;
+    }
+    options.memory_limit = 0;
+
+    options.memory_cap = peak;
+    if ((err = generate(old, new, &options, &patch, NULL)) < 0) {
+        fprintf(stderr, "FAIL: generating capped at the peak: %d\n", err);
+        failed++;
+    }
+    options.memory_cap = peak / 2;
+    if ((err = generate(old, new, &options, &patch, NULL)) != -DDELTA_ENOMEM) {
+        fprintf(stderr, "FAIL: generating capped below the peak gave %d\n", err);
+        failed++;
+    }
+    options.memory_cap = 0;
+
+    /* A device that cannot apply the patch, or not in place */
+    options.device = &device;
+    device.ram = ddelta_apply_memory(DDELTA_FLAG_WORD32, 0) - 1;
+    if ((err = generate(old, new, &options, &patch, NULL)) != -DDELTA_EBUDGET) {
+        fprintf(stderr, "FAIL: generating for a device without memory gave %d\n", err);
+        failed++;
+    }
+    device.ram = 0;
+    device.scratch = BLOCKSIZE - 1;
+    options.blocksize = BLOCKSIZE;
+    if ((err = generate(old, new, &options, &patch, NULL)) != -DDELTA_EBUDGET) {
+        fprintf(stderr, "FAIL: generating for a device without scratch space gave %d\n", err);
+        failed++;
+    }
+    device.scratch = BLOCKSIZE;
+    if ((err = generate(old, new, &options, &patch, NULL)) < 0) {
+        fprintf(stderr, "FAIL: generating for a device with scratch space: %d\n", err);
+        failed++;
+    }
+
+    free(patch.data);
+    return failed;
+}
+
+/* Apply |patch| from memory, incrementally and from files with |options|,
+ * expecting |expected| from each */
+static int check_apply(const char *what, const struct buffer *patch,
+                       const struct buffer *old, const struct buffer *new,
+                       const struct ddelta_apply_options *options, int expected)
+{
+    struct ddelta_header header;
+    struct buffer out = {0};
+    char dir[] = "/tmp/ddelta-test.XXXXXX";
+    char patchpath[64], oldpath[64], newpath[64];
+    FILE *patchf = NULL, *oldf = NULL;
+    int err, failed = 0;
+
+    if ((err = ddelta_apply_mem(patch->data, patch->size, old->data, old->size,
+                                buffer_write, &out, options, NULL)) != expected) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_mem gave %d\n", what, err);
+        failed++;
+    } else if (expected == 0) {
+        failed += check_output(what, &out, new);
+    }
+
+    out.size = 0;
+    if ((err = apply_ctx(patch, old, &out, options)) != expected) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_ctx_feed gave %d\n", what, err);
+        failed++;
+    } else if (expected == 0) {
+        failed += check_output(what, &out, new);
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        free(out.data);
+        return failed + 1;
+    }
+    snprintf(patchpath, sizeof(patchpath), "%s/patch", dir);
+    snprintf(oldpath, sizeof(oldpath), "%s/old", dir);
+    snprintf(newpath, sizeof(newpath), "%s/new", dir);
+
+    out.size = 0;
+    if (write_file(patchpath, patch) < 0 || write_file(oldpath, old) < 0 ||
+        (patchf = fopen(patchpath, "rb")) == NULL || (oldf = fopen(oldpath, "rb")) == NULL ||
+        ddelta_header_read(&header, patchf) < 0) {
+        perror(dir);
+        failed++;
+    } else if ((err = ddelta_apply_opts(&header, patchf, oldf, newpath, options, NULL)) != expected) {
+        fprintf(stderr, "FAIL: %s: ddelta_apply_opts gave %d\n", what, err);
+        failed++;
+    } else if (expected == 0) {
+        if (read_file(newpath, &out) < 0)
+            perror(newpath);
+        failed += check_output(what, &out, new);
+    }
+
+    if (patchf != NULL)
+        fclose(patchf);
+    if (oldf != NULL)
+        fclose(oldf);
+    unlink(patchpath);
+    unlink(oldpath);
+    unlink(newpath);
+    rmdir(dir);
+    free(out.data);
+    return failed;
+}
+
+static int check_applying(const struct buffer *old, const struct buffer *new)
+{
+    struct ddelta_generate_options generate_options = {0};
+    struct ddelta_apply_options options = {0};
+    struct ddelta_apply_stats stats;
+    struct buffer patch = {0}, out = {0};
+    uint64_t projected;
+    int err, failed = 0;
+
+    generate_options.word_size = 4;
+    if ((err = generate(old, new, &generate_options, &patch, NULL)) < 0 ||
+        (err = ddelta_apply_mem(patch.data, patch.size, old->data, old->size,
+                                buffer_write, &out, NULL, &stats)) < 0) {
+        fprintf(stderr, "FAIL: applying without limits: %d\n", err);
+        free(patch.data);
+        free(out.data);
+        return 1;
+    }
+    projected = ddelta_apply_memory(DDELTA_FLAG_WORD32, 0);
+
+    options.memory_limit = projected;
+    failed += check_apply("within the projection", &patch, old, new, &options, 0);
+    options.memory_limit = projected - 1;
+    failed += check_apply("below the projection", &patch, old, new, &options,
+                          -DDELTA_EBUDGET);
+    options.memory_limit = 0;
+
+    options.memory_cap = stats.allocated_peak;
+    failed += check_apply("capped at the peak", &patch, old, new, &options, 0);
+    options.memory_cap = stats.allocated_peak / 2;
+    failed += check_apply("capped below the peak", &patch, old, new, &options,
+                          -DDELTA_ENOMEM);
+
+    free(patch.data);
+    free(out.data);
+    return failed;
+}
+
+int main(void)
+{
+    struct buffer old = {0}, new = {0};
+    int failed = 0;
+
+    make_files(&old, &new);
+
+    failed += check_generate(&old, &new);
+    failed += check_applying(&old, &new);
+
+    free(old.data);
+    free(new.data);
+    if (failed > 0)
+        return 1;
+    printf("limits: ok\n");
+    return 0;
+}
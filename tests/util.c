@@ -0,0 +1,141 @@
+/* util.c - Buffers and file helpers shared by the tests
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int buffer_write(void *data, const void *buf, size_t size)
+{
+    struct buffer *b = data;
+
+    if (b->size + size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        unsigned char *p;
+
+        while (capacity < b->size + size)
+            capacity *= 2;
+        if ((p = realloc(b->data, capacity)) == NULL)
+            return -1;
+        b->data = p;
+        b->capacity = capacity;
+    }
+
+    memcpy(b->data + b->size, buf, size);
+    b->size += size;
+    return 0;
+}
+
+uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+int check_output(const char *what, const struct buffer *out,
+                 const struct buffer *new)
+{
+    if (out->size == new->size && memcmp(out->data, new->data, new->size) == 0)
+        return 0;
+
+    fprintf(stderr, "FAIL: %s: output differs from the new file\n", what);
+    return 1;
+}
+
+int apply_ctx(const struct buffer *patch, const struct buffer *old,
+              struct buffer *out, const struct ddelta_apply_options *options)
+{
+    struct ddelta_apply_ctx *ctx;
+    size_t off = 0, n = 1;
+    int err = 0;
+
+    ctx = ddelta_apply_ctx_new_mem(old->data, old->size, buffer_write, out, options);
+    if (ctx == NULL)
+        return -DDELTA_ENOMEM;
+
+    while (err == 0 && off < patch->size) {
+        n = n * 7 % 4099 + 1;
+        if (n > patch->size - off)
+            n = patch->size - off;
+        err = ddelta_apply_ctx_feed(ctx, patch->data + off, n);
+        off += n;
+    }
+
+    ddelta_apply_ctx_free(ctx, NULL);
+    return err == 1 ? 0 : err == 0 ? -DDELTA_EPATCHIO : err;
+}
+
+int write_file(const char *path, const struct buffer *b)
+{
+    FILE *f = fopen(path, "wb");
+    int err = 0;
+
+    if (f == NULL)
+        return -1;
+    if (fwrite(b->data, 1, b->size, f) != b->size)
+        err = -1;
+    if (fclose(f) != 0)
+        err = -1;
+    return err;
+}
+
+int read_file(const char *path, struct buffer *b)
+{
+    unsigned char buf[4096];
+    FILE *f = fopen(path, "rb");
+    size_t n;
+    int err = 0;
+
+    if (f == NULL)
+        return -1;
+    while (err == 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0)
+        err = buffer_write(b, buf, n);
+    if (ferror(f))
+        err = -1;
+    fclose(f);
+    return err;
+}
+
+int apply_file(const char *patchpath, const char *oldpath, const char *newpath)
+{
+    struct ddelta_header header;
+    FILE *patchf = fopen(patchpath, "rb");
+    FILE *oldf = fopen(oldpath, "r+b");
+    int err;
+
+    if (patchf == NULL || oldf == NULL)
+        err = -DDELTA_EOLDIO;
+    else if ((err = ddelta_header_read(&header, patchf)) == 0)
+        err = ddelta_apply(&header, patchf, oldf, newpath);
+
+    if (patchf != NULL)
+        fclose(patchf);
+    if (oldf != NULL)
+        fclose(oldf);
+    return err;
+}
@@ -0,0 +1,57 @@
+#ifndef DDELTA_TESTS_UTIL_H
+#define DDELTA_TESTS_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ddelta.h"
+
+/* A growing buffer, written by buffer_write() */
+struct buffer {
+    unsigned char *data;
+    size_t size, capacity;
+};
+
+/**
+ * Append |size| bytes to the struct buffer |data|, as a ddelta_write_fn.
+ */
+int buffer_write(void *data, const void *buf, size_t size);
+
+/**
+ * The next number of a xorshift generator, so that the files made up by
+ * the tests are the same on every run.
+ */
+uint32_t next_random(uint32_t *state);
+
+/**
+ * Whether |out| is |new|, printing a failure for |what| if not.
+ *
+ * @return 0 if it is, 1 otherwise
+ */
+int check_output(const char *what, const struct buffer *out,
+                 const struct buffer *new);
+
+/**
+ * Feed |patch| to ddelta_apply_ctx_feed() in pieces of 1 to 4099 bytes,
+ * with |options|, which may be NULL.
+ *
+ * @return 0 once the new file is complete, or a negative error
+ */
+int apply_ctx(const struct buffer *patch, const struct buffer *old,
+              struct buffer *out, const struct ddelta_apply_options *options);
+
+int write_file(const char *path, const struct buffer *b);
+
+/**
+ * Append the contents of the file at |path| to |b|.
+ */
+int read_file(const char *path, struct buffer *b);
+
+/**
+ * Apply the patch at |patchpath| with ddelta_apply() to the old file at
+ * |oldpath|, into |newpath|, which may be a directory to update it in
+ * place.
+ */
+int apply_file(const char *patchpath, const char *oldpath, const char *newpath);
+
+#endif